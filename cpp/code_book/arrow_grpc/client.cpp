@@ -5,34 +5,91 @@
 #include <parquet/exception.h>
 #include <arrow/filesystem/api.h>
 
+#include <cstdlib>
 #include <iostream>
 #include <string>
+#include <vector>
 
 #include "common.h"
 #include <grpc++/grpc++.h>
 #include "arrow_grpc.service.grpc.pb.h"
+#include "flight_data_reader.h"
+#include "../flight_speed_test/message_chunking.h"
 
 using namespace std;
 
-void requestDoGet(const std::unique_ptr<::FlightService::Stub> &service)
+/**
+ * @brief 列出服务端的数据集，返回第一个数据集的FlightInfo
+ *
+ */
+arrow::Result<::FlightInfo> requestListFlights(const std::unique_ptr<::FlightService::Stub> &service)
 {
-    grpc::ClientContext ctx;
+    grpc::ClientContext context;
+    ::Criteria criteria;
+    auto stream = service->ListFlights(&context, criteria);
+    std::vector<::FlightInfo> infos;
+    ::FlightInfo info;
+    while (stream->Read(&info))
+    {
+        cout << info.flight_descriptor().path(0) << ": " << info.total_records() << " rows, "
+             << info.total_bytes() << " bytes" << endl;
+        infos.push_back(info);
+    }
+    ARROW_RETURN_NOT_OK(FromGrpcStatus(stream->Finish()));
+    if (infos.empty())
+    {
+        return arrow::Status::KeyError("No dataset on the server");
+    }
+    return infos.front();
+}
 
-    ::Ticket ticket;
-    auto reader = service->DoGet(&ctx, ticket);
-    FlightData data;
-    bool read_flag = reader->Read(&data);
-    while(read_flag)
+/**
+ * @brief GetSchema只返回缓存的schema，不读数据
+ *
+ */
+arrow::Result<std::shared_ptr<arrow::Schema>> requestGetSchema(const std::unique_ptr<::FlightService::Stub> &service,
+                                                               const ::FlightDescriptor &descriptor)
+{
+    grpc::ClientContext context;
+    ::SchemaResult result;
+    ARROW_RETURN_NOT_OK(FromGrpcStatus(service->GetSchema(&context, descriptor, &result)));
+    arrow::io::BufferReader schema_reader(arrow::Buffer::FromString(result.schema()));
+    arrow::ipc::DictionaryMemo dictionary_memo;
+    return arrow::ipc::ReadSchema(&schema_reader, &dictionary_memo);
+}
+
+/**
+ * @brief 取第一个数据集
+ *
+ * @param max_message_bytes 希望服务端每条消息的大小
+ */
+arrow::Status requestDoGet(const std::shared_ptr<grpc::Channel> &channel,
+                           const std::unique_ptr<::FlightService::Stub> &service, int64_t max_message_bytes)
+{
+    ARROW_ASSIGN_OR_RAISE(auto info, requestListFlights(service));
+    ARROW_ASSIGN_OR_RAISE(auto schema, requestGetSchema(service, info.flight_descriptor()));
+    cout << "GetSchema: " << schema->ToString() << endl;
+    if (info.endpoint_size() == 0)
     {
-        read_flag = reader->Read(&data);
+        return arrow::Status::Invalid("FlightInfo without endpoint");
     }
-    auto status = reader->Finish();
-    if (!status.ok())
+
+    // 用FlightInfo里的ticket取数据，附带消息大小
+    ::Ticket ticket;
+    ticket.set_ticket(MakeTicket(info.endpoint(0).ticket().ticket(), max_message_bytes));
+    ARROW_ASSIGN_OR_RAISE(auto reader, FlightDataStreamReader::Open(channel.get(), ticket));
+    cout << reader->schema()->ToString() << endl;
+
+    // batch直接引用收到的gRPC slice，这里只统计行数
+    while (true)
     {
-        printf("request failed: %s\n", status.error_message().c_str());
-        return;
+        std::shared_ptr<arrow::RecordBatch> batch;
+        ARROW_RETURN_NOT_OK(reader->ReadNext(&batch));
+        if (batch == nullptr)
+            break;
     }
-    printf("request done\n");
+    cout << "request done: " << reader->stats().ToString() << endl;
+    return arrow::Status::OK();
 }
 
 int main(int argc, char const *argv[])
@@ -41,10 +98,11 @@ int main(int argc, char const *argv[])
 
     std::string server_addr(std::string("0.0.0.0:") + std::to_string(SERVER_PORT));
     grpc::ChannelArguments chan_args;
-    chan_args.SetMaxReceiveMessageSize(INT_MAX);
+    chan_args.SetMaxReceiveMessageSize(GRPC_MESSAGE_LIMIT);
 
     auto channel = grpc::CreateCustomChannel(server_addr, grpc::InsecureChannelCredentials(), chan_args);
     auto service = FlightService::NewStub(channel);
-    requestDoGet(service);
+    int64_t max_message_bytes = argc > 1 ? std::atoll(argv[1]) : DEFAULT_MESSAGE_BYTES;
+    cout << requestDoGet(channel, service, max_message_bytes) << endl;
     return 0;
 }
@@ -8,6 +8,7 @@
 #define PARQUET_ROWGROUP_RECORDS 10000
 #define RECORD_ROW_NUM 100
 #define SERVER_PORT 33000
+#define SHM_SOCKET_PATH "/tmp/arrow_grpc_shm.sock"
 
 std::shared_ptr<arrow::Schema> getSchema()
 {
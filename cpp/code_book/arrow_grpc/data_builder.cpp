@@ -17,6 +17,7 @@
 #include <chrono>
 
 #include "common.h"
+#include "../flight_speed_test/parquet_lookup.h"
 using namespace std;
 
 class RandomBatchGenerator
@@ -119,8 +120,14 @@ void write_parquet_file(const arrow::Table &table)
 
     PARQUET_ASSIGN_OR_THROW(
         outfile, arrow::io::FileOutputStream ::Open(PARQUET_FILE_DIR PARQUET_FILE_NAME, false));
+    // 成交编号和序号是点查的主键，生成统计信息和布隆过滤器
+    std::vector<std::string> key_columns{"trdno", "sno"};
     PARQUET_THROW_NOT_OK(
-        parquet::arrow::WriteTable(table, arrow::default_memory_pool(), outfile, PARQUET_ROWGROUP_RECORDS));
+        parquet::arrow::WriteTable(table, arrow::default_memory_pool(), outfile, PARQUET_ROWGROUP_RECORDS,
+                                   LookupWriterProperties(key_columns)));
+    PARQUET_THROW_NOT_OK(outfile->Close());
+    PARQUET_THROW_NOT_OK(BuildBloomSidecar(std::make_shared<arrow::fs::LocalFileSystem>(),
+                                           PARQUET_FILE_DIR PARQUET_FILE_NAME, key_columns));
 }
 
 std::string formatTime(std::chrono::steady_clock::time_point &clock)
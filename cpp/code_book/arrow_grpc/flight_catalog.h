@@ -0,0 +1,165 @@
+#ifndef FLIGHT_CATALOG_H
+#define FLIGHT_CATALOG_H
+
+#include <arrow/api.h>
+#include <arrow/io/api.h>
+#include <arrow/ipc/api.h>
+#include <arrow/filesystem/api.h>
+#include <parquet/arrow/reader.h>
+
+#include "arrow_grpc.service.pb.h"
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/**
+ * 数据目录：目录下每个parquet文件是一个数据集，名字就是文件名，也是DoGet的ticket。
+ *
+ * 每个文件的序列化schema和FlightInfo缓存在内存里，文件的mtime或大小变化时才重新读footer，
+ * ListFlights/GetFlightInfo/GetSchema通常不碰磁盘上的数据。
+ */
+
+/**
+ * @brief 一个数据集的缓存，创建后不再修改
+ *
+ */
+struct FlightCatalogEntry
+{
+    int64_t mtime = 0;
+    int64_t size = 0;
+    std::string path;
+    std::shared_ptr<arrow::Schema> schema;
+    FlightInfo info; // info.schema()是IPC序列化后的schema
+};
+
+class FlightCatalog
+{
+public:
+    /**
+     * @param root_dir 数据目录
+     * @param location 写进FlightEndpoint的地址，如"grpc+tcp://localhost:33000"
+     */
+    FlightCatalog(std::string root_dir, std::string location)
+        : filesystem_(std::make_shared<arrow::fs::LocalFileSystem>()),
+          root_dir_(std::move(root_dir)), location_(std::move(location))
+    {
+        while (root_dir_.size() > 1 && root_dir_.back() == '/')
+        {
+            root_dir_.pop_back();
+        }
+    }
+
+    /**
+     * @brief 获取一个数据集，文件变化时重新读footer
+     *
+     * @param name 数据集名（文件名），不能包含路径
+     * @return arrow::Result<std::shared_ptr<const FlightCatalogEntry>> 文件不存在时返回KeyError
+     */
+    arrow::Result<std::shared_ptr<const FlightCatalogEntry>> Get(const std::string &name)
+    {
+        if (name.empty() || name.find('/') != std::string::npos || name == "." || name == "..")
+        {
+            return arrow::Status::Invalid("Invalid dataset name: '", name, "'");
+        }
+        ARROW_ASSIGN_OR_RAISE(auto file_info, filesystem_->GetFileInfo(root_dir_ + "/" + name));
+        if (!file_info.IsFile())
+        {
+            return arrow::Status::KeyError("Dataset ", name, " does not exist");
+        }
+        return Refresh(name, file_info);
+    }
+
+    /**
+     * @brief 列出目录下的所有数据集，同时清掉已删除文件的缓存
+     *
+     * @param prefix 只返回名字以prefix开头的数据集
+     */
+    arrow::Result<std::vector<std::shared_ptr<const FlightCatalogEntry>>> List(const std::string &prefix = "")
+    {
+        arrow::fs::FileSelector selector;
+        selector.base_dir = root_dir_;
+        ARROW_ASSIGN_OR_RAISE(auto file_infos, filesystem_->GetFileInfo(selector));
+        std::vector<std::shared_ptr<const FlightCatalogEntry>> entries;
+        std::map<std::string, bool> present;
+        for (const auto &file_info : file_infos)
+        {
+            const std::string name = file_info.base_name();
+            // 下划线开头的是布隆过滤器等附属文件
+            if (!file_info.IsFile() || file_info.extension() != "parquet" || name[0] == '_' || name[0] == '.')
+                continue;
+            present[name] = true;
+            if (name.compare(0, prefix.size(), prefix) != 0)
+                continue;
+            ARROW_ASSIGN_OR_RAISE(auto entry, Refresh(name, file_info));
+            entries.push_back(entry);
+        }
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (auto it = cache_.begin(); it != cache_.end();)
+        {
+            if (present.count(it->first) == 0)
+                it = cache_.erase(it);
+            else
+                ++it;
+        }
+        return entries;
+    }
+
+private:
+    arrow::Result<std::shared_ptr<const FlightCatalogEntry>> Refresh(const std::string &name,
+                                                                     const arrow::fs::FileInfo &file_info)
+    {
+        int64_t mtime = file_info.mtime().time_since_epoch().count();
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto it = cache_.find(name);
+            if (it != cache_.end() && it->second->mtime == mtime && it->second->size == file_info.size())
+            {
+                return it->second;
+            }
+        }
+
+        // 读footer不加锁，同一个文件并发刷新时后写入的覆盖先写入的，内容相同
+        ARROW_ASSIGN_OR_RAISE(auto entry, Load(name, file_info));
+        entry->mtime = mtime;
+        std::lock_guard<std::mutex> lock(mutex_);
+        cache_[name] = entry;
+        return std::shared_ptr<const FlightCatalogEntry>(entry);
+    }
+
+    arrow::Result<std::shared_ptr<FlightCatalogEntry>> Load(const std::string &name, const arrow::fs::FileInfo &file_info)
+    {
+        ARROW_ASSIGN_OR_RAISE(auto input, filesystem_->OpenInputFile(file_info));
+        std::unique_ptr<parquet::arrow::FileReader> reader;
+        ARROW_RETURN_NOT_OK(parquet::arrow::OpenFile(std::move(input), arrow::default_memory_pool(), &reader));
+
+        auto entry = std::make_shared<FlightCatalogEntry>();
+        entry->path = file_info.path();
+        entry->size = file_info.size();
+        ARROW_RETURN_NOT_OK(reader->GetSchema(&entry->schema));
+        // 与arrow_flight相同，schema是IPC流格式的一条schema消息
+        ARROW_ASSIGN_OR_RAISE(auto schema_bytes, arrow::ipc::SerializeSchema(*entry->schema));
+
+        entry->info.set_schema(schema_bytes->ToString());
+        auto descriptor = entry->info.mutable_flight_descriptor();
+        descriptor->set_type(FlightDescriptor::PATH);
+        descriptor->add_path(name);
+        auto endpoint = entry->info.add_endpoint();
+        endpoint->mutable_ticket()->set_ticket(name);
+        endpoint->add_location()->set_uri(location_);
+        entry->info.set_total_records(reader->parquet_reader()->metadata()->num_rows());
+        entry->info.set_total_bytes(file_info.size());
+        return entry;
+    }
+
+    std::shared_ptr<arrow::fs::FileSystem> filesystem_;
+    std::string root_dir_;
+    std::string location_;
+    std::mutex mutex_;
+    std::map<std::string, std::shared_ptr<const FlightCatalogEntry>> cache_;
+};
+
+#endif
@@ -0,0 +1,237 @@
+#ifndef FLIGHT_DATA_PAYLOAD_H
+#define FLIGHT_DATA_PAYLOAD_H
+
+#include <arrow/api.h>
+#include <arrow/ipc/api.h>
+#include <arrow/ipc/dictionary.h>
+#include <arrow/util/bit_util.h>
+
+#include <grpc++/grpc++.h>
+#include "arrow_grpc.service.pb.h"
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+/**
+ * 零拷贝发送FlightData：protobuf生成的FlightData::data_body是std::string，
+ * 赋值时会把整个batch拷贝一遍，序列化时再拷贝一遍。
+ *
+ * 这里按protobuf的线格式手工拼出FlightData：data_header等小字段拷贝到一个slice里，
+ * data_body的每个Arrow buffer各自包装成一个引用原内存的grpc::Slice，
+ * slice释放时才释放对Arrow buffer的引用。
+ */
+
+// FlightData的字段号，与proto/arrow_grpc.service.proto一致
+#define FLIGHT_DATA_HEADER_FIELD 2
+#define FLIGHT_DATA_APP_METADATA_FIELD 3
+#define FLIGHT_DATA_BODY_FIELD 1000
+
+/**
+ * @brief 一条待发送的FlightData：IPC消息（schema或record batch）和可选的应用元数据
+ *
+ */
+struct FlightDataPayload
+{
+    arrow::ipc::IpcPayload ipc_message;
+    std::shared_ptr<arrow::Buffer> app_metadata;
+};
+
+/**
+ * @brief 发送统计
+ *
+ */
+struct FlightStreamStats
+{
+    int64_t messages = 0;
+    int64_t rows = 0;
+    int64_t bytes = 0; // data_header + data_body
+    int64_t largest_message = 0;
+
+    void AddMessage(int64_t message_bytes)
+    {
+        ++messages;
+        bytes += message_bytes;
+        largest_message = std::max(largest_message, message_bytes);
+    }
+
+    std::string ToString() const
+    {
+        return std::to_string(messages) + " messages, " + std::to_string(rows) + " rows, " +
+               std::to_string(bytes) + " bytes, largest message " + std::to_string(largest_message) + " bytes";
+    }
+};
+
+void AppendVarint(std::string *out, uint64_t value)
+{
+    while (value >= 0x80)
+    {
+        out->push_back(static_cast<char>((value & 0x7F) | 0x80));
+        value >>= 7;
+    }
+    out->push_back(static_cast<char>(value));
+}
+
+/**
+ * @brief 写一个length-delimited字段的tag和长度
+ *
+ */
+void AppendBytesFieldHeader(std::string *out, uint32_t field, uint64_t length)
+{
+    AppendVarint(out, (static_cast<uint64_t>(field) << 3) | 2);
+    AppendVarint(out, length);
+}
+
+void ReleaseArrowBuffer(void *user_data)
+{
+    delete static_cast<std::shared_ptr<arrow::Buffer> *>(user_data);
+}
+
+/**
+ * @brief 引用Arrow buffer内存的slice，不拷贝
+ *
+ */
+grpc::Slice ArrowBufferSlice(const std::shared_ptr<arrow::Buffer> &buffer)
+{
+    return grpc::Slice(const_cast<uint8_t *>(buffer->data()), static_cast<size_t>(buffer->size()),
+                       &ReleaseArrowBuffer, new std::shared_ptr<arrow::Buffer>(buffer));
+}
+
+namespace grpc
+{
+    template <>
+    class SerializationTraits<FlightDataPayload>
+    {
+    public:
+        static Status Serialize(const FlightDataPayload &msg, ByteBuffer *out, bool *own_buffer)
+        {
+            static const uint8_t kPadding[8] = {0};
+            const auto &ipc = msg.ipc_message;
+
+            // 除data_body的内容外都是几百字节到几KB，拷贝到一个slice里
+            std::string head;
+            if (ipc.metadata != nullptr && ipc.metadata->size() > 0)
+            {
+                AppendBytesFieldHeader(&head, FLIGHT_DATA_HEADER_FIELD, ipc.metadata->size());
+                head.append(reinterpret_cast<const char *>(ipc.metadata->data()), ipc.metadata->size());
+            }
+            if (msg.app_metadata != nullptr && msg.app_metadata->size() > 0)
+            {
+                AppendBytesFieldHeader(&head, FLIGHT_DATA_APP_METADATA_FIELD, msg.app_metadata->size());
+                head.append(reinterpret_cast<const char *>(msg.app_metadata->data()), msg.app_metadata->size());
+            }
+            if (ipc.body_length > 0)
+            {
+                AppendBytesFieldHeader(&head, FLIGHT_DATA_BODY_FIELD, ipc.body_length);
+            }
+
+            std::vector<Slice> slices;
+            slices.emplace_back(head.data(), head.size());
+            int64_t body_length = 0;
+            for (const auto &buffer : ipc.body_buffers)
+            {
+                if (buffer == nullptr || buffer->size() == 0)
+                    continue;
+                slices.push_back(ArrowBufferSlice(buffer));
+                // IPC要求每个buffer按8字节对齐，body_length已经包含了补齐的长度
+                int64_t padding = arrow::bit_util::RoundUpToMultipleOf8(buffer->size()) - buffer->size();
+                if (padding > 0)
+                {
+                    slices.emplace_back(kPadding, static_cast<size_t>(padding), Slice::STATIC_SLICE);
+                }
+                body_length += buffer->size() + padding;
+            }
+            if (body_length != ipc.body_length)
+            {
+                return Status(StatusCode::INTERNAL, "IPC body length " + std::to_string(ipc.body_length) +
+                                                        " does not match its buffers (" + std::to_string(body_length) + ")");
+            }
+
+            ByteBuffer buffer(slices.data(), slices.size());
+            out->Swap(&buffer);
+            *own_buffer = true;
+            return Status::OK;
+        }
+
+        static Status Deserialize(ByteBuffer *, FlightDataPayload *)
+        {
+            return Status(StatusCode::UNIMPLEMENTED, "FlightDataPayload is only used for sending");
+        }
+    };
+} // namespace grpc
+
+/**
+ * @brief 把FlightDataPayload序列化成ByteBuffer，用于raw方法的异步writer
+ *
+ */
+grpc::Status SerializeFlightData(const FlightDataPayload &payload, grpc::ByteBuffer *out)
+{
+    bool own_buffer;
+    return grpc::SerializationTraits<FlightDataPayload>::Serialize(payload, out, &own_buffer);
+}
+
+grpc::Status ToGrpcStatus(const arrow::Status &status)
+{
+    if (status.ok())
+        return grpc::Status::OK;
+    if (status.IsCancelled())
+        return grpc::Status(grpc::StatusCode::CANCELLED, status.ToString());
+    if (status.IsKeyError() || status.IsIOError())
+        return grpc::Status(grpc::StatusCode::NOT_FOUND, status.ToString());
+    if (status.IsInvalid())
+        return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT, status.ToString());
+    return grpc::Status(grpc::StatusCode::INTERNAL, status.ToString());
+}
+
+/**
+ * @brief 把一个RecordBatchReader逐条编码成FlightData：第一条是schema，之后每个record batch一条
+ *
+ * 每次Next才从reader取下一个batch，发送方可以等上一条写完再取，内存里只有一个batch
+ */
+class FlightDataEncoder
+{
+public:
+    explicit FlightDataEncoder(std::shared_ptr<arrow::RecordBatchReader> reader)
+        : reader_(std::move(reader)), options_(arrow::ipc::IpcWriteOptions::Defaults())
+    {
+        options_.allow_64bit = true;
+    }
+
+    /**
+     * @brief 编码下一条消息
+     *
+     * @param payload 输出
+     * @return arrow::Result<bool> 没有更多消息时返回false
+     */
+    arrow::Result<bool> Next(FlightDataPayload *payload)
+    {
+        *payload = FlightDataPayload();
+        if (!schema_sent_)
+        {
+            auto schema = reader_->schema();
+            arrow::ipc::DictionaryFieldMapper mapper(*schema);
+            ARROW_RETURN_NOT_OK(arrow::ipc::GetSchemaPayload(*schema, options_, mapper, &payload->ipc_message));
+            schema_sent_ = true;
+            stats_.AddMessage(payload->ipc_message.metadata->size());
+            return true;
+        }
+        std::shared_ptr<arrow::RecordBatch> batch;
+        ARROW_RETURN_NOT_OK(reader_->ReadNext(&batch));
+        if (batch == nullptr)
+            return false;
+        ARROW_RETURN_NOT_OK(arrow::ipc::GetRecordBatchPayload(*batch, options_, &payload->ipc_message));
+        stats_.AddMessage(payload->ipc_message.metadata->size() + payload->ipc_message.body_length);
+        stats_.rows += batch->num_rows();
+        return true;
+    }
+
+    const FlightStreamStats &stats() const { return stats_; }
+
+private:
+    std::shared_ptr<arrow::RecordBatchReader> reader_;
+    arrow::ipc::IpcWriteOptions options_;
+    bool schema_sent_ = false;
+    FlightStreamStats stats_;
+};
+
+#endif
@@ -0,0 +1,289 @@
+#ifndef FLIGHT_DATA_READER_H
+#define FLIGHT_DATA_READER_H
+
+#include <arrow/api.h>
+#include <arrow/ipc/api.h>
+
+#include <grpc++/grpc++.h>
+#include "arrow_grpc.service.pb.h"
+#include "arrow_grpc.service.grpc.pb.h"
+
+#include <algorithm>
+#include <chrono>
+#include <string>
+
+#include "flight_data_payload.h"
+
+/**
+ * 零拷贝接收FlightData：protobuf解析会把data_body拷贝到std::string里。
+ *
+ * 这里直接拿gRPC收到的ByteBuffer，按protobuf线格式手工找出data_header和data_body，
+ * 二者都是引用gRPC slice的arrow::Buffer，再交给IPC reader还原RecordBatch。
+ * 消息只有一个slice时完全不拷贝，被切成多个slice时（比如超过传输层的帧大小）合并一次。
+ */
+
+/**
+ * @brief 持有一个grpc::Slice的arrow::Buffer，buffer释放时才释放slice
+ *
+ */
+class GrpcSliceBuffer : public arrow::Buffer
+{
+public:
+    explicit GrpcSliceBuffer(grpc::Slice slice)
+        : arrow::Buffer(nullptr, 0), slice_(std::move(slice))
+    {
+        // 小slice的数据内联在grpc_slice结构体里，必须在slice_就位后再取地址
+        data_ = slice_.begin();
+        size_ = capacity_ = static_cast<int64_t>(slice_.size());
+    }
+
+private:
+    grpc::Slice slice_;
+};
+
+/**
+ * @brief 收到的一条FlightData，各字段都引用同一个gRPC slice
+ *
+ */
+struct FlightDataMessage
+{
+    std::shared_ptr<arrow::Buffer> data_header;
+    std::shared_ptr<arrow::Buffer> app_metadata;
+    std::shared_ptr<arrow::Buffer> data_body;
+};
+
+/**
+ * @brief 读一个varint，越界时返回false
+ *
+ */
+bool ReadVarint(const uint8_t **pos, const uint8_t *end, uint64_t *value)
+{
+    *value = 0;
+    for (int shift = 0; shift < 64 && *pos < end; shift += 7)
+    {
+        uint8_t byte = *(*pos)++;
+        *value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0)
+            return true;
+    }
+    return false;
+}
+
+namespace grpc
+{
+    template <>
+    class SerializationTraits<FlightDataMessage>
+    {
+    public:
+        static Status Serialize(const FlightDataMessage &, ByteBuffer *, bool *)
+        {
+            return Status(StatusCode::UNIMPLEMENTED, "FlightDataMessage is only used for receiving");
+        }
+
+        static Status Deserialize(ByteBuffer *buffer, FlightDataMessage *msg)
+        {
+            Slice slice;
+            if (!buffer->TrySingleSlice(&slice).ok())
+            {
+                Status status = buffer->DumpToSingleSlice(&slice);
+                if (!status.ok())
+                    return status;
+            }
+            buffer->Clear();
+            auto whole = std::make_shared<GrpcSliceBuffer>(std::move(slice));
+
+            *msg = FlightDataMessage();
+            const uint8_t *begin = whole->data();
+            const uint8_t *pos = begin;
+            const uint8_t *end = begin + whole->size();
+            while (pos < end)
+            {
+                uint64_t tag, length;
+                if (!ReadVarint(&pos, end, &tag))
+                    return Status(StatusCode::INTERNAL, "Truncated FlightData tag");
+                uint32_t field = static_cast<uint32_t>(tag >> 3);
+                switch (tag & 0x7)
+                {
+                case 0: // varint
+                    if (!ReadVarint(&pos, end, &length))
+                        return Status(StatusCode::INTERNAL, "Truncated FlightData varint");
+                    continue;
+                case 1: // 64位定长
+                    length = 8;
+                    break;
+                case 5: // 32位定长
+                    length = 4;
+                    break;
+                case 2: // length-delimited
+                    if (!ReadVarint(&pos, end, &length))
+                        return Status(StatusCode::INTERNAL, "Truncated FlightData length");
+                    break;
+                default:
+                    return Status(StatusCode::INTERNAL, "Unsupported wire type in FlightData");
+                }
+                if (length > static_cast<uint64_t>(end - pos))
+                    return Status(StatusCode::INTERNAL, "Truncated FlightData field " + std::to_string(field));
+
+                if ((tag & 0x7) == 2)
+                {
+                    auto field_buffer = arrow::SliceBuffer(whole, pos - begin, static_cast<int64_t>(length));
+                    if (field == FLIGHT_DATA_HEADER_FIELD)
+                        msg->data_header = field_buffer;
+                    else if (field == FLIGHT_DATA_APP_METADATA_FIELD)
+                        msg->app_metadata = field_buffer;
+                    else if (field == FLIGHT_DATA_BODY_FIELD)
+                        msg->data_body = field_buffer;
+                    // flight_descriptor等其他字段跳过
+                }
+                pos += length;
+            }
+            return Status::OK;
+        }
+    };
+} // namespace grpc
+
+arrow::Status FromGrpcStatus(const grpc::Status &status)
+{
+    if (status.ok())
+        return arrow::Status::OK();
+    return arrow::Status::IOError("gRPC error ", static_cast<int>(status.error_code()), ": ",
+                                  status.error_message());
+}
+
+/**
+ * @brief 接收统计
+ *
+ */
+struct FlightReadStats
+{
+    int64_t messages = 0;
+    int64_t rows = 0;
+    int64_t bytes = 0; // data_header + data_body
+    int64_t largest_message = 0;
+    double seconds = 0;
+
+    std::string ToString() const
+    {
+        return std::to_string(messages) + " messages, " + std::to_string(rows) + " rows, " +
+               std::to_string(bytes) + " bytes in " + std::to_string(seconds) + " s, " +
+               std::to_string(seconds > 0 ? rows / seconds : 0) + " rows/s, " +
+               std::to_string(seconds > 0 ? bytes / seconds / (1 << 20) : 0) + " MB/s, largest message " +
+               std::to_string(largest_message) + " bytes";
+    }
+};
+
+/**
+ * @brief 把一个DoGet的FlightData流还原成RecordBatchReader
+ *
+ */
+class FlightDataStreamReader : public arrow::RecordBatchReader
+{
+public:
+    /**
+     * @brief 发起DoGet，读到schema消息后返回
+     *
+     * 生成的Stub::DoGet返回的是ClientReader<FlightData>，每条消息都会被protobuf解析。
+     * 这里在同一个channel上自己发起DoGet，响应类型直接是FlightDataMessage，
+     * 请求仍按生成的Ticket序列化。
+     */
+    static arrow::Result<std::shared_ptr<FlightDataStreamReader>> Open(grpc::ChannelInterface *channel,
+                                                                     const ::Ticket &ticket)
+    {
+        static const grpc::internal::RpcMethod kDoGetMethod("/FlightService/DoGet",
+                                                            grpc::internal::RpcMethod::SERVER_STREAMING);
+        std::shared_ptr<FlightDataStreamReader> reader(new FlightDataStreamReader());
+        reader->start_ = std::chrono::steady_clock::now();
+        reader->context_.reset(new grpc::ClientContext());
+        reader->stream_.reset(grpc::internal::ClientReaderFactory<FlightDataMessage>::Create(
+            channel, kDoGetMethod, reader->context_.get(), ticket));
+
+        FlightDataMessage message;
+        ARROW_ASSIGN_OR_RAISE(bool has_message, reader->ReadMessage(&message));
+        if (!has_message)
+        {
+            return arrow::Status::IOError("DoGet stream ended before the schema message");
+        }
+        ARROW_ASSIGN_OR_RAISE(auto ipc_message, arrow::ipc::Message::Open(message.data_header, message.data_body));
+        if (ipc_message->type() != arrow::ipc::MessageType::SCHEMA)
+        {
+            return arrow::Status::Invalid("First DoGet message is not a schema");
+        }
+        ARROW_ASSIGN_OR_RAISE(reader->schema_, arrow::ipc::ReadSchema(*ipc_message, &reader->dictionary_memo_));
+        return reader;
+    }
+
+    ~FlightDataStreamReader() override
+    {
+        // 没读完就释放时先取消调用，否则Finish要等服务端把剩下的数据发完
+        if (stream_ != nullptr && !finished_)
+        {
+            context_->TryCancel();
+            stream_->Finish();
+        }
+    }
+
+    std::shared_ptr<arrow::Schema> schema() const override { return schema_; }
+
+    arrow::Status ReadNext(std::shared_ptr<arrow::RecordBatch> *batch) override
+    {
+        *batch = nullptr;
+        FlightDataMessage message;
+        ARROW_ASSIGN_OR_RAISE(bool has_message, ReadMessage(&message));
+        if (!has_message)
+            return arrow::Status::OK();
+        ARROW_ASSIGN_OR_RAISE(auto ipc_message, arrow::ipc::Message::Open(message.data_header, message.data_body));
+        if (ipc_message->type() != arrow::ipc::MessageType::RECORD_BATCH)
+        {
+            return arrow::Status::NotImplemented("Unexpected IPC message type in DoGet stream");
+        }
+        // body里的buffer直接被RecordBatch引用
+        ARROW_ASSIGN_OR_RAISE(*batch, arrow::ipc::ReadRecordBatch(*ipc_message, schema_, &dictionary_memo_,
+                                                                  arrow::ipc::IpcReadOptions::Defaults()));
+        stats_.rows += (*batch)->num_rows();
+        return arrow::Status::OK();
+    }
+
+    const FlightReadStats &stats() const { return stats_; }
+
+private:
+    FlightDataStreamReader() = default;
+
+    /**
+     * @brief 读一条原始FlightData，流结束时检查gRPC状态
+     *
+     */
+    arrow::Result<bool> ReadMessage(FlightDataMessage *message)
+    {
+        if (finished_)
+            return false;
+        // Read通过SerializationTraits<FlightDataMessage>走上面的手工解析
+        if (stream_->Read(message))
+        {
+            int64_t message_bytes = (message->data_header == nullptr ? 0 : message->data_header->size()) +
+                                    (message->data_body == nullptr ? 0 : message->data_body->size());
+            ++stats_.messages;
+            stats_.bytes += message_bytes;
+            stats_.largest_message = std::max(stats_.largest_message, message_bytes);
+            stats_.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_).count();
+            if (message->data_header == nullptr)
+            {
+                return arrow::Status::Invalid("FlightData without data_header");
+            }
+            return true;
+        }
+        finished_ = true;
+        stats_.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_).count();
+        ARROW_RETURN_NOT_OK(FromGrpcStatus(stream_->Finish()));
+        return false;
+    }
+
+    std::unique_ptr<grpc::ClientContext> context_;
+    std::unique_ptr<grpc::ClientReader<FlightDataMessage>> stream_;
+    std::shared_ptr<arrow::Schema> schema_;
+    arrow::ipc::DictionaryMemo dictionary_memo_;
+    std::chrono::steady_clock::time_point start_;
+    bool finished_ = false;
+    FlightReadStats stats_;
+};
+
+#endif
@@ -15,70 +15,541 @@
 #include "arrow_grpc.service.pb.h"
 #include "arrow_grpc.service.grpc.pb.h"
 
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <set>
 #include <string>
+#include <thread>
+#include <vector>
 #include "common.h"
+#include "flight_catalog.h"
+#include "flight_data_payload.h"
+#include "../flight_speed_test/message_chunking.h"
+#include "../flight_speed_test/resumable_read.h"
+#include "shm_transport.h"
 
 using namespace std;
 
-// #2: 读取整个文件
-std::shared_ptr<arrow::Table> read_whole_file(std::string file_name)
+/**
+ * @brief 打开parquet文件，按row group流式读取，不把整个文件读进内存
+ *
+ * @param start_row 续传时从该行开始，之前的row group不解码
+ */
+arrow::Result<std::shared_ptr<arrow::RecordBatchReader>> OpenParquetStream(const std::string &file_name,
+                                                                           int64_t start_row)
 {
-    std::shared_ptr<arrow::io::ReadableFile> infile;
-    PARQUET_ASSIGN_OR_THROW(infile, arrow::io::ReadableFile::Open(file_name, arrow::default_memory_pool()));
+    ARROW_ASSIGN_OR_RAISE(auto infile, arrow::io::ReadableFile::Open(file_name, arrow::default_memory_pool()));
+    ARROW_ASSIGN_OR_RAISE(std::shared_ptr<arrow::RecordBatchReader> batch_reader,
+                          ParquetTailReader::Open(std::move(infile), start_row));
+    return batch_reader;
+}
 
-    std::unique_ptr<parquet::arrow::FileReader> reader;
-    PARQUET_THROW_NOT_OK(parquet::arrow::OpenFile(infile, arrow::default_memory_pool(), &reader));
-    std::shared_ptr<arrow::Table> table;
-    PARQUET_THROW_NOT_OK(reader->ReadTable(&table));
+/**
+ * @brief DoGet是异步raw方法（见DoGetCall），目录相关的调用很轻，用同步方法实现
+ *
+ */
+class TradeQueryImpl : public FlightService::WithRawMethod_DoGet<FlightService::Service>
+{
+public:
+    explicit TradeQueryImpl(std::shared_ptr<FlightCatalog> catalog)
+        : catalog_(std::move(catalog))
+    {
+    }
 
-    return table;
-}
+    FlightCatalog *catalog() { return catalog_.get(); }
+
+    /**
+     * @brief criteria.expression不为空时作为数据集名前缀过滤
+     *
+     */
+    ::grpc::Status ListFlights(::grpc::ServerContext *context, const ::Criteria *criteria,
+                               ::grpc::ServerWriter<::FlightInfo> *writer) override
+    {
+        auto entries = catalog_->List(criteria->expression());
+        if (!entries.ok())
+        {
+            return ToGrpcStatus(entries.status());
+        }
+        for (const auto &entry : *entries)
+        {
+            if (!writer->Write(entry->info))
+                break;
+        }
+        return ::grpc::Status::OK;
+    }
+
+    ::grpc::Status GetFlightInfo(::grpc::ServerContext *context, const ::FlightDescriptor *descriptor,
+                                 ::FlightInfo *info) override
+    {
+        auto entry = EntryFromDescriptor(*descriptor);
+        if (!entry.ok())
+        {
+            return ToGrpcStatus(entry.status());
+        }
+        *info = (*entry)->info;
+        return ::grpc::Status::OK;
+    }
+
+    ::grpc::Status GetSchema(::grpc::ServerContext *context, const ::FlightDescriptor *descriptor,
+                             ::SchemaResult *result) override
+    {
+        auto entry = EntryFromDescriptor(*descriptor);
+        if (!entry.ok())
+        {
+            return ToGrpcStatus(entry.status());
+        }
+        result->set_schema((*entry)->info.schema());
+        return ::grpc::Status::OK;
+    }
+
+private:
+    arrow::Result<std::shared_ptr<const FlightCatalogEntry>> EntryFromDescriptor(const ::FlightDescriptor &descriptor)
+    {
+        if (descriptor.type() != ::FlightDescriptor::PATH || descriptor.path_size() != 1)
+        {
+            return arrow::Status::Invalid("Must provide PATH-type FlightDescriptor with one path component");
+        }
+        return catalog_->Get(descriptor.path(0));
+    }
+
+    std::shared_ptr<FlightCatalog> catalog_;
+};
 
-class TradeQueryImpl : public FlightService::Service
+/**
+ * @brief 异步服务的关闭状态。完成队列Shutdown之后不能再注册新的调用，
+ * 注册和关闭完成队列都在mutex下进行，shutting_down置位后不再注册
+ *
+ */
+struct AsyncServerState
 {
-protected:
-    virtual ::grpc::Status DoGet(::grpc::ServerContext *context, const ::Ticket *ticket, ::grpc::ServerWriter<::FlightData> *writer)
+    std::mutex mutex;
+    bool shutting_down = false;
+};
+
+/**
+ * @brief 一次DoGet调用的状态机，所有回调都在同一个完成队列的轮询线程上执行
+ *
+ * 上一条消息写完（完成队列返回写操作的tag）后才编码下一片，读完一个row group的所有片才读下一个，
+ * 每个流同时最多只有一个row group在内存里，慢客户端不会让服务端堆积数据。
+ * 写操作要等传输层按HTTP/2流控窗口接收了消息才完成，消息切小以后流控按片推进，不会一次压进几MB。
+ */
+class DoGetCall
+{
+public:
+    /**
+     * @brief 注册一个等待中的DoGet，有请求到达时完成队列返回它。服务正在关闭时不注册
+     *
+     */
+    static void Arm(TradeQueryImpl *service, grpc::ServerCompletionQueue *cq, AsyncServerState *state)
     {
-        printf("get do get\n");
-        // FlightData empty;
-        // writer->Write(empty);
+        std::lock_guard<std::mutex> lock(state->mutex);
+        if (state->shutting_down)
+            return;
+        new DoGetCall(service, cq, state);
+    }
 
-        std::vector<std::shared_ptr<arrow::RecordBatch>> batches;
-        auto table = read_whole_file(PARQUET_FILE_DIR PARQUET_FILE_NAME);
-        arrow::TableBatchReader batch_reader(table);
+    /**
+     * @brief 完成队列返回本调用的tag时调用
+     *
+     * @param ok 操作是否成功：等待请求时为false表示服务在关闭，写入时为false表示客户端已断开
+     */
+    void Proceed(bool ok)
+    {
+        switch (state_)
+        {
+        case State::kRequest:
+            if (!ok)
+            {
+                delete this;
+                return;
+            }
+            // 先补一个等待中的调用，再处理这个请求
+            Arm(service_, cq_, server_state_);
+            start_ = std::chrono::steady_clock::now();
+            {
+                auto status = Start();
+                if (!status.ok())
+                {
+                    Finish(ToGrpcStatus(status));
+                    return;
+                }
+            }
+            WriteNext();
+            return;
+        case State::kWriting:
+            if (!ok)
+            {
+                cout << "DoGet cancelled by client after " << encoder_->stats().ToString() << endl;
+                delete this;
+                return;
+            }
+            WriteNext();
+            return;
+        case State::kFinishing:
+            delete this;
+            return;
+        }
+    }
+
+private:
+    enum class State
+    {
+        kRequest,
+        kWriting,
+        kFinishing,
+    };
+
+    DoGetCall(TradeQueryImpl *service, grpc::ServerCompletionQueue *cq, AsyncServerState *state)
+        : service_(service), cq_(cq), server_state_(state), writer_(&ctx_)
+    {
+        service_->RequestDoGet(&ctx_, &request_, &writer_, cq_, cq_, this);
+    }
 
-        auto rst_batches = batch_reader.ToRecordBatches();
-        if (!rst_batches.ok())
+    arrow::Status Start()
+    {
+        ::Ticket ticket;
+        auto status = grpc::SerializationTraits<::Ticket>::Deserialize(&request_, &ticket);
+        if (!status.ok())
         {
-            printf("%s\n", rst_batches.status().message().c_str());
-            return ::grpc::Status::OK;
+            return arrow::Status::Invalid("Malformed ticket: ", status.error_message());
         }
-        batches = rst_batches.MoveValueUnsafe();
-        auto rst_owning_reader = arrow::RecordBatchReader::Make(
-            std::move(batches), table->schema());
-        if (!rst_owning_reader.ok())
+        // ticket是数据集名加传输参数，数据集名为空时读默认文件
+        ARROW_ASSIGN_OR_RAISE(auto request, ParseTicket(ticket.ticket()));
+        ARROW_ASSIGN_OR_RAISE(auto entry, service_->catalog()->Get(request.name.empty() ? PARQUET_FILE_NAME : request.name));
+        ARROW_ASSIGN_OR_RAISE(auto batch_reader, OpenParquetStream(entry->path, request.start_row));
+        // row group切成客户端要求大小的片，每片一条消息
+        encoder_.reset(new FlightDataEncoder(
+            std::make_shared<RechunkingBatchReader>(std::move(batch_reader), request.max_message_bytes)));
+        return arrow::Status::OK();
+    }
+
+    void WriteNext()
+    {
+        FlightDataPayload payload;
+        auto has_next = encoder_->Next(&payload);
+        if (!has_next.ok())
         {
-            printf("%s\n", rst_owning_reader.status().message().c_str());
-            return ::grpc::Status::OK;
+            Finish(ToGrpcStatus(has_next.status()));
+            return;
         }
-        auto owning_reader = rst_owning_reader.ValueUnsafe();
+        if (!*has_next)
+        {
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_).count();
+            cout << "DoGet " << encoder_->stats().ToString() << " in " << seconds << " s, "
+                 << encoder_->stats().bytes / seconds / (1 << 20) << " MB/s" << endl;
+            Finish(grpc::Status::OK);
+            return;
+        }
+        // 序列化后的slice引用batch的buffer，写完之前batch不会释放
+        grpc::ByteBuffer buffer;
+        auto status = SerializeFlightData(payload, &buffer);
+        if (!status.ok())
+        {
+            Finish(status);
+            return;
+        }
+        state_ = State::kWriting;
+        writer_.Write(buffer, this);
+    }
 
-        // owning_reader->Next();
-        auto rst_tmp_batch = owning_reader->Next();
-        if (!rst_tmp_batch.ok())
+    void Finish(const grpc::Status &status)
+    {
+        state_ = State::kFinishing;
+        writer_.Finish(status, this);
+    }
+
+    TradeQueryImpl *service_;
+    grpc::ServerCompletionQueue *cq_;
+    AsyncServerState *server_state_;
+    grpc::ServerContext ctx_;
+    grpc::ByteBuffer request_;
+    grpc::ServerAsyncWriter<grpc::ByteBuffer> writer_;
+    State state_ = State::kRequest;
+
+    std::chrono::steady_clock::time_point start_;
+    std::unique_ptr<FlightDataEncoder> encoder_;
+};
+
+/**
+ * @brief 异步服务：每个核一个完成队列和一个轮询线程，线程数与并发流的数量无关
+ *
+ */
+class AsyncTradeServer
+{
+public:
+    // 每个完成队列预先注册的等待中DoGet数，突发的连接不用排队等待注册
+    static const int kPendingCallsPerQueue = 16;
+
+    AsyncTradeServer(std::shared_ptr<FlightCatalog> catalog, int num_queues)
+        : num_queues_(num_queues), service_(std::move(catalog))
+    {
+    }
+
+    ~AsyncTradeServer()
+    {
+        Shutdown();
+    }
+
+    bool Start(const std::string &server_addr)
+    {
+        grpc::ServerBuilder builder;
+        builder.SetMaxSendMessageSize(GRPC_MESSAGE_LIMIT);
+        builder.AddListeningPort(server_addr, grpc::InsecureServerCredentials());
+        builder.RegisterService(&service_);
+        for (int i = 0; i < num_queues_; ++i)
+        {
+            queues_.push_back(builder.AddCompletionQueue());
+        }
+        server_ = builder.BuildAndStart();
+        if (server_ == nullptr)
         {
-            printf("%s\n", rst_tmp_batch.status().message().c_str());
-            return ::grpc::Status::OK;
+            return false;
         }
-        auto tmp_batch = rst_tmp_batch.ValueUnsafe();
+        for (auto &cq : queues_)
+        {
+            for (int i = 0; i < kPendingCallsPerQueue; ++i)
+            {
+                DoGetCall::Arm(&service_, cq.get(), &state_);
+            }
+            grpc::ServerCompletionQueue *queue = cq.get();
+            threads_.emplace_back([queue]()
+                                  {
+                                      void *tag;
+                                      bool ok;
+                                      while (queue->Next(&tag, &ok))
+                                      {
+                                          static_cast<DoGetCall *>(tag)->Proceed(ok);
+                                      } });
+        }
+        return true;
+    }
 
-        ArrowArray out;
-        arrow::ExportRecordBatch(*tmp_batch, &out);
+    void Wait()
+    {
+        server_->Wait();
+    }
 
-        printf("done do get\n");
-        return ::grpc::Status::OK;
+    /**
+     * @brief 先关服务（未完成的调用会以ok=false返回），再关完成队列，轮询线程取完剩余事件后退出
+     *
+     * 关服务之前先在mutex下置位shutting_down：之后刚收到请求的调用不会再补注册，正在注册的已经注册完，
+     * 完成队列关闭后不会再有新的操作。server_->Shutdown()要等轮询线程处理完进行中的调用，不能持有mutex
+     */
+    void Shutdown()
+    {
+        if (server_ == nullptr)
+            return;
+        {
+            std::lock_guard<std::mutex> lock(state_.mutex);
+            state_.shutting_down = true;
+        }
+        server_->Shutdown();
+        for (auto &cq : queues_)
+        {
+            cq->Shutdown();
+        }
+        for (auto &thread : threads_)
+        {
+            thread.join();
+        }
+        threads_.clear();
+        server_.reset();
+    }
+
+private:
+    int num_queues_;
+    AsyncServerState state_;
+    TradeQueryImpl service_;
+    std::unique_ptr<grpc::Server> server_;
+    std::vector<std::unique_ptr<grpc::ServerCompletionQueue>> queues_;
+    std::vector<std::thread> threads_;
+};
+
+/**
+ * @brief 同机客户端用的共享内存服务：每个连接一个线程、一个环，数据集与gRPC服务共用一个目录
+ *
+ * 同时服务的连接不超过SHM_MAX_CONNECTIONS，超过时回一个错误包后关闭，客户端可以改走gRPC。
+ */
+class ShmTradeServer
+{
+public:
+    explicit ShmTradeServer(std::shared_ptr<FlightCatalog> catalog)
+        : catalog_(std::move(catalog)), connections_(std::make_shared<Connections>())
+    {
+    }
+
+    ~ShmTradeServer()
+    {
+        Shutdown();
+    }
+
+    arrow::Status Start(const std::string &socket_path)
+    {
+        if (listen_fd_ >= 0)
+        {
+            return arrow::Status::Invalid("Shared memory server already started");
+        }
+        struct sockaddr_un addr;
+        std::memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (socket_path.size() >= sizeof(addr.sun_path))
+        {
+            return arrow::Status::Invalid("Socket path too long: ", socket_path);
+        }
+        std::strncpy(addr.sun_path, socket_path.c_str(), sizeof(addr.sun_path) - 1);
+
+        int listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+        if (listen_fd < 0)
+        {
+            return ErrnoStatus("socket");
+        }
+        // 上次退出时留下的socket文件
+        unlink(socket_path.c_str());
+        if (bind(listen_fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) != 0 ||
+            listen(listen_fd, 64) != 0)
+        {
+            auto status = ErrnoStatus("bind " + socket_path);
+            close(listen_fd);
+            return status;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(connections_->mutex);
+            connections_->stopping = false;
+        }
+        std::shared_ptr<FlightCatalog> catalog = catalog_;
+        std::shared_ptr<Connections> connections = connections_;
+        accept_thread_ = std::thread([catalog, connections, listen_fd]()
+                                     {
+                                         while (true)
+                                         {
+                                             int fd = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+                                             if (fd < 0)
+                                             {
+                                                 if (errno == EINTR || errno == ECONNABORTED)
+                                                     continue;
+                                                 break;
+                                             }
+                                             if (!connections->Add(fd))
+                                             {
+                                                 auto send_status = SendShmPacket(fd, kShmError, 0, 0,
+                                                                                  "Too many shared memory connections");
+                                                 ARROW_UNUSED(send_status);
+                                                 close(fd);
+                                                 continue;
+                                             }
+                                             std::thread(&ShmTradeServer::Serve, catalog, connections, fd).detach();
+                                         } });
+        listen_fd_ = listen_fd;
+        return arrow::Status::OK();
     }
+
+    /**
+     * @brief 停止接受新连接，断开进行中的连接，等连接线程全部退出
+     *
+     */
+    void Shutdown()
+    {
+        if (listen_fd_ < 0)
+            return;
+        // shutdown让阻塞的accept返回
+        shutdown(listen_fd_, SHUT_RDWR);
+        if (accept_thread_.joinable())
+        {
+            accept_thread_.join();
+        }
+        close(listen_fd_);
+        listen_fd_ = -1;
+        connections_->StopAll();
+    }
+
+private:
+    /**
+     * @brief 进行中的连接。连接线程是detach的，各自持有一份，服务端对象析构后线程也能安全退出
+     *
+     */
+    struct Connections
+    {
+        std::mutex mutex;
+        std::condition_variable done;
+        std::set<int> fds;
+        bool stopping = false;
+
+        bool Add(int fd)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (stopping || fds.size() >= SHM_MAX_CONNECTIONS)
+                return false;
+            fds.insert(fd);
+            return true;
+        }
+
+        void Remove(int fd)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            fds.erase(fd);
+            close(fd);
+            done.notify_all();
+        }
+
+        /**
+         * @brief 断开所有连接，阻塞在收发上的线程随即出错返回，等它们都关闭fd
+         *
+         */
+        void StopAll()
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            stopping = true;
+            for (int fd : fds)
+            {
+                shutdown(fd, SHUT_RDWR);
+            }
+            done.wait(lock, [this]() { return fds.empty(); });
+        }
+    };
+
+    static void Serve(std::shared_ptr<FlightCatalog> catalog, std::shared_ptr<Connections> connections, int fd)
+    {
+        auto status = ServeStream(catalog.get(), fd);
+        if (!status.ok())
+        {
+            cout << "shared memory stream failed: " << status.ToString() << endl;
+            auto send_status = SendShmPacket(fd, kShmError, 0, 0, status.ToString());
+            ARROW_UNUSED(send_status);
+        }
+        connections->Remove(fd);
+    }
+
+    static arrow::Status ServeStream(FlightCatalog *catalog, int fd)
+    {
+        ShmPacket request;
+        ARROW_RETURN_NOT_OK(RecvShmPacket(fd, true, &request).status());
+        if (request.header.type != kShmRequest)
+        {
+            return arrow::Status::Invalid("Expected a ticket");
+        }
+        auto start = std::chrono::steady_clock::now();
+        ARROW_ASSIGN_OR_RAISE(auto ticket, ParseTicket(request.extra));
+        ARROW_ASSIGN_OR_RAISE(auto entry, catalog->Get(ticket.name.empty() ? PARQUET_FILE_NAME : ticket.name));
+        ARROW_ASSIGN_OR_RAISE(auto batch_reader, OpenParquetStream(entry->path, ticket.start_row));
+        // 切片的大小决定环里一段的大小，也决定客户端一次能拿到多少数据
+        RechunkingBatchReader reader(std::move(batch_reader), ticket.max_message_bytes);
+        ARROW_ASSIGN_OR_RAISE(auto ring, ShmRing::Create(SHM_RING_BYTES));
+        int64_t bytes;
+        ARROW_RETURN_NOT_OK(WriteShmStream(fd, ring.get(), &reader, &bytes));
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        cout << "shared memory stream " << bytes << " bytes in " << seconds << " s" << endl;
+        return arrow::Status::OK();
+    }
+
+    std::shared_ptr<FlightCatalog> catalog_;
+    std::shared_ptr<Connections> connections_;
+    int listen_fd_ = -1;
+    std::thread accept_thread_;
 };
 
 int main(int argc, char const *argv[])
@@ -87,21 +558,25 @@ int main(int argc, char const *argv[])
     std::string server_addr(std::string("0.0.0.0:") + std::to_string(SERVER_PORT));
     grpc::EnableDefaultHealthCheckService(true);
 
-    TradeQueryImpl service;
-
-    grpc::ServerBuilder builder;
-    builder.AddChannelArgument("MaxSendMessageSize", INT_MAX);
-    builder.AddListeningPort(server_addr, grpc::InsecureServerCredentials());
-    builder.RegisterService(&service);
-
-    std::unique_ptr<grpc::Server> server = builder.BuildAndStart();
-    if (nullptr == server)
+    auto catalog = std::make_shared<FlightCatalog>(PARQUET_FILE_DIR,
+                                                   "grpc+tcp://localhost:" + std::to_string(SERVER_PORT));
+    AsyncTradeServer server(catalog, static_cast<int>(std::max(1u, std::thread::hardware_concurrency())));
+    if (!server.Start(server_addr))
     {
         return -1;
     }
-    server->Wait();
+    cout << "Listening on " << server_addr << endl;
 
-    // auto table = read_whole_file(PARQUET_FILE_DIR PARQUET_FILE_NAME);
-    // auto stream =
+    ShmTradeServer shm_server(catalog);
+    auto status = shm_server.Start(SHM_SOCKET_PATH);
+    if (!status.ok())
+    {
+        cout << "shared memory transport disabled: " << status.ToString() << endl;
+    }
+    else
+    {
+        cout << "Shared memory transport on " << SHM_SOCKET_PATH << endl;
+    }
+    server.Wait();
     return 0;
 }
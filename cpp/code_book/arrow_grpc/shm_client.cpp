@@ -0,0 +1,56 @@
+#include <arrow/api.h>
+#include <arrow/io/api.h>
+#include <arrow/c/abi.h>
+#include <arrow/c/bridge.h>
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+#include "common.h"
+#include "shm_transport.h"
+#include "../flight_speed_test/message_chunking.h"
+
+using namespace std;
+
+/**
+ * @brief 通过共享内存读默认数据集
+ *
+ * 读到的reader再经C Stream接口导出、导入一次，模拟只认ArrowArrayStream的consumer（别的库或语言）：
+ * 每个ArrowArray的release回调释放batch的引用，最后一个引用释放时环里的空间才还给服务端。
+ */
+arrow::Status requestShm(int64_t max_message_bytes)
+{
+    auto start = std::chrono::steady_clock::now();
+    ARROW_ASSIGN_OR_RAISE(auto shm_reader, ShmStreamReader::Open(SHM_SOCKET_PATH,
+                                                                 MakeTicket(PARQUET_FILE_NAME, max_message_bytes)));
+    cout << shm_reader->schema()->ToString() << endl;
+
+    struct ArrowArrayStream c_stream;
+    ARROW_RETURN_NOT_OK(arrow::ExportRecordBatchReader(shm_reader, &c_stream));
+    ARROW_ASSIGN_OR_RAISE(auto reader, arrow::ImportRecordBatchReader(&c_stream));
+
+    int64_t rows = 0;
+    while (true)
+    {
+        std::shared_ptr<arrow::RecordBatch> batch;
+        ARROW_RETURN_NOT_OK(reader->ReadNext(&batch));
+        if (batch == nullptr)
+            break;
+        rows += batch->num_rows();
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    cout << "request done: " << shm_reader->messages() << " messages, " << rows << " rows, "
+         << shm_reader->bytes() << " bytes in " << seconds << " s, " << rows / seconds << " rows/s, "
+         << shm_reader->bytes() / seconds / (1 << 20) << " MB/s, " << shm_reader->copied_messages()
+         << " messages copied out of the ring" << endl;
+    return arrow::Status::OK();
+}
+
+int main(int argc, char const *argv[])
+{
+    int64_t max_message_bytes = argc > 1 ? std::atoll(argv[1]) : DEFAULT_MESSAGE_BYTES;
+    cout << requestShm(max_message_bytes) << endl;
+    return 0;
+}
@@ -0,0 +1,603 @@
+#ifndef SHM_TRANSPORT_H
+#define SHM_TRANSPORT_H
+
+#include <arrow/api.h>
+#include <arrow/io/api.h>
+#include <arrow/ipc/api.h>
+
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <string>
+
+/**
+ * 同机共享内存传输：数据不经过socket，只有几十字节的控制消息经过Unix socket。
+ *
+ * - 每个连接一个memfd环形缓冲区，服务端把IPC格式的消息（schema和record batch）写进环里，
+ *   通过socket发出偏移和长度，memfd本身用SCM_RIGHTS传给客户端；
+ * - 客户端只读映射整个环，每个消息包装成一个引用映射内存的arrow::Buffer，IPC reader还原的
+ *   RecordBatch直接引用这块内存，不拷贝；
+ * - 消息的最后一个引用释放时（包括经C Stream接口导出后consumer调用release），客户端把偏移发回服务端，
+ *   服务端收回这段空间，释放的段不论先后都可以立即重用；
+ * - 客户端零拷贝持有的消息不超过环的一半：再收到的消息会先拷贝出来、立即释放，
+ *   像ToTable那样留住所有batch的consumer不会把环占满，服务端也就不会和等下一条消息的客户端互相等待；
+ * - 环满后服务端最多等SHM_RING_WAIT_MS，期间没有任何释放就返回CapacityError，不会永远挂住。
+ *
+ * 控制消息用SOCK_SEQPACKET，每个包就是一条消息，不用自己分帧。
+ */
+
+#define SHM_RING_BYTES (64LL << 20)
+#define SHM_MAX_CONNECTIONS 16 // 每个连接一个线程和一个SHM_RING_BYTES的环，超过时拒绝新连接
+#define SHM_SLOT_ALIGNMENT 64
+#define SHM_RING_WAIT_MS 10000 // 环满时等待客户端释放的最长时间，每收到一次释放重新计时
+
+enum ShmMessageType : uint32_t
+{
+    kShmRequest = 1, // 客户端->服务端，后面跟ticket
+    kShmRing = 2,    // 服务端->客户端，附带memfd，length是环的大小
+    kShmMessage = 3, // 服务端->客户端，环里[offset, offset + length)是一条IPC消息，第一条是schema
+    kShmEnd = 4,     // 服务端->客户端，流结束
+    kShmError = 5,   // 服务端->客户端，后面跟错误信息
+    kShmRelease = 6, // 客户端->服务端，offset处的消息已释放
+};
+
+struct ShmMessage
+{
+    uint32_t type;
+    uint32_t reserved;
+    int64_t offset;
+    int64_t length;
+};
+
+struct ShmPacket
+{
+    ShmMessage header;
+    std::string extra;
+    int fd = -1; // 随包传来的文件描述符
+};
+
+arrow::Status ErrnoStatus(const std::string &what)
+{
+    return arrow::Status::IOError(what, ": ", std::strerror(errno));
+}
+
+/**
+ * @brief 发一个控制包
+ *
+ * @param pass_fd 不小于0时通过SCM_RIGHTS一起发出
+ */
+arrow::Status SendShmPacket(int socket_fd, uint32_t type, int64_t offset, int64_t length,
+                            const std::string &extra = "", int pass_fd = -1)
+{
+    ShmMessage header;
+    std::memset(&header, 0, sizeof(header));
+    header.type = type;
+    header.offset = offset;
+    header.length = length;
+    std::string packet(reinterpret_cast<const char *>(&header), sizeof(header));
+    packet += extra;
+
+    struct iovec iov;
+    iov.iov_base = &packet[0];
+    iov.iov_len = packet.size();
+    struct msghdr msg;
+    std::memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    char control[CMSG_SPACE(sizeof(int))];
+    if (pass_fd >= 0)
+    {
+        std::memset(control, 0, sizeof(control));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        std::memcpy(CMSG_DATA(cmsg), &pass_fd, sizeof(int));
+    }
+    if (sendmsg(socket_fd, &msg, MSG_NOSIGNAL) < 0)
+    {
+        return ErrnoStatus("sendmsg");
+    }
+    return arrow::Status::OK();
+}
+
+/**
+ * @brief 收一个控制包
+ *
+ * @param wait 为false时没有包可读立即返回false
+ * @return arrow::Result<bool> 对端关闭连接时返回IOError
+ */
+arrow::Result<bool> RecvShmPacket(int socket_fd, bool wait, ShmPacket *packet)
+{
+    char buffer[64 * 1024];
+    struct iovec iov;
+    iov.iov_base = buffer;
+    iov.iov_len = sizeof(buffer);
+    struct msghdr msg;
+    std::memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    char control[CMSG_SPACE(sizeof(int))];
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t received;
+    do
+    {
+        received = recvmsg(socket_fd, &msg, (wait ? 0 : MSG_DONTWAIT) | MSG_CMSG_CLOEXEC);
+    } while (received < 0 && errno == EINTR);
+    if (received < 0)
+    {
+        if (!wait && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return false;
+        return ErrnoStatus("recvmsg");
+    }
+    if (received == 0)
+    {
+        return arrow::Status::IOError("Shared memory peer closed the connection");
+    }
+    if (static_cast<size_t>(received) < sizeof(ShmMessage) || (msg.msg_flags & MSG_TRUNC))
+    {
+        return arrow::Status::IOError("Malformed shared memory control packet");
+    }
+
+    std::memcpy(&packet->header, buffer, sizeof(ShmMessage));
+    packet->extra.assign(buffer + sizeof(ShmMessage), received - sizeof(ShmMessage));
+    packet->fd = -1;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+        {
+            std::memcpy(&packet->fd, CMSG_DATA(cmsg), sizeof(int));
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief 等socket可读
+ *
+ * @return arrow::Result<bool> 超时返回false
+ */
+arrow::Result<bool> PollShmSocket(int socket_fd, int timeout_ms)
+{
+    struct pollfd pfd;
+    pfd.fd = socket_fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    int ready;
+    do
+    {
+        ready = poll(&pfd, 1, timeout_ms);
+    } while (ready < 0 && errno == EINTR);
+    if (ready < 0)
+    {
+        return ErrnoStatus("poll");
+    }
+    return ready > 0;
+}
+
+/**
+ * @brief 服务端的环形缓冲区：memfd加上按偏移排列的占用段
+ *
+ * 客户端可以乱序释放，释放的段立即从占用表中删除；分配时从头找第一个放得下的空隙。
+ * 不按分配顺序回收，某条消息被长期持有也不会挡住它后面已经释放的空间。
+ */
+class ShmRing
+{
+public:
+    static arrow::Result<std::unique_ptr<ShmRing>> Create(int64_t capacity)
+    {
+        int fd = memfd_create("arrow_grpc_shm", MFD_CLOEXEC);
+        if (fd < 0)
+        {
+            return ErrnoStatus("memfd_create");
+        }
+        if (ftruncate(fd, capacity) != 0)
+        {
+            auto status = ErrnoStatus("ftruncate");
+            close(fd);
+            return status;
+        }
+        void *data = mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (data == MAP_FAILED)
+        {
+            auto status = ErrnoStatus("mmap");
+            close(fd);
+            return status;
+        }
+        return std::unique_ptr<ShmRing>(new ShmRing(fd, static_cast<uint8_t *>(data), capacity));
+    }
+
+    ~ShmRing()
+    {
+        // 客户端的映射还在时内存不会释放
+        munmap(data_, capacity_);
+        close(fd_);
+    }
+
+    int fd() const { return fd_; }
+    int64_t capacity() const { return capacity_; }
+    uint8_t *data() { return data_; }
+
+    /**
+     * @brief 分配一段连续空间
+     *
+     * @return int64_t 偏移，当前没有足够的空间时返回-1
+     */
+    int64_t Allocate(int64_t size)
+    {
+        size = (size + SHM_SLOT_ALIGNMENT - 1) / SHM_SLOT_ALIGNMENT * SHM_SLOT_ALIGNMENT;
+        // 第一个放得下的空隙，最后一段之后到环尾也算一个空隙
+        int64_t offset = 0;
+        for (const auto &slot : slots_)
+        {
+            if (slot.first - offset >= size)
+                break;
+            offset = slot.first + slot.second;
+        }
+        if (capacity_ - offset < size)
+            return -1;
+        slots_[offset] = size;
+        return offset;
+    }
+
+    void Release(int64_t offset)
+    {
+        slots_.erase(offset);
+    }
+
+    size_t pending() const { return slots_.size(); }
+
+private:
+    ShmRing(int fd, uint8_t *data, int64_t capacity)
+        : fd_(fd), data_(data), capacity_(capacity)
+    {
+    }
+
+    int fd_;
+    uint8_t *data_;
+    int64_t capacity_;
+    std::map<int64_t, int64_t> slots_; // 偏移 -> 长度
+};
+
+/**
+ * @brief 服务端：把reader的内容写进环里，逐条通知客户端
+ *
+ * @param socket_fd 已收到请求的连接
+ * @param stats_bytes 输出写入环的字节数
+ */
+arrow::Status WriteShmStream(int socket_fd, ShmRing *ring, arrow::RecordBatchReader *reader, int64_t *stats_bytes)
+{
+    ARROW_RETURN_NOT_OK(SendShmPacket(socket_fd, kShmRing, 0, ring->capacity(), "", ring->fd()));
+    auto options = arrow::ipc::IpcWriteOptions::Defaults();
+    options.allow_64bit = true;
+    *stats_bytes = 0;
+
+    auto put = [&](const arrow::ipc::IpcPayload &payload) -> arrow::Status
+    {
+        // 前缀8字节，元数据补齐到8字节对齐，再加上body
+        int64_t size = 16 + payload.metadata->size() + payload.body_length;
+        if (size > ring->capacity())
+        {
+            return arrow::Status::CapacityError("IPC message of ", size, " bytes does not fit the shared memory ring");
+        }
+        ShmPacket packet;
+        // 先收掉已经到达的释放通知，再在空间不够时等待，有限时间内没有释放就放弃
+        while (true)
+        {
+            ARROW_ASSIGN_OR_RAISE(bool has_packet, RecvShmPacket(socket_fd, false, &packet));
+            if (!has_packet)
+                break;
+            if (packet.header.type == kShmRelease)
+                ring->Release(packet.header.offset);
+        }
+        int64_t offset;
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(SHM_RING_WAIT_MS);
+        while ((offset = ring->Allocate(size)) < 0)
+        {
+            auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+                deadline - std::chrono::steady_clock::now());
+            if (remaining.count() <= 0)
+            {
+                return arrow::Status::CapacityError("Shared memory ring stayed full for ", SHM_RING_WAIT_MS, " ms (",
+                                                    ring->pending(), " messages held by the client)");
+            }
+            ARROW_ASSIGN_OR_RAISE(bool readable, PollShmSocket(socket_fd, static_cast<int>(remaining.count())));
+            if (!readable)
+                continue;
+            ARROW_RETURN_NOT_OK(RecvShmPacket(socket_fd, true, &packet).status());
+            if (packet.header.type == kShmRelease)
+            {
+                ring->Release(packet.header.offset);
+                deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(SHM_RING_WAIT_MS);
+            }
+        }
+
+        arrow::io::FixedSizeBufferWriter writer(std::make_shared<arrow::MutableBuffer>(ring->data() + offset, size));
+        int32_t metadata_length;
+        ARROW_RETURN_NOT_OK(arrow::ipc::WriteIpcPayload(payload, options, &writer, &metadata_length));
+        ARROW_ASSIGN_OR_RAISE(int64_t length, writer.Tell());
+        *stats_bytes += length;
+        return SendShmPacket(socket_fd, kShmMessage, offset, length);
+    };
+
+    arrow::ipc::IpcPayload payload;
+    arrow::ipc::DictionaryFieldMapper mapper(*reader->schema());
+    ARROW_RETURN_NOT_OK(arrow::ipc::GetSchemaPayload(*reader->schema(), options, mapper, &payload));
+    ARROW_RETURN_NOT_OK(put(payload));
+    while (true)
+    {
+        std::shared_ptr<arrow::RecordBatch> batch;
+        ARROW_RETURN_NOT_OK(reader->ReadNext(&batch));
+        if (batch == nullptr)
+            break;
+        ARROW_RETURN_NOT_OK(arrow::ipc::GetRecordBatchPayload(*batch, options, &payload));
+        ARROW_RETURN_NOT_OK(put(payload));
+    }
+    // 之后客户端的释放通知不再需要，连接关闭后客户端的映射仍然有效
+    return SendShmPacket(socket_fd, kShmEnd, 0, 0);
+}
+
+/**
+ * @brief 客户端的连接，发释放通知时加锁，batch可能在任意线程释放
+ *
+ * 同时记录零拷贝持有的环空间，决定新消息是否要拷贝出来。
+ */
+class ShmConnection
+{
+public:
+    explicit ShmConnection(int fd) : fd_(fd) {}
+
+    ~ShmConnection()
+    {
+        close(fd_);
+    }
+
+    int fd() const { return fd_; }
+
+    void Hold(int64_t length)
+    {
+        held_bytes_ += length;
+    }
+
+    /**
+     * @brief 通知服务端回收offset处的消息
+     *
+     * @param held_length 这条消息计入持有量的长度，拷贝出来的消息为0
+     */
+    void Release(int64_t offset, int64_t held_length)
+    {
+        held_bytes_ -= held_length;
+        std::lock_guard<std::mutex> lock(mutex_);
+        // 服务端发完数据就关闭连接，之后的通知失败可以忽略
+        auto status = SendShmPacket(fd_, kShmRelease, offset, 0);
+        ARROW_UNUSED(status);
+    }
+
+    int64_t held_bytes() const { return held_bytes_; }
+
+private:
+    int fd_;
+    std::mutex mutex_;
+    std::atomic<int64_t> held_bytes_{0};
+};
+
+/**
+ * @brief 客户端对整个环的只读映射，所有消息都释放后才解除映射
+ *
+ */
+struct ShmMapping
+{
+    const uint8_t *data;
+    int64_t size;
+
+    ShmMapping(const uint8_t *data, int64_t size) : data(data), size(size) {}
+
+    ~ShmMapping()
+    {
+        munmap(const_cast<uint8_t *>(data), size);
+    }
+};
+
+/**
+ * @brief 环里的一条消息，最后一个引用释放时通知服务端回收
+ *
+ */
+class ShmSlotBuffer : public arrow::Buffer
+{
+public:
+    ShmSlotBuffer(std::shared_ptr<ShmMapping> mapping, std::shared_ptr<ShmConnection> connection,
+                  int64_t offset, int64_t length)
+        : arrow::Buffer(mapping->data + offset, length), mapping_(std::move(mapping)),
+          connection_(std::move(connection)), offset_(offset)
+    {
+        connection_->Hold(length);
+    }
+
+    ~ShmSlotBuffer() override
+    {
+        connection_->Release(offset_, size_);
+    }
+
+private:
+    std::shared_ptr<ShmMapping> mapping_;
+    std::shared_ptr<ShmConnection> connection_;
+    int64_t offset_;
+};
+
+/**
+ * @brief 客户端：从共享内存读batch的RecordBatchReader
+ *
+ */
+class ShmStreamReader : public arrow::RecordBatchReader
+{
+public:
+    /**
+     * @brief 连接服务端并发送ticket，读到schema后返回
+     *
+     */
+    static arrow::Result<std::shared_ptr<ShmStreamReader>> Open(const std::string &socket_path, const std::string &ticket)
+    {
+        int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+        if (fd < 0)
+        {
+            return ErrnoStatus("socket");
+        }
+        auto connection = std::make_shared<ShmConnection>(fd);
+
+        struct sockaddr_un addr;
+        std::memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (socket_path.size() >= sizeof(addr.sun_path))
+        {
+            return arrow::Status::Invalid("Socket path too long: ", socket_path);
+        }
+        std::strncpy(addr.sun_path, socket_path.c_str(), sizeof(addr.sun_path) - 1);
+        if (connect(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) != 0)
+        {
+            return ErrnoStatus("connect " + socket_path);
+        }
+        return Start(std::move(connection), ticket);
+    }
+
+    /**
+     * @brief 在已经连上服务端的连接上发送ticket，读到schema后返回
+     *
+     */
+    static arrow::Result<std::shared_ptr<ShmStreamReader>> Start(std::shared_ptr<ShmConnection> connection,
+                                                                 const std::string &ticket)
+    {
+        std::shared_ptr<ShmStreamReader> reader(new ShmStreamReader());
+        reader->connection_ = std::move(connection);
+        ARROW_RETURN_NOT_OK(SendShmPacket(reader->connection_->fd(), kShmRequest, 0, 0, ticket));
+
+        ShmPacket packet;
+        ARROW_RETURN_NOT_OK(reader->RecvControl(&packet));
+        if (packet.header.type != kShmRing || packet.fd < 0)
+        {
+            return arrow::Status::IOError("Expected the shared memory ring first");
+        }
+        void *data = mmap(nullptr, packet.header.length, PROT_READ, MAP_SHARED, packet.fd, 0);
+        close(packet.fd);
+        if (data == MAP_FAILED)
+        {
+            return ErrnoStatus("mmap");
+        }
+        reader->mapping_ = std::make_shared<ShmMapping>(static_cast<const uint8_t *>(data), packet.header.length);
+
+        ARROW_ASSIGN_OR_RAISE(auto message, reader->ReadMessage());
+        if (message == nullptr || message->type() != arrow::ipc::MessageType::SCHEMA)
+        {
+            return arrow::Status::IOError("Expected a schema message");
+        }
+        ARROW_ASSIGN_OR_RAISE(reader->schema_, arrow::ipc::ReadSchema(*message, &reader->dictionary_memo_));
+        return reader;
+    }
+
+    std::shared_ptr<arrow::Schema> schema() const override { return schema_; }
+
+    arrow::Status ReadNext(std::shared_ptr<arrow::RecordBatch> *batch) override
+    {
+        *batch = nullptr;
+        ARROW_ASSIGN_OR_RAISE(auto message, ReadMessage());
+        if (message == nullptr)
+            return arrow::Status::OK();
+        if (message->type() != arrow::ipc::MessageType::RECORD_BATCH)
+        {
+            return arrow::Status::NotImplemented("Unexpected IPC message type in shared memory stream");
+        }
+        // batch的buffer是ShmSlotBuffer（或拷贝出来的buffer）的切片，batch释放后才通知服务端回收
+        ARROW_ASSIGN_OR_RAISE(*batch, arrow::ipc::ReadRecordBatch(*message, schema_, &dictionary_memo_,
+                                                                  arrow::ipc::IpcReadOptions::Defaults()));
+        rows_ += (*batch)->num_rows();
+        return arrow::Status::OK();
+    }
+
+    int64_t messages() const { return messages_; }
+    int64_t rows() const { return rows_; }
+    int64_t bytes() const { return bytes_; }
+    int64_t copied_messages() const { return copied_messages_; }
+
+private:
+    ShmStreamReader() = default;
+
+    arrow::Status RecvControl(ShmPacket *packet)
+    {
+        ARROW_RETURN_NOT_OK(RecvShmPacket(connection_->fd(), true, packet).status());
+        if (packet->header.type == kShmError)
+        {
+            return arrow::Status::IOError("Shared memory server error: ", packet->extra);
+        }
+        return arrow::Status::OK();
+    }
+
+    /**
+     * @brief 读下一条IPC消息，流结束时返回nullptr
+     *
+     */
+    arrow::Result<std::unique_ptr<arrow::ipc::Message>> ReadMessage()
+    {
+        if (finished_)
+            return std::unique_ptr<arrow::ipc::Message>();
+        ShmPacket packet;
+        ARROW_RETURN_NOT_OK(RecvControl(&packet));
+        if (packet.header.type == kShmEnd)
+        {
+            finished_ = true;
+            return std::unique_ptr<arrow::ipc::Message>();
+        }
+        if (packet.header.type != kShmMessage || packet.header.offset < 0 || packet.header.length <= 0 ||
+            packet.header.offset + packet.header.length > mapping_->size)
+        {
+            return arrow::Status::IOError("Invalid shared memory message descriptor");
+        }
+        ++messages_;
+        bytes_ += packet.header.length;
+        std::shared_ptr<arrow::Buffer> slot;
+        if (connection_->held_bytes() + packet.header.length > mapping_->size / 2)
+        {
+            // 持有的消息已经占了半个环：拷贝出来并立即释放，服务端总有空间写下一条
+            ARROW_ASSIGN_OR_RAISE(auto copy, arrow::AllocateBuffer(packet.header.length));
+            std::memcpy(copy->mutable_data(), mapping_->data + packet.header.offset, packet.header.length);
+            connection_->Release(packet.header.offset, 0);
+            ++copied_messages_;
+            slot = std::move(copy);
+        }
+        else
+        {
+            slot = std::make_shared<ShmSlotBuffer>(mapping_, connection_, packet.header.offset, packet.header.length);
+        }
+        // BufferReader支持零拷贝，读出的元数据和body都是slot的切片
+        arrow::io::BufferReader stream(slot);
+        ARROW_ASSIGN_OR_RAISE(auto message, arrow::ipc::ReadMessage(&stream));
+        if (message == nullptr)
+        {
+            return arrow::Status::IOError("Empty IPC message in shared memory");
+        }
+        return std::move(message);
+    }
+
+    std::shared_ptr<ShmConnection> connection_;
+    std::shared_ptr<ShmMapping> mapping_;
+    std::shared_ptr<arrow::Schema> schema_;
+    arrow::ipc::DictionaryMemo dictionary_memo_;
+    bool finished_ = false;
+    int64_t messages_ = 0;
+    int64_t rows_ = 0;
+    int64_t bytes_ = 0;
+    int64_t copied_messages_ = 0;
+};
+
+#endif
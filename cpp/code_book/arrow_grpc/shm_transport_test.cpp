@@ -0,0 +1,101 @@
+#include <arrow/api.h>
+
+#include <sys/socket.h>
+
+#include <iostream>
+#include <thread>
+
+#include "shm_transport.h"
+
+using namespace std;
+
+#define TEST_RING_BYTES (4LL << 20)
+#define TEST_BATCHES 64
+#define TEST_BATCH_ROWS (1 << 16) // 每个batch 512KB，全部留住是环的8倍
+
+arrow::Result<std::shared_ptr<arrow::RecordBatchReader>> MakeTestReader()
+{
+    auto schema = arrow::schema({arrow::field("value", arrow::int64())});
+    std::vector<std::shared_ptr<arrow::RecordBatch>> batches;
+    int64_t value = 0;
+    for (int i = 0; i < TEST_BATCHES; ++i)
+    {
+        arrow::Int64Builder builder;
+        ARROW_RETURN_NOT_OK(builder.Reserve(TEST_BATCH_ROWS));
+        for (int j = 0; j < TEST_BATCH_ROWS; ++j)
+            builder.UnsafeAppend(value++);
+        ARROW_ASSIGN_OR_RAISE(auto array, builder.Finish());
+        batches.push_back(arrow::RecordBatch::Make(schema, TEST_BATCH_ROWS, {array}));
+    }
+    return arrow::RecordBatchReader::Make(batches, schema);
+}
+
+/**
+ * @brief 客户端留住所有batch（ToTable），数据量远大于环，服务端不能和客户端互相等待
+ *
+ */
+arrow::Status TestKeepAllBatches()
+{
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) != 0)
+    {
+        return ErrnoStatus("socketpair");
+    }
+    auto client_connection = std::make_shared<ShmConnection>(fds[1]);
+    ARROW_ASSIGN_OR_RAISE(auto ring, ShmRing::Create(TEST_RING_BYTES));
+    ARROW_ASSIGN_OR_RAISE(auto source, MakeTestReader());
+
+    arrow::Status server_status;
+    int64_t server_bytes = 0;
+    std::thread server([&]()
+                       {
+                           ShmPacket request;
+                           server_status = RecvShmPacket(fds[0], true, &request).status();
+                           if (server_status.ok())
+                               server_status = WriteShmStream(fds[0], ring.get(), source.get(), &server_bytes);
+                           close(fds[0]);
+                       });
+
+    auto client = [&]() -> arrow::Status
+    {
+        ARROW_ASSIGN_OR_RAISE(auto reader, ShmStreamReader::Start(client_connection, ""));
+        ARROW_ASSIGN_OR_RAISE(auto table, arrow::Table::FromRecordBatchReader(reader.get()));
+        if (table->num_rows() != static_cast<int64_t>(TEST_BATCHES) * TEST_BATCH_ROWS)
+        {
+            return arrow::Status::Invalid("Expected ", TEST_BATCHES * TEST_BATCH_ROWS, " rows, got ", table->num_rows());
+        }
+        int64_t expected = 0;
+        for (const auto &chunk : table->column(0)->chunks())
+        {
+            auto values = std::static_pointer_cast<arrow::Int64Array>(chunk);
+            for (int64_t i = 0; i < values->length(); ++i)
+            {
+                if (values->Value(i) != expected++)
+                    return arrow::Status::Invalid("Wrong value at row ", expected - 1);
+            }
+        }
+        if (reader->copied_messages() == 0)
+        {
+            return arrow::Status::Invalid("Expected messages to be copied out of a full ring");
+        }
+        cout << "keep all batches: " << reader->messages() << " messages, " << reader->copied_messages()
+             << " copied" << endl;
+        return arrow::Status::OK();
+    };
+    auto client_status = client();
+    server.join();
+    ARROW_RETURN_NOT_OK(server_status);
+    return client_status;
+}
+
+int main(int argc, char const *argv[])
+{
+    auto status = TestKeepAllBatches();
+    if (!status.ok())
+    {
+        cout << "FAILED: " << status.ToString() << endl;
+        return 1;
+    }
+    cout << "OK" << endl;
+    return 0;
+}
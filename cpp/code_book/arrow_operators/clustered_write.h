@@ -0,0 +1,607 @@
+#ifndef CLUSTERED_WRITE_H
+#define CLUSTERED_WRITE_H
+
+#include <arrow/api.h>
+#include <arrow/io/api.h>
+#include <arrow/result.h>
+#include <arrow/status.h>
+#include <arrow/compute/api.h>
+#include <arrow/dataset/dataset.h>
+#include <arrow/dataset/file_base.h>
+#include <arrow/dataset/file_parquet.h>
+#include <arrow/dataset/scanner.h>
+#include <arrow/filesystem/api.h>
+#include <arrow/ipc/api.h>
+#include <arrow/util/byte_size.h>
+#include <arrow/util/checked_cast.h>
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "scan_stream.h"
+
+/**
+ * 聚簇写入：写分区数据集之前先按指定列排序（或按Z-order曲线排序），
+ * 让每个row group内这些列的取值范围尽量窄，min/max统计信息才能裁剪掉row group。
+ *
+ * 排序是外部排序：输入攒到run_bytes后排好序写成一个IPC临时文件，最后k路归并，
+ * 归并结果以RecordBatchReader的形式交给FileSystemDataset::Write，内存占用与数据集大小无关。
+ * 全局有序的数据按分区拆开后，每个分区内仍然有序。
+ */
+
+#define CLUSTER_KEY_COLUMN "__cluster_key"
+
+enum class ClusterMode
+{
+    kSort,   // 按columns依次排序，第一列聚得最好，后面的列只在前一列相等时有序
+    kZOrder, // 按columns的Z-order值排序，各列都能得到一定程度的聚集
+};
+
+/**
+ * @brief 聚簇写入参数
+ *
+ */
+struct ClusterOptions
+{
+    ClusterMode mode = ClusterMode::kZOrder;
+    std::vector<std::string> columns;
+    int64_t run_bytes = 64 << 20;         // 每个有序段在内存中攒的字节数
+    int64_t row_group_rows = 64 * 1024;   // 写入的row group行数，也是归并输出的batch行数
+    std::string spill_dir = "./cluster_spill/"; // 每次写入在下面建一个独立的"cluster-..."子目录，结束后只删除它
+};
+
+/**
+ * @brief 本次写入专用的临时目录名，与合并小文件的"compact-<时间>-<序号>"类似，另加进程号区分并发的任务
+ *
+ */
+std::string ClusterSpillDirName()
+{
+    static std::atomic<int64_t> next_id(0);
+    return "cluster-" + std::to_string(std::chrono::system_clock::now().time_since_epoch().count()) + "-" +
+           std::to_string(getpid()) + "-" + std::to_string(next_id++);
+}
+
+/**
+ * @brief 把一个值映射成保序的uint64：整数翻转符号位，浮点数按IEEE754的保序变换，字符串取前8个字节
+ *
+ */
+uint64_t SortableBits(const arrow::Array &array, int64_t i)
+{
+    switch (array.type_id())
+    {
+    case arrow::Type::INT32:
+    case arrow::Type::DATE32:
+        return static_cast<uint64_t>(static_cast<int64_t>(array.data()->GetValues<int32_t>(1)[i])) ^ (1ULL << 63);
+    case arrow::Type::INT64:
+    case arrow::Type::TIMESTAMP:
+        return static_cast<uint64_t>(array.data()->GetValues<int64_t>(1)[i]) ^ (1ULL << 63);
+    case arrow::Type::DOUBLE:
+    {
+        uint64_t bits;
+        double value = array.data()->GetValues<double>(1)[i];
+        std::memcpy(&bits, &value, sizeof(bits));
+        return (bits & (1ULL << 63)) ? ~bits : bits | (1ULL << 63);
+    }
+    default:
+    {
+        auto view = arrow::internal::checked_cast<const arrow::StringArray &>(array).GetView(i);
+        uint64_t bits = 0;
+        for (size_t k = 0; k < 8; ++k)
+        {
+            bits = (bits << 8) | (k < view.size() ? static_cast<uint8_t>(view[k]) : 0);
+        }
+        return bits;
+    }
+    }
+}
+
+/**
+ * @brief 比较两个数组中的非空值，返回-1、0、1
+ *
+ */
+int CompareClusterCell(const arrow::Array &a, int64_t i, const arrow::Array &b, int64_t j)
+{
+    if (a.type_id() == arrow::Type::STRING)
+    {
+        int result = arrow::internal::checked_cast<const arrow::StringArray &>(a).GetView(i).compare(
+            arrow::internal::checked_cast<const arrow::StringArray &>(b).GetView(j));
+        return result < 0 ? -1 : (result > 0 ? 1 : 0);
+    }
+    if (a.type_id() == arrow::Type::UINT64)
+    {
+        uint64_t x = a.data()->GetValues<uint64_t>(1)[i];
+        uint64_t y = b.data()->GetValues<uint64_t>(1)[j];
+        return x < y ? -1 : (x > y ? 1 : 0);
+    }
+    uint64_t x = SortableBits(a, i);
+    uint64_t y = SortableBits(b, j);
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+/**
+ * @brief 按排序键升序比较两行，空值排在最后（与SortIndices默认一致）
+ *
+ */
+int CompareClusterRows(const std::vector<std::shared_ptr<arrow::Array>> &a_keys, int64_t i,
+                       const std::vector<std::shared_ptr<arrow::Array>> &b_keys, int64_t j)
+{
+    for (size_t k = 0; k < a_keys.size(); ++k)
+    {
+        bool a_null = a_keys[k]->IsNull(i);
+        bool b_null = b_keys[k]->IsNull(j);
+        if (a_null || b_null)
+        {
+            if (a_null && b_null)
+                continue;
+            return a_null ? 1 : -1;
+        }
+        int result = CompareClusterCell(*a_keys[k], i, *b_keys[k], j);
+        if (result != 0)
+            return result;
+    }
+    return 0;
+}
+
+/**
+ * @brief 计算Z-order值：每列先按全局[min, max]归一化到64/列数位，再逐位交织
+ *
+ */
+class ZOrderEncoder
+{
+public:
+    explicit ZOrderEncoder(size_t num_columns)
+        : min_(num_columns, ~0ULL), max_(num_columns, 0), shift_(num_columns, 0),
+          bits_(static_cast<int>(64 / std::max<size_t>(num_columns, 1))) {}
+
+    /**
+     * @brief 第一遍扫描：更新每列的取值范围
+     *
+     */
+    void Observe(const std::vector<std::shared_ptr<arrow::Array>> &columns)
+    {
+        for (size_t c = 0; c < columns.size(); ++c)
+        {
+            for (int64_t i = 0; i < columns[c]->length(); ++i)
+            {
+                if (columns[c]->IsNull(i))
+                    continue;
+                uint64_t bits = SortableBits(*columns[c], i);
+                min_[c] = std::min(min_[c], bits);
+                max_[c] = std::max(max_[c], bits);
+            }
+        }
+    }
+
+    /**
+     * @brief 取值范围确定后，计算每列需要右移的位数，只保留范围内的高bits_位
+     *
+     */
+    void Seal()
+    {
+        for (size_t c = 0; c < min_.size(); ++c)
+        {
+            uint64_t range = max_[c] > min_[c] ? max_[c] - min_[c] : 0;
+            int width = 0;
+            while (width < 64 && (range >> width) != 0)
+                ++width;
+            shift_[c] = std::max(0, width - bits_);
+        }
+    }
+
+    arrow::Result<std::shared_ptr<arrow::Array>> Encode(const std::vector<std::shared_ptr<arrow::Array>> &columns) const
+    {
+        arrow::UInt64Builder builder;
+        int64_t length = columns.empty() ? 0 : columns[0]->length();
+        ARROW_RETURN_NOT_OK(builder.Reserve(length));
+        std::vector<uint64_t> normalized(columns.size());
+        for (int64_t i = 0; i < length; ++i)
+        {
+            for (size_t c = 0; c < columns.size(); ++c)
+            {
+                // 空值当作最小值
+                uint64_t bits = columns[c]->IsNull(i) ? min_[c] : std::max(SortableBits(*columns[c], i), min_[c]);
+                normalized[c] = (bits - min_[c]) >> shift_[c];
+            }
+            uint64_t z = 0;
+            for (int b = bits_ - 1; b >= 0; --b)
+            {
+                for (size_t c = 0; c < columns.size(); ++c)
+                {
+                    z = (z << 1) | ((normalized[c] >> b) & 1);
+                }
+            }
+            builder.UnsafeAppend(z);
+        }
+        return builder.Finish();
+    }
+
+private:
+    std::vector<uint64_t> min_;
+    std::vector<uint64_t> max_;
+    std::vector<int> shift_;
+    int bits_;
+};
+
+/**
+ * @brief 对已排好序的IPC段文件做k路归并，每次ReadNext输出最多batch_rows行
+ *
+ */
+class SortedRunMergeReader : public arrow::RecordBatchReader
+{
+public:
+    static arrow::Result<std::shared_ptr<SortedRunMergeReader>> Open(const std::shared_ptr<arrow::fs::FileSystem> &filesystem,
+                                                                     const std::vector<std::string> &run_paths,
+                                                                     std::shared_ptr<arrow::Schema> schema,
+                                                                     std::vector<int> key_indices, int64_t batch_rows)
+    {
+        std::shared_ptr<SortedRunMergeReader> reader(new SortedRunMergeReader());
+        reader->schema_ = std::move(schema);
+        reader->key_indices_ = std::move(key_indices);
+        reader->batch_rows_ = batch_rows;
+        reader->cursors_.resize(run_paths.size());
+        for (size_t r = 0; r < run_paths.size(); ++r)
+        {
+            ARROW_ASSIGN_OR_RAISE(auto input, filesystem->OpenInputFile(run_paths[r]));
+            ARROW_ASSIGN_OR_RAISE(reader->cursors_[r].reader, arrow::ipc::RecordBatchFileReader::Open(input));
+            ARROW_RETURN_NOT_OK(reader->LoadNextBatch(&reader->cursors_[r]));
+            if (reader->cursors_[r].batch)
+                reader->PushHeap(static_cast<int>(r));
+        }
+        return reader;
+    }
+
+    std::shared_ptr<arrow::Schema> schema() const override { return schema_; }
+
+    arrow::Status ReadNext(std::shared_ptr<arrow::RecordBatch> *batch) override
+    {
+        // 选出的行记为各段当前batch上的连续区间，切片本身零拷贝；多路交错时区间很短，
+        // 拼成一个batch_rows_行的batch时拷贝一次，写入时row group不会被切碎
+        std::vector<std::shared_ptr<arrow::RecordBatch>> slices;
+        std::shared_ptr<arrow::RecordBatch> segment_batch;
+        int64_t segment_start = 0;
+        int64_t segment_length = 0;
+        int64_t selected_rows = 0;
+        while (!heap_.empty() && selected_rows < batch_rows_)
+        {
+            int r = PopHeap();
+            RunCursor &cursor = cursors_[r];
+            if (segment_batch == cursor.batch && segment_start + segment_length == cursor.row)
+            {
+                ++segment_length;
+            }
+            else
+            {
+                if (segment_batch)
+                    slices.push_back(segment_batch->Slice(segment_start, segment_length));
+                segment_batch = cursor.batch;
+                segment_start = cursor.row;
+                segment_length = 1;
+            }
+            ++selected_rows;
+            if (++cursor.row >= cursor.batch->num_rows())
+            {
+                ARROW_RETURN_NOT_OK(LoadNextBatch(&cursor));
+            }
+            if (cursor.batch)
+                PushHeap(r);
+        }
+        if (segment_batch)
+            slices.push_back(segment_batch->Slice(segment_start, segment_length));
+        if (slices.empty())
+        {
+            *batch = nullptr;
+            return arrow::Status::OK();
+        }
+        ARROW_ASSIGN_OR_RAISE(auto table, arrow::Table::FromRecordBatches(schema_, slices));
+        ARROW_ASSIGN_OR_RAISE(*batch, table->CombineChunksToBatch(arrow::default_memory_pool()));
+        return arrow::Status::OK();
+    }
+
+private:
+    struct RunCursor
+    {
+        std::shared_ptr<arrow::ipc::RecordBatchFileReader> reader;
+        int next_batch = 0;
+        std::shared_ptr<arrow::RecordBatch> batch;
+        std::vector<std::shared_ptr<arrow::Array>> keys;
+        int64_t row = 0;
+    };
+
+    SortedRunMergeReader() = default;
+
+    arrow::Status LoadNextBatch(RunCursor *cursor)
+    {
+        cursor->batch = nullptr;
+        while (cursor->next_batch < cursor->reader->num_record_batches())
+        {
+            ARROW_ASSIGN_OR_RAISE(auto batch, cursor->reader->ReadRecordBatch(cursor->next_batch++));
+            if (batch->num_rows() == 0)
+                continue;
+            cursor->batch = batch;
+            cursor->row = 0;
+            cursor->keys.clear();
+            for (int index : key_indices_)
+            {
+                cursor->keys.push_back(batch->column(index));
+            }
+            break;
+        }
+        return arrow::Status::OK();
+    }
+
+    // 小顶堆，相等时按段号保持稳定
+    bool ComesAfter(int a, int b) const
+    {
+        int result = CompareClusterRows(cursors_[a].keys, cursors_[a].row, cursors_[b].keys, cursors_[b].row);
+        return result > 0 || (result == 0 && a > b);
+    }
+
+    void PushHeap(int r)
+    {
+        heap_.push_back(r);
+        std::push_heap(heap_.begin(), heap_.end(), [this](int a, int b) { return ComesAfter(a, b); });
+    }
+
+    int PopHeap()
+    {
+        std::pop_heap(heap_.begin(), heap_.end(), [this](int a, int b) { return ComesAfter(a, b); });
+        int r = heap_.back();
+        heap_.pop_back();
+        return r;
+    }
+
+    std::shared_ptr<arrow::Schema> schema_;
+    std::vector<int> key_indices_;
+    int64_t batch_rows_ = 0;
+    std::vector<RunCursor> cursors_;
+    std::vector<int> heap_;
+};
+
+/**
+ * @brief 检查聚簇列的类型并返回它们在schema中的下标
+ *
+ */
+arrow::Result<std::vector<int>> ResolveClusterColumns(const arrow::Schema &schema, const std::vector<std::string> &columns)
+{
+    if (columns.empty())
+    {
+        return arrow::Status::Invalid("Clustered write requires at least one column");
+    }
+    std::vector<int> indices;
+    for (const auto &name : columns)
+    {
+        int index = schema.GetFieldIndex(name);
+        if (index < 0)
+        {
+            return arrow::Status::Invalid("No column named ", name);
+        }
+        switch (schema.field(index)->type()->id())
+        {
+        case arrow::Type::INT32:
+        case arrow::Type::DATE32:
+        case arrow::Type::INT64:
+        case arrow::Type::TIMESTAMP:
+        case arrow::Type::DOUBLE:
+        case arrow::Type::STRING:
+            break;
+        default:
+            return arrow::Status::NotImplemented("Clustering on ", schema.field(index)->type()->ToString());
+        }
+        indices.push_back(index);
+    }
+    return indices;
+}
+
+/**
+ * @brief 排序一个段并写入IPC临时文件
+ *
+ */
+arrow::Status SpillSortedRun(const std::shared_ptr<arrow::fs::FileSystem> &filesystem, const std::string &path,
+                             const std::shared_ptr<arrow::Schema> &schema,
+                             const std::vector<std::shared_ptr<arrow::RecordBatch>> &batches,
+                             const std::vector<std::string> &key_names, int64_t batch_rows)
+{
+    std::vector<arrow::compute::SortKey> sort_keys;
+    for (const auto &name : key_names)
+    {
+        sort_keys.emplace_back(name);
+    }
+    ARROW_ASSIGN_OR_RAISE(auto table, arrow::Table::FromRecordBatches(schema, batches));
+    ARROW_ASSIGN_OR_RAISE(auto indices, arrow::compute::SortIndices(table, arrow::compute::SortOptions(sort_keys)));
+    ARROW_ASSIGN_OR_RAISE(arrow::Datum sorted, arrow::compute::Take(table, indices));
+    ARROW_ASSIGN_OR_RAISE(auto output, filesystem->OpenOutputStream(path));
+    ARROW_ASSIGN_OR_RAISE(auto writer, arrow::ipc::MakeFileWriter(output, schema));
+    ARROW_RETURN_NOT_OK(writer->WriteTable(*sorted.table(), batch_rows));
+    ARROW_RETURN_NOT_OK(writer->Close());
+    return output->Close();
+}
+
+/**
+ * @brief 在spill_dir下生成有序段，归并后写出，由WriteClusteredDataset负责删除spill_dir
+ *
+ */
+arrow::Status SortAndWriteClustered(const std::shared_ptr<arrow::dataset::Dataset> &input,
+                                    arrow::dataset::FileSystemDatasetWriteOptions write_options,
+                                    const ClusterOptions &options,
+                                    const std::shared_ptr<arrow::fs::FileSystem> &filesystem,
+                                    const std::string &spill_dir, const std::vector<int> &column_indices,
+                                    const ZOrderEncoder &encoder, const std::shared_ptr<arrow::Schema> &run_schema,
+                                    const std::vector<std::string> &key_names, const std::vector<int> &key_indices)
+{
+    auto schema = input->schema();
+    ScanStreamOptions stream_options;
+    stream_options.batch_size = options.row_group_rows;
+    std::vector<std::string> run_paths;
+    std::vector<std::shared_ptr<arrow::RecordBatch>> buffered;
+    int64_t buffered_bytes = 0;
+    auto spill = [&]() -> arrow::Status
+    {
+        if (buffered.empty())
+            return arrow::Status::OK();
+        run_paths.push_back(spill_dir + "/run_" + std::to_string(run_paths.size()) + ".arrow");
+        ARROW_RETURN_NOT_OK(SpillSortedRun(filesystem, run_paths.back(), run_schema, buffered, key_names,
+                                           options.row_group_rows));
+        buffered.clear();
+        buffered_bytes = 0;
+        return arrow::Status::OK();
+    };
+
+    ARROW_ASSIGN_OR_RAISE(auto scan_builder, input->NewScan());
+    ARROW_RETURN_NOT_OK(ApplyScanStreamOptions(*scan_builder, stream_options));
+    ARROW_ASSIGN_OR_RAISE(auto scanner, scan_builder->Finish());
+    auto collect = [&](const std::shared_ptr<arrow::RecordBatch> &batch) -> arrow::Status
+    {
+        std::shared_ptr<arrow::RecordBatch> run_batch = batch;
+        if (options.mode == ClusterMode::kZOrder)
+        {
+            std::vector<std::shared_ptr<arrow::Array>> columns;
+            for (int index : column_indices)
+            {
+                columns.push_back(batch->column(index));
+            }
+            ARROW_ASSIGN_OR_RAISE(auto z, encoder.Encode(columns));
+            ARROW_ASSIGN_OR_RAISE(run_batch, batch->AddColumn(batch->num_columns(), run_schema->fields().back(), z));
+        }
+        buffered.push_back(run_batch);
+        buffered_bytes += arrow::util::TotalBufferSize(*run_batch);
+        if (buffered_bytes >= options.run_bytes)
+        {
+            return spill();
+        }
+        return arrow::Status::OK();
+    };
+    ARROW_RETURN_NOT_OK(VisitScan(scanner, stream_options, collect));
+    ARROW_RETURN_NOT_OK(spill());
+
+    // 归并结果不经过线程池，保证写入顺序就是排序顺序
+    ARROW_ASSIGN_OR_RAISE(auto merged, SortedRunMergeReader::Open(filesystem, run_paths, run_schema, key_indices,
+                                                                  options.row_group_rows));
+    auto write_builder = arrow::dataset::ScannerBuilder::FromRecordBatchReader(merged);
+    ARROW_RETURN_NOT_OK(write_builder->Project(schema->field_names()));
+    ARROW_RETURN_NOT_OK(write_builder->UseThreads(false));
+    ARROW_ASSIGN_OR_RAISE(auto write_scanner, write_builder->Finish());
+    write_options.min_rows_per_group = options.row_group_rows;
+    write_options.max_rows_per_group = options.row_group_rows;
+    return arrow::dataset::FileSystemDataset::Write(write_options, write_scanner);
+}
+
+/**
+ * @brief 按聚簇列排序后写分区数据集
+ *
+ * @param input 输入数据集
+ * @param write_options 与FileSystemDataset::Write相同，分区方式、文件名、post_finish回调等都照常生效
+ * @param options 聚簇参数
+ * @return arrow::Status
+ */
+arrow::Status WriteClusteredDataset(const std::shared_ptr<arrow::dataset::Dataset> &input,
+                                    arrow::dataset::FileSystemDatasetWriteOptions write_options,
+                                    const ClusterOptions &options)
+{
+    auto schema = input->schema();
+    ARROW_ASSIGN_OR_RAISE(auto column_indices, ResolveClusterColumns(*schema, options.columns));
+    ScanStreamOptions stream_options;
+    stream_options.batch_size = options.row_group_rows;
+
+    // Z-order需要先扫一遍聚簇列，得到每列的取值范围
+    ZOrderEncoder encoder(options.columns.size());
+    if (options.mode == ClusterMode::kZOrder)
+    {
+        ARROW_ASSIGN_OR_RAISE(auto scan_builder, input->NewScan());
+        ARROW_RETURN_NOT_OK(scan_builder->Project(options.columns));
+        ARROW_RETURN_NOT_OK(ApplyScanStreamOptions(*scan_builder, stream_options));
+        ARROW_ASSIGN_OR_RAISE(auto scanner, scan_builder->Finish());
+        auto observe = [&encoder](const std::shared_ptr<arrow::RecordBatch> &batch)
+        {
+            encoder.Observe(batch->columns());
+            return arrow::Status::OK();
+        };
+        ARROW_RETURN_NOT_OK(VisitScan(scanner, stream_options, observe));
+        encoder.Seal();
+    }
+
+    // 排序键：Z-order时是追加的uint64列，否则就是聚簇列本身
+    auto run_schema = schema;
+    std::vector<std::string> key_names = options.columns;
+    std::vector<int> key_indices = column_indices;
+    if (options.mode == ClusterMode::kZOrder)
+    {
+        ARROW_ASSIGN_OR_RAISE(run_schema, schema->AddField(schema->num_fields(),
+                                                           arrow::field(CLUSTER_KEY_COLUMN, arrow::uint64(), false)));
+        key_names = {CLUSTER_KEY_COLUMN};
+        key_indices = {schema->num_fields()};
+    }
+
+    // 每次写入用自己的临时目录，并发的任务不会删掉彼此的有序段
+    auto filesystem = std::make_shared<arrow::fs::LocalFileSystem>();
+    std::string spill_dir = options.spill_dir;
+    if (!spill_dir.empty() && spill_dir.back() != '/')
+        spill_dir += "/";
+    spill_dir += ClusterSpillDirName();
+    ARROW_RETURN_NOT_OK(filesystem->CreateDir(spill_dir));
+    auto status = SortAndWriteClustered(input, write_options, options, filesystem, spill_dir, column_indices, encoder,
+                                        run_schema, key_names, key_indices);
+    auto cleanup = filesystem->DeleteDir(spill_dir);
+    return status.ok() ? cleanup : status;
+}
+
+/**
+ * @brief 一个过滤条件的裁剪效果
+ *
+ */
+struct PruningResult
+{
+    std::string predicate;
+    int64_t files = 0;
+    int64_t files_kept = 0;
+    int64_t row_groups = 0;
+    int64_t row_groups_kept = 0;
+
+    std::string ToString() const
+    {
+        double pruned = row_groups == 0 ? 0 : 100.0 * (row_groups - row_groups_kept) / row_groups;
+        return predicate + ": files " + std::to_string(files_kept) + "/" + std::to_string(files) +
+               ", row groups " + std::to_string(row_groups_kept) + "/" + std::to_string(row_groups) +
+               ", pruned " + std::to_string(pruned) + "%";
+    }
+};
+
+/**
+ * @brief 统计每个条件在分区表达式和row group统计信息上能裁剪掉多少row group，不读数据页
+ *
+ * @param dataset parquet数据集
+ * @param predicates 样例过滤条件
+ * @return arrow::Result<std::vector<PruningResult>>
+ */
+arrow::Result<std::vector<PruningResult>> MeasurePruning(const std::shared_ptr<arrow::dataset::Dataset> &dataset,
+                                                         const std::vector<arrow::compute::Expression> &predicates)
+{
+    std::vector<PruningResult> results;
+    for (const auto &predicate : predicates)
+    {
+        PruningResult result;
+        result.predicate = predicate.ToString();
+        ARROW_ASSIGN_OR_RAISE(auto bound_predicate, predicate.Bind(*dataset->schema()));
+        ARROW_ASSIGN_OR_RAISE(auto fragments, dataset->GetFragments());
+        for (const auto &maybe_fragment : fragments)
+        {
+            ARROW_ASSIGN_OR_RAISE(auto fragment, maybe_fragment);
+            auto parquet_fragment = arrow::internal::checked_pointer_cast<arrow::dataset::ParquetFileFragment>(fragment);
+            ARROW_RETURN_NOT_OK(parquet_fragment->EnsureCompleteMetadata());
+            ARROW_ASSIGN_OR_RAISE(auto kept, parquet_fragment->SplitByRowGroup(bound_predicate));
+            ++result.files;
+            result.files_kept += kept.empty() ? 0 : 1;
+            result.row_groups += parquet_fragment->metadata()->num_row_groups();
+            result.row_groups_kept += kept.size();
+        }
+        results.push_back(result);
+    }
+    return results;
+}
+
+#endif
@@ -0,0 +1,108 @@
+#include <arrow/api.h>
+#include <arrow/io/api.h>
+#include <arrow/result.h>
+#include <arrow/status.h>
+#include <arrow/type.h>
+#include <arrow/filesystem/api.h>
+#include <arrow/dataset/dataset.h>
+#include <arrow/dataset/discovery.h>
+#include <arrow/dataset/file_base.h>
+#include <arrow/dataset/file_parquet.h>
+#include <arrow/dataset/scanner.h>
+
+#include <iostream>
+using namespace std;
+
+#include "common.h"
+#include "dataset_catalog.h"
+#include "dataset_compaction.h"
+
+#define DATASET_NAME "partition"
+#define APPEND_ROUNDS 3
+
+/**
+ * @brief 模拟多次追加写入：每轮在每个分区下各新增一个小文件，和多次DoPut的效果一样
+ *
+ * @param filesystem
+ * @param base_path make_partition_parquet生成的分区数据集
+ * @return arrow::Status
+ */
+arrow::Status AppendSmallFiles(const std::shared_ptr<arrow::fs::FileSystem> &filesystem, const std::string &base_path)
+{
+    ARROW_ASSIGN_OR_RAISE(auto table, CreateTableWithPart());
+    auto partition_schema = arrow::schema({arrow::field("part", arrow::utf8())});
+    auto format = std::make_shared<arrow::dataset::ParquetFileFormat>();
+    for (int round = 0; round < APPEND_ROUNDS; ++round)
+    {
+        auto dataset = std::make_shared<arrow::dataset::InMemoryDataset>(table);
+        ARROW_ASSIGN_OR_RAISE(auto scanner_builder, dataset->NewScan());
+        ARROW_ASSIGN_OR_RAISE(auto scanner, scanner_builder->Finish());
+
+        arrow::dataset::FileSystemDatasetWriteOptions write_options;
+        write_options.file_write_options = format->DefaultWriteOptions();
+        write_options.filesystem = filesystem;
+        write_options.base_dir = base_path;
+        write_options.partitioning = std::make_shared<arrow::dataset::HivePartitioning>(partition_schema);
+        write_options.basename_template = "append" + std::to_string(round) + "-{i}.parquet";
+        // 保留已有文件
+        write_options.existing_data_behavior = arrow::dataset::ExistingDataBehavior::kOverwriteOrIgnore;
+        ARROW_RETURN_NOT_OK(arrow::dataset::FileSystemDataset::Write(write_options, scanner));
+    }
+    return arrow::Status::OK();
+}
+
+/**
+ * @brief 数据集的行数和文件数
+ *
+ */
+arrow::Status PrintDataset(const std::shared_ptr<arrow::fs::FileSystem> &filesystem, const std::string &base_path)
+{
+    arrow::dataset::FileSystemFactoryOptions factory_options;
+    factory_options.partitioning = arrow::dataset::HivePartitioning::MakeFactory();
+    auto format = std::make_shared<arrow::dataset::ParquetFileFormat>();
+    CatalogRefreshStats refresh_stats;
+    ARROW_ASSIGN_OR_RAISE(auto dataset, DiscoverDataset(filesystem, format, base_path, factory_options, &refresh_stats));
+    cout << "dataset catalog: " << refresh_stats.ToString() << endl;
+    ARROW_ASSIGN_OR_RAISE(auto fragments, dataset->GetFragments());
+    int64_t num_files = 0;
+    for (const auto &fragment : fragments)
+    {
+        ARROW_RETURN_NOT_OK(fragment.status());
+        ++num_files;
+    }
+    ARROW_ASSIGN_OR_RAISE(auto scan_builder, dataset->NewScan());
+    ARROW_ASSIGN_OR_RAISE(auto scanner, scan_builder->Finish());
+    ARROW_ASSIGN_OR_RAISE(auto num_rows, scanner->CountRows());
+    cout << "files: " << num_files << ", rows: " << num_rows << endl;
+    return arrow::Status::OK();
+}
+
+/**
+ * @brief 合并分区数据集中的小文件
+ *
+ * @param base_path 数据集目录，为空时使用make_partition_parquet的输出并先追加几轮小文件
+ * @return arrow::Status
+ */
+arrow::Status func(std::string base_path)
+{
+    ARROW_ASSIGN_OR_RAISE(auto fs, arrow::fs::FileSystemFromUri(uri, &root_path));
+    CompactionOptions options;
+    if (base_path.empty())
+    {
+        base_path = root_path + "/" + DATASET_NAME + "_output/parquet_dataset";
+        ARROW_RETURN_NOT_OK(AppendSmallFiles(fs, base_path));
+        options.key_columns = {"a"}; // 与make_partition_parquet一致，维护a列的布隆过滤器和二级索引
+    }
+
+    ARROW_RETURN_NOT_OK(PrintDataset(fs, base_path));
+    ARROW_ASSIGN_OR_RAISE(auto stats, CompactDataset(fs, base_path, options));
+    cout << stats.ToString() << endl;
+    ARROW_RETURN_NOT_OK(PrintDataset(fs, base_path));
+    return arrow::Status::OK();
+}
+
+int main(int argc, char const *argv[])
+{
+    cout << func(argc > 1 ? argv[1] : "") << endl;
+    return 0;
+}
@@ -0,0 +1,655 @@
+#ifndef DATASET_CATALOG_H
+#define DATASET_CATALOG_H
+
+#include <arrow/api.h>
+#include <arrow/io/api.h>
+#include <arrow/result.h>
+#include <arrow/status.h>
+#include <arrow/compute/exec/expression.h>
+#include <arrow/dataset/dataset.h>
+#include <arrow/dataset/discovery.h>
+#include <arrow/dataset/file_base.h>
+#include <arrow/dataset/file_parquet.h>
+#include <arrow/filesystem/api.h>
+#include <arrow/ipc/api.h>
+#include <arrow/util/base64.h>
+#include <arrow/util/checked_cast.h>
+#include <parquet/metadata.h>
+#include <parquet/statistics.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+/**
+ * 数据集目录缓存：把发现阶段的结果（文件列表、分区表达式、每个文件的统计信息、合并后的schema）
+ * 保存在数据集目录下的"_catalog/dataset.arrow"里。放在子目录里是为了写缓存时不改变数据集目录自身的mtime。
+ *
+ * 刷新时只stat已知的目录，mtime没变的目录直接复用缓存，变了的目录才重新列出，
+ * 新增或修改过的文件才交给FileSystemDatasetFactory检查。数据文件按只追加的方式写入时，
+ * 重复扫描基本不需要再列目录和读footer。
+ */
+
+#define DATASET_CATALOG_DIR "_catalog"
+#define DATASET_CATALOG_FILE "dataset.arrow"
+#define DATASET_COMPACTION_JOURNAL "_compaction.arrow"
+
+/**
+ * @brief 目录缓存中的一个数据文件
+ *
+ */
+struct CatalogFile
+{
+    std::string path;
+    int64_t size = 0;
+    int64_t mtime_ns = 0;
+    int64_t num_rows = -1;                 // 从footer读到的行数，未知为-1
+    arrow::compute::Expression guarantee = arrow::compute::literal(true); // 分区表达式 + 各列的min/max范围
+};
+
+/**
+ * @brief 目录缓存中的一个目录
+ *
+ */
+struct CatalogDirectory
+{
+    int64_t mtime_ns = 0;
+    std::vector<std::string> subdirs;
+    std::map<std::string, CatalogFile> files;
+};
+
+/**
+ * @brief 一次刷新的统计
+ *
+ */
+struct CatalogRefreshStats
+{
+    int64_t directories = 0;        // stat过的目录
+    int64_t listed_directories = 0; // mtime变化、重新列出的目录
+    int64_t reused_files = 0;       // 直接复用缓存的文件
+    int64_t inspected_files = 0;    // 新增或修改、重新读取footer的文件
+
+    std::string ToString() const
+    {
+        return "directories=" + std::to_string(directories) +
+               " listed_directories=" + std::to_string(listed_directories) +
+               " reused_files=" + std::to_string(reused_files) +
+               " inspected_files=" + std::to_string(inspected_files);
+    }
+};
+
+int64_t MtimeNs(const arrow::fs::FileInfo &info)
+{
+    return info.mtime().time_since_epoch().count();
+}
+
+/**
+ * @brief 与FileSystemFactoryOptions的默认值一致，忽略"."和"_"开头的文件
+ *
+ */
+bool IgnoredByDiscovery(const std::string &base_name)
+{
+    return base_name.empty() || base_name[0] == '.' || base_name[0] == '_';
+}
+
+/**
+ * @brief 合并小文件的日志，写在分区目录下，记录的都是目录内的文件名
+ *
+ * 新文件先以"_"开头的名字写入，日志写入后再逐个改成added中的名字。读者从不打开改名前的文件：
+ * added中的文件全部改完名之前，removed中的文件可见、已改名的新文件不可见；全部改完之后反过来。
+ * 旧文件在切换后还要保留一个宽限期，给切换前建好dataset的读者读完，之后才删除并删除日志。
+ */
+struct CompactionJournal
+{
+    std::vector<std::string> removed;
+    std::vector<std::string> added;
+    int64_t swapped_at_ms = 0; // 新文件全部改名、索引更新完的时间，0表示还没切换
+};
+
+std::string CompactionStagedName(const std::string &name)
+{
+    return "_" + name;
+}
+
+std::shared_ptr<arrow::Schema> CompactionJournalSchema()
+{
+    return arrow::schema({arrow::field("added", arrow::boolean()), arrow::field("name", arrow::utf8())});
+}
+
+/**
+ * @brief 读取目录下的合并日志，没有日志时返回nullptr
+ *
+ */
+arrow::Result<std::shared_ptr<CompactionJournal>> ReadCompactionJournal(
+    const std::shared_ptr<arrow::fs::FileSystem> &filesystem, const std::string &dir)
+{
+    ARROW_ASSIGN_OR_RAISE(auto info, filesystem->GetFileInfo(dir + "/" + DATASET_COMPACTION_JOURNAL));
+    if (!info.IsFile())
+    {
+        return std::shared_ptr<CompactionJournal>();
+    }
+    ARROW_ASSIGN_OR_RAISE(auto input, filesystem->OpenInputFile(info));
+    ARROW_ASSIGN_OR_RAISE(auto reader, arrow::ipc::RecordBatchFileReader::Open(input));
+    if (!reader->schema()->Equals(*CompactionJournalSchema()))
+    {
+        return arrow::Status::Invalid("Unexpected compaction journal schema in ", dir);
+    }
+    auto journal = std::make_shared<CompactionJournal>();
+    auto metadata = reader->schema()->metadata();
+    int pos = metadata == nullptr ? -1 : metadata->FindKey("swapped_at_ms");
+    if (pos >= 0)
+    {
+        std::string text = metadata->value(pos);
+        char *end = nullptr;
+        long long swapped_at_ms = std::strtoll(text.c_str(), &end, 10);
+        if (text.empty() || *end != '\0' || swapped_at_ms < 0)
+        {
+            return arrow::Status::Invalid("Invalid swapped_at_ms in compaction journal of ", dir, ": ", text);
+        }
+        journal->swapped_at_ms = swapped_at_ms;
+    }
+    for (int b = 0; b < reader->num_record_batches(); ++b)
+    {
+        ARROW_ASSIGN_OR_RAISE(auto batch, reader->ReadRecordBatch(b));
+        auto added = std::static_pointer_cast<arrow::BooleanArray>(batch->column(0));
+        auto name = std::static_pointer_cast<arrow::StringArray>(batch->column(1));
+        for (int64_t i = 0; i < batch->num_rows(); ++i)
+        {
+            (added->Value(i) ? journal->added : journal->removed).push_back(name->GetString(i));
+        }
+    }
+    return journal;
+}
+
+/**
+ * @brief 取一列在[begin, end)这些row group上的[min, max]，有row group缺统计信息或有null时返回false
+ *
+ */
+template <typename StatisticsType, typename CType>
+bool ColumnRange(const parquet::FileMetaData &metadata, int column, int begin, int end, CType *min, CType *max)
+{
+    for (int row_group = begin; row_group < end; ++row_group)
+    {
+        auto statistics = metadata.RowGroup(row_group)->ColumnChunk(column)->statistics();
+        if (statistics == nullptr || !statistics->HasMinMax() || !statistics->HasNullCount() ||
+            statistics->null_count() > 0)
+        {
+            return false;
+        }
+        auto typed = std::static_pointer_cast<StatisticsType>(statistics);
+        if (row_group == begin || typed->min() < *min)
+            *min = typed->min();
+        if (row_group == begin || typed->max() > *max)
+            *max = typed->max();
+    }
+    return end > begin;
+}
+
+/**
+ * @brief 把[begin, end)这些row group的列统计转成表达式：每一行都满足该表达式
+ *
+ * 目前支持int32/int64/date32列。parquet的浮点统计信息不计入NaN，[min, max]不能保证每一行，
+ * 据此化简过滤条件会把NaN行错判，所以浮点列不生成保证条件
+ */
+arrow::Result<arrow::compute::Expression> RowGroupsStatisticsGuarantee(const parquet::FileMetaData &metadata,
+                                                                       const arrow::Schema &physical_schema,
+                                                                       int begin, int end)
+{
+    std::vector<arrow::compute::Expression> conjuncts;
+    if (physical_schema.num_fields() != metadata.num_columns())
+    {
+        return arrow::compute::literal(true); // 嵌套类型，列号与字段号对不上
+    }
+    for (int i = 0; i < physical_schema.num_fields(); ++i)
+    {
+        const auto &field = physical_schema.field(i);
+        std::shared_ptr<arrow::Scalar> min_scalar;
+        std::shared_ptr<arrow::Scalar> max_scalar;
+        switch (field->type()->id())
+        {
+        case arrow::Type::INT64:
+        {
+            int64_t min, max;
+            if (!ColumnRange<parquet::Int64Statistics>(metadata, i, begin, end, &min, &max))
+                continue;
+            ARROW_ASSIGN_OR_RAISE(min_scalar, arrow::MakeScalar(field->type(), min));
+            ARROW_ASSIGN_OR_RAISE(max_scalar, arrow::MakeScalar(field->type(), max));
+            break;
+        }
+        case arrow::Type::INT32:
+        case arrow::Type::DATE32:
+        {
+            int32_t min, max;
+            if (!ColumnRange<parquet::Int32Statistics>(metadata, i, begin, end, &min, &max))
+                continue;
+            ARROW_ASSIGN_OR_RAISE(min_scalar, arrow::MakeScalar(field->type(), min));
+            ARROW_ASSIGN_OR_RAISE(max_scalar, arrow::MakeScalar(field->type(), max));
+            break;
+        }
+        default:
+            continue;
+        }
+        auto ref = arrow::compute::field_ref(field->name());
+        conjuncts.push_back(arrow::compute::greater_equal(ref, arrow::compute::literal(min_scalar)));
+        conjuncts.push_back(arrow::compute::less_equal(ref, arrow::compute::literal(max_scalar)));
+    }
+    return arrow::compute::and_(conjuncts);
+}
+
+/**
+ * @brief 把parquet footer中的列统计转成表达式，作为fragment的保证条件，扫描时不用读footer就能裁剪文件
+ *
+ */
+arrow::Result<arrow::compute::Expression> FileStatisticsGuarantee(const parquet::FileMetaData &metadata,
+                                                                  const arrow::Schema &physical_schema)
+{
+    return RowGroupsStatisticsGuarantee(metadata, physical_schema, 0, metadata.num_row_groups());
+}
+
+class DatasetCatalog
+{
+public:
+    /**
+     * @brief 打开数据集目录的缓存，没有缓存文件时从空缓存开始
+     *
+     * @param filesystem
+     * @param format
+     * @param base_dir 数据集目录
+     * @param options 与FileSystemDatasetFactory相同的参数（分区方式等）
+     * @return arrow::Result<std::shared_ptr<DatasetCatalog>>
+     */
+    static arrow::Result<std::shared_ptr<DatasetCatalog>> Open(
+        const std::shared_ptr<arrow::fs::FileSystem> &filesystem,
+        const std::shared_ptr<arrow::dataset::FileFormat> &format, const std::string &base_dir,
+        arrow::dataset::FileSystemFactoryOptions options = arrow::dataset::FileSystemFactoryOptions())
+    {
+        auto catalog = std::make_shared<DatasetCatalog>();
+        catalog->filesystem_ = filesystem;
+        catalog->format_ = format;
+        catalog->base_dir_ = base_dir;
+        while (catalog->base_dir_.size() > 1 && catalog->base_dir_.back() == '/')
+        {
+            catalog->base_dir_.pop_back();
+        }
+        catalog->options_ = std::move(options);
+        catalog->options_.partition_base_dir = catalog->base_dir_;
+        ARROW_RETURN_NOT_OK(catalog->Load());
+        return catalog;
+    }
+
+    /**
+     * @brief 增量刷新，有变化时写回缓存文件
+     *
+     */
+    arrow::Status Refresh()
+    {
+        CatalogRefreshStats stats;
+        std::map<std::string, CatalogDirectory> directories;
+        std::vector<std::string> pending{base_dir_};
+        std::map<std::string, std::string> changed_paths; // 文件 -> 所在目录
+        bool changed = false;
+
+        while (!pending.empty())
+        {
+            std::string dir = pending.back();
+            pending.pop_back();
+            ARROW_ASSIGN_OR_RAISE(auto info, filesystem_->GetFileInfo(dir));
+            if (!info.IsDirectory())
+            {
+                if (dir == base_dir_)
+                    return arrow::Status::IOError("Dataset directory ", dir, " does not exist");
+                changed = true; // 目录被删掉了
+                continue;
+            }
+            ++stats.directories;
+
+            auto cached = directories_.find(dir);
+            if (cached != directories_.end() && cached->second.mtime_ns == MtimeNs(info))
+            {
+                // 目录的直接成员没有增删，复用缓存，子目录仍需检查
+                directories[dir] = cached->second;
+                stats.reused_files += cached->second.files.size();
+                pending.insert(pending.end(), cached->second.subdirs.begin(), cached->second.subdirs.end());
+                continue;
+            }
+
+            changed = true;
+            ++stats.listed_directories;
+            CatalogDirectory &directory = directories[dir];
+            directory.mtime_ns = MtimeNs(info);
+            arrow::fs::FileSelector selector;
+            selector.base_dir = dir;
+            ARROW_ASSIGN_OR_RAISE(auto children, filesystem_->GetFileInfo(selector));
+
+            // 正在合并小文件的目录以合并日志为准，被替换的文件和新文件不会同时可见
+            std::set<std::string> hidden;
+            for (const auto &child : children)
+            {
+                if (child.base_name() != DATASET_COMPACTION_JOURNAL)
+                    continue;
+                ARROW_ASSIGN_OR_RAISE(auto journal, ReadCompactionJournal(filesystem_, dir));
+                if (journal == nullptr)
+                    break; // 日志刚被删除，合并已经完成
+                std::set<std::string> existing;
+                for (const auto &file : children)
+                {
+                    if (file.IsFile())
+                        existing.insert(file.path());
+                }
+                bool swapped = true;
+                for (const auto &name : journal->added)
+                    swapped = swapped && existing.count(dir + "/" + name) > 0;
+                // 新文件全部改完名才切换，之前只显示旧文件
+                for (const auto &name : swapped ? journal->removed : journal->added)
+                    hidden.insert(dir + "/" + name);
+            }
+
+            for (const auto &child : children)
+            {
+                if (hidden.count(child.path()) > 0 || IgnoredByDiscovery(child.base_name()))
+                    continue;
+                if (child.IsDirectory())
+                {
+                    directory.subdirs.push_back(child.path());
+                    pending.push_back(child.path());
+                    continue;
+                }
+                if (!child.IsFile())
+                    continue;
+
+                const CatalogFile *old_file = nullptr;
+                if (cached != directories_.end())
+                {
+                    auto it = cached->second.files.find(child.path());
+                    if (it != cached->second.files.end())
+                        old_file = &it->second;
+                }
+                if (old_file != nullptr && old_file->size == child.size() && old_file->mtime_ns == MtimeNs(child))
+                {
+                    directory.files[child.path()] = *old_file;
+                    ++stats.reused_files;
+                    continue;
+                }
+                CatalogFile file;
+                file.path = child.path();
+                file.size = child.size();
+                file.mtime_ns = MtimeNs(child);
+                directory.files[child.path()] = file;
+                changed_paths[child.path()] = dir;
+            }
+        }
+        changed = changed || directories.size() != directories_.size();
+
+        if (!changed_paths.empty())
+        {
+            stats.inspected_files = changed_paths.size();
+            ARROW_RETURN_NOT_OK(Inspect(changed_paths, &directories));
+        }
+        directories_ = std::move(directories);
+        last_refresh_ = stats;
+        if (changed)
+        {
+            ARROW_RETURN_NOT_OK(Save());
+        }
+        return arrow::Status::OK();
+    }
+
+    /**
+     * @brief 用缓存直接构造Dataset，不列目录、不读footer
+     *
+     */
+    arrow::Result<std::shared_ptr<arrow::dataset::Dataset>> ToDataset() const
+    {
+        if (schema_ == nullptr)
+        {
+            return arrow::Status::Invalid("Dataset catalog of ", base_dir_, " is empty, call Refresh() first");
+        }
+        std::vector<std::shared_ptr<arrow::dataset::FileFragment>> fragments;
+        for (const auto &directory : directories_)
+        {
+            for (const auto &file : directory.second.files)
+            {
+                ARROW_ASSIGN_OR_RAISE(auto fragment,
+                                      format_->MakeFragment(arrow::dataset::FileSource(file.first, filesystem_),
+                                                            file.second.guarantee));
+                fragments.push_back(fragment);
+            }
+        }
+        // 目录遍历顺序不固定，按路径排序保证扫描顺序稳定
+        std::sort(fragments.begin(), fragments.end(),
+                  [](const std::shared_ptr<arrow::dataset::FileFragment> &a,
+                     const std::shared_ptr<arrow::dataset::FileFragment> &b)
+                  { return a->source().path() < b->source().path(); });
+        ARROW_ASSIGN_OR_RAISE(auto dataset, arrow::dataset::FileSystemDataset::Make(
+                                                schema_, arrow::compute::literal(true), format_, filesystem_,
+                                                std::move(fragments)));
+        return std::static_pointer_cast<arrow::dataset::Dataset>(dataset);
+    }
+
+    std::vector<CatalogFile> files() const
+    {
+        std::vector<CatalogFile> result;
+        for (const auto &directory : directories_)
+        {
+            for (const auto &file : directory.second.files)
+            {
+                result.push_back(file.second);
+            }
+        }
+        return result;
+    }
+
+    const std::shared_ptr<arrow::Schema> &schema() const { return schema_; }
+    const CatalogRefreshStats &last_refresh() const { return last_refresh_; }
+
+private:
+    std::string CatalogDir() const { return base_dir_ + "/" + DATASET_CATALOG_DIR; }
+    std::string CatalogPath() const { return CatalogDir() + "/" + DATASET_CATALOG_FILE; }
+
+    static std::shared_ptr<arrow::Schema> CatalogSchema()
+    {
+        return arrow::schema({arrow::field("is_dir", arrow::boolean()),
+                              arrow::field("path", arrow::utf8()),
+                              arrow::field("parent", arrow::utf8()),
+                              arrow::field("size", arrow::int64()),
+                              arrow::field("mtime_ns", arrow::int64()),
+                              arrow::field("num_rows", arrow::int64()),
+                              arrow::field("guarantee", arrow::binary())});
+    }
+
+    /**
+     * @brief 只对新增或修改的文件运行FileSystemDatasetFactory，得到分区表达式、schema和footer统计
+     *
+     */
+    arrow::Status Inspect(const std::map<std::string, std::string> &changed_paths,
+                          std::map<std::string, CatalogDirectory> *directories)
+    {
+        std::vector<std::string> paths;
+        for (const auto &changed_path : changed_paths)
+        {
+            paths.push_back(changed_path.first);
+        }
+        ARROW_ASSIGN_OR_RAISE(auto factory,
+                              arrow::dataset::FileSystemDatasetFactory::Make(filesystem_, paths, format_, options_));
+        ARROW_ASSIGN_OR_RAISE(auto inspected_schema, factory->Inspect());
+        std::shared_ptr<arrow::Schema> schema = inspected_schema;
+        if (schema_ != nullptr)
+        {
+            ARROW_ASSIGN_OR_RAISE(schema, arrow::UnifySchemas({schema_, inspected_schema}));
+        }
+        arrow::dataset::FinishOptions finish_options;
+        finish_options.schema = schema;
+        ARROW_ASSIGN_OR_RAISE(auto dataset, factory->Finish(finish_options));
+        ARROW_ASSIGN_OR_RAISE(auto fragments, dataset->GetFragments());
+        for (const auto &maybe_fragment : fragments)
+        {
+            ARROW_ASSIGN_OR_RAISE(auto fragment, maybe_fragment);
+            auto file_fragment = arrow::internal::checked_pointer_cast<arrow::dataset::FileFragment>(fragment);
+            const std::string &path = file_fragment->source().path();
+            auto dir = changed_paths.find(path);
+            if (dir == changed_paths.end())
+            {
+                return arrow::Status::Invalid("Unexpected fragment ", path, " while inspecting ", base_dir_);
+            }
+            auto &file = (*directories)[dir->second].files[path];
+            file.guarantee = fragment->partition_expression();
+
+            if (format_->type_name() == "parquet")
+            {
+                auto parquet_fragment = arrow::internal::checked_pointer_cast<arrow::dataset::ParquetFileFragment>(fragment);
+                ARROW_RETURN_NOT_OK(parquet_fragment->EnsureCompleteMetadata());
+                ARROW_ASSIGN_OR_RAISE(auto physical_schema, parquet_fragment->ReadPhysicalSchema());
+                auto metadata = parquet_fragment->metadata();
+                file.num_rows = metadata->num_rows();
+                ARROW_ASSIGN_OR_RAISE(auto statistics, FileStatisticsGuarantee(*metadata, *physical_schema));
+                file.guarantee = arrow::compute::and_(file.guarantee, statistics);
+            }
+        }
+        schema_ = schema;
+        return arrow::Status::OK();
+    }
+
+    arrow::Status Load()
+    {
+        ARROW_ASSIGN_OR_RAISE(auto info, filesystem_->GetFileInfo(CatalogPath()));
+        if (!info.IsFile())
+        {
+            return arrow::Status::OK();
+        }
+        ARROW_ASSIGN_OR_RAISE(auto input, filesystem_->OpenInputFile(info));
+        ARROW_ASSIGN_OR_RAISE(auto reader, arrow::ipc::RecordBatchFileReader::Open(input));
+
+        // 合并后的schema序列化后以base64保存在文件元数据里
+        auto metadata = reader->schema()->metadata();
+        if (metadata == nullptr || metadata->FindKey("dataset_schema") < 0)
+        {
+            return arrow::Status::Invalid("Catalog ", CatalogPath(), " has no dataset schema");
+        }
+        std::string serialized = arrow::util::base64_decode(metadata->value(metadata->FindKey("dataset_schema")));
+        arrow::io::BufferReader schema_reader(arrow::Buffer::FromString(serialized));
+        arrow::ipc::DictionaryMemo dictionary_memo;
+        ARROW_ASSIGN_OR_RAISE(schema_, arrow::ipc::ReadSchema(&schema_reader, &dictionary_memo));
+
+        for (int b = 0; b < reader->num_record_batches(); ++b)
+        {
+            ARROW_ASSIGN_OR_RAISE(auto batch, reader->ReadRecordBatch(b));
+            auto is_dir = std::static_pointer_cast<arrow::BooleanArray>(batch->column(0));
+            auto path = std::static_pointer_cast<arrow::StringArray>(batch->column(1));
+            auto parent = std::static_pointer_cast<arrow::StringArray>(batch->column(2));
+            auto size = std::static_pointer_cast<arrow::Int64Array>(batch->column(3));
+            auto mtime = std::static_pointer_cast<arrow::Int64Array>(batch->column(4));
+            auto num_rows = std::static_pointer_cast<arrow::Int64Array>(batch->column(5));
+            auto guarantee = std::static_pointer_cast<arrow::BinaryArray>(batch->column(6));
+            for (int64_t i = 0; i < batch->num_rows(); ++i)
+            {
+                if (is_dir->Value(i))
+                {
+                    directories_[path->GetString(i)].mtime_ns = mtime->Value(i);
+                    if (!parent->IsNull(i)) // 数据集根目录没有parent
+                        directories_[parent->GetString(i)].subdirs.push_back(path->GetString(i));
+                    continue;
+                }
+                CatalogFile file;
+                file.path = path->GetString(i);
+                file.size = size->Value(i);
+                file.mtime_ns = mtime->Value(i);
+                file.num_rows = num_rows->Value(i);
+                ARROW_ASSIGN_OR_RAISE(file.guarantee,
+                                      arrow::compute::Deserialize(arrow::Buffer::FromString(guarantee->GetString(i))));
+                directories_[parent->GetString(i)].files[file.path] = file;
+            }
+        }
+        return arrow::Status::OK();
+    }
+
+    arrow::Status Save() const
+    {
+        arrow::BooleanBuilder is_dir;
+        arrow::StringBuilder path, parent;
+        arrow::Int64Builder size, mtime, num_rows;
+        arrow::BinaryBuilder guarantee;
+        for (const auto &directory : directories_)
+        {
+            ARROW_RETURN_NOT_OK(is_dir.Append(true));
+            ARROW_RETURN_NOT_OK(path.Append(directory.first));
+            if (directory.first == base_dir_)
+                ARROW_RETURN_NOT_OK(parent.AppendNull());
+            else
+                ARROW_RETURN_NOT_OK(parent.Append(directory.first.substr(0, directory.first.rfind('/'))));
+            ARROW_RETURN_NOT_OK(size.Append(0));
+            ARROW_RETURN_NOT_OK(mtime.Append(directory.second.mtime_ns));
+            ARROW_RETURN_NOT_OK(num_rows.Append(-1));
+            ARROW_RETURN_NOT_OK(guarantee.AppendNull());
+            for (const auto &file : directory.second.files)
+            {
+                ARROW_ASSIGN_OR_RAISE(auto serialized, arrow::compute::Serialize(file.second.guarantee));
+                ARROW_RETURN_NOT_OK(is_dir.Append(false));
+                ARROW_RETURN_NOT_OK(path.Append(file.first));
+                ARROW_RETURN_NOT_OK(parent.Append(directory.first));
+                ARROW_RETURN_NOT_OK(size.Append(file.second.size));
+                ARROW_RETURN_NOT_OK(mtime.Append(file.second.mtime_ns));
+                ARROW_RETURN_NOT_OK(num_rows.Append(file.second.num_rows));
+                ARROW_RETURN_NOT_OK(guarantee.Append(serialized->data(), serialized->size()));
+            }
+        }
+        std::vector<std::shared_ptr<arrow::Array>> arrays(7);
+        ARROW_RETURN_NOT_OK(is_dir.Finish(&arrays[0]));
+        ARROW_RETURN_NOT_OK(path.Finish(&arrays[1]));
+        ARROW_RETURN_NOT_OK(parent.Finish(&arrays[2]));
+        ARROW_RETURN_NOT_OK(size.Finish(&arrays[3]));
+        ARROW_RETURN_NOT_OK(mtime.Finish(&arrays[4]));
+        ARROW_RETURN_NOT_OK(num_rows.Finish(&arrays[5]));
+        ARROW_RETURN_NOT_OK(guarantee.Finish(&arrays[6]));
+
+        ARROW_ASSIGN_OR_RAISE(auto serialized_schema, arrow::ipc::SerializeSchema(*schema_));
+        auto schema = CatalogSchema()->WithMetadata(arrow::key_value_metadata(
+            {"dataset_schema"}, {arrow::util::base64_encode(serialized_schema->ToString())}));
+        auto batch = arrow::RecordBatch::Make(schema, arrays[0]->length(), arrays);
+
+        // 先写临时文件再改名，并发的读者要么看到旧缓存，要么看到新缓存
+        ARROW_RETURN_NOT_OK(filesystem_->CreateDir(CatalogDir()));
+        std::string tmp_path = CatalogPath() + ".tmp";
+        ARROW_ASSIGN_OR_RAISE(auto output, filesystem_->OpenOutputStream(tmp_path));
+        ARROW_ASSIGN_OR_RAISE(auto writer, arrow::ipc::MakeFileWriter(output, schema));
+        ARROW_RETURN_NOT_OK(writer->WriteRecordBatch(*batch));
+        ARROW_RETURN_NOT_OK(writer->Close());
+        ARROW_RETURN_NOT_OK(output->Close());
+        return filesystem_->Move(tmp_path, CatalogPath());
+    }
+
+    std::shared_ptr<arrow::fs::FileSystem> filesystem_;
+    std::shared_ptr<arrow::dataset::FileFormat> format_;
+    std::string base_dir_;
+    arrow::dataset::FileSystemFactoryOptions options_;
+    std::shared_ptr<arrow::Schema> schema_;
+    std::map<std::string, CatalogDirectory> directories_;
+    CatalogRefreshStats last_refresh_;
+};
+
+/**
+ * @brief 代替FileSystemDatasetFactory::Make + Finish：打开目录缓存、增量刷新、构造Dataset
+ *
+ * @param filesystem
+ * @param format
+ * @param base_dir
+ * @param options
+ * @param refresh_stats 不为空时输出这次刷新的统计信息
+ * @return arrow::Result<std::shared_ptr<arrow::dataset::Dataset>>
+ */
+arrow::Result<std::shared_ptr<arrow::dataset::Dataset>> DiscoverDataset(
+    const std::shared_ptr<arrow::fs::FileSystem> &filesystem,
+    const std::shared_ptr<arrow::dataset::FileFormat> &format, const std::string &base_dir,
+    arrow::dataset::FileSystemFactoryOptions options = arrow::dataset::FileSystemFactoryOptions(),
+    CatalogRefreshStats *refresh_stats = nullptr)
+{
+    ARROW_ASSIGN_OR_RAISE(auto catalog, DatasetCatalog::Open(filesystem, format, base_dir, std::move(options)));
+    ARROW_RETURN_NOT_OK(catalog->Refresh());
+    if (refresh_stats != nullptr)
+        *refresh_stats = catalog->last_refresh();
+    return catalog->ToDataset();
+}
+
+#endif
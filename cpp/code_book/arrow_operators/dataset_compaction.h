@@ -0,0 +1,528 @@
+#ifndef DATASET_COMPACTION_H
+#define DATASET_COMPACTION_H
+
+#include <arrow/api.h>
+#include <arrow/io/api.h>
+#include <arrow/result.h>
+#include <arrow/status.h>
+#include <arrow/filesystem/api.h>
+#include <arrow/ipc/api.h>
+#include <parquet/arrow/reader.h>
+#include <parquet/arrow/writer.h>
+#include <parquet/properties.h>
+
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "dataset_catalog.h"
+#include "../flight_speed_test/parquet_lookup.h"
+#include "../flight_speed_test/secondary_index.h"
+
+#define DATASET_COMPACTION_GRACE_SECONDS 600 // 被替换的文件在切换后保留的时间，长于最慢的一次扫描
+
+/**
+ * 合并Hive分区数据集中的小文件。每个分区目录内，把小文件按目标大小分组，
+ * 每组合并成一个文件，row group按目标行数重新切分。
+ *
+ * 切换过程：
+ * 1. 新文件以"_compact-..."的名字写入分区目录，此时扫描不可见；
+ * 2. 原子写入合并日志"_compaction.arrow"，记下要替换的文件，之后只会向前完成；
+ * 3. 新文件改为正式名字，全部改完时DatasetCatalog隐藏旧文件、显示新文件，读者不会打开改名前的文件；
+ *    再更新布隆过滤器和二级索引，在日志里记下切换时间；
+ * 4. 旧文件保留deleted_file_grace_seconds，切换前建好dataset的读者仍能读完，
+ *    宽限期过后的下一次合并才删除旧文件和日志，期间这个分区不再合并。
+ * 中途崩溃时，有日志就继续完成第3、4步，没有日志就删掉写了一半的新文件。
+ */
+
+/**
+ * @brief 合并参数
+ *
+ */
+struct CompactionOptions
+{
+    int64_t small_file_bytes = 16 * 1024 * 1024;   // 小于这个大小的文件参与合并
+    int64_t target_file_bytes = 128 * 1024 * 1024; // 合并后文件的目标大小（按输入文件大小估算）
+    int64_t row_group_rows = 1024 * 1024;          // 合并后每个row group的行数
+    int min_files = 2;                             // 分区内至少有这么多小文件才合并
+    std::vector<std::string> key_columns;          // 需要维护布隆过滤器和二级索引的列
+    int64_t deleted_file_grace_seconds = DATASET_COMPACTION_GRACE_SECONDS; // 旧文件切换后保留的时间
+};
+
+/**
+ * @brief 合并统计
+ *
+ */
+struct CompactionStats
+{
+    int64_t partitions = 0;
+    int64_t compacted_partitions = 0;
+    int64_t input_files = 0;
+    int64_t output_files = 0;
+    int64_t input_bytes = 0;
+    int64_t output_bytes = 0;
+    int64_t rows = 0;
+    int64_t deleted_files = 0; // 宽限期已过、本次删除的旧文件
+    int64_t pending_files = 0; // 还在宽限期内的旧文件
+
+    std::string ToString() const
+    {
+        return "partitions=" + std::to_string(partitions) +
+               " compacted_partitions=" + std::to_string(compacted_partitions) +
+               " input_files=" + std::to_string(input_files) +
+               " output_files=" + std::to_string(output_files) +
+               " input_bytes=" + std::to_string(input_bytes) +
+               " output_bytes=" + std::to_string(output_bytes) +
+               " rows=" + std::to_string(rows) +
+               " deleted_files=" + std::to_string(deleted_files) +
+               " pending_files=" + std::to_string(pending_files);
+    }
+};
+
+/**
+ * @brief 一个待合并的小文件
+ *
+ */
+struct CompactionInput
+{
+    arrow::fs::FileInfo info;
+    std::shared_ptr<arrow::Schema> schema;
+    int64_t num_rows;
+};
+
+/**
+ * @brief 按目标行数切分row group的parquet写入器，跨输入文件攒满一个row group再写
+ *
+ */
+class RowGroupWriter
+{
+public:
+    static arrow::Result<std::unique_ptr<RowGroupWriter>> Open(std::shared_ptr<arrow::io::OutputStream> output,
+                                                               const std::shared_ptr<arrow::Schema> &schema,
+                                                               const CompactionOptions &options)
+    {
+        std::unique_ptr<RowGroupWriter> result(new RowGroupWriter());
+        result->output_ = std::move(output);
+        result->row_group_rows_ = options.row_group_rows;
+        // 与写入时保持一致，保留统计信息，主键列不用字典编码
+        auto arrow_properties = parquet::ArrowWriterProperties::Builder().store_schema()->build();
+        ARROW_RETURN_NOT_OK(parquet::arrow::FileWriter::Open(*schema, arrow::default_memory_pool(), result->output_,
+                                                             LookupWriterProperties(options.key_columns),
+                                                             arrow_properties, &result->writer_));
+        return std::move(result);
+    }
+
+    arrow::Status Write(const std::shared_ptr<arrow::RecordBatch> &batch)
+    {
+        ARROW_ASSIGN_OR_RAISE(auto table, arrow::Table::FromRecordBatches({batch}));
+        pending_.push_back(table);
+        pending_rows_ += batch->num_rows();
+        while (pending_rows_ >= row_group_rows_)
+        {
+            ARROW_ASSIGN_OR_RAISE(auto merged, arrow::ConcatenateTables(pending_));
+            ARROW_RETURN_NOT_OK(writer_->WriteTable(*merged->Slice(0, row_group_rows_), row_group_rows_));
+            pending_ = {merged->Slice(row_group_rows_)};
+            pending_rows_ -= row_group_rows_;
+        }
+        return arrow::Status::OK();
+    }
+
+    arrow::Status Close()
+    {
+        if (pending_rows_ > 0)
+        {
+            ARROW_ASSIGN_OR_RAISE(auto merged, arrow::ConcatenateTables(pending_));
+            ARROW_RETURN_NOT_OK(writer_->WriteTable(*merged, row_group_rows_));
+        }
+        pending_.clear();
+        pending_rows_ = 0;
+        ARROW_RETURN_NOT_OK(writer_->Close());
+        return output_->Close();
+    }
+
+private:
+    RowGroupWriter() = default;
+
+    std::shared_ptr<arrow::io::OutputStream> output_;
+    std::unique_ptr<parquet::arrow::FileWriter> writer_;
+    int64_t row_group_rows_ = 0;
+    std::vector<std::shared_ptr<arrow::Table>> pending_;
+    int64_t pending_rows_ = 0;
+};
+
+/**
+ * @brief 路径中是否有被dataset扫描忽略的部分（"_"或"."开头）
+ *
+ */
+bool HiddenDatasetPath(const std::string &base_dir, const std::string &path)
+{
+    std::string relative = RelativeFragmentPath(base_dir, path);
+    size_t begin = 0;
+    while (begin <= relative.size())
+    {
+        size_t end = relative.find('/', begin);
+        if (end == std::string::npos)
+            end = relative.size();
+        if (IgnoredByDiscovery(relative.substr(begin, end - begin)))
+            return true;
+        begin = end + 1;
+    }
+    return false;
+}
+
+std::string ParentDir(const std::string &path)
+{
+    size_t pos = path.rfind('/');
+    return pos == std::string::npos ? std::string() : path.substr(0, pos);
+}
+
+/**
+ * @brief 是否是合并过程中写入的新文件（注意布隆过滤器"_compact-...parquet.bloom"不算）
+ *
+ */
+bool IsStagedCompactionFile(const std::string &base_name)
+{
+    const std::string prefix = CompactionStagedName("compact-");
+    const std::string suffix = ".parquet";
+    return base_name.size() > prefix.size() + suffix.size() && base_name.compare(0, prefix.size(), prefix) == 0 &&
+           base_name.compare(base_name.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+/**
+ * @brief 原子写入合并日志（先写临时文件再改名）
+ *
+ */
+arrow::Status WriteCompactionJournal(const std::shared_ptr<arrow::fs::FileSystem> &filesystem, const std::string &dir,
+                                     const CompactionJournal &journal)
+{
+    arrow::BooleanBuilder added;
+    arrow::StringBuilder name;
+    for (const auto &removed_name : journal.removed)
+    {
+        ARROW_RETURN_NOT_OK(added.Append(false));
+        ARROW_RETURN_NOT_OK(name.Append(removed_name));
+    }
+    for (const auto &added_name : journal.added)
+    {
+        ARROW_RETURN_NOT_OK(added.Append(true));
+        ARROW_RETURN_NOT_OK(name.Append(added_name));
+    }
+    std::vector<std::shared_ptr<arrow::Array>> arrays(2);
+    ARROW_RETURN_NOT_OK(added.Finish(&arrays[0]));
+    ARROW_RETURN_NOT_OK(name.Finish(&arrays[1]));
+    auto batch = arrow::RecordBatch::Make(CompactionJournalSchema(), arrays[0]->length(), arrays);
+    if (journal.swapped_at_ms > 0)
+    {
+        batch = batch->ReplaceSchemaMetadata(
+            arrow::key_value_metadata({"swapped_at_ms"}, {std::to_string(journal.swapped_at_ms)}));
+    }
+
+    std::string journal_path = dir + "/" + DATASET_COMPACTION_JOURNAL;
+    std::string tmp_path = journal_path + ".tmp";
+    ARROW_ASSIGN_OR_RAISE(auto output, filesystem->OpenOutputStream(tmp_path));
+    ARROW_ASSIGN_OR_RAISE(auto writer, arrow::ipc::MakeFileWriter(output, batch->schema()));
+    ARROW_RETURN_NOT_OK(writer->WriteRecordBatch(*batch));
+    ARROW_RETURN_NOT_OK(writer->Close());
+    ARROW_RETURN_NOT_OK(output->Close());
+    return filesystem->Move(tmp_path, journal_path);
+}
+
+arrow::Status DeleteFileIfExists(const std::shared_ptr<arrow::fs::FileSystem> &filesystem, const std::string &path)
+{
+    ARROW_ASSIGN_OR_RAISE(auto info, filesystem->GetFileInfo(path));
+    if (!info.IsFile())
+    {
+        return arrow::Status::OK();
+    }
+    return filesystem->DeleteFile(path);
+}
+
+int64_t CompactionNowMs()
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+               std::chrono::system_clock::now().time_since_epoch())
+        .count();
+}
+
+/**
+ * @brief 完成已提交的合并：新文件改名，更新布隆过滤器和二级索引；宽限期过后删除旧文件和日志。可重复执行
+ *
+ * 二级索引先加入新文件再移除旧文件，旧文件在索引更新完之前一直保留，点查始终能读到数据。
+ * 宽限期未到时日志留在目录里，DatasetCatalog继续隐藏旧文件，下一次合并再来删除
+ */
+arrow::Status FinishCompaction(const std::shared_ptr<arrow::fs::FileSystem> &filesystem, const std::string &base_dir,
+                               const std::string &dir, CompactionJournal journal, const CompactionOptions &options,
+                               CompactionStats *stats)
+{
+    if (journal.swapped_at_ms == 0)
+    {
+        std::vector<std::string> indexed_columns;
+        for (const auto &column : options.key_columns)
+        {
+            ARROW_ASSIGN_OR_RAISE(auto indexed, HasSecondaryIndex(filesystem, base_dir, column));
+            if (indexed)
+                indexed_columns.push_back(column);
+        }
+
+        for (const auto &name : journal.added)
+        {
+            std::string path = dir + "/" + name;
+            ARROW_ASSIGN_OR_RAISE(auto staged, filesystem->GetFileInfo(dir + "/" + CompactionStagedName(name)));
+            if (staged.IsFile())
+            {
+                ARROW_RETURN_NOT_OK(filesystem->Move(staged.path(), path));
+            }
+            if (!options.key_columns.empty())
+            {
+                ARROW_RETURN_NOT_OK(BuildBloomSidecar(filesystem, path, options.key_columns));
+            }
+            for (const auto &column : indexed_columns)
+            {
+                ARROW_RETURN_NOT_OK(UpdateSecondaryIndex(filesystem, base_dir, column, path));
+            }
+        }
+        for (const auto &name : journal.removed)
+        {
+            for (const auto &column : indexed_columns)
+            {
+                ARROW_RETURN_NOT_OK(UpdateSecondaryIndex(filesystem, base_dir, column, dir + "/" + name, true));
+            }
+        }
+        journal.swapped_at_ms = CompactionNowMs();
+        ARROW_RETURN_NOT_OK(WriteCompactionJournal(filesystem, dir, journal));
+    }
+
+    if (CompactionNowMs() - journal.swapped_at_ms < options.deleted_file_grace_seconds * 1000)
+    {
+        stats->pending_files += journal.removed.size();
+        return arrow::Status::OK();
+    }
+    for (const auto &name : journal.removed)
+    {
+        std::string path = dir + "/" + name;
+        ARROW_RETURN_NOT_OK(DeleteFileIfExists(filesystem, BloomSidecarPath(path)));
+        ARROW_RETURN_NOT_OK(DeleteFileIfExists(filesystem, path));
+        ++stats->deleted_files;
+    }
+    return filesystem->DeleteFile(dir + "/" + DATASET_COMPACTION_JOURNAL);
+}
+
+/**
+ * @brief 处理上次中断或还在宽限期内的合并：有日志的目录继续完成，没有日志的"_compact-"临时文件直接删除
+ *
+ */
+arrow::Status RecoverCompaction(const std::shared_ptr<arrow::fs::FileSystem> &filesystem, const std::string &base_dir,
+                                const std::string &dir, const CompactionOptions &options, CompactionStats *stats)
+{
+    ARROW_ASSIGN_OR_RAISE(auto journal, ReadCompactionJournal(filesystem, dir));
+    if (journal != nullptr)
+    {
+        return FinishCompaction(filesystem, base_dir, dir, *journal, options, stats);
+    }
+    arrow::fs::FileSelector selector;
+    selector.base_dir = dir;
+    ARROW_ASSIGN_OR_RAISE(auto children, filesystem->GetFileInfo(selector));
+    for (const auto &child : children)
+    {
+        if (child.IsFile() && IsStagedCompactionFile(child.base_name()))
+        {
+            ARROW_RETURN_NOT_OK(filesystem->DeleteFile(child.path()));
+        }
+    }
+    return arrow::Status::OK();
+}
+
+/**
+ * @brief 把一组小文件逐个row group流式读出，写成一个新文件
+ *
+ */
+arrow::Status MergeFiles(const std::shared_ptr<arrow::fs::FileSystem> &filesystem,
+                         const std::vector<CompactionInput> &inputs, const std::string &output_path,
+                         const CompactionOptions &options)
+{
+    ARROW_ASSIGN_OR_RAISE(auto output, filesystem->OpenOutputStream(output_path));
+    ARROW_ASSIGN_OR_RAISE(auto writer, RowGroupWriter::Open(output, inputs.front().schema, options));
+    parquet::ArrowReaderProperties properties;
+    properties.set_batch_size(std::min<int64_t>(options.row_group_rows, 64 * 1024));
+    for (const auto &input : inputs)
+    {
+        ARROW_ASSIGN_OR_RAISE(auto file, filesystem->OpenInputFile(input.info));
+        parquet::arrow::FileReaderBuilder builder;
+        ARROW_RETURN_NOT_OK(builder.Open(file));
+        std::unique_ptr<parquet::arrow::FileReader> reader;
+        ARROW_RETURN_NOT_OK(builder.properties(properties)->Build(&reader));
+        std::vector<int> row_groups(reader->num_row_groups());
+        for (int i = 0; i < reader->num_row_groups(); ++i)
+        {
+            row_groups[i] = i;
+        }
+        std::unique_ptr<arrow::RecordBatchReader> batch_reader;
+        ARROW_RETURN_NOT_OK(reader->GetRecordBatchReader(row_groups, &batch_reader));
+        std::shared_ptr<arrow::RecordBatch> batch;
+        while (true)
+        {
+            ARROW_RETURN_NOT_OK(batch_reader->ReadNext(&batch));
+            if (batch == nullptr)
+            {
+                break;
+            }
+            ARROW_RETURN_NOT_OK(writer->Write(batch));
+        }
+    }
+    return writer->Close();
+}
+
+/**
+ * @brief 合并一个分区目录中的小文件
+ *
+ * @param filesystem
+ * @param base_dir 数据集目录
+ * @param dir 分区目录
+ * @param files 分区目录中的数据文件
+ * @param options
+ * @param stats
+ * @return arrow::Status
+ */
+arrow::Status CompactPartition(const std::shared_ptr<arrow::fs::FileSystem> &filesystem, const std::string &base_dir,
+                               const std::string &dir, const std::vector<arrow::fs::FileInfo> &files,
+                               const CompactionOptions &options, CompactionStats *stats)
+{
+    std::vector<CompactionInput> small_files;
+    for (const auto &info : files)
+    {
+        if (info.size() >= options.small_file_bytes)
+            continue;
+        ARROW_ASSIGN_OR_RAISE(auto file, filesystem->OpenInputFile(info));
+        std::unique_ptr<parquet::arrow::FileReader> reader;
+        ARROW_RETURN_NOT_OK(parquet::arrow::OpenFile(file, arrow::default_memory_pool(), &reader));
+        CompactionInput input;
+        input.info = info;
+        ARROW_RETURN_NOT_OK(reader->GetSchema(&input.schema));
+        input.num_rows = reader->parquet_reader()->metadata()->num_rows();
+        small_files.push_back(input);
+    }
+    if (static_cast<int>(small_files.size()) < options.min_files)
+    {
+        return arrow::Status::OK();
+    }
+
+    // 按路径排序后顺序装箱，schema不同或超过目标大小时换下一个箱子
+    std::sort(small_files.begin(), small_files.end(),
+              [](const CompactionInput &a, const CompactionInput &b)
+              { return a.info.path() < b.info.path(); });
+    std::vector<std::vector<CompactionInput>> bins;
+    int64_t bin_bytes = 0;
+    for (const auto &input : small_files)
+    {
+        if (bins.empty() || bin_bytes + input.info.size() > options.target_file_bytes ||
+            !bins.back().front().schema->Equals(*input.schema))
+        {
+            bins.emplace_back();
+            bin_bytes = 0;
+        }
+        bins.back().push_back(input);
+        bin_bytes += input.info.size();
+    }
+
+    std::string token = std::to_string(std::chrono::system_clock::now().time_since_epoch().count());
+    CompactionJournal journal;
+    for (size_t i = 0; i < bins.size(); ++i)
+    {
+        if (bins[i].size() < 2)
+            continue; // 单个文件合并没有意义
+        std::string name = "compact-" + token + "-" + std::to_string(i) + ".parquet";
+        std::string staged_path = dir + "/" + CompactionStagedName(name);
+        ARROW_RETURN_NOT_OK(MergeFiles(filesystem, bins[i], staged_path, options));
+        ARROW_ASSIGN_OR_RAISE(auto output_info, filesystem->GetFileInfo(staged_path));
+        journal.added.push_back(name);
+        ++stats->output_files;
+        stats->output_bytes += output_info.size();
+        for (const auto &input : bins[i])
+        {
+            journal.removed.push_back(input.info.base_name());
+            ++stats->input_files;
+            stats->input_bytes += input.info.size();
+            stats->rows += input.num_rows;
+        }
+    }
+    if (journal.added.empty())
+    {
+        return arrow::Status::OK();
+    }
+    ++stats->compacted_partitions;
+    ARROW_RETURN_NOT_OK(WriteCompactionJournal(filesystem, dir, journal));
+    return FinishCompaction(filesystem, base_dir, dir, journal, options, stats);
+}
+
+/**
+ * @brief 按所在目录列出数据文件，同时找出有合并日志或临时文件的目录
+ *
+ */
+arrow::Status ListCompactionPartitions(const std::shared_ptr<arrow::fs::FileSystem> &filesystem,
+                                       const std::string &base_dir,
+                                       std::map<std::string, std::vector<arrow::fs::FileInfo>> *partitions,
+                                       std::vector<std::string> *interrupted)
+{
+    partitions->clear();
+    interrupted->clear();
+    arrow::fs::FileSelector selector;
+    selector.base_dir = base_dir;
+    selector.recursive = true;
+    ARROW_ASSIGN_OR_RAISE(auto infos, filesystem->GetFileInfo(selector));
+    for (const auto &info : infos)
+    {
+        if (!info.IsFile())
+            continue;
+        std::string dir = ParentDir(info.path());
+        if (info.base_name() == DATASET_COMPACTION_JOURNAL || IsStagedCompactionFile(info.base_name()))
+        {
+            if (std::find(interrupted->begin(), interrupted->end(), dir) == interrupted->end())
+                interrupted->push_back(dir);
+            continue;
+        }
+        if (HiddenDatasetPath(base_dir, info.path()) || info.extension() != "parquet")
+            continue;
+        (*partitions)[dir].push_back(info);
+    }
+    return arrow::Status::OK();
+}
+
+/**
+ * @brief 合并数据集中每个分区目录的小parquet文件
+ *
+ * @param filesystem
+ * @param base_dir 数据集目录
+ * @param options
+ * @return arrow::Result<CompactionStats>
+ */
+arrow::Result<CompactionStats> CompactDataset(const std::shared_ptr<arrow::fs::FileSystem> &filesystem,
+                                              const std::string &base_dir,
+                                              const CompactionOptions &options = CompactionOptions())
+{
+    std::map<std::string, std::vector<arrow::fs::FileInfo>> partitions;
+    std::vector<std::string> interrupted;
+    ARROW_RETURN_NOT_OK(ListCompactionPartitions(filesystem, base_dir, &partitions, &interrupted));
+
+    CompactionStats stats;
+    if (!interrupted.empty())
+    {
+        for (const auto &dir : interrupted)
+        {
+            ARROW_RETURN_NOT_OK(RecoverCompaction(filesystem, base_dir, dir, options, &stats));
+        }
+        // 恢复过程会改名和删除文件，重新列一次；还在宽限期内的目录仍有日志，这次不合并
+        ARROW_RETURN_NOT_OK(ListCompactionPartitions(filesystem, base_dir, &partitions, &interrupted));
+    }
+    for (const auto &partition : partitions)
+    {
+        ++stats.partitions;
+        if (std::find(interrupted.begin(), interrupted.end(), partition.first) != interrupted.end())
+            continue;
+        ARROW_RETURN_NOT_OK(CompactPartition(filesystem, base_dir, partition.first, partition.second, options, &stats));
+    }
+    return stats;
+}
+
+#endif
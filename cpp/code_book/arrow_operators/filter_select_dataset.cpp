@@ -5,18 +5,32 @@
 #include <arrow/status.h>
 #include <arrow/type.h>
 #include <arrow/filesystem/api.h>
+#include <parquet/arrow/reader.h>
 #include <parquet/arrow/writer.h>
+#include <parquet/column_reader.h>
+#include <parquet/exception.h>
+#include <parquet/file_reader.h>
+#include <parquet/properties.h>
 #include <arrow/dataset/dataset.h>
 #include <arrow/dataset/discovery.h>
 #include <arrow/dataset/file_base.h>
 #include <arrow/dataset/file_ipc.h>
 #include <arrow/dataset/file_parquet.h>
 #include <arrow/dataset/scanner.h>
+#include <arrow/compute/api.h>
+#include <arrow/compute/exec/expression.h>
+#include <arrow/util/checked_cast.h>
 
+#include <algorithm>
 #include <iostream>
+#include <utility>
+#include <vector>
 using namespace std;
 
 #include "common.h"
+#include "scan_stream.h"
+#include "dataset_catalog.h"
+#include "../flight_speed_test/ranged_read.h"
 
 #define DATASET_NAME "slice"
 
@@ -26,19 +40,16 @@ using namespace std;
  * @param filesystem
  * @param format
  * @param base_dir
- * @return arrow::Result<std::shared_ptr<arrow::Table>>
+ * @param options 流式扫描参数
+ * @return arrow::Result<std::shared_ptr<arrow::dataset::Scanner>> 用ScanToReader或VisitScan流式读取
  */
-arrow::Result<std::shared_ptr<arrow::Table>> FilterAndSelectDataset(
+arrow::Result<std::shared_ptr<arrow::dataset::Scanner>> FilterAndSelectDataset(
     const std::shared_ptr<arrow::fs::FileSystem> &filesystem,
-    const std::shared_ptr<arrow::dataset::FileFormat> &format, const std::string &base_dir)
+    const std::shared_ptr<arrow::dataset::FileFormat> &format, const std::string &base_dir,
+    const ScanStreamOptions &options = ScanStreamOptions())
 {
     // 扫描获取文件
-    arrow::fs::FileSelector selector;
-    selector.base_dir = base_dir;
-    ARROW_ASSIGN_OR_RAISE(
-        auto factory, arrow::dataset::FileSystemDatasetFactory::Make(filesystem, selector, format,
-                                                                     arrow::dataset::FileSystemFactoryOptions()));
-    ARROW_ASSIGN_OR_RAISE(auto dataset, factory->Finish());
+    ARROW_ASSIGN_OR_RAISE(auto dataset, DiscoverDataset(filesystem, format, base_dir));
 
     // 只读特定的列 b ，并限制行条件为小于4
     ARROW_ASSIGN_OR_RAISE(auto scan_builder, dataset->NewScan());
@@ -46,8 +57,346 @@ arrow::Result<std::shared_ptr<arrow::Table>> FilterAndSelectDataset(
     ARROW_RETURN_NOT_OK(scan_builder->Project({"c"})); // 读个c列
 
     ARROW_RETURN_NOT_OK(scan_builder->Filter(arrow::compute::less(arrow::compute::field_ref("b"), arrow::compute::literal(4)))); // 条件设置为b<4
-    ARROW_ASSIGN_OR_RAISE(auto scanner, scan_builder->Finish());
-    return scanner->ToTable();
+    ARROW_RETURN_NOT_OK(ApplyScanStreamOptions(*scan_builder, options));
+    return scan_builder->Finish();
+}
+
+/**
+ * @brief 延迟物化扫描的统计
+ *
+ */
+struct LateMaterializationStats
+{
+    int64_t row_groups = 0;             // 统计信息裁剪后剩下的row group
+    int64_t skipped_row_groups = 0;     // 过滤列没有命中，投影列完全没有解码的row group
+    int64_t filter_rows_decoded = 0;    // 过滤列解码的行数
+    int64_t projected_rows_decoded = 0; // 投影列解码的行数
+    int64_t ranged_row_groups = 0;      // 投影列只读取了命中行区间的row group
+    int64_t selected_rows = 0;
+
+    std::string ToString() const
+    {
+        return "row_groups=" + std::to_string(row_groups) +
+               " skipped_row_groups=" + std::to_string(skipped_row_groups) +
+               " filter_rows_decoded=" + std::to_string(filter_rows_decoded) +
+               " projected_rows_decoded=" + std::to_string(projected_rows_decoded) +
+               " ranged_row_groups=" + std::to_string(ranged_row_groups) +
+               " selected_rows=" + std::to_string(selected_rows);
+    }
+};
+
+/**
+ * @brief 按列名取列号，只支持平铺（非嵌套）的schema
+ *
+ */
+arrow::Result<std::vector<int>> ColumnIndices(const arrow::Schema &schema, const std::vector<std::string> &names)
+{
+    std::vector<int> indices;
+    for (const auto &name : names)
+    {
+        int index = schema.GetFieldIndex(name);
+        if (index < 0)
+        {
+            return arrow::Status::Invalid("No column named ", name);
+        }
+        indices.push_back(index);
+    }
+    return indices;
+}
+
+/**
+ * @brief 把按batch排列的选择向量转成连续的命中行区间，null视为没有命中
+ *
+ */
+RowRanges SelectedRanges(const std::vector<std::shared_ptr<arrow::BooleanArray>> &selections)
+{
+    RowRanges ranges;
+    int64_t row = 0;
+    for (const auto &selection : selections)
+    {
+        for (int64_t i = 0; i < selection->length(); ++i, ++row)
+        {
+            if (!selection->IsValid(i) || !selection->Value(i))
+                continue;
+            if (!ranges.empty() && ranges.back().first + ranges.back().second == row)
+                ++ranges.back().second;
+            else
+                ranges.emplace_back(row, 1);
+        }
+    }
+    return ranges;
+}
+
+/**
+ * @brief 在一批行上计算选择向量，结果是常量时展开成数组
+ *
+ */
+arrow::Result<std::shared_ptr<arrow::BooleanArray>> EvaluateSelection(const arrow::compute::Expression &predicate,
+                                                                      const arrow::compute::ExecBatch &batch)
+{
+    ARROW_ASSIGN_OR_RAISE(auto mask, arrow::compute::ExecuteScalarExpression(predicate, batch));
+    std::shared_ptr<arrow::Array> mask_array;
+    if (mask.is_scalar())
+    {
+        ARROW_ASSIGN_OR_RAISE(mask_array, arrow::MakeArrayFromScalar(*mask.scalar(), batch.length));
+    }
+    else
+    {
+        mask_array = mask.make_array();
+    }
+    return std::static_pointer_cast<arrow::BooleanArray>(mask_array);
+}
+
+/**
+ * @brief 按投影顺序拼出输出batch：文件里的列依次取file_columns，分区列把分区值重复num_rows次
+ *
+ * @param partition_values 与投影列一一对应，文件里的列为nullptr
+ */
+arrow::Result<std::shared_ptr<arrow::RecordBatch>> MakeProjectedBatch(
+    const std::shared_ptr<arrow::Schema> &schema, const std::vector<std::shared_ptr<arrow::Array>> &file_columns,
+    const std::vector<std::shared_ptr<arrow::Scalar>> &partition_values, int64_t num_rows)
+{
+    std::vector<std::shared_ptr<arrow::Array>> columns;
+    size_t next = 0;
+    for (const auto &value : partition_values)
+    {
+        if (value == nullptr)
+        {
+            columns.push_back(file_columns[next++]);
+            continue;
+        }
+        ARROW_ASSIGN_OR_RAISE(auto repeated, arrow::MakeArrayFromScalar(*value, num_rows));
+        columns.push_back(repeated);
+    }
+    return arrow::RecordBatch::Make(schema, num_rows, columns);
+}
+
+/**
+ * @brief 延迟物化的过滤读取：先只解码过滤列算出选择向量，再只解码投影列中命中的行
+ *
+ * 1. 用row group统计信息裁剪（与dataset扫描相同）
+ * 2. 每个row group只解码过滤列，按batch计算出布尔选择向量
+ * 3. 整个row group都没有命中时，投影列完全不解码；否则把选择向量转成行区间，
+ *    投影列用底层ColumnReader跳过区间之间的行，只解码区间内的行
+ * 4. 投影列有嵌套或需要类型转换的列时，退回按batch解码整个row group再用选择向量过滤
+ * 分区列不在文件里：过滤条件里代入每个文件的分区值，投影时把分区值重复成列。
+ * 列名不存在时返回KeyError。
+ *
+ * @param filesystem
+ * @param base_dir
+ * @param predicate 过滤条件，用到的列只解码一次
+ * @param projection 需要输出的列
+ * @param batch_size 选择向量的粒度，越小越接近按页跳过
+ * @param stats 统计信息
+ * @return arrow::Result<std::shared_ptr<arrow::Table>>
+ */
+arrow::Result<std::shared_ptr<arrow::Table>> LateMaterializedFilterAndSelect(
+    const std::shared_ptr<arrow::fs::FileSystem> &filesystem, const std::string &base_dir,
+    const arrow::compute::Expression &predicate, const std::vector<std::string> &projection,
+    int64_t batch_size, LateMaterializationStats *stats)
+{
+    auto format = std::make_shared<arrow::dataset::ParquetFileFormat>();
+    ARROW_ASSIGN_OR_RAISE(auto dataset, DiscoverDataset(filesystem, format, base_dir));
+
+    // 过滤列
+    std::vector<std::string> filter_names;
+    for (const auto &ref : arrow::compute::FieldsInExpression(predicate))
+    {
+        if (ref.name() == nullptr)
+        {
+            return arrow::Status::NotImplemented("Only filters on named columns are supported: ", predicate.ToString());
+        }
+        if (std::find(filter_names.begin(), filter_names.end(), *ref.name()) == filter_names.end())
+        {
+            filter_names.push_back(*ref.name());
+        }
+    }
+    auto schema = dataset->schema();
+    for (const auto &name : filter_names)
+    {
+        if (schema->GetFieldByName(name) == nullptr)
+            return arrow::Status::KeyError("Column ", name, " not found in ", schema->ToString());
+    }
+    std::vector<std::shared_ptr<arrow::Field>> projected_fields;
+    for (const auto &name : projection)
+    {
+        auto field = schema->GetFieldByName(name);
+        if (field == nullptr)
+            return arrow::Status::KeyError("Column ", name, " not found in ", schema->ToString());
+        projected_fields.push_back(field);
+    }
+    auto projected_schema = arrow::schema(projected_fields);
+    // 绑定到完整schema，用于统计信息裁剪；每个文件再代入分区值，绑定到只有过滤列的schema计算选择向量
+    ARROW_ASSIGN_OR_RAISE(auto bound_predicate, predicate.Bind(*schema));
+
+    parquet::ArrowReaderProperties properties;
+    properties.set_batch_size(batch_size);
+
+    std::vector<std::shared_ptr<arrow::RecordBatch>> results;
+    ARROW_ASSIGN_OR_RAISE(auto fragments, dataset->GetFragments());
+    for (const auto &maybe_fragment : fragments)
+    {
+        ARROW_ASSIGN_OR_RAISE(auto fragment, maybe_fragment);
+        auto parquet_fragment = arrow::internal::checked_pointer_cast<arrow::dataset::ParquetFileFragment>(fragment);
+        // 按统计信息裁剪后，每个row group一个fragment
+        ARROW_ASSIGN_OR_RAISE(auto row_group_fragments, parquet_fragment->SplitByRowGroup(bound_predicate));
+        if (row_group_fragments.empty())
+        {
+            continue;
+        }
+
+        ARROW_ASSIGN_OR_RAISE(auto input, filesystem->OpenInputFile(parquet_fragment->source().path()));
+        parquet::arrow::FileReaderBuilder builder;
+        ARROW_RETURN_NOT_OK(builder.Open(input));
+        std::unique_ptr<parquet::arrow::FileReader> reader;
+        ARROW_RETURN_NOT_OK(builder.properties(properties)->Build(&reader));
+        std::shared_ptr<arrow::Schema> file_schema;
+        ARROW_RETURN_NOT_OK(reader->GetSchema(&file_schema));
+
+        // 分区列（例如part）不在文件里，值来自分区表达式：过滤条件里代入常量，投影时重复分区值
+        ARROW_ASSIGN_OR_RAISE(auto known, arrow::compute::ExtractKnownFieldValues(fragment->partition_expression()));
+        ARROW_ASSIGN_OR_RAISE(auto fragment_predicate,
+                              arrow::compute::SimplifyWithGuarantee(bound_predicate, fragment->partition_expression()));
+        std::vector<std::string> file_filter_names;
+        std::vector<std::shared_ptr<arrow::Field>> file_filter_fields;
+        for (const auto &ref : arrow::compute::FieldsInExpression(fragment_predicate))
+        {
+            if (file_schema->GetFieldIndex(*ref.name()) < 0)
+            {
+                return arrow::Status::KeyError("Column ", *ref.name(), " is neither in ", parquet_fragment->source().path(),
+                                               " nor a partition key with a known value");
+            }
+            if (std::find(file_filter_names.begin(), file_filter_names.end(), *ref.name()) == file_filter_names.end())
+            {
+                file_filter_names.push_back(*ref.name());
+                file_filter_fields.push_back(schema->GetFieldByName(*ref.name()));
+            }
+        }
+        ARROW_ASSIGN_OR_RAISE(auto filter_columns, ColumnIndices(*file_schema, file_filter_names));
+        ARROW_ASSIGN_OR_RAISE(auto filter_predicate, fragment_predicate.Bind(*arrow::schema(file_filter_fields)));
+
+        std::vector<int> projected_columns;
+        std::vector<std::shared_ptr<arrow::Scalar>> partition_values;
+        bool ranged = true;
+        for (size_t k = 0; k < projection.size(); ++k)
+        {
+            int column = file_schema->GetFieldIndex(projection[k]);
+            if (column < 0)
+            {
+                auto value = known.map.find(arrow::FieldRef(projection[k]));
+                if (value == known.map.end() || !value->second.is_scalar())
+                {
+                    return arrow::Status::KeyError("Column ", projection[k], " is neither in ",
+                                                   parquet_fragment->source().path(), " nor a partition key");
+                }
+                ARROW_ASSIGN_OR_RAISE(auto scalar, value->second.scalar()->CastTo(projected_fields[k]->type()));
+                partition_values.push_back(scalar);
+                continue;
+            }
+            partition_values.push_back(nullptr);
+            projected_columns.push_back(column);
+            const auto &type = file_schema->field(column)->type();
+            ranged = ranged && type->Equals(projected_fields[k]->type()) &&
+                     SupportsRangedRead(*type, *reader->parquet_reader()->metadata()->schema()->Column(column));
+        }
+
+        for (const auto &row_group_fragment : row_group_fragments)
+        {
+            const auto &row_groups =
+                arrow::internal::checked_pointer_cast<arrow::dataset::ParquetFileFragment>(row_group_fragment)->row_groups();
+            for (int row_group : row_groups)
+            {
+                ++stats->row_groups;
+
+                // 第一步：只解码过滤列，得到每个batch的选择向量
+                std::vector<std::shared_ptr<arrow::BooleanArray>> selections;
+                int64_t selected = 0;
+                std::shared_ptr<arrow::RecordBatch> batch;
+                if (filter_columns.empty())
+                {
+                    // 条件只涉及分区列，代入后是常量；仍按batch_size切分，和投影列的batch对齐
+                    int64_t rows = reader->parquet_reader()->metadata()->RowGroup(row_group)->num_rows();
+                    for (int64_t begin = 0; begin < rows; begin += batch_size)
+                    {
+                        int64_t length = std::min(batch_size, rows - begin);
+                        ARROW_ASSIGN_OR_RAISE(auto selection,
+                                              EvaluateSelection(filter_predicate, arrow::compute::ExecBatch({}, length)));
+                        selected += selection->true_count();
+                        selections.push_back(selection);
+                    }
+                }
+                else
+                {
+                    std::unique_ptr<arrow::RecordBatchReader> filter_reader;
+                    ARROW_RETURN_NOT_OK(reader->GetRecordBatchReader({row_group}, filter_columns, &filter_reader));
+                    while (true)
+                    {
+                        ARROW_RETURN_NOT_OK(filter_reader->ReadNext(&batch));
+                        if (batch == nullptr)
+                        {
+                            break;
+                        }
+                        stats->filter_rows_decoded += batch->num_rows();
+                        ARROW_ASSIGN_OR_RAISE(auto selection,
+                                              EvaluateSelection(filter_predicate, arrow::compute::ExecBatch(*batch)));
+                        selected += selection->true_count();
+                        selections.push_back(selection);
+                    }
+                }
+
+                // 第二步：没有命中的row group，投影列一个字节都不用解码
+                if (selected == 0)
+                {
+                    ++stats->skipped_row_groups;
+                    continue;
+                }
+                stats->selected_rows += selected;
+
+                // 第三步：投影列只解码命中的行区间
+                if (ranged)
+                {
+                    auto ranges = SelectedRanges(selections);
+                    auto row_group_reader = reader->parquet_reader()->RowGroup(row_group);
+                    std::vector<std::shared_ptr<arrow::Array>> columns;
+                    for (int column : projected_columns)
+                    {
+                        ARROW_ASSIGN_OR_RAISE(auto array, ReadRangedColumn(row_group_reader.get(), column,
+                                                                           *file_schema->field(column)->type(), ranges));
+                        columns.push_back(array);
+                    }
+                    stats->projected_rows_decoded += selected;
+                    ++stats->ranged_row_groups;
+                    ARROW_ASSIGN_OR_RAISE(auto result,
+                                          MakeProjectedBatch(projected_schema, columns, partition_values, selected));
+                    results.push_back(result);
+                    continue;
+                }
+
+                // 不能按区间读取时，用相同的batch大小解码投影列，与选择向量一一对应
+                std::unique_ptr<arrow::RecordBatchReader> projected_reader;
+                ARROW_RETURN_NOT_OK(reader->GetRecordBatchReader({row_group}, projected_columns, &projected_reader));
+                for (const auto &selection : selections)
+                {
+                    ARROW_RETURN_NOT_OK(projected_reader->ReadNext(&batch));
+                    if (batch == nullptr || batch->num_rows() != selection->length())
+                    {
+                        return arrow::Status::Invalid("Projected batches are not aligned with the filter batches");
+                    }
+                    stats->projected_rows_decoded += batch->num_rows();
+                    if (selection->true_count() == 0)
+                    {
+                        continue;
+                    }
+                    ARROW_ASSIGN_OR_RAISE(auto filtered, arrow::compute::Filter(batch, selection));
+                    ARROW_ASSIGN_OR_RAISE(auto result,
+                                          MakeProjectedBatch(projected_schema, filtered.record_batch()->columns(),
+                                                             partition_values, filtered.record_batch()->num_rows()));
+                    results.push_back(result);
+                }
+            }
+        }
+    }
+    return arrow::Table::FromRecordBatches(projected_schema, results);
 }
 
 arrow::Status func()
@@ -61,11 +410,22 @@ arrow::Status func()
 
     ARROW_ASSIGN_OR_RAISE(auto fs, arrow::fs::FileSystemFromUri(uri, &root_path));
 
-    std::shared_ptr<arrow::Table> table;
-    ARROW_ASSIGN_OR_RAISE(table, FilterAndSelectDataset(fs, format, base_path));
+    // 过滤后的结果顺序无关紧要，使用不保证顺序的回调方式
+    ScanStreamOptions options;
+    options.ordered = false;
+    ARROW_ASSIGN_OR_RAISE(auto scanner, FilterAndSelectDataset(fs, format, base_path, options));
+
+    ARROW_RETURN_NOT_OK(PrintScan(scanner, options));
 
-    std::cout << "Read " << table->num_rows() << " rows" << std::endl;
+    // 延迟物化：先解码b，再只解码命中部分的c
+    LateMaterializationStats stats;
+    ARROW_ASSIGN_OR_RAISE(auto table, LateMaterializedFilterAndSelect(
+                                          fs, base_path,
+                                          arrow::compute::less(arrow::compute::field_ref("b"), arrow::compute::literal(4)),
+                                          {"c"}, 1024, &stats));
+    std::cout << "Late materialization read " << table->num_rows() << " rows" << std::endl;
     std::cout << table->ToString() << std::endl;
+    std::cout << stats.ToString() << std::endl;
     return arrow::Status::OK();
 }
 
@@ -17,6 +17,9 @@
 using namespace std;
 
 #include "common.h"
+#include "clustered_write.h"
+#include "../flight_speed_test/parquet_lookup.h"
+#include "../flight_speed_test/secondary_index.h"
 
 #define DATASET_NAME "partition"
 
@@ -37,8 +40,6 @@ arrow::Result<std::string> CreateExampleParquetHivePartitionedDataset(
 
     // 通过dataset来写文件
     auto dataset = std::make_shared<arrow::dataset::InMemoryDataset>(table);
-    ARROW_ASSIGN_OR_RAISE(auto scanner_builder, dataset->NewScan());
-    ARROW_ASSIGN_OR_RAISE(auto scanner, scanner_builder->Finish());
 
     // partition schema说明了要按照哪个列分区，这里取part列
     auto partition_schema = arrow::schema({arrow::field("part", arrow::utf8())});
@@ -47,12 +48,31 @@ arrow::Result<std::string> CreateExampleParquetHivePartitionedDataset(
     // 写parquet文件
     auto format = std::make_shared<arrow::dataset::ParquetFileFormat>();
     arrow::dataset::FileSystemDatasetWriteOptions write_options;
-    write_options.file_write_options = format->DefaultWriteOptions();
+    // 打开统计信息，并在每个文件写完后为a列生成布隆过滤器和二级索引，用于点查
+    std::vector<std::string> key_columns{"a"};
+    auto parquet_options = std::static_pointer_cast<arrow::dataset::ParquetFileWriteOptions>(format->DefaultWriteOptions());
+    parquet_options->writer_properties = LookupWriterProperties(key_columns);
+    write_options.file_write_options = parquet_options;
+    write_options.writer_post_finish = [key_columns, base_path](arrow::dataset::FileWriter *writer)
+    {
+        const auto &destination = writer->destination();
+        ARROW_RETURN_NOT_OK(BuildBloomSidecar(destination.filesystem, destination.path, key_columns));
+        // 二级索引按数据集目录维护，每写完一个文件合并一次
+        for (const auto &column : key_columns)
+        {
+            ARROW_RETURN_NOT_OK(UpdateSecondaryIndex(destination.filesystem, base_path, column, destination.path));
+        }
+        return arrow::Status::OK();
+    };
     write_options.filesystem = filesystem;
     write_options.base_dir = base_path;
     write_options.partitioning = partitioning;
     write_options.basename_template = "part{i}.parquet"; // 文件名为part{i}.parquet
-    ARROW_RETURN_NOT_OK(arrow::dataset::FileSystemDataset::Write(write_options, scanner));
+    // 每个分区内按b列排序后写入，row group的b列范围不重叠，b < 4这样的条件可以用统计信息裁剪
+    ClusterOptions cluster_options;
+    cluster_options.mode = ClusterMode::kSort;
+    cluster_options.columns = {"b"};
+    ARROW_RETURN_NOT_OK(WriteClusteredDataset(dataset, write_options, cluster_options));
     return base_path;
 }
 
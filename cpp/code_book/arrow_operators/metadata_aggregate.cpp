@@ -0,0 +1,162 @@
+#include <arrow/api.h>
+#include <arrow/io/api.h>
+#include <arrow/result.h>
+#include <arrow/status.h>
+#include <arrow/type.h>
+#include <arrow/compute/api.h>
+#include <arrow/filesystem/api.h>
+#include <arrow/dataset/dataset.h>
+#include <arrow/dataset/discovery.h>
+#include <arrow/dataset/file_base.h>
+#include <arrow/dataset/file_parquet.h>
+#include <arrow/dataset/scanner.h>
+
+#include <chrono>
+#include <iostream>
+#include <random>
+using namespace std;
+
+#include "common.h"
+#include "dataset_catalog.h"
+#include "clustered_write.h"
+#include "metadata_aggregate.h"
+
+#define DATASET_NAME "metadata_aggregate"
+#define TRADE_ROWS 1000000
+#define ROW_GROUP_ROWS 8192
+
+/**
+ * @brief 生成成交数据(trddate, pri, market)，按market分区、按trddate聚簇写入
+ *
+ */
+arrow::Status WriteTrades(const std::shared_ptr<arrow::fs::FileSystem> &filesystem, const std::string &base_path)
+{
+    std::mt19937 gen{42};
+    std::uniform_int_distribution<int32_t> date{19000, 19029};
+    std::uniform_real_distribution<double> pri{0, 100};
+    std::vector<std::string> markets{"SH", "SZ", "BJ"};
+    arrow::Date32Builder trddate_builder;
+    arrow::DoubleBuilder pri_builder;
+    arrow::StringBuilder market_builder;
+    for (int64_t i = 0; i < TRADE_ROWS; ++i)
+    {
+        ARROW_RETURN_NOT_OK(trddate_builder.Append(date(gen)));
+        ARROW_RETURN_NOT_OK(pri_builder.Append(pri(gen)));
+        ARROW_RETURN_NOT_OK(market_builder.Append(markets[i % markets.size()]));
+    }
+    std::vector<std::shared_ptr<arrow::Array>> arrays(3);
+    ARROW_RETURN_NOT_OK(trddate_builder.Finish(&arrays[0]));
+    ARROW_RETURN_NOT_OK(pri_builder.Finish(&arrays[1]));
+    ARROW_RETURN_NOT_OK(market_builder.Finish(&arrays[2]));
+    auto table = arrow::Table::Make(arrow::schema({arrow::field("trddate", arrow::date32()),
+                                                   arrow::field("pri", arrow::float64()),
+                                                   arrow::field("market", arrow::utf8())}),
+                                    arrays);
+
+    ARROW_RETURN_NOT_OK(filesystem->CreateDir(base_path));
+    ARROW_RETURN_NOT_OK(filesystem->DeleteDirContents(base_path));
+    auto format = std::make_shared<arrow::dataset::ParquetFileFormat>();
+    arrow::dataset::FileSystemDatasetWriteOptions write_options;
+    write_options.file_write_options = format->DefaultWriteOptions();
+    write_options.filesystem = filesystem;
+    write_options.base_dir = base_path;
+    write_options.partitioning = std::make_shared<arrow::dataset::HivePartitioning>(
+        arrow::schema({arrow::field("market", arrow::utf8())}));
+    write_options.basename_template = "part{i}.parquet";
+    ClusterOptions cluster_options;
+    cluster_options.mode = ClusterMode::kSort;
+    cluster_options.columns = {"trddate"};
+    cluster_options.row_group_rows = ROW_GROUP_ROWS;
+    return WriteClusteredDataset(std::make_shared<arrow::dataset::InMemoryDataset>(table), write_options,
+                                 cluster_options);
+}
+
+/**
+ * @brief 对照组：过滤后ToTable，再用计算函数求聚合
+ *
+ */
+arrow::Result<std::vector<std::shared_ptr<arrow::Scalar>>> AggregateByScan(
+    const std::shared_ptr<arrow::dataset::Dataset> &dataset, const arrow::compute::Expression &filter,
+    const std::vector<MetadataAggregate> &aggregates)
+{
+    ARROW_ASSIGN_OR_RAISE(auto scan_builder, dataset->NewScan());
+    ARROW_RETURN_NOT_OK(scan_builder->Filter(filter));
+    ARROW_ASSIGN_OR_RAISE(auto scanner, scan_builder->Finish());
+    ARROW_ASSIGN_OR_RAISE(auto table, scanner->ToTable());
+    std::vector<std::shared_ptr<arrow::Scalar>> values;
+    for (const auto &aggregate : aggregates)
+    {
+        if (aggregate.kind == MetadataAggregateKind::kCount)
+        {
+            values.push_back(std::make_shared<arrow::Int64Scalar>(table->num_rows()));
+            continue;
+        }
+        ARROW_ASSIGN_OR_RAISE(auto min_max, arrow::compute::MinMax(table->GetColumnByName(aggregate.column)));
+        values.push_back(min_max.scalar_as<arrow::StructScalar>().value[aggregate.kind == MetadataAggregateKind::kMin ? 0 : 1]);
+    }
+    return values;
+}
+
+/**
+ * @brief 几个典型查询分别用全量扫描和元数据回答，对比结果和耗时
+ *
+ */
+arrow::Status func()
+{
+    ARROW_ASSIGN_OR_RAISE(auto fs, arrow::fs::FileSystemFromUri(uri, &root_path));
+    std::string base_path = root_path + "/" + DATASET_NAME + "_output/parquet_dataset";
+    ARROW_RETURN_NOT_OK(WriteTrades(fs, base_path));
+
+    arrow::dataset::FileSystemFactoryOptions factory_options;
+    factory_options.partitioning = arrow::dataset::HivePartitioning::MakeFactory();
+    auto format = std::make_shared<arrow::dataset::ParquetFileFormat>();
+    ARROW_ASSIGN_OR_RAISE(auto dataset, DiscoverDataset(fs, format, base_path, factory_options));
+
+    MetadataAggregate count;
+    MetadataAggregate min_pri{MetadataAggregateKind::kMin, "pri"};
+    MetadataAggregate max_pri{MetadataAggregateKind::kMax, "pri"};
+    MetadataAggregate min_date{MetadataAggregateKind::kMin, "trddate"};
+    MetadataAggregate max_date{MetadataAggregateKind::kMax, "trddate"};
+    MetadataAggregate max_market{MetadataAggregateKind::kMax, "market"};
+
+    auto trddate = arrow::compute::field_ref("trddate");
+    auto date_19015 = arrow::compute::literal(std::make_shared<arrow::Date32Scalar>(19015));
+    std::vector<std::pair<arrow::compute::Expression, std::vector<MetadataAggregate>>> queries{
+        // 不过滤：全部来自footer和分区值
+        {arrow::compute::literal(true), {count, min_date, max_date, max_market}},
+        // 与分区对齐：COUNT只读SZ分区的footer；pri是浮点列，统计信息不计入NaN，MIN/MAX要扫描SZ分区
+        {arrow::compute::equal(arrow::compute::field_ref("market"), arrow::compute::literal("SZ")),
+         {count, min_pri, max_pri}},
+        // 按trddate聚簇后，大部分row group整体满足条件，只扫描边界上的row group
+        {arrow::compute::equal(trddate, date_19015), {count, max_date}},
+        {arrow::compute::greater_equal(trddate, date_19015), {count, min_date}},
+        // pri是浮点列，不用统计信息化简，所有row group都要扫描
+        {arrow::compute::greater(arrow::compute::field_ref("pri"), arrow::compute::literal(99.0)), {count}}};
+
+    for (const auto &query : queries)
+    {
+        cout << query.first.ToString() << endl;
+
+        auto start = std::chrono::steady_clock::now();
+        ARROW_ASSIGN_OR_RAISE(auto expected, AggregateByScan(dataset, query.first, query.second));
+        double scan_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+        start = std::chrono::steady_clock::now();
+        ARROW_ASSIGN_OR_RAISE(auto result, AggregateFromMetadata(dataset, query.first, query.second));
+        double metadata_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+        for (size_t i = 0; i < query.second.size(); ++i)
+        {
+            cout << "  " << query.second[i].ToString() << " = " << result.values[i]->ToString()
+                 << (result.values[i]->Equals(*expected[i]) ? "" : " (scan: " + expected[i]->ToString() + ")") << endl;
+        }
+        cout << "  scan " << scan_ms << " ms, metadata " << metadata_ms << " ms, " << result.stats.ToString() << endl;
+    }
+    return arrow::Status::OK();
+}
+
+int main(int argc, char const *argv[])
+{
+    cout << func() << endl;
+    return 0;
+}
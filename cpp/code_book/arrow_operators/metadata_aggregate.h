@@ -0,0 +1,377 @@
+#ifndef METADATA_AGGREGATE_H
+#define METADATA_AGGREGATE_H
+
+#include <arrow/api.h>
+#include <arrow/io/api.h>
+#include <arrow/result.h>
+#include <arrow/status.h>
+#include <arrow/compute/api.h>
+#include <arrow/compute/exec/expression.h>
+#include <arrow/dataset/dataset.h>
+#include <arrow/dataset/file_base.h>
+#include <arrow/dataset/file_parquet.h>
+#include <arrow/dataset/scanner.h>
+#include <arrow/util/checked_cast.h>
+#include <parquet/metadata.h>
+#include <parquet/statistics.h>
+
+#include <numeric>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "dataset_catalog.h"
+
+/**
+ * 只用元数据回答COUNT(*)/MIN/MAX：
+ *
+ * - 分区表达式（目录缓存里还带有文件级统计）排除的文件不读footer；
+ * - 在分区表达式和row group统计信息下，过滤条件化简为true的row group，
+ *   行数取footer中的num_rows，MIN/MAX取列统计信息或分区值（浮点列的统计信息不计入NaN，不用来回答）；
+ * - 化简为false的row group直接跳过；
+ * - 其余部分满足条件的row group，以及统计信息不够用的row group，才真正扫描。
+ */
+
+enum class MetadataAggregateKind
+{
+    kCount, // COUNT(*)
+    kMin,
+    kMax,
+};
+
+/**
+ * @brief 一个聚合：COUNT(*)时column为空
+ *
+ */
+struct MetadataAggregate
+{
+    MetadataAggregateKind kind;
+    std::string column;
+
+    MetadataAggregate(MetadataAggregateKind kind = MetadataAggregateKind::kCount, std::string column = "")
+        : kind(kind), column(std::move(column))
+    {
+    }
+
+    std::string ToString() const
+    {
+        switch (kind)
+        {
+        case MetadataAggregateKind::kMin:
+            return "min(" + column + ")";
+        case MetadataAggregateKind::kMax:
+            return "max(" + column + ")";
+        default:
+            return "count(*)";
+        }
+    }
+};
+
+struct MetadataAggregateStats
+{
+    int64_t files = 0;
+    int64_t files_pruned = 0;        // 只看分区表达式就排除的文件
+    int64_t row_groups = 0;
+    int64_t row_groups_pruned = 0;   // 统计信息排除的row group
+    int64_t row_groups_answered = 0; // 全部满足条件，只用元数据回答的row group
+    int64_t row_groups_scanned = 0;  // 需要扫描的row group
+    int64_t rows_scanned = 0;        // 需要扫描的row group的总行数
+
+    std::string ToString() const
+    {
+        return "files " + std::to_string(files - files_pruned) + "/" + std::to_string(files) +
+               ", row groups answered " + std::to_string(row_groups_answered) +
+               ", pruned " + std::to_string(row_groups_pruned) +
+               ", scanned " + std::to_string(row_groups_scanned) + "/" + std::to_string(row_groups) +
+               " (" + std::to_string(rows_scanned) + " rows)";
+    }
+};
+
+struct MetadataAggregateResult
+{
+    std::vector<std::shared_ptr<arrow::Scalar>> values; // 与aggregates一一对应
+    MetadataAggregateStats stats;
+};
+
+/**
+ * @brief 一个row group中某列的min/max，全为null时min/max为nullptr
+ *
+ * @return arrow::Result<bool> 统计信息缺失或类型不支持时返回false。浮点列总是返回false：
+ * parquet的min/max不计入NaN，又没有NaN计数，无法证明row group里没有NaN，只能扫描
+ */
+arrow::Result<bool> RowGroupMinMax(const parquet::FileMetaData &metadata, int row_group, int column,
+                                   const std::shared_ptr<arrow::DataType> &type,
+                                   std::shared_ptr<arrow::Scalar> *min, std::shared_ptr<arrow::Scalar> *max)
+{
+    *min = nullptr;
+    *max = nullptr;
+    auto chunk = metadata.RowGroup(row_group)->ColumnChunk(column);
+    auto statistics = chunk->statistics();
+    if (statistics == nullptr)
+        return false;
+    if (!statistics->HasMinMax())
+    {
+        return statistics->HasNullCount() && statistics->null_count() == chunk->num_values();
+    }
+    switch (type->id())
+    {
+    case arrow::Type::INT64:
+    {
+        auto typed = std::static_pointer_cast<parquet::Int64Statistics>(statistics);
+        ARROW_ASSIGN_OR_RAISE(*min, arrow::MakeScalar(type, typed->min()));
+        ARROW_ASSIGN_OR_RAISE(*max, arrow::MakeScalar(type, typed->max()));
+        return true;
+    }
+    case arrow::Type::INT32:
+    case arrow::Type::DATE32:
+    {
+        auto typed = std::static_pointer_cast<parquet::Int32Statistics>(statistics);
+        ARROW_ASSIGN_OR_RAISE(*min, arrow::MakeScalar(type, typed->min()));
+        ARROW_ASSIGN_OR_RAISE(*max, arrow::MakeScalar(type, typed->max()));
+        return true;
+    }
+    default:
+        return false;
+    }
+}
+
+/**
+ * @brief 聚合的中间状态，最后一次性求MIN/MAX
+ *
+ */
+struct MetadataAggregateState
+{
+    int64_t count = 0;
+    arrow::ScalarVector candidates; // 各row group/batch的min或max
+
+    arrow::Status Consume(const MetadataAggregate &aggregate, const arrow::RecordBatch &batch)
+    {
+        count += batch.num_rows();
+        if (aggregate.kind == MetadataAggregateKind::kCount)
+            return arrow::Status::OK();
+        ARROW_ASSIGN_OR_RAISE(auto min_max, arrow::compute::MinMax(batch.GetColumnByName(aggregate.column)));
+        const auto &value = min_max.scalar_as<arrow::StructScalar>().value;
+        auto candidate = value[aggregate.kind == MetadataAggregateKind::kMin ? 0 : 1];
+        if (candidate->is_valid)
+            candidates.push_back(candidate);
+        return arrow::Status::OK();
+    }
+
+    arrow::Result<std::shared_ptr<arrow::Scalar>> Finish(const MetadataAggregate &aggregate,
+                                                         const std::shared_ptr<arrow::DataType> &type) const
+    {
+        if (aggregate.kind == MetadataAggregateKind::kCount)
+            return std::make_shared<arrow::Int64Scalar>(count);
+        if (candidates.empty())
+            return arrow::MakeNullScalar(type);
+        std::unique_ptr<arrow::ArrayBuilder> builder;
+        ARROW_RETURN_NOT_OK(arrow::MakeBuilder(arrow::default_memory_pool(), type, &builder));
+        for (const auto &candidate : candidates)
+        {
+            // 分区值的类型来自分区推断，与数据集schema不一定相同
+            if (candidate->type->Equals(*type))
+            {
+                ARROW_RETURN_NOT_OK(builder->AppendScalar(*candidate));
+            }
+            else
+            {
+                ARROW_ASSIGN_OR_RAISE(auto casted, candidate->CastTo(type));
+                ARROW_RETURN_NOT_OK(builder->AppendScalar(*casted));
+            }
+        }
+        ARROW_ASSIGN_OR_RAISE(auto array, builder->Finish());
+        ARROW_ASSIGN_OR_RAISE(auto min_max, arrow::compute::MinMax(array));
+        return min_max.scalar_as<arrow::StructScalar>().value[aggregate.kind == MetadataAggregateKind::kMin ? 0 : 1];
+    }
+};
+
+/**
+ * @brief 扫描元数据回答不了的row group
+ *
+ */
+arrow::Status ScanRemainingRowGroups(const std::shared_ptr<arrow::dataset::FileSystemDataset> &dataset,
+                                     const arrow::dataset::FragmentVector &fragments,
+                                     const arrow::compute::Expression &filter,
+                                     const std::vector<MetadataAggregate> &aggregates,
+                                     std::vector<MetadataAggregateState> *states)
+{
+    std::vector<std::shared_ptr<arrow::dataset::FileFragment>> file_fragments;
+    for (const auto &fragment : fragments)
+    {
+        file_fragments.push_back(arrow::internal::checked_pointer_cast<arrow::dataset::FileFragment>(fragment));
+    }
+    ARROW_ASSIGN_OR_RAISE(auto remaining, arrow::dataset::FileSystemDataset::Make(
+                                              dataset->schema(), arrow::compute::literal(true), dataset->format(),
+                                              dataset->filesystem(), file_fragments));
+
+    // 只读聚合用到的列，过滤列由scanner自己补上
+    std::set<std::string> columns;
+    for (const auto &aggregate : aggregates)
+    {
+        if (aggregate.kind != MetadataAggregateKind::kCount)
+            columns.insert(aggregate.column);
+    }
+    ARROW_ASSIGN_OR_RAISE(auto scan_builder, remaining->NewScan());
+    ARROW_RETURN_NOT_OK(scan_builder->Filter(filter));
+    ARROW_RETURN_NOT_OK(scan_builder->Project(std::vector<std::string>(columns.begin(), columns.end())));
+    ARROW_RETURN_NOT_OK(scan_builder->UseThreads(true));
+    ARROW_ASSIGN_OR_RAISE(auto scanner, scan_builder->Finish());
+    ARROW_ASSIGN_OR_RAISE(auto batches, scanner->ScanBatches());
+    while (true)
+    {
+        ARROW_ASSIGN_OR_RAISE(auto tagged, batches.Next());
+        if (arrow::IsIterationEnd(tagged))
+            break;
+        for (size_t i = 0; i < aggregates.size(); ++i)
+        {
+            ARROW_RETURN_NOT_OK((*states)[i].Consume(aggregates[i], *tagged.record_batch));
+        }
+    }
+    return arrow::Status::OK();
+}
+
+/**
+ * @brief 计算带过滤条件的COUNT(*)/MIN/MAX，能用元数据回答的部分不读数据页
+ *
+ * @param dataset FileSystemDataset，非parquet的文件整体扫描
+ * @param filter 过滤条件，literal(true)表示不过滤
+ * @param aggregates 聚合列表
+ * @return arrow::Result<MetadataAggregateResult>
+ */
+arrow::Result<MetadataAggregateResult> AggregateFromMetadata(const std::shared_ptr<arrow::dataset::Dataset> &dataset,
+                                                             const arrow::compute::Expression &filter,
+                                                             const std::vector<MetadataAggregate> &aggregates)
+{
+    if (dataset->type_name() != "filesystem")
+    {
+        return arrow::Status::NotImplemented("Metadata aggregation needs a FileSystemDataset, got ",
+                                             dataset->type_name());
+    }
+    auto fs_dataset = arrow::internal::checked_pointer_cast<arrow::dataset::FileSystemDataset>(dataset);
+    auto schema = dataset->schema();
+    std::vector<std::shared_ptr<arrow::DataType>> types;
+    for (const auto &aggregate : aggregates)
+    {
+        if (aggregate.kind == MetadataAggregateKind::kCount)
+        {
+            types.push_back(arrow::int64());
+            continue;
+        }
+        auto field = schema->GetFieldByName(aggregate.column);
+        if (field == nullptr)
+        {
+            return arrow::Status::KeyError("Column ", aggregate.column, " is not in the dataset schema");
+        }
+        types.push_back(field->type());
+    }
+    ARROW_ASSIGN_OR_RAISE(auto bound_filter, filter.Bind(*schema));
+
+    MetadataAggregateResult result;
+    std::vector<MetadataAggregateState> states(aggregates.size());
+    arrow::dataset::FragmentVector to_scan;
+    ARROW_ASSIGN_OR_RAISE(auto fragments, fs_dataset->GetFragments());
+    for (const auto &maybe_fragment : fragments)
+    {
+        ARROW_ASSIGN_OR_RAISE(auto fragment, maybe_fragment);
+        ++result.stats.files;
+        ARROW_ASSIGN_OR_RAISE(auto file_filter,
+                              arrow::compute::SimplifyWithGuarantee(bound_filter, fragment->partition_expression()));
+        if (file_filter == arrow::compute::literal(false))
+        {
+            ++result.stats.files_pruned;
+            continue;
+        }
+        if (fragment->type_name() != "parquet")
+        {
+            to_scan.push_back(fragment);
+            continue;
+        }
+
+        auto parquet_fragment = arrow::internal::checked_pointer_cast<arrow::dataset::ParquetFileFragment>(fragment);
+        ARROW_RETURN_NOT_OK(parquet_fragment->EnsureCompleteMetadata());
+        auto metadata = parquet_fragment->metadata();
+        ARROW_ASSIGN_OR_RAISE(auto physical_schema, parquet_fragment->ReadPhysicalSchema());
+        bool flat = physical_schema->num_fields() == metadata->num_columns(); // 嵌套类型时列号与字段号对不上
+        ARROW_ASSIGN_OR_RAISE(auto known, arrow::compute::ExtractKnownFieldValues(fragment->partition_expression()));
+
+        std::vector<int> row_groups = parquet_fragment->row_groups();
+        if (row_groups.empty())
+        {
+            row_groups.resize(metadata->num_row_groups());
+            std::iota(row_groups.begin(), row_groups.end(), 0);
+        }
+        std::vector<int> partial;
+        for (int row_group : row_groups)
+        {
+            ++result.stats.row_groups;
+            int64_t num_rows = metadata->RowGroup(row_group)->num_rows();
+            ARROW_ASSIGN_OR_RAISE(auto guarantee, RowGroupsStatisticsGuarantee(*metadata, *physical_schema,
+                                                                               row_group, row_group + 1));
+            ARROW_ASSIGN_OR_RAISE(auto row_group_filter, arrow::compute::SimplifyWithGuarantee(file_filter, guarantee));
+            if (row_group_filter == arrow::compute::literal(false))
+            {
+                ++result.stats.row_groups_pruned;
+                continue;
+            }
+
+            // 所有聚合都能从元数据得到时才算回答了这个row group
+            bool answered = row_group_filter == arrow::compute::literal(true);
+            arrow::ScalarVector candidates(aggregates.size());
+            for (size_t i = 0; answered && i < aggregates.size(); ++i)
+            {
+                if (aggregates[i].kind == MetadataAggregateKind::kCount)
+                    continue;
+                auto value = known.map.find(arrow::FieldRef(aggregates[i].column));
+                if (value != known.map.end())
+                {
+                    if (value->second.scalar()->is_valid)
+                        candidates[i] = value->second.scalar();
+                    continue;
+                }
+                int column = physical_schema->GetFieldIndex(aggregates[i].column);
+                if (!flat || column < 0)
+                {
+                    answered = false;
+                    break;
+                }
+                std::shared_ptr<arrow::Scalar> min, max;
+                ARROW_ASSIGN_OR_RAISE(answered, RowGroupMinMax(*metadata, row_group, column,
+                                                               physical_schema->field(column)->type(), &min, &max));
+                candidates[i] = aggregates[i].kind == MetadataAggregateKind::kMin ? min : max;
+            }
+            if (!answered)
+            {
+                partial.push_back(row_group);
+                ++result.stats.row_groups_scanned;
+                result.stats.rows_scanned += num_rows;
+                continue;
+            }
+
+            ++result.stats.row_groups_answered;
+            for (size_t i = 0; i < aggregates.size(); ++i)
+            {
+                states[i].count += num_rows;
+                if (candidates[i] != nullptr)
+                    states[i].candidates.push_back(candidates[i]);
+            }
+        }
+        if (!partial.empty())
+        {
+            ARROW_ASSIGN_OR_RAISE(auto subset, parquet_fragment->Subset(partial));
+            to_scan.push_back(subset);
+        }
+    }
+
+    if (!to_scan.empty())
+    {
+        ARROW_RETURN_NOT_OK(ScanRemainingRowGroups(fs_dataset, to_scan, filter, aggregates, &states));
+    }
+    for (size_t i = 0; i < aggregates.size(); ++i)
+    {
+        ARROW_ASSIGN_OR_RAISE(auto value, states[i].Finish(aggregates[i], types[i]));
+        result.values.push_back(value);
+    }
+    return result;
+}
+
+#endif
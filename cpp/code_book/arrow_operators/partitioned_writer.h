@@ -0,0 +1,596 @@
+#ifndef PARTITIONED_WRITER_H
+#define PARTITIONED_WRITER_H
+
+#include <arrow/api.h>
+#include <arrow/io/api.h>
+#include <arrow/result.h>
+#include <arrow/status.h>
+#include <arrow/compute/api.h>
+#include <arrow/compute/exec.h>
+#include <arrow/filesystem/api.h>
+#include <arrow/util/byte_size.h>
+#include <arrow/util/thread_pool.h>
+#include <parquet/arrow/writer.h>
+#include <parquet/properties.h>
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * 并行的Hive分区写入器：
+ * - 每个分区先在内存中缓冲到partition_buffer_bytes，再作为一个完整的row group交给线程池写出；
+ * - 所有分区的缓冲加上正在写的数据不超过max_buffered_bytes，超过时先把最大的分区写出，
+ *   仍然超过就阻塞Write等待写线程，峰值内存由这个参数决定；
+ * - 每个batch用Grouper一次算出所有行的分区编号，再按分区Take出各自的切片，不逐行拼目录名；
+ * - 同时打开的文件数不超过max_open_files，超过时关闭最久没写的文件，该分区之后再写会开新文件；
+ *   打开的文件都正在被其他线程写时，等其中一个写完再关闭它；
+ * - max_rows_per_file大于0时，文件写满后换新文件。
+ * 同一个分区的row group按提交顺序串行写入，不同分区并行写入。
+ */
+
+/**
+ * @brief 分区写入参数
+ *
+ */
+struct PartitionedWriterOptions
+{
+    std::shared_ptr<arrow::fs::FileSystem> filesystem;
+    std::string base_dir;
+    std::vector<std::string> partition_columns;    // 按这些列生成key=value目录
+    int64_t partition_buffer_bytes = 8 << 20;      // 每个分区攒够这么多字节写一个row group
+    int64_t max_buffered_bytes = 256 << 20;        // 缓冲和正在写的数据总量上限
+    int max_open_files = 64;
+    int64_t max_rows_per_file = 0;                 // 0表示不限制
+    int num_threads = static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+    std::string basename_prefix = "part";          // 文件名为<prefix>-<序号>.parquet
+    std::shared_ptr<parquet::WriterProperties> writer_properties = parquet::default_writer_properties();
+    std::function<arrow::Status(const std::string &path)> post_finish; // 每个文件关闭后调用
+};
+
+/**
+ * @brief 写入统计
+ *
+ */
+struct PartitionedWriteStats
+{
+    int64_t rows = 0;
+    int64_t partitions = 0;
+    int64_t files = 0;
+    int64_t row_groups = 0;
+    int64_t evicted_files = 0;   // 因为打开文件数上限被提前关闭的文件
+    int64_t open_file_waits = 0; // 打开的文件都在写、等待其中一个写完的次数
+    int64_t peak_buffered_bytes = 0;
+
+    std::string ToString() const
+    {
+        return "rows=" + std::to_string(rows) + " partitions=" + std::to_string(partitions) +
+               " files=" + std::to_string(files) + " row_groups=" + std::to_string(row_groups) +
+               " evicted_files=" + std::to_string(evicted_files) +
+               " open_file_waits=" + std::to_string(open_file_waits) +
+               " peak_buffered_bytes=" + std::to_string(peak_buffered_bytes);
+    }
+};
+
+class PartitionedWriter
+{
+public:
+    /**
+     * @brief 创建写入器
+     *
+     * @param schema 输入数据的schema（包含分区列）
+     * @param options
+     * @return arrow::Result<std::shared_ptr<PartitionedWriter>>
+     */
+    static arrow::Result<std::shared_ptr<PartitionedWriter>> Make(const std::shared_ptr<arrow::Schema> &schema,
+                                                                  PartitionedWriterOptions options)
+    {
+        if (options.filesystem == nullptr || options.partition_columns.empty())
+        {
+            return arrow::Status::Invalid("PartitionedWriter requires a filesystem and partition columns");
+        }
+        if (options.max_open_files < 1)
+        {
+            return arrow::Status::Invalid("max_open_files must be positive, got ", options.max_open_files);
+        }
+        std::shared_ptr<PartitionedWriter> writer(new PartitionedWriter());
+        std::vector<std::shared_ptr<arrow::Field>> data_fields;
+        for (const auto &name : options.partition_columns)
+        {
+            int index = schema->GetFieldIndex(name);
+            if (index < 0)
+            {
+                return arrow::Status::Invalid("No partition column named ", name);
+            }
+            writer->partition_indices_.push_back(index);
+        }
+        for (int i = 0; i < schema->num_fields(); ++i)
+        {
+            // 分区列的值已经体现在目录名里，不写进文件
+            if (std::find(writer->partition_indices_.begin(), writer->partition_indices_.end(), i) ==
+                writer->partition_indices_.end())
+            {
+                writer->data_indices_.push_back(i);
+                data_fields.push_back(schema->field(i));
+            }
+        }
+        writer->data_schema_ = arrow::schema(data_fields);
+        ARROW_ASSIGN_OR_RAISE(writer->pool_, arrow::internal::ThreadPool::Make(options.num_threads));
+        writer->options_ = std::move(options);
+        return writer;
+    }
+
+    ~PartitionedWriter()
+    {
+        if (!closed_)
+        {
+            Close().Warn();
+        }
+    }
+
+    /**
+     * @brief 写入一个batch，按分区拆开后进入各分区的缓冲。只能在一个线程中调用
+     *
+     */
+    arrow::Status Write(const std::shared_ptr<arrow::RecordBatch> &batch)
+    {
+        ARROW_RETURN_NOT_OK(FirstError());
+        std::vector<arrow::Datum> keys;
+        for (int index : partition_indices_)
+        {
+            keys.emplace_back(batch->column(index));
+        }
+        arrow::compute::ExecBatch key_batch(keys, batch->num_rows());
+        if (grouper_ == nullptr)
+        {
+            ARROW_ASSIGN_OR_RAISE(grouper_, arrow::compute::internal::Grouper::Make(key_batch.GetDescriptors()));
+        }
+        // 分区编号在整个写入过程中不变，新出现的编号才需要拼目录名
+        ARROW_ASSIGN_OR_RAISE(auto ids, grouper_->Consume(key_batch));
+        ARROW_RETURN_NOT_OK(AddNewPartitions());
+        ARROW_ASSIGN_OR_RAISE(auto groupings, arrow::compute::internal::Grouper::MakeGroupings(
+                                                  *ids.array_as<arrow::UInt32Array>(), grouper_->num_groups()));
+        stats_.rows += batch->num_rows();
+
+        std::shared_ptr<arrow::RecordBatch> data = DataColumns(batch);
+        for (int64_t group = 0; group < groupings->length(); ++group)
+        {
+            int64_t rows = groupings->value_length(group);
+            if (rows == 0)
+                continue;
+            std::shared_ptr<arrow::RecordBatch> part = data;
+            if (rows < batch->num_rows())
+            {
+                ARROW_ASSIGN_OR_RAISE(auto taken, arrow::compute::Take(data, groupings->value_slice(group)));
+                part = taken.record_batch();
+            }
+            Partition *partition = partition_by_group_[group];
+            int64_t bytes = arrow::util::TotalBufferSize(*part);
+            partition->buffer.push_back(part);
+            partition->buffer_bytes += bytes;
+            buffered_bytes_ += bytes;
+            if (partition->buffer_bytes >= options_.partition_buffer_bytes)
+            {
+                ARROW_RETURN_NOT_OK(Submit(partition));
+            }
+        }
+        return ApplyBackpressure();
+    }
+
+    /**
+     * @brief 写出所有缓冲，等待写线程结束并关闭所有文件
+     *
+     */
+    arrow::Status Close()
+    {
+        if (closed_)
+            return FirstError();
+        closed_ = true;
+        for (const auto &partition : partitions_)
+        {
+            if (!partition.second->buffer.empty())
+            {
+                RecordError(Submit(partition.second.get()));
+            }
+        }
+        {
+            std::unique_lock<std::mutex> lock(progress_mutex_);
+            progress_.wait(lock, [this]() { return active_drains_ == 0; });
+        }
+        for (const auto &partition : partitions_)
+        {
+            std::lock_guard<std::mutex> file_lock(partition.second->file_mutex);
+            RecordError(CloseFile(partition.second.get(), false));
+        }
+        open_files_.clear();
+        RecordError(pool_->Shutdown());
+        stats_.partitions = static_cast<int64_t>(partitions_.size());
+        stats_.files = files_.load();
+        stats_.row_groups = row_groups_.load();
+        stats_.evicted_files = evicted_files_.load();
+        stats_.open_file_waits = open_file_waits_.load();
+        return FirstError();
+    }
+
+    // Close之后才完整
+    const PartitionedWriteStats &stats() const { return stats_; }
+
+private:
+    struct Partition
+    {
+        std::string dir;
+
+        // 以下只在调用Write的线程中访问
+        std::vector<std::shared_ptr<arrow::RecordBatch>> buffer;
+        int64_t buffer_bytes = 0;
+
+        // 待写的row group队列，scheduled表示已经有线程在写这个分区
+        std::mutex queue_mutex;
+        std::deque<std::pair<std::shared_ptr<arrow::Table>, int64_t>> queue;
+        bool scheduled = false;
+
+        // 当前打开的文件，由file_mutex保护；in_lru由lru_mutex_保护
+        std::mutex file_mutex;
+        std::shared_ptr<arrow::io::OutputStream> output;
+        std::unique_ptr<parquet::arrow::FileWriter> writer;
+        std::string path;
+        int64_t file_rows = 0;
+        bool in_lru = false;
+        std::list<Partition *>::iterator lru_it;
+    };
+
+    PartitionedWriter() = default;
+
+    arrow::Status FirstError()
+    {
+        std::lock_guard<std::mutex> lock(error_mutex_);
+        return first_error_;
+    }
+
+    void RecordError(const arrow::Status &status)
+    {
+        if (status.ok())
+            return;
+        std::lock_guard<std::mutex> lock(error_mutex_);
+        if (first_error_.ok())
+            first_error_ = status;
+    }
+
+    /**
+     * @brief 为Grouper新分配的分区编号建立分区，目录形如base_dir/col1=v1/col2=v2
+     *
+     */
+    arrow::Status AddNewPartitions()
+    {
+        if (grouper_->num_groups() == partition_by_group_.size())
+            return arrow::Status::OK();
+        ARROW_ASSIGN_OR_RAISE(auto uniques, grouper_->GetUniques());
+        for (uint32_t group = static_cast<uint32_t>(partition_by_group_.size()); group < grouper_->num_groups(); ++group)
+        {
+            std::string dir = options_.base_dir;
+            for (size_t k = 0; k < partition_indices_.size(); ++k)
+            {
+                ARROW_ASSIGN_OR_RAISE(auto value, PartitionValue(*uniques.values[k].make_array(), group));
+                dir += "/" + options_.partition_columns[k] + "=" + value;
+            }
+            partition_by_group_.push_back(GetPartition(dir));
+        }
+        return arrow::Status::OK();
+    }
+
+    static arrow::Result<std::string> PartitionValue(const arrow::Array &column, int64_t i)
+    {
+        std::string value;
+        if (column.IsNull(i))
+        {
+            value = "__HIVE_DEFAULT_PARTITION__"; // 与HivePartitioning的空值约定一致
+        }
+        else if (column.type_id() == arrow::Type::STRING)
+        {
+            value = static_cast<const arrow::StringArray &>(column).GetString(i);
+        }
+        else if (column.type_id() == arrow::Type::INT64)
+        {
+            value = std::to_string(static_cast<const arrow::Int64Array &>(column).Value(i));
+        }
+        else if (column.type_id() == arrow::Type::INT32)
+        {
+            value = std::to_string(static_cast<const arrow::Int32Array &>(column).Value(i));
+        }
+        else
+        {
+            ARROW_ASSIGN_OR_RAISE(auto scalar, column.GetScalar(i));
+            value = scalar->ToString();
+        }
+        if (value.empty() || value.find('/') != std::string::npos)
+        {
+            return arrow::Status::Invalid("Cannot use '", value, "' as a partition value");
+        }
+        return value;
+    }
+
+    std::shared_ptr<arrow::RecordBatch> DataColumns(const std::shared_ptr<arrow::RecordBatch> &batch) const
+    {
+        std::vector<std::shared_ptr<arrow::Array>> columns;
+        for (int index : data_indices_)
+        {
+            columns.push_back(batch->column(index));
+        }
+        return arrow::RecordBatch::Make(data_schema_, batch->num_rows(), columns);
+    }
+
+    Partition *GetPartition(const std::string &dir)
+    {
+        auto &partition = partitions_[dir];
+        if (partition == nullptr)
+        {
+            partition.reset(new Partition());
+            partition->dir = dir;
+        }
+        return partition.get();
+    }
+
+    /**
+     * @brief 把分区的缓冲作为一个row group放进写队列，必要时调度写线程
+     *
+     */
+    arrow::Status Submit(Partition *partition)
+    {
+        ARROW_ASSIGN_OR_RAISE(auto table, arrow::Table::FromRecordBatches(data_schema_, partition->buffer));
+        int64_t bytes = partition->buffer_bytes;
+        partition->buffer.clear();
+        partition->buffer_bytes = 0;
+        buffered_bytes_ -= bytes;
+        {
+            std::lock_guard<std::mutex> progress_lock(progress_mutex_);
+            in_flight_bytes_ += bytes;
+        }
+
+        std::lock_guard<std::mutex> lock(partition->queue_mutex);
+        partition->queue.emplace_back(table, bytes);
+        if (partition->scheduled)
+            return arrow::Status::OK();
+        partition->scheduled = true;
+        {
+            std::lock_guard<std::mutex> progress_lock(progress_mutex_);
+            ++active_drains_;
+        }
+        return pool_->Spawn([this, partition]() { Drain(partition); });
+    }
+
+    /**
+     * @brief 写线程：按顺序写完分区队列中的row group
+     *
+     */
+    void Drain(Partition *partition)
+    {
+        while (true)
+        {
+            std::pair<std::shared_ptr<arrow::Table>, int64_t> item;
+            {
+                std::lock_guard<std::mutex> lock(partition->queue_mutex);
+                if (partition->queue.empty())
+                {
+                    partition->scheduled = false;
+                    break;
+                }
+                item = partition->queue.front();
+                partition->queue.pop_front();
+            }
+            if (FirstError().ok())
+            {
+                RecordError(WriteRowGroups(partition, *item.first));
+                // 文件锁已经释放，唤醒等着关闭文件的线程；先拿lru_mutex_，不会错过正要开始等待的线程
+                {
+                    std::lock_guard<std::mutex> lock(lru_mutex_);
+                }
+                file_released_.notify_all();
+            }
+            std::lock_guard<std::mutex> progress_lock(progress_mutex_);
+            in_flight_bytes_ -= item.second;
+            progress_.notify_all();
+        }
+        std::lock_guard<std::mutex> progress_lock(progress_mutex_);
+        --active_drains_;
+        progress_.notify_all();
+    }
+
+    arrow::Status WriteRowGroups(Partition *partition, const arrow::Table &table)
+    {
+        std::lock_guard<std::mutex> file_lock(partition->file_mutex);
+        int64_t offset = 0;
+        while (offset < table.num_rows())
+        {
+            if (partition->writer == nullptr)
+            {
+                ARROW_RETURN_NOT_OK(OpenFile(partition));
+            }
+            else
+            {
+                TouchFile(partition);
+            }
+            int64_t length = table.num_rows() - offset;
+            if (options_.max_rows_per_file > 0)
+            {
+                length = std::min(length, options_.max_rows_per_file - partition->file_rows);
+            }
+            ARROW_RETURN_NOT_OK(partition->writer->WriteTable(*table.Slice(offset, length), length));
+            partition->file_rows += length;
+            offset += length;
+            ++row_groups_;
+            if (options_.max_rows_per_file > 0 && partition->file_rows >= options_.max_rows_per_file)
+            {
+                ARROW_RETURN_NOT_OK(CloseFile(partition, true));
+            }
+        }
+        return arrow::Status::OK();
+    }
+
+    /**
+     * @brief 为分区打开新文件，打开文件数达到上限时关闭最久没写、且当前没有在写的文件
+     *
+     * 打开的文件都在写时等待其中一个写完，不超过上限。等待的线程自己的分区没有打开的文件，
+     * 不在open_files_里，持有这些文件锁的线程不会反过来等它。调用前需持有partition->file_mutex
+     */
+    arrow::Status OpenFile(Partition *partition)
+    {
+        Partition *victim = nullptr;
+        int64_t file_id;
+        {
+            std::unique_lock<std::mutex> lock(lru_mutex_);
+            while (static_cast<int>(open_files_.size()) >= options_.max_open_files)
+            {
+                for (auto it = open_files_.rbegin(); it != open_files_.rend(); ++it)
+                {
+                    // 只尝试加锁，正在写的文件跳过，不会和其他写线程互相等待
+                    if ((*it)->file_mutex.try_lock())
+                    {
+                        victim = *it;
+                        open_files_.erase(victim->lru_it);
+                        victim->in_lru = false;
+                        break;
+                    }
+                }
+                if (victim != nullptr)
+                    break;
+                ++open_file_waits_;
+                file_released_.wait(lock);
+            }
+            open_files_.push_front(partition);
+            partition->lru_it = open_files_.begin();
+            partition->in_lru = true;
+            file_id = next_file_id_++;
+        }
+        if (victim != nullptr)
+        {
+            auto status = CloseFile(victim, false);
+            victim->file_mutex.unlock();
+            ++evicted_files_;
+            ARROW_RETURN_NOT_OK(status);
+        }
+
+        ARROW_RETURN_NOT_OK(options_.filesystem->CreateDir(partition->dir));
+        partition->path = partition->dir + "/" + options_.basename_prefix + "-" + std::to_string(file_id) + ".parquet";
+        ARROW_ASSIGN_OR_RAISE(partition->output, options_.filesystem->OpenOutputStream(partition->path));
+        auto arrow_properties = parquet::ArrowWriterProperties::Builder().store_schema()->build();
+        ARROW_RETURN_NOT_OK(parquet::arrow::FileWriter::Open(*data_schema_, arrow::default_memory_pool(),
+                                                             partition->output, options_.writer_properties,
+                                                             arrow_properties, &partition->writer));
+        partition->file_rows = 0;
+        return arrow::Status::OK();
+    }
+
+    void TouchFile(Partition *partition)
+    {
+        std::lock_guard<std::mutex> lock(lru_mutex_);
+        if (partition->in_lru)
+        {
+            open_files_.splice(open_files_.begin(), open_files_, partition->lru_it);
+        }
+    }
+
+    /**
+     * @brief 关闭分区当前的文件。调用前需持有partition->file_mutex
+     *
+     */
+    arrow::Status CloseFile(Partition *partition, bool remove_from_lru)
+    {
+        if (remove_from_lru)
+        {
+            std::lock_guard<std::mutex> lock(lru_mutex_);
+            if (partition->in_lru)
+            {
+                open_files_.erase(partition->lru_it);
+                partition->in_lru = false;
+            }
+        }
+        if (partition->writer == nullptr)
+            return arrow::Status::OK();
+        ARROW_RETURN_NOT_OK(partition->writer->Close());
+        ARROW_RETURN_NOT_OK(partition->output->Close());
+        partition->writer.reset();
+        partition->output.reset();
+        ++files_;
+        if (options_.post_finish)
+        {
+            return options_.post_finish(partition->path);
+        }
+        return arrow::Status::OK();
+    }
+
+    /**
+     * @brief 缓冲加正在写的数据超过上限时，先写出最大的分区，写线程来不及时阻塞等待
+     *
+     */
+    arrow::Status ApplyBackpressure()
+    {
+        while (true)
+        {
+            int64_t in_flight;
+            {
+                std::lock_guard<std::mutex> lock(progress_mutex_);
+                in_flight = in_flight_bytes_;
+            }
+            stats_.peak_buffered_bytes = std::max(stats_.peak_buffered_bytes, buffered_bytes_ + in_flight);
+            if (buffered_bytes_ + in_flight <= options_.max_buffered_bytes)
+                return FirstError();
+            if (buffered_bytes_ > options_.max_buffered_bytes / 2 || in_flight == 0)
+            {
+                Partition *largest = nullptr;
+                for (const auto &partition : partitions_)
+                {
+                    if (largest == nullptr || partition.second->buffer_bytes > largest->buffer_bytes)
+                        largest = partition.second.get();
+                }
+                if (largest == nullptr || largest->buffer_bytes == 0)
+                    return FirstError();
+                ARROW_RETURN_NOT_OK(Submit(largest));
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(progress_mutex_);
+            progress_.wait(lock, [this, in_flight]() { return in_flight_bytes_ < in_flight; });
+            ARROW_RETURN_NOT_OK(FirstError());
+        }
+    }
+
+    PartitionedWriterOptions options_;
+    std::vector<int> partition_indices_;
+    std::vector<int> data_indices_;
+    std::shared_ptr<arrow::Schema> data_schema_;
+    std::shared_ptr<arrow::internal::ThreadPool> pool_;
+    std::unordered_map<std::string, std::unique_ptr<Partition>> partitions_;
+    std::unique_ptr<arrow::compute::internal::Grouper> grouper_; // 分区列的值 -> 分区编号
+    std::vector<Partition *> partition_by_group_;
+    int64_t buffered_bytes_ = 0;
+    bool closed_ = false;
+
+    std::mutex progress_mutex_;
+    std::condition_variable progress_;
+    int64_t in_flight_bytes_ = 0; // 由progress_mutex_保护
+    int active_drains_ = 0;       // 由progress_mutex_保护
+
+    std::mutex lru_mutex_;
+    std::condition_variable file_released_; // 有写线程写完一批、释放了文件锁
+    std::list<Partition *> open_files_; // 最近写过的在前
+    int64_t next_file_id_ = 0;
+
+    std::mutex error_mutex_;
+    arrow::Status first_error_;
+
+    std::atomic<int64_t> files_{0};
+    std::atomic<int64_t> row_groups_{0};
+    std::atomic<int64_t> evicted_files_{0};
+    std::atomic<int64_t> open_file_waits_{0};
+    PartitionedWriteStats stats_;
+};
+
+#endif
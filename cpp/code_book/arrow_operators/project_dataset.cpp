@@ -19,6 +19,8 @@
 using namespace std;
 
 #include "common.h"
+#include "scan_stream.h"
+#include "dataset_catalog.h"
 
 #define DATASET_NAME "slice"
 
@@ -28,19 +30,16 @@ using namespace std;
  * @param filesystem
  * @param format
  * @param base_dir
- * @return arrow::Result<std::shared_ptr<arrow::Table>>
+ * @param options 流式扫描参数
+ * @return arrow::Result<std::shared_ptr<arrow::dataset::Scanner>> 用ScanToReader或VisitScan流式读取
  */
-arrow::Result<std::shared_ptr<arrow::Table>> ProjectDataset(
+arrow::Result<std::shared_ptr<arrow::dataset::Scanner>> ProjectDataset(
     const std::shared_ptr<arrow::fs::FileSystem> &filesystem,
-    const std::shared_ptr<arrow::dataset::FileFormat> &format, const std::string &base_dir)
+    const std::shared_ptr<arrow::dataset::FileFormat> &format, const std::string &base_dir,
+    const ScanStreamOptions &options = ScanStreamOptions())
 {
     // 扫描获取文件
-    arrow::fs::FileSelector selector;
-    selector.base_dir = base_dir;
-    ARROW_ASSIGN_OR_RAISE(
-        auto factory, arrow::dataset::FileSystemDatasetFactory::Make(filesystem, selector, format,
-                                                                     arrow::dataset::FileSystemFactoryOptions()));
-    ARROW_ASSIGN_OR_RAISE(auto dataset, factory->Finish());
+    ARROW_ASSIGN_OR_RAISE(auto dataset, DiscoverDataset(filesystem, format, base_dir));
 
     // 映射获取数据集
     ARROW_ASSIGN_OR_RAISE(auto scan_builder, dataset->NewScan());
@@ -56,21 +55,17 @@ arrow::Result<std::shared_ptr<arrow::Table>> ProjectDataset(
                                               // 列名
                                               {"a_renamed", "b_as_float32", "c_1"}));
 
-    ARROW_ASSIGN_OR_RAISE(auto scanner, scan_builder->Finish());
-    return scanner->ToTable();
+    ARROW_RETURN_NOT_OK(ApplyScanStreamOptions(*scan_builder, options));
+    return scan_builder->Finish();
 }
 
-arrow::Result<std::shared_ptr<arrow::Table>> SelectAndProjectDataset(
+arrow::Result<std::shared_ptr<arrow::dataset::Scanner>> SelectAndProjectDataset(
     const std::shared_ptr<arrow::fs::FileSystem> &filesystem,
-    const std::shared_ptr<arrow::dataset::FileFormat> &format, const std::string &base_dir)
+    const std::shared_ptr<arrow::dataset::FileFormat> &format, const std::string &base_dir,
+    const ScanStreamOptions &options = ScanStreamOptions())
 {
     // 扫描获取文件
-    arrow::fs::FileSelector selector;
-    selector.base_dir = base_dir;
-    ARROW_ASSIGN_OR_RAISE(
-        auto factory, arrow::dataset::FileSystemDatasetFactory::Make(filesystem, selector, format,
-                                                                     arrow::dataset::FileSystemFactoryOptions()));
-    ARROW_ASSIGN_OR_RAISE(auto dataset, factory->Finish());
+    ARROW_ASSIGN_OR_RAISE(auto dataset, DiscoverDataset(filesystem, format, base_dir));
 
     // 映射获取数据集
     ARROW_ASSIGN_OR_RAISE(auto scan_builder, dataset->NewScan());
@@ -87,8 +82,8 @@ arrow::Result<std::shared_ptr<arrow::Table>> SelectAndProjectDataset(
     exprs.push_back(arrow::compute::greater(arrow::compute::field_ref("b"), arrow::compute::literal(1)));
 
     ARROW_RETURN_NOT_OK(scan_builder->Project(exprs, names));
-    ARROW_ASSIGN_OR_RAISE(auto scanner, scan_builder->Finish());
-    return scanner->ToTable();
+    ARROW_RETURN_NOT_OK(ApplyScanStreamOptions(*scan_builder, options));
+    return scan_builder->Finish();
 }
 
 arrow::Status func()
@@ -102,20 +97,15 @@ arrow::Status func()
 
     ARROW_ASSIGN_OR_RAISE(auto fs, arrow::fs::FileSystemFromUri(uri, &root_path));
 
+    ScanStreamOptions options;
     {
-        std::shared_ptr<arrow::Table> table;
-        ARROW_ASSIGN_OR_RAISE(table, ProjectDataset(fs, format, base_path));
-
-        std::cout << "Read " << table->num_rows() << " rows" << std::endl;
-        std::cout << table->ToString() << std::endl;
+        ARROW_ASSIGN_OR_RAISE(auto scanner, ProjectDataset(fs, format, base_path, options));
+        ARROW_RETURN_NOT_OK(PrintScan(scanner, options));
     }
 
     {
-        std::shared_ptr<arrow::Table> table;
-        ARROW_ASSIGN_OR_RAISE(table, SelectAndProjectDataset(fs, format, base_path));
-
-        std::cout << "Read " << table->num_rows() << " rows" << std::endl;
-        std::cout << table->ToString() << std::endl;
+        ARROW_ASSIGN_OR_RAISE(auto scanner, SelectAndProjectDataset(fs, format, base_path, options));
+        ARROW_RETURN_NOT_OK(PrintScan(scanner, options));
     }
     return arrow::Status::OK();
 }
@@ -17,6 +17,9 @@
 using namespace std;
 
 #include "common.h"
+#include "scan_stream.h"
+#include "dataset_catalog.h"
+#include "../flight_speed_test/secondary_index.h"
 
 #define DATASET_NAME "partition"
 
@@ -26,21 +29,19 @@ using namespace std;
  * @param filesystem
  * @param format
  * @param base_dir
- * @return arrow::Result<std::shared_ptr<arrow::Table>>
+ * @param options 流式扫描参数
+ * @return arrow::Result<std::shared_ptr<arrow::dataset::Scanner>> 用ScanToReader或VisitScan流式读取
  */
-arrow::Result<std::shared_ptr<arrow::Table>> ScanPartitionedDataset(
+arrow::Result<std::shared_ptr<arrow::dataset::Scanner>> ScanPartitionedDataset(
     const std::shared_ptr<arrow::fs::FileSystem> &filesystem,
-    const std::shared_ptr<arrow::dataset::FileFormat> &format, const std::string &base_dir)
+    const std::shared_ptr<arrow::dataset::FileFormat> &format, const std::string &base_dir,
+    const ScanStreamOptions &options = ScanStreamOptions())
 {
-    arrow::fs::FileSelector selector;
-    selector.base_dir = base_dir;
-    selector.recursive = true; // 确保扫描子目录
-    arrow::dataset::FileSystemFactoryOptions options;
+    arrow::dataset::FileSystemFactoryOptions factory_options;
     // 使用Hive-style分区方式。我们让Arrow Dataset推断出分区方式
-    options.partitioning = arrow::dataset::HivePartitioning::MakeFactory();
-    ARROW_ASSIGN_OR_RAISE(auto factory, arrow::dataset::FileSystemDatasetFactory::Make(
-                                            filesystem, selector, format, options));
-    ARROW_ASSIGN_OR_RAISE(auto dataset, factory->Finish());
+    factory_options.partitioning = arrow::dataset::HivePartitioning::MakeFactory();
+    // 目录缓存会递归检查子目录，分区文件很多时只有变化的分区目录会被重新列出
+    ARROW_ASSIGN_OR_RAISE(auto dataset, DiscoverDataset(filesystem, format, base_dir, factory_options));
 
     // 输出fragments
     ARROW_ASSIGN_OR_RAISE(auto fragments, dataset->GetFragments());
@@ -55,8 +56,8 @@ arrow::Result<std::shared_ptr<arrow::Table>> ScanPartitionedDataset(
     // 我们使用filter过滤一些条件，下面的条件是取part=b的数据，这也就意味着，不会读取part!=b的文件。
     ARROW_RETURN_NOT_OK(scan_builder->Filter(arrow::compute::equal(arrow::compute::field_ref("part"), arrow::compute::literal("b"))));
 
-    ARROW_ASSIGN_OR_RAISE(auto scanner, scan_builder->Finish());
-    return scanner->ToTable();
+    ARROW_RETURN_NOT_OK(ApplyScanStreamOptions(*scan_builder, options));
+    return scan_builder->Finish();
 }
 
 arrow::Status func()
@@ -70,10 +71,24 @@ arrow::Status func()
 
     ARROW_ASSIGN_OR_RAISE(auto fs, arrow::fs::FileSystemFromUri(uri, &root_path));
 
-    std::shared_ptr<arrow::Table> table;
-    ARROW_ASSIGN_OR_RAISE(table, ScanPartitionedDataset(fs, format, base_path));
+    // 分区数据集可能很大，按batch流式读取，不要ToTable
+    ScanStreamOptions options;
+    options.fragment_readahead = 4; // 每个分区目录下文件较多时可以多预读几个
+    ARROW_ASSIGN_OR_RAISE(auto scanner, ScanPartitionedDataset(fs, format, base_path, options));
 
-    std::cout << "Read " << table->num_rows() << " rows" << std::endl;
+    ARROW_RETURN_NOT_OK(PrintScan(scanner, options));
+
+    // 点查：通过make_partition_parquet生成的二级索引，直接定位到文件、row group和行号
+    ARROW_ASSIGN_OR_RAISE(auto index, SecondaryIndex::Open(fs, base_path, "a"));
+    ARROW_ASSIGN_OR_RAISE(auto entries, index->Lookup(std::string("7")));
+    for (const auto &entry : entries)
+    {
+        std::cout << "a=7 -> " << entry.fragment << " row_group=" << entry.row_group << " row=" << entry.row << std::endl;
+    }
+    // 分区列不在数据文件里，没有命中时按数据文件的schema返回空表
+    auto file_schema = scanner->options()->dataset_schema;
+    ARROW_ASSIGN_OR_RAISE(file_schema, file_schema->RemoveField(file_schema->GetFieldIndex("part")));
+    ARROW_ASSIGN_OR_RAISE(auto table, ReadIndexedRows(fs, base_path, entries, file_schema));
     std::cout << table->ToString() << std::endl;
     return arrow::Status::OK();
 }
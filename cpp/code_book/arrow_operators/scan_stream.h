@@ -0,0 +1,136 @@
+#ifndef SCAN_STREAM_H
+#define SCAN_STREAM_H
+
+#include <arrow/api.h>
+#include <arrow/result.h>
+#include <arrow/status.h>
+#include <arrow/dataset/scanner.h>
+
+#include <functional>
+#include <iostream>
+
+/**
+ * @brief 流式扫描的参数
+ *
+ * 同时预读fragment_readahead个文件，每个文件各自预读batch_readahead个batch，
+ * 内存占用大约是 fragment_readahead × batch_readahead 个batch（默认2×4=8个），与数据集大小无关
+ */
+struct ScanStreamOptions
+{
+    int64_t batch_size = 64 * 1024; // 每个batch的最大行数
+    int32_t fragment_readahead = 2; // 同时预读的文件数
+    int32_t batch_readahead = 4;    // 每个文件预读的batch数
+    bool use_threads = true;
+    bool ordered = true; // false时哪个batch先解码完就先交付，吞吐更高，但顺序不确定
+};
+
+/**
+ * @brief 把流式参数设置到ScannerBuilder上
+ *
+ * @param scan_builder
+ * @param options
+ * @return arrow::Status
+ */
+arrow::Status ApplyScanStreamOptions(arrow::dataset::ScannerBuilder &scan_builder, const ScanStreamOptions &options)
+{
+    ARROW_RETURN_NOT_OK(scan_builder.BatchSize(options.batch_size));
+    ARROW_RETURN_NOT_OK(scan_builder.FragmentReadahead(options.fragment_readahead));
+    ARROW_RETURN_NOT_OK(scan_builder.BatchReadahead(options.batch_readahead));
+    ARROW_RETURN_NOT_OK(scan_builder.UseThreads(options.use_threads));
+    return arrow::Status::OK();
+}
+
+/**
+ * @brief 不保证顺序的RecordBatchReader，包装ScanBatchesUnordered
+ *
+ */
+class UnorderedScanReader : public arrow::RecordBatchReader
+{
+public:
+    UnorderedScanReader(std::shared_ptr<arrow::Schema> schema, arrow::dataset::EnumeratedRecordBatchIterator iterator)
+        : schema_(std::move(schema)), iterator_(std::move(iterator)) {}
+
+    std::shared_ptr<arrow::Schema> schema() const override { return schema_; }
+
+    arrow::Status ReadNext(std::shared_ptr<arrow::RecordBatch> *batch) override
+    {
+        ARROW_ASSIGN_OR_RAISE(auto next, iterator_.Next());
+        if (arrow::IsIterationEnd(next))
+        {
+            *batch = nullptr;
+            return arrow::Status::OK();
+        }
+        *batch = std::move(next.record_batch.value);
+        return arrow::Status::OK();
+    }
+
+private:
+    std::shared_ptr<arrow::Schema> schema_;
+    arrow::dataset::EnumeratedRecordBatchIterator iterator_;
+};
+
+/**
+ * @brief 以RecordBatchReader的方式流式读取扫描结果，读完一个batch就可以丢弃一个
+ *
+ * @param scanner
+ * @param options
+ * @return arrow::Result<std::shared_ptr<arrow::RecordBatchReader>>
+ */
+arrow::Result<std::shared_ptr<arrow::RecordBatchReader>> ScanToReader(
+    const std::shared_ptr<arrow::dataset::Scanner> &scanner, const ScanStreamOptions &options)
+{
+    if (options.ordered)
+    {
+        return scanner->ToRecordBatchReader();
+    }
+    ARROW_ASSIGN_OR_RAISE(auto iterator, scanner->ScanBatchesUnordered());
+    return std::make_shared<UnorderedScanReader>(scanner->options()->projected_schema, std::move(iterator));
+}
+
+/**
+ * @brief 回调方式遍历扫描结果，visitor返回错误时停止扫描
+ *
+ * @param scanner
+ * @param options
+ * @param visitor
+ * @return arrow::Status
+ */
+arrow::Status VisitScan(const std::shared_ptr<arrow::dataset::Scanner> &scanner, const ScanStreamOptions &options,
+                        const std::function<arrow::Status(const std::shared_ptr<arrow::RecordBatch> &)> &visitor)
+{
+    ARROW_ASSIGN_OR_RAISE(auto reader, ScanToReader(scanner, options));
+    std::shared_ptr<arrow::RecordBatch> batch;
+    while (true)
+    {
+        ARROW_RETURN_NOT_OK(reader->ReadNext(&batch));
+        if (batch == nullptr)
+        {
+            break;
+        }
+        ARROW_RETURN_NOT_OK(visitor(batch));
+    }
+    return arrow::Status::OK();
+}
+
+/**
+ * @brief 逐个batch输出扫描结果，最后输出总行数
+ *
+ * @param scanner
+ * @param options
+ * @return arrow::Status
+ */
+arrow::Status PrintScan(const std::shared_ptr<arrow::dataset::Scanner> &scanner, const ScanStreamOptions &options)
+{
+    int64_t num_rows = 0;
+    auto visitor = [&num_rows](const std::shared_ptr<arrow::RecordBatch> &batch)
+    {
+        num_rows += batch->num_rows();
+        std::cout << batch->ToString() << std::endl;
+        return arrow::Status::OK();
+    };
+    ARROW_RETURN_NOT_OK(VisitScan(scanner, options, visitor));
+    std::cout << "Read " << num_rows << " rows" << std::endl;
+    return arrow::Status::OK();
+}
+
+#endif
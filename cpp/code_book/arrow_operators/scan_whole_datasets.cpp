@@ -18,6 +18,8 @@
 using namespace std;
 
 #include "common.h"
+#include "scan_stream.h"
+#include "dataset_catalog.h"
 
 #define DATASET_NAME "slice"
 
@@ -27,18 +29,21 @@ using namespace std;
  * @param filesystem
  * @param format 需要扫描的文件格式
  * @param base_dir
- * @return arrow::Result<std::shared_ptr<arrow::Table>>
+ * @param options 流式扫描参数
+ * @return arrow::Result<std::shared_ptr<arrow::dataset::Scanner>> 用ScanToReader或VisitScan流式读取
  */
-arrow::Result<std::shared_ptr<arrow::Table>> ScanWholeDataset(
+arrow::Result<std::shared_ptr<arrow::dataset::Scanner>> ScanWholeDataset(
     const std::shared_ptr<arrow::fs::FileSystem> &filesystem,
-    const std::shared_ptr<arrow::dataset::FileFormat> &format, const std::string &base_dir)
+    const std::shared_ptr<arrow::dataset::FileFormat> &format, const std::string &base_dir,
+    const ScanStreamOptions &options = ScanStreamOptions())
 {
     // 通过扫描路径获取dataset
     // 我们也要传递要使用的文件系统和要用于读取的文件格式。这让我们可以选择（例如）读取本地文件或Amazon S3中的文件，或在Parquet和CSV之间进行选择。
-    arrow::fs::FileSelector selector;
-    selector.base_dir = base_dir;
-    ARROW_ASSIGN_OR_RAISE(auto factory, arrow::dataset::FileSystemDatasetFactory::Make(filesystem, selector, format, arrow::dataset::FileSystemFactoryOptions()));
-    ARROW_ASSIGN_OR_RAISE(auto dataset, factory->Finish());
+    // 发现结果缓存在目录缓存里，重复扫描时只检查有变化的目录和文件
+    CatalogRefreshStats refresh_stats;
+    ARROW_ASSIGN_OR_RAISE(auto dataset, DiscoverDataset(filesystem, format, base_dir,
+                                                        arrow::dataset::FileSystemFactoryOptions(), &refresh_stats));
+    std::cout << "dataset catalog: " << refresh_stats.ToString() << std::endl;
 
     // 输出fragments，一个fragments可以代表一个数据集块？
     ARROW_ASSIGN_OR_RAISE(auto fragments, dataset->GetFragments())
@@ -47,7 +52,7 @@ arrow::Result<std::shared_ptr<arrow::Table>> ScanWholeDataset(
         std::cout << "发现 fragment: " << (*fragment)->ToString() << std::endl;
     }
 
-    // 读取整个路径下的数据文件，并放到一张Table里
+    // 读取整个路径下的数据文件，结果由调用方按batch流式读取，不会一次性放到一张Table里
     ARROW_ASSIGN_OR_RAISE(auto scan_builder, dataset->NewScan());
 
     // 可以设置读取方式？ TODO 没明白为啥没作用
@@ -55,8 +60,8 @@ arrow::Result<std::shared_ptr<arrow::Table>> ScanWholeDataset(
     // options->arrow_reader_properties->set_read_dictionary(0, true); // 第一行是dict
     // ARROW_RETURN_NOT_OK(scan_builder->FragmentScanOptions(options));
 
-    ARROW_ASSIGN_OR_RAISE(auto scanner, scan_builder->Finish());
-    return scanner->ToTable();
+    ARROW_RETURN_NOT_OK(ApplyScanStreamOptions(*scan_builder, options));
+    return scan_builder->Finish();
 }
 
 arrow::Status func()
@@ -70,11 +75,24 @@ arrow::Status func()
 
     ARROW_ASSIGN_OR_RAISE(auto fs, arrow::fs::FileSystemFromUri(uri, &root_path));
 
-    std::shared_ptr<arrow::Table> table;
-    ARROW_ASSIGN_OR_RAISE(table, ScanWholeDataset(fs, format, base_path));
+    ScanStreamOptions options;
+    ARROW_ASSIGN_OR_RAISE(auto scanner, ScanWholeDataset(fs, format, base_path, options));
 
-    std::cout << "Read " << table->num_rows() << " rows" << std::endl;
-    std::cout << table->ToString() << std::endl;
+    // 流式读取，同一时间只持有少量batch
+    ARROW_ASSIGN_OR_RAISE(auto reader, ScanToReader(scanner, options));
+    int64_t num_rows = 0;
+    std::shared_ptr<arrow::RecordBatch> batch;
+    while (true)
+    {
+        ARROW_RETURN_NOT_OK(reader->ReadNext(&batch));
+        if (batch == nullptr)
+        {
+            break;
+        }
+        num_rows += batch->num_rows();
+        std::cout << batch->ToString() << std::endl;
+    }
+    std::cout << "Read " << num_rows << " rows" << std::endl;
     return arrow::Status::OK();
 }
 
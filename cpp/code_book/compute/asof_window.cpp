@@ -0,0 +1,416 @@
+
+#include <arrow/api.h>
+#include <arrow/io/api.h>
+#include <arrow/result.h>
+#include <arrow/status.h>
+#include <arrow/type.h>
+#include <arrow/compute/api.h>
+#include <arrow/compute/exec/exec_plan.h>
+#include <arrow/compute/exec/options.h>
+#include <arrow/util/checked_cast.h>
+
+#include <iostream>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <unordered_map>
+using namespace std;
+
+#include "common.h"
+
+/**
+ * @brief 生成按时间排序的成交数据
+ *
+ * @param num_rows 行数
+ * @return 数据表(ts, inst, pri, qty)，ts为微秒时间戳，inst为合约编号
+ */
+arrow::Result<std::shared_ptr<arrow::Table>> CreateTimedTradeTable(int64_t num_rows)
+{
+    auto schema = arrow::schema({arrow::field("ts", arrow::int64()),
+                                 arrow::field("inst", arrow::int32()),
+                                 arrow::field("pri", arrow::float64()),
+                                 arrow::field("qty", arrow::int64())});
+    arrow::Int64Builder ts_builder, qty_builder;
+    arrow::Int32Builder inst_builder;
+    arrow::DoubleBuilder pri_builder;
+    for (int64_t i = 0; i < num_rows; ++i)
+    {
+        ARROW_RETURN_NOT_OK(ts_builder.Append(i * 1000 + 500));
+        ARROW_RETURN_NOT_OK(inst_builder.Append(static_cast<int32_t>(i % 3)));
+        ARROW_RETURN_NOT_OK(pri_builder.Append(10.0 + (i % 7) * 0.5));
+        ARROW_RETURN_NOT_OK(qty_builder.Append((i % 5 + 1) * 100));
+    }
+    std::vector<std::shared_ptr<arrow::Array>> arrays(4);
+    ARROW_RETURN_NOT_OK(ts_builder.Finish(&arrays[0]));
+    ARROW_RETURN_NOT_OK(inst_builder.Finish(&arrays[1]));
+    ARROW_RETURN_NOT_OK(pri_builder.Finish(&arrays[2]));
+    ARROW_RETURN_NOT_OK(qty_builder.Finish(&arrays[3]));
+    return arrow::Table::Make(schema, arrays);
+}
+
+/**
+ * @brief 生成按时间排序的报价数据，报价比成交稀疏
+ *
+ * @param num_rows 行数
+ * @return 数据表(ts, inst, bid, ask)
+ */
+arrow::Result<std::shared_ptr<arrow::Table>> CreateTimedQuoteTable(int64_t num_rows)
+{
+    auto schema = arrow::schema({arrow::field("ts", arrow::int64()),
+                                 arrow::field("inst", arrow::int32()),
+                                 arrow::field("bid", arrow::float64()),
+                                 arrow::field("ask", arrow::float64())});
+    arrow::Int64Builder ts_builder;
+    arrow::Int32Builder inst_builder;
+    arrow::DoubleBuilder bid_builder, ask_builder;
+    for (int64_t i = 0; i < num_rows; ++i)
+    {
+        ARROW_RETURN_NOT_OK(ts_builder.Append(i * 2000));
+        ARROW_RETURN_NOT_OK(inst_builder.Append(static_cast<int32_t>(i % 3)));
+        ARROW_RETURN_NOT_OK(bid_builder.Append(9.9 + (i % 7) * 0.5));
+        ARROW_RETURN_NOT_OK(ask_builder.Append(10.1 + (i % 7) * 0.5));
+    }
+    std::vector<std::shared_ptr<arrow::Array>> arrays(4);
+    ARROW_RETURN_NOT_OK(ts_builder.Finish(&arrays[0]));
+    ARROW_RETURN_NOT_OK(inst_builder.Finish(&arrays[1]));
+    ARROW_RETURN_NOT_OK(bid_builder.Finish(&arrays[2]));
+    ARROW_RETURN_NOT_OK(ask_builder.Finish(&arrays[3]));
+    return arrow::Table::Make(schema, arrays);
+}
+
+/**
+ * @brief 滑动窗口节点的参数
+ *
+ * 对每一行，统计同一by_key在(time - window, time]内target列的聚合值，追加为output_name列。
+ * 输入必须按time_key有序；每个key只缓存窗口内的行，缓存行数超过max_buffered_rows时报错。
+ */
+class SlidingWindowNodeOptions : public arrow::compute::ExecNodeOptions
+{
+public:
+    SlidingWindowNodeOptions(arrow::FieldRef time_key, arrow::FieldRef by_key, arrow::FieldRef target,
+                             int64_t window, std::string function, std::string output_name,
+                             int64_t max_buffered_rows = 1 << 20)
+        : time_key(std::move(time_key)), by_key(std::move(by_key)), target(std::move(target)),
+          window(window), function(std::move(function)), output_name(std::move(output_name)),
+          max_buffered_rows(max_buffered_rows) {}
+
+    arrow::FieldRef time_key; // int64
+    arrow::FieldRef by_key;   // int32
+    arrow::FieldRef target;   // float64或int64
+    int64_t window;
+    std::string function; // sum, mean, count
+    std::string output_name;
+    int64_t max_buffered_rows;
+};
+
+class SlidingWindowNode : public arrow::compute::ExecNode
+{
+public:
+    SlidingWindowNode(arrow::compute::ExecPlan *plan, std::vector<arrow::compute::ExecNode *> inputs,
+                      std::shared_ptr<arrow::Schema> output_schema,
+                      int time_index, int key_index, int target_index,
+                      const SlidingWindowNodeOptions &options)
+        : ExecNode(plan, std::move(inputs), {"target"}, std::move(output_schema), /*num_outputs=*/1),
+          time_index_(time_index), key_index_(key_index), target_index_(target_index),
+          window_(options.window), function_(options.function),
+          max_buffered_rows_(options.max_buffered_rows) {}
+
+    static arrow::Result<arrow::compute::ExecNode *> Make(arrow::compute::ExecPlan *plan,
+                                                          std::vector<arrow::compute::ExecNode *> inputs,
+                                                          const arrow::compute::ExecNodeOptions &options)
+    {
+        if (inputs.size() != 1)
+        {
+            return arrow::Status::Invalid("sliding_window requires exactly one input");
+        }
+        const auto &window_options = arrow::internal::checked_cast<const SlidingWindowNodeOptions &>(options);
+        if (window_options.window <= 0)
+        {
+            return arrow::Status::Invalid("sliding_window requires a positive window");
+        }
+        if (window_options.function != "sum" && window_options.function != "mean" &&
+            window_options.function != "count")
+        {
+            return arrow::Status::NotImplemented("sliding_window function ", window_options.function);
+        }
+
+        const auto &input_schema = inputs[0]->output_schema();
+        ARROW_ASSIGN_OR_RAISE(auto time_path, window_options.time_key.FindOne(*input_schema));
+        ARROW_ASSIGN_OR_RAISE(auto key_path, window_options.by_key.FindOne(*input_schema));
+        ARROW_ASSIGN_OR_RAISE(auto target_path, window_options.target.FindOne(*input_schema));
+        if (input_schema->field(time_path[0])->type()->id() != arrow::Type::INT64)
+        {
+            return arrow::Status::TypeError("sliding_window time key must be int64");
+        }
+        if (input_schema->field(key_path[0])->type()->id() != arrow::Type::INT32)
+        {
+            return arrow::Status::TypeError("sliding_window by key must be int32");
+        }
+        auto target_type = input_schema->field(target_path[0])->type()->id();
+        if (target_type != arrow::Type::DOUBLE && target_type != arrow::Type::INT64)
+        {
+            return arrow::Status::TypeError("sliding_window target must be float64 or int64");
+        }
+
+        // 输出为输入的所有列再加上窗口统计列
+        auto fields = input_schema->fields();
+        fields.push_back(arrow::field(window_options.output_name, arrow::float64()));
+        return plan->EmplaceNode<SlidingWindowNode>(plan, std::move(inputs), arrow::schema(fields),
+                                                    time_path[0], key_path[0], target_path[0], window_options);
+    }
+
+    const char *kind_name() const override { return "SlidingWindowNode"; }
+
+    void InputReceived(arrow::compute::ExecNode *input, arrow::compute::ExecBatch batch) override
+    {
+        // 窗口状态依赖输入顺序，按批次串行处理
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (stopped_)
+            return;
+        auto maybe_output = Process(batch);
+        ++batches_processed_;
+        bool done = (batches_processed_ == total_batches_);
+        lock.unlock();
+
+        if (!maybe_output.ok())
+        {
+            outputs_[0]->ErrorReceived(this, maybe_output.status());
+            StopProducing();
+            return;
+        }
+        outputs_[0]->InputReceived(this, maybe_output.MoveValueUnsafe());
+        if (done)
+            MarkFinishedOnce();
+    }
+
+    void ErrorReceived(arrow::compute::ExecNode *input, arrow::Status error) override
+    {
+        outputs_[0]->ErrorReceived(this, std::move(error));
+    }
+
+    void InputFinished(arrow::compute::ExecNode *input, int total_batches) override
+    {
+        // 每个输入批次恰好产生一个输出批次
+        outputs_[0]->InputFinished(this, total_batches);
+        std::unique_lock<std::mutex> lock(mutex_);
+        total_batches_ = total_batches;
+        bool done = (batches_processed_ == total_batches_);
+        lock.unlock();
+        if (done)
+            MarkFinishedOnce();
+    }
+
+    arrow::Status StartProducing() override { return arrow::Status::OK(); }
+
+    void PauseProducing(arrow::compute::ExecNode *output, int32_t counter) override
+    {
+        inputs_[0]->PauseProducing(this, counter);
+    }
+
+    void ResumeProducing(arrow::compute::ExecNode *output, int32_t counter) override
+    {
+        inputs_[0]->ResumeProducing(this, counter);
+    }
+
+    void StopProducing(arrow::compute::ExecNode *output) override { StopProducing(); }
+
+    void StopProducing() override
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopped_ = true;
+        }
+        inputs_[0]->StopProducing(this);
+        MarkFinishedOnce();
+    }
+
+private:
+    struct KeyWindow
+    {
+        std::deque<std::pair<int64_t, double>> rows; // 窗口内的(时间, 值)
+        double sum = 0;
+        int64_t last_time = INT64_MIN;
+    };
+
+    void MarkFinishedOnce()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!marked_finished_)
+        {
+            marked_finished_ = true;
+            finished_.MarkFinished();
+        }
+    }
+
+    arrow::Result<arrow::compute::ExecBatch> Process(const arrow::compute::ExecBatch &batch)
+    {
+        for (int index : {time_index_, key_index_, target_index_})
+        {
+            if (!batch.values[index].is_array())
+            {
+                return arrow::Status::NotImplemented("sliding_window on scalar columns");
+            }
+        }
+        arrow::Int64Array times(batch.values[time_index_].array());
+        arrow::Int32Array keys(batch.values[key_index_].array());
+        auto target = batch.values[target_index_].make_array();
+
+        arrow::DoubleBuilder builder;
+        ARROW_RETURN_NOT_OK(builder.Reserve(batch.length));
+        for (int64_t i = 0; i < batch.length; ++i)
+        {
+            if (times.IsNull(i) || keys.IsNull(i))
+            {
+                return arrow::Status::Invalid("sliding_window keys must not be null");
+            }
+            int64_t now = times.Value(i);
+            KeyWindow &state = windows_[keys.Value(i)];
+            if (now < state.last_time)
+            {
+                return arrow::Status::Invalid("sliding_window input is not sorted by time");
+            }
+            state.last_time = now;
+
+            // 淘汰窗口之外的行
+            while (!state.rows.empty() && state.rows.front().first <= now - window_)
+            {
+                state.sum -= state.rows.front().second;
+                state.rows.pop_front();
+            }
+            if (!target->IsNull(i))
+            {
+                double value = target->type_id() == arrow::Type::DOUBLE
+                                   ? std::static_pointer_cast<arrow::DoubleArray>(target)->Value(i)
+                                   : static_cast<double>(std::static_pointer_cast<arrow::Int64Array>(target)->Value(i));
+                state.rows.emplace_back(now, value);
+                state.sum += value;
+                if (static_cast<int64_t>(state.rows.size()) > max_buffered_rows_)
+                {
+                    return arrow::Status::CapacityError("sliding_window buffered more than ", max_buffered_rows_,
+                                                        " rows for one key");
+                }
+            }
+
+            if (function_ == "count")
+            {
+                builder.UnsafeAppend(static_cast<double>(state.rows.size()));
+            }
+            else if (state.rows.empty())
+            {
+                builder.UnsafeAppendNull();
+            }
+            else if (function_ == "sum")
+            {
+                builder.UnsafeAppend(state.sum);
+            }
+            else
+            {
+                builder.UnsafeAppend(state.sum / state.rows.size());
+            }
+        }
+
+        ARROW_ASSIGN_OR_RAISE(auto window_values, builder.Finish());
+        std::vector<arrow::Datum> values = batch.values;
+        values.emplace_back(window_values);
+        return arrow::compute::ExecBatch(std::move(values), batch.length);
+    }
+
+    int time_index_;
+    int key_index_;
+    int target_index_;
+    int64_t window_;
+    std::string function_;
+    int64_t max_buffered_rows_;
+
+    std::mutex mutex_;
+    std::unordered_map<int32_t, KeyWindow> windows_;
+    int batches_processed_ = 0;
+    int total_batches_ = -1;
+    bool stopped_ = false;
+    bool marked_finished_ = false;
+};
+
+/**
+ * @brief 把sliding_window注册到默认的节点工厂中，之后就可以像aggregate一样通过MakeExecNode创建
+ *
+ */
+arrow::Status RegisterSlidingWindowNode()
+{
+    return arrow::compute::default_exec_factory_registry()->AddFactory("sliding_window", SlidingWindowNode::Make);
+}
+
+/**
+ * @brief 每笔成交关联同一合约在成交时刻之前（含）最近的一笔报价
+ *
+ */
+arrow::Status AsofJoinTradesAndQuotes(const std::shared_ptr<arrow::Table> &trades,
+                                      const std::shared_ptr<arrow::Table> &quotes)
+{
+    // 输入需要保持时间顺序，这里不使用线程池
+    arrow::compute::ExecContext exec_context;
+    ARROW_ASSIGN_OR_RAISE(std::shared_ptr<arrow::compute::ExecPlan> plan, arrow::compute::ExecPlan::Make(&exec_context));
+    arrow::AsyncGenerator<arrow::util::optional<arrow::compute::ExecBatch>> sink_gen;
+
+    ARROW_ASSIGN_OR_RAISE(arrow::compute::ExecNode * trade_source,
+                          arrow::compute::MakeExecNode("table_source", plan.get(), {},
+                                                       arrow::compute::TableSourceNodeOptions{trades, 16}));
+    ARROW_ASSIGN_OR_RAISE(arrow::compute::ExecNode * quote_source,
+                          arrow::compute::MakeExecNode("table_source", plan.get(), {},
+                                                       arrow::compute::TableSourceNodeOptions{quotes, 16}));
+
+    // on: 时间列，by: 合约列，tolerance: 报价最多比成交早多久(微秒)
+    auto asof_options = arrow::compute::AsofJoinNodeOptions{/*on_key=*/"ts", /*by_key=*/"inst", /*tolerance=*/5000};
+    ARROW_ASSIGN_OR_RAISE(arrow::compute::ExecNode * asof,
+                          arrow::compute::MakeExecNode("asofjoin", plan.get(), {trade_source, quote_source}, asof_options));
+
+    ARROW_RETURN_NOT_OK(
+        arrow::compute::MakeExecNode("sink", plan.get(), {asof}, arrow::compute::SinkNodeOptions{&sink_gen}));
+
+    ARROW_ASSIGN_OR_RAISE(auto table, ExecutePlanToTable(exec_context, plan, asof->output_schema(), sink_gen));
+    std::cout << "As-of join results : " << table->ToString() << std::endl;
+    return arrow::Status::OK();
+}
+
+/**
+ * @brief 统计每个合约最近10ms的成交均价
+ *
+ */
+arrow::Status RollingMeanPrice(const std::shared_ptr<arrow::Table> &trades)
+{
+    arrow::compute::ExecContext exec_context;
+    ARROW_ASSIGN_OR_RAISE(std::shared_ptr<arrow::compute::ExecPlan> plan, arrow::compute::ExecPlan::Make(&exec_context));
+    arrow::AsyncGenerator<arrow::util::optional<arrow::compute::ExecBatch>> sink_gen;
+
+    ARROW_ASSIGN_OR_RAISE(arrow::compute::ExecNode * source,
+                          arrow::compute::MakeExecNode("table_source", plan.get(), {},
+                                                       arrow::compute::TableSourceNodeOptions{trades, 16}));
+
+    auto window_options = SlidingWindowNodeOptions{/*time_key=*/"ts", /*by_key=*/"inst", /*target=*/"pri",
+                                                   /*window=*/10000, "mean", "pri_mean_10ms"};
+    ARROW_ASSIGN_OR_RAISE(arrow::compute::ExecNode * window,
+                          arrow::compute::MakeExecNode("sliding_window", plan.get(), {source}, window_options));
+
+    ARROW_RETURN_NOT_OK(
+        arrow::compute::MakeExecNode("sink", plan.get(), {window}, arrow::compute::SinkNodeOptions{&sink_gen}));
+
+    ARROW_ASSIGN_OR_RAISE(auto table, ExecutePlanToTable(exec_context, plan, window->output_schema(), sink_gen));
+    std::cout << "Sliding window results : " << table->ToString() << std::endl;
+    return arrow::Status::OK();
+}
+
+arrow::Status opers()
+{
+    ARROW_RETURN_NOT_OK(RegisterSlidingWindowNode());
+    ARROW_ASSIGN_OR_RAISE(auto trades, CreateTimedTradeTable(60));
+    ARROW_ASSIGN_OR_RAISE(auto quotes, CreateTimedQuoteTable(30));
+
+    ARROW_RETURN_NOT_OK(AsofJoinTradesAndQuotes(trades, quotes));
+    ARROW_RETURN_NOT_OK(RollingMeanPrice(trades));
+    return arrow::Status::OK();
+}
+
+int main(int argc, char const *argv[])
+{
+    cout << opers() << endl;
+    return 0;
+}
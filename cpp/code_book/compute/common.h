@@ -8,6 +8,9 @@
 #include <arrow/type.h>
 #include <arrow/filesystem/api.h>
 #include <parquet/arrow/writer.h>
+#include <arrow/compute/api.h>
+#include <arrow/compute/exec/exec_plan.h>
+#include <arrow/util/async_generator.h>
 
 /**
  * @brief 生成一系列用于展示的数据
@@ -62,4 +65,91 @@ arrow::Result<std::shared_ptr<arrow::Array>> CreateArrayWithNull()
     return arrow::ToResult(rst);
 }
 
+/**
+ * @brief 生成成交样例数据，字段名与flight_speed_test中的成交表保持一致
+ *
+ * @param num_rows 行数
+ * @return 数据表(fid, cuid, trderid, pri, qty)
+ */
+arrow::Result<std::shared_ptr<arrow::Table>> CreateTradeTable(int64_t num_rows)
+{
+    auto schema = arrow::schema({arrow::field("fid", arrow::utf8()),
+                                 arrow::field("cuid", arrow::utf8()),
+                                 arrow::field("trderid", arrow::utf8()),
+                                 arrow::field("pri", arrow::float64()),
+                                 arrow::field("qty", arrow::int64())});
+    arrow::StringBuilder fid_builder, cuid_builder, trderid_builder;
+    arrow::DoubleBuilder pri_builder;
+    arrow::Int64Builder qty_builder;
+    for (int64_t i = 0; i < num_rows; ++i)
+    {
+        ARROW_RETURN_NOT_OK(fid_builder.Append("F" + std::to_string(i % 7)));
+        ARROW_RETURN_NOT_OK(cuid_builder.Append("C" + std::to_string(i % 13)));
+        ARROW_RETURN_NOT_OK(trderid_builder.Append("T" + std::to_string(i % 5)));
+        ARROW_RETURN_NOT_OK(pri_builder.Append(10.0 + (i % 100) * 0.1));
+        ARROW_RETURN_NOT_OK(qty_builder.Append((i % 10 + 1) * 100));
+    }
+    std::vector<std::shared_ptr<arrow::Array>> arrays(5);
+    ARROW_RETURN_NOT_OK(fid_builder.Finish(&arrays[0]));
+    ARROW_RETURN_NOT_OK(cuid_builder.Finish(&arrays[1]));
+    ARROW_RETURN_NOT_OK(trderid_builder.Finish(&arrays[2]));
+    ARROW_RETURN_NOT_OK(pri_builder.Finish(&arrays[3]));
+    ARROW_RETURN_NOT_OK(qty_builder.Finish(&arrays[4]));
+    return arrow::Table::Make(schema, arrays);
+}
+
+/**
+ * @brief 生成交易对手参考表，只包含C0~C{num_rows-1}，故成交表中部分cuid匹配不上
+ *
+ * @param num_rows 行数
+ * @return 数据表(cuid, cu_name, region)
+ */
+arrow::Result<std::shared_ptr<arrow::Table>> CreateCounterpartyTable(int64_t num_rows)
+{
+    auto schema = arrow::schema({arrow::field("cuid", arrow::utf8()),
+                                 arrow::field("cu_name", arrow::utf8()),
+                                 arrow::field("region", arrow::utf8())});
+    arrow::StringBuilder cuid_builder, name_builder, region_builder;
+    for (int64_t i = 0; i < num_rows; ++i)
+    {
+        ARROW_RETURN_NOT_OK(cuid_builder.Append("C" + std::to_string(i)));
+        ARROW_RETURN_NOT_OK(name_builder.Append("counterparty_" + std::to_string(i)));
+        ARROW_RETURN_NOT_OK(region_builder.Append(i % 2 == 0 ? "SH" : "SZ"));
+    }
+    std::vector<std::shared_ptr<arrow::Array>> arrays(3);
+    ARROW_RETURN_NOT_OK(cuid_builder.Finish(&arrays[0]));
+    ARROW_RETURN_NOT_OK(name_builder.Finish(&arrays[1]));
+    ARROW_RETURN_NOT_OK(region_builder.Finish(&arrays[2]));
+    return arrow::Table::Make(schema, arrays);
+}
+
+/**
+ * @brief 执行plan，并将sink_gen输出的数据收集成Table
+ *
+ * @param exec_context
+ * @param plan
+ * @param schema sink输出的表结构
+ * @param sink_gen
+ * @return arrow::Result<std::shared_ptr<arrow::Table>>
+ */
+arrow::Result<std::shared_ptr<arrow::Table>> ExecutePlanToTable(
+    arrow::compute::ExecContext &exec_context, std::shared_ptr<arrow::compute::ExecPlan> plan,
+    std::shared_ptr<arrow::Schema> schema,
+    arrow::AsyncGenerator<arrow::util::optional<arrow::compute::ExecBatch>> sink_gen)
+{
+    std::shared_ptr<arrow::RecordBatchReader> sink_reader =
+        arrow::compute::MakeGeneratorReader(schema, std::move(sink_gen), exec_context.memory_pool());
+
+    ARROW_RETURN_NOT_OK(plan->Validate());
+    ARROW_RETURN_NOT_OK(plan->StartProducing());
+
+    std::shared_ptr<arrow::Table> response_table;
+    ARROW_ASSIGN_OR_RAISE(response_table,
+                          arrow::Table::FromRecordBatchReader(sink_reader.get()));
+
+    plan->StopProducing();
+    ARROW_RETURN_NOT_OK(plan->finished().status());
+    return response_table;
+}
+
 #endif
\ No newline at end of file
@@ -16,6 +16,7 @@
 using namespace std;
 
 #include "common.h"
+#include "plan_profiler.h"
 
 /**
  * @brief 执行计划，生成Table
@@ -24,12 +25,15 @@ using namespace std;
  * @param plan
  * @param schema
  * @param sink_gen
+ * @param profiler 执行计划的性能统计
+ * @param sink sink节点，作为输出统计的根
  * @return arrow::Status
  */
 arrow::Status ExecutePlanAndCollectAsTable(
     arrow::compute::ExecContext &exec_context, std::shared_ptr<arrow::compute::ExecPlan> plan,
     std::shared_ptr<arrow::Schema> schema,
-    arrow::AsyncGenerator<arrow::util::optional<arrow::compute::ExecBatch>> sink_gen)
+    arrow::AsyncGenerator<arrow::util::optional<arrow::compute::ExecBatch>> sink_gen,
+    PlanProfiler &profiler, arrow::compute::ExecNode *sink)
 {
     // 将sink_gen从异步转换成同步的sink_reader
     std::shared_ptr<arrow::RecordBatchReader> sink_reader =
@@ -39,6 +43,7 @@ arrow::Status ExecutePlanAndCollectAsTable(
     ARROW_RETURN_NOT_OK(plan->Validate());
     std::cout << "ExecPlan created : " << plan->ToString() << std::endl;
     // 开始执行plan
+    profiler.Start();
     ARROW_RETURN_NOT_OK(plan->StartProducing());
 
     // 将sink_reader的数据导入到Table结构中
@@ -53,7 +58,12 @@ arrow::Status ExecutePlanAndCollectAsTable(
     plan->StopProducing();
     // 标记plan结束
     auto future = plan->finished();
-    return future.status();
+    ARROW_RETURN_NOT_OK(future.status());
+
+    // 输出各节点的行数、批次、耗时等统计
+    std::cout << profiler.ToString(sink) << std::endl;
+    std::cout << profiler.ToJson(sink) << std::endl;
+    return arrow::Status::OK();
 }
 
 arrow::Status opers()
@@ -70,6 +80,7 @@ arrow::Status opers()
 
     arrow::compute::ExecContext exec_context;
     ARROW_ASSIGN_OR_RAISE(std::shared_ptr<arrow::compute::ExecPlan> plan, arrow::compute::ExecPlan::Make(&exec_context));
+    PlanProfiler profiler(exec_context.memory_pool());
 
     arrow::AsyncGenerator<arrow::util::optional<arrow::compute::ExecBatch>> sink_gen;
     arrow::AsyncGenerator<arrow::util::optional<arrow::compute::ExecBatch>> table_gen; // 用于读表的生成器（异步的）
@@ -82,6 +93,7 @@ arrow::Status opers()
     // 第一步：加载数据
     auto source_node_options = arrow::compute::SourceNodeOptions{table->schema(), table_gen};
     ARROW_ASSIGN_OR_RAISE(arrow::compute::ExecNode * source, arrow::compute::MakeExecNode("source", plan.get(), {}, source_node_options));
+    ARROW_ASSIGN_OR_RAISE(source, profiler.Wrap(plan.get(), source)); // 统计source的输出
 
     // 第二步：统计数据：统计非空数据
     auto options = std::make_shared<arrow::compute::ScalarAggregateOptions>(true);
@@ -93,9 +105,11 @@ arrow::Status opers()
     ARROW_ASSIGN_OR_RAISE(
         arrow::compute::ExecNode * aggregate,
         arrow::compute::MakeExecNode("aggregate", plan.get(), {source}, aggregate_options));
+    ARROW_ASSIGN_OR_RAISE(aggregate, profiler.Wrap(plan.get(), aggregate)); // 统计aggregate的输出
 
     // 第三步：设置读取用的生成器
-    ARROW_RETURN_NOT_OK(
+    ARROW_ASSIGN_OR_RAISE(
+        arrow::compute::ExecNode * sink,
         arrow::compute::MakeExecNode("sink", plan.get(), {aggregate}, arrow::compute::SinkNodeOptions{&sink_gen}));
 
     // 设置输出结构
@@ -105,7 +119,7 @@ arrow::Status opers()
     });
 
     // 执行plan，形成结果表
-    return ExecutePlanAndCollectAsTable(exec_context, plan, schema, sink_gen);
+    return ExecutePlanAndCollectAsTable(exec_context, plan, schema, sink_gen, profiler, sink);
 }
 
 int main(int argc, char const *argv[])
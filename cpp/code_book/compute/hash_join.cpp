@@ -0,0 +1,457 @@
+
+#include <arrow/api.h>
+#include <arrow/io/api.h>
+#include <arrow/ipc/api.h>
+#include <arrow/result.h>
+#include <arrow/status.h>
+#include <arrow/type.h>
+#include <arrow/filesystem/api.h>
+#include <arrow/compute/api.h>
+#include <arrow/compute/exec/exec_plan.h>
+#include <arrow/compute/exec/options.h>
+#include <arrow/util/byte_size.h>
+#include <arrow/util/thread_pool.h>
+
+#include <iostream>
+#include <functional>
+using namespace std;
+
+#include "common.h"
+
+#define SPILL_DIR "./hash_join_spill/"
+
+/**
+ * @brief 关联参数
+ *
+ */
+struct HashJoinSpec
+{
+    arrow::compute::JoinType join_type = arrow::compute::JoinType::INNER;
+    std::vector<std::string> left_keys;
+    std::vector<std::string> right_keys;
+    int64_t memory_budget = 64 << 20;  // build侧允许常驻内存的字节数，超过后落盘
+    int spill_partitions = 8;          // 落盘时按key哈希切分的分区数
+    int64_t max_prefilter_keys = 1 << 16; // build侧去重key超过该数量时不再下推过滤
+};
+
+std::string JoinTypeName(arrow::compute::JoinType join_type)
+{
+    switch (join_type)
+    {
+    case arrow::compute::JoinType::LEFT_SEMI:
+        return "LEFT_SEMI";
+    case arrow::compute::JoinType::RIGHT_SEMI:
+        return "RIGHT_SEMI";
+    case arrow::compute::JoinType::LEFT_ANTI:
+        return "LEFT_ANTI";
+    case arrow::compute::JoinType::RIGHT_ANTI:
+        return "RIGHT_ANTI";
+    case arrow::compute::JoinType::INNER:
+        return "INNER";
+    case arrow::compute::JoinType::LEFT_OUTER:
+        return "LEFT_OUTER";
+    case arrow::compute::JoinType::RIGHT_OUTER:
+        return "RIGHT_OUTER";
+    case arrow::compute::JoinType::FULL_OUTER:
+        return "FULL_OUTER";
+    }
+    return "UNKNOWN";
+}
+
+/**
+ * @brief 左右互换后等价的关联方式
+ *
+ */
+arrow::compute::JoinType MirrorJoinType(arrow::compute::JoinType join_type)
+{
+    switch (join_type)
+    {
+    case arrow::compute::JoinType::LEFT_SEMI:
+        return arrow::compute::JoinType::RIGHT_SEMI;
+    case arrow::compute::JoinType::RIGHT_SEMI:
+        return arrow::compute::JoinType::LEFT_SEMI;
+    case arrow::compute::JoinType::LEFT_ANTI:
+        return arrow::compute::JoinType::RIGHT_ANTI;
+    case arrow::compute::JoinType::RIGHT_ANTI:
+        return arrow::compute::JoinType::LEFT_ANTI;
+    case arrow::compute::JoinType::LEFT_OUTER:
+        return arrow::compute::JoinType::RIGHT_OUTER;
+    case arrow::compute::JoinType::RIGHT_OUTER:
+        return arrow::compute::JoinType::LEFT_OUTER;
+    default:
+        return join_type;
+    }
+}
+
+/**
+ * @brief 在Arrow的hashjoin中右侧为build侧、左侧为probe侧，判断probe侧匹配不上的行是否可以直接丢弃
+ *
+ */
+bool ProbeCanDropUnmatched(arrow::compute::JoinType join_type)
+{
+    switch (join_type)
+    {
+    case arrow::compute::JoinType::INNER:
+    case arrow::compute::JoinType::LEFT_SEMI:
+    case arrow::compute::JoinType::RIGHT_SEMI:
+    case arrow::compute::JoinType::RIGHT_ANTI:
+    case arrow::compute::JoinType::RIGHT_OUTER:
+        return true;
+    default:
+        return false;
+    }
+}
+
+std::vector<arrow::FieldRef> ToFieldRefs(const std::vector<std::string> &names)
+{
+    std::vector<arrow::FieldRef> refs;
+    for (const auto &name : names)
+    {
+        refs.emplace_back(name);
+    }
+    return refs;
+}
+
+/**
+ * @brief 用build侧的key集合生成probe侧的is_in过滤条件，在probe侧扫描时就丢掉不可能匹配的行
+ *
+ * 只支持单列key，去重后的key过多时返回literal(true)
+ */
+arrow::Result<arrow::compute::Expression> MakeKeyPrefilter(
+    const std::shared_ptr<arrow::Table> &build, const std::string &build_key,
+    const std::string &probe_key, int64_t max_prefilter_keys)
+{
+    auto column = build->GetColumnByName(build_key);
+    if (column == nullptr)
+    {
+        return arrow::Status::Invalid("No key column ", build_key, " in build side");
+    }
+    ARROW_ASSIGN_OR_RAISE(std::shared_ptr<arrow::Array> value_set, arrow::compute::Unique(column));
+    if (value_set->length() > max_prefilter_keys)
+    {
+        return arrow::compute::literal(true);
+    }
+    return arrow::compute::call("is_in", {arrow::compute::field_ref(probe_key)},
+                                arrow::compute::SetLookupOptions(value_set));
+}
+
+/**
+ * @brief 在内存中执行一次hashjoin，右侧为build侧
+ *
+ * @param exec_context
+ * @param probe 左表(probe侧)
+ * @param build 右表(build侧)
+ * @param join_type
+ * @param probe_keys
+ * @param build_keys
+ * @param prefilter 下推到probe侧的过滤条件
+ * @param probe_suffix probe侧与build侧重名的列加的后缀
+ * @param build_suffix build侧与probe侧重名的列加的后缀
+ * @return arrow::Result<std::shared_ptr<arrow::Table>>
+ */
+arrow::Result<std::shared_ptr<arrow::Table>> InMemoryHashJoin(
+    arrow::compute::ExecContext &exec_context,
+    const std::shared_ptr<arrow::Table> &probe, const std::shared_ptr<arrow::Table> &build,
+    arrow::compute::JoinType join_type,
+    const std::vector<std::string> &probe_keys, const std::vector<std::string> &build_keys,
+    const arrow::compute::Expression &prefilter, const std::string &probe_suffix, const std::string &build_suffix)
+{
+    ARROW_ASSIGN_OR_RAISE(std::shared_ptr<arrow::compute::ExecPlan> plan, arrow::compute::ExecPlan::Make(&exec_context));
+    arrow::AsyncGenerator<arrow::util::optional<arrow::compute::ExecBatch>> sink_gen;
+
+    // probe侧按小批次切分，交给线程池并行探测
+    ARROW_ASSIGN_OR_RAISE(arrow::compute::ExecNode * probe_source,
+                          arrow::compute::MakeExecNode("table_source", plan.get(), {},
+                                                       arrow::compute::TableSourceNodeOptions{probe, 4096}));
+    if (!prefilter.Equals(arrow::compute::literal(true)))
+    {
+        ARROW_ASSIGN_OR_RAISE(probe_source,
+                              arrow::compute::MakeExecNode("filter", plan.get(), {probe_source},
+                                                           arrow::compute::FilterNodeOptions{prefilter}));
+    }
+    ARROW_ASSIGN_OR_RAISE(arrow::compute::ExecNode * build_source,
+                          arrow::compute::MakeExecNode("table_source", plan.get(), {},
+                                                       arrow::compute::TableSourceNodeOptions{build, 4096}));
+
+    arrow::compute::HashJoinNodeOptions join_options{join_type,
+                                                     ToFieldRefs(probe_keys),
+                                                     ToFieldRefs(build_keys),
+                                                     arrow::compute::literal(true),
+                                                     /*output_suffix_for_left=*/probe_suffix,
+                                                     /*output_suffix_for_right=*/build_suffix};
+    ARROW_ASSIGN_OR_RAISE(arrow::compute::ExecNode * join,
+                          arrow::compute::MakeExecNode("hashjoin", plan.get(), {probe_source, build_source}, join_options));
+
+    ARROW_RETURN_NOT_OK(
+        arrow::compute::MakeExecNode("sink", plan.get(), {join}, arrow::compute::SinkNodeOptions{&sink_gen}));
+
+    return ExecutePlanToTable(exec_context, plan, join->output_schema(), sink_gen);
+}
+
+/**
+ * @brief 按key列计算每行的哈希值
+ *
+ */
+arrow::Status HashKeys(const arrow::RecordBatch &batch, const std::vector<std::string> &keys,
+                       std::vector<uint64_t> *hashes)
+{
+    hashes->assign(batch.num_rows(), 17);
+    for (const auto &key : keys)
+    {
+        auto column = batch.GetColumnByName(key);
+        if (column == nullptr)
+        {
+            return arrow::Status::Invalid("No key column ", key);
+        }
+        for (int64_t i = 0; i < batch.num_rows(); ++i)
+        {
+            uint64_t h = 0;
+            if (column->IsNull(i))
+            {
+                h = 0;
+            }
+            else if (column->type_id() == arrow::Type::STRING)
+            {
+                h = std::hash<std::string>()(
+                    std::static_pointer_cast<arrow::StringArray>(column)->GetString(i));
+            }
+            else if (column->type_id() == arrow::Type::INT64)
+            {
+                h = std::hash<int64_t>()(std::static_pointer_cast<arrow::Int64Array>(column)->Value(i));
+            }
+            else if (column->type_id() == arrow::Type::INT32)
+            {
+                h = std::hash<int32_t>()(std::static_pointer_cast<arrow::Int32Array>(column)->Value(i));
+            }
+            else
+            {
+                return arrow::Status::NotImplemented("Spill partitioning on key type ", column->type()->ToString());
+            }
+            (*hashes)[i] = (*hashes)[i] * 31 + h;
+        }
+    }
+    return arrow::Status::OK();
+}
+
+/**
+ * @brief 按key的哈希值把表切成num_partitions份，写入落盘目录
+ *
+ * @param fs
+ * @param table
+ * @param keys
+ * @param num_partitions
+ * @param prefix 落盘文件名前缀
+ * @return arrow::Status
+ */
+arrow::Status SpillPartitions(const std::shared_ptr<arrow::fs::FileSystem> &fs,
+                              const std::shared_ptr<arrow::Table> &table,
+                              const std::vector<std::string> &keys, int num_partitions,
+                              const std::string &prefix)
+{
+    std::vector<std::shared_ptr<arrow::io::OutputStream>> outputs(num_partitions);
+    std::vector<std::shared_ptr<arrow::ipc::RecordBatchWriter>> writers(num_partitions);
+    for (int p = 0; p < num_partitions; ++p)
+    {
+        ARROW_ASSIGN_OR_RAISE(outputs[p], fs->OpenOutputStream(SPILL_DIR + prefix + std::to_string(p) + ".arrow"));
+        ARROW_ASSIGN_OR_RAISE(writers[p], arrow::ipc::MakeFileWriter(outputs[p].get(), table->schema()));
+    }
+
+    // 逐个batch切分后直接写出，内存里只保留当前batch
+    arrow::TableBatchReader batch_reader(*table);
+    std::shared_ptr<arrow::RecordBatch> batch;
+    std::vector<uint64_t> hashes;
+    while (true)
+    {
+        ARROW_RETURN_NOT_OK(batch_reader.ReadNext(&batch));
+        if (!batch)
+            break;
+        ARROW_RETURN_NOT_OK(HashKeys(*batch, keys, &hashes));
+        std::vector<arrow::Int64Builder> indices(num_partitions);
+        for (int64_t i = 0; i < batch->num_rows(); ++i)
+        {
+            ARROW_RETURN_NOT_OK(indices[hashes[i] % num_partitions].Append(i));
+        }
+        for (int p = 0; p < num_partitions; ++p)
+        {
+            if (indices[p].length() == 0)
+                continue;
+            ARROW_ASSIGN_OR_RAISE(auto index_array, indices[p].Finish());
+            ARROW_ASSIGN_OR_RAISE(arrow::Datum part, arrow::compute::Take(batch, index_array));
+            ARROW_RETURN_NOT_OK(writers[p]->WriteRecordBatch(*part.record_batch()));
+        }
+    }
+
+    for (int p = 0; p < num_partitions; ++p)
+    {
+        ARROW_RETURN_NOT_OK(writers[p]->Close());
+        ARROW_RETURN_NOT_OK(outputs[p]->Close());
+    }
+    return arrow::Status::OK();
+}
+
+/**
+ * @brief 读回一个落盘分区
+ *
+ */
+arrow::Result<std::shared_ptr<arrow::Table>> LoadPartition(const std::shared_ptr<arrow::fs::FileSystem> &fs,
+                                                           const std::string &prefix, int partition)
+{
+    ARROW_ASSIGN_OR_RAISE(auto input, fs->OpenInputFile(SPILL_DIR + prefix + std::to_string(partition) + ".arrow"));
+    ARROW_ASSIGN_OR_RAISE(auto reader, arrow::ipc::RecordBatchFileReader::Open(input));
+    std::vector<std::shared_ptr<arrow::RecordBatch>> batches;
+    for (int i = 0; i < reader->num_record_batches(); ++i)
+    {
+        ARROW_ASSIGN_OR_RAISE(auto batch, reader->ReadRecordBatch(i));
+        batches.push_back(batch);
+    }
+    return arrow::Table::FromRecordBatches(reader->schema(), batches);
+}
+
+/**
+ * @brief 左右互换执行后，把输出列恢复成左表在前、右表在后
+ *
+ * semi/anti只输出一侧的列，不需要调整
+ */
+arrow::Result<std::shared_ptr<arrow::Table>> RestoreColumnOrder(const std::shared_ptr<arrow::Table> &joined,
+                                                                int probe_columns, int build_columns)
+{
+    if (joined->num_columns() != probe_columns + build_columns)
+    {
+        return joined;
+    }
+    std::vector<int> indices;
+    for (int i = 0; i < build_columns; ++i)
+        indices.push_back(probe_columns + i);
+    for (int i = 0; i < probe_columns; ++i)
+        indices.push_back(i);
+    return joined->SelectColumns(indices);
+}
+
+/**
+ * @brief 关联两张表，输出列总是左表在前、右表在后，右表重名的列加"_ref"后缀
+ *
+ * 1. 以较小的一侧作为build侧（必要时左右互换并镜像关联方式，输出时再换回原来的列顺序和后缀）
+ * 2. 单列key时把build侧的key集合作为is_in条件下推到probe侧
+ * 3. build侧超过内存预算时，两侧按key哈希分区落盘，再逐个分区关联(grace hash join)
+ *
+ * 输入已经是内存中的Table，第3步只是演示grace hash join的分区流程，并不能降低峰值内存；
+ * 真正的外存关联需要在流式读取build侧时按预算决定是否落盘。
+ *
+ * @param spec
+ * @param left
+ * @param right
+ * @return arrow::Result<std::shared_ptr<arrow::Table>>
+ */
+arrow::Result<std::shared_ptr<arrow::Table>> HashJoin(const HashJoinSpec &spec,
+                                                      const std::shared_ptr<arrow::Table> &left,
+                                                      const std::shared_ptr<arrow::Table> &right)
+{
+    // 使用CPU线程池，probe侧的batch会被并行处理
+    arrow::compute::ExecContext exec_context(arrow::default_memory_pool(), arrow::internal::GetCpuThreadPool());
+
+    auto probe = left;
+    auto build = right;
+    auto probe_keys = spec.left_keys;
+    auto build_keys = spec.right_keys;
+    auto join_type = spec.join_type;
+    std::string probe_suffix = "";
+    std::string build_suffix = "_ref";
+    int64_t left_bytes = arrow::util::TotalBufferSize(*left);
+    int64_t right_bytes = arrow::util::TotalBufferSize(*right);
+    int64_t build_bytes = right_bytes;
+    bool swapped = left_bytes < right_bytes && join_type != arrow::compute::JoinType::FULL_OUTER;
+    if (swapped)
+    {
+        std::swap(probe, build);
+        std::swap(probe_keys, build_keys);
+        std::swap(probe_suffix, build_suffix);
+        join_type = MirrorJoinType(join_type);
+        build_bytes = left_bytes;
+    }
+    cout << "join " << JoinTypeName(spec.join_type) << " executed as " << JoinTypeName(join_type)
+         << ", build side " << build->num_rows() << " rows / " << build_bytes << " bytes" << endl;
+
+    arrow::compute::Expression prefilter = arrow::compute::literal(true);
+    if (ProbeCanDropUnmatched(join_type) && probe_keys.size() == 1)
+    {
+        ARROW_ASSIGN_OR_RAISE(prefilter, MakeKeyPrefilter(build, build_keys[0], probe_keys[0], spec.max_prefilter_keys));
+    }
+
+    std::shared_ptr<arrow::Table> joined;
+    if (build_bytes <= spec.memory_budget)
+    {
+        ARROW_ASSIGN_OR_RAISE(joined, InMemoryHashJoin(exec_context, probe, build, join_type, probe_keys, build_keys,
+                                                       prefilter, probe_suffix, build_suffix));
+        if (swapped)
+        {
+            return RestoreColumnOrder(joined, probe->num_columns(), build->num_columns());
+        }
+        return joined;
+    }
+
+    // build侧超过预算，两侧同样按key切分，每次只有一个分区的build侧在内存中
+    cout << "build side exceeds memory budget " << spec.memory_budget << ", spilling into "
+         << spec.spill_partitions << " partitions" << endl;
+    auto fs = std::make_shared<arrow::fs::LocalFileSystem>();
+    ARROW_RETURN_NOT_OK(fs->CreateDir(SPILL_DIR));
+    ARROW_RETURN_NOT_OK(fs->DeleteDirContents(SPILL_DIR));
+    ARROW_RETURN_NOT_OK(SpillPartitions(fs, build, build_keys, spec.spill_partitions, "build_"));
+    ARROW_RETURN_NOT_OK(SpillPartitions(fs, probe, probe_keys, spec.spill_partitions, "probe_"));
+
+    std::vector<std::shared_ptr<arrow::Table>> results;
+    for (int p = 0; p < spec.spill_partitions; ++p)
+    {
+        ARROW_ASSIGN_OR_RAISE(auto build_part, LoadPartition(fs, "build_", p));
+        ARROW_ASSIGN_OR_RAISE(auto probe_part, LoadPartition(fs, "probe_", p));
+        ARROW_ASSIGN_OR_RAISE(auto result, InMemoryHashJoin(exec_context, probe_part, build_part, join_type,
+                                                            probe_keys, build_keys, prefilter, probe_suffix,
+                                                            build_suffix));
+        results.push_back(result);
+    }
+    ARROW_RETURN_NOT_OK(fs->DeleteDirContents(SPILL_DIR));
+    ARROW_ASSIGN_OR_RAISE(joined, arrow::ConcatenateTables(results));
+    if (swapped)
+    {
+        return RestoreColumnOrder(joined, probe->num_columns(), build->num_columns());
+    }
+    return joined;
+}
+
+arrow::Status opers()
+{
+    ARROW_ASSIGN_OR_RAISE(auto trades, CreateTradeTable(100000));
+    ARROW_ASSIGN_OR_RAISE(auto counterparties, CreateCounterpartyTable(10)); // C10~C12在参考表中不存在
+
+    HashJoinSpec spec;
+    spec.left_keys = {"cuid"};
+    spec.right_keys = {"cuid"};
+
+    // 成交表关联交易对手表
+    for (auto join_type : {arrow::compute::JoinType::INNER, arrow::compute::JoinType::LEFT_OUTER,
+                           arrow::compute::JoinType::LEFT_SEMI, arrow::compute::JoinType::LEFT_ANTI})
+    {
+        spec.join_type = join_type;
+        ARROW_ASSIGN_OR_RAISE(auto joined, HashJoin(spec, trades, counterparties));
+        cout << JoinTypeName(join_type) << ": " << joined->num_rows() << " rows" << endl;
+        cout << joined->schema()->ToString() << endl;
+    }
+
+    // 有成交的交易对手：左侧是小表，会被换到build侧
+    spec.join_type = arrow::compute::JoinType::LEFT_SEMI;
+    ARROW_ASSIGN_OR_RAISE(auto active, HashJoin(spec, counterparties, trades));
+    cout << "counterparties with trades: " << active->ToString() << endl;
+
+    // 把内存预算调小，验证落盘关联的结果与内存中一致
+    spec.join_type = arrow::compute::JoinType::INNER;
+    spec.memory_budget = 1024;
+    ARROW_ASSIGN_OR_RAISE(auto spilled, HashJoin(spec, trades, counterparties));
+    cout << "INNER with spill: " << spilled->num_rows() << " rows" << endl;
+
+    return arrow::Status::OK();
+}
+
+int main(int argc, char const *argv[])
+{
+    cout << opers() << endl;
+    return 0;
+}
@@ -0,0 +1,337 @@
+#ifndef PLAN_PROFILER_H
+#define PLAN_PROFILER_H
+
+#include <arrow/api.h>
+#include <arrow/result.h>
+#include <arrow/status.h>
+#include <arrow/compute/exec/exec_plan.h>
+#include <arrow/compute/exec/options.h>
+#include <arrow/util/checked_cast.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <ctime>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+
+/**
+ * @brief 单个节点的统计数据，由插在该节点输出端的ProfileNode记录
+ *
+ * 所有计数都是原子变量，每个batch只有几次原子操作和两次取时，开销很小
+ */
+struct NodeProfile
+{
+    int64_t start_ns = 0;                      // plan开始执行的时间
+    std::atomic<int64_t> output_batches{0};
+    std::atomic<int64_t> output_rows{0};
+    std::atomic<int64_t> output_bytes{0};
+    std::atomic<int64_t> downstream_wall_ns{0}; // 下游节点处理该节点输出的耗时（含下游的下游）
+    std::atomic<int64_t> downstream_cpu_ns{0};
+    std::atomic<int64_t> first_batch_delay_ns{-1}; // plan开始到第一个batch输出的等待时间
+    std::atomic<int64_t> peak_pool_bytes{0};       // 输出batch时内存池的最大占用
+};
+
+int64_t SteadyNowNs()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+int64_t ThreadCpuNowNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return static_cast<int64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+void AtomicMax(std::atomic<int64_t> &target, int64_t value)
+{
+    int64_t current = target.load();
+    while (current < value && !target.compare_exchange_weak(current, value))
+    {
+    }
+}
+
+class ProfileNodeOptions : public arrow::compute::ExecNodeOptions
+{
+public:
+    ProfileNodeOptions(std::shared_ptr<NodeProfile> profile, arrow::MemoryPool *pool)
+        : profile(std::move(profile)), pool(pool) {}
+
+    std::shared_ptr<NodeProfile> profile;
+    arrow::MemoryPool *pool;
+};
+
+/**
+ * @brief 透传节点，统计上游节点的输出并计时下游节点的处理
+ *
+ */
+class ProfileNode : public arrow::compute::ExecNode
+{
+public:
+    ProfileNode(arrow::compute::ExecPlan *plan, std::vector<arrow::compute::ExecNode *> inputs,
+                const ProfileNodeOptions &options)
+        : ExecNode(plan, inputs, {"target"}, inputs[0]->output_schema(), /*num_outputs=*/1),
+          profile_(options.profile), pool_(options.pool) {}
+
+    static arrow::Result<arrow::compute::ExecNode *> Make(arrow::compute::ExecPlan *plan,
+                                                          std::vector<arrow::compute::ExecNode *> inputs,
+                                                          const arrow::compute::ExecNodeOptions &options)
+    {
+        if (inputs.size() != 1)
+        {
+            return arrow::Status::Invalid("profile requires exactly one input");
+        }
+        const auto &profile_options = arrow::internal::checked_cast<const ProfileNodeOptions &>(options);
+        return plan->EmplaceNode<ProfileNode>(plan, std::move(inputs), profile_options);
+    }
+
+    const char *kind_name() const override { return "ProfileNode"; }
+
+    void InputReceived(arrow::compute::ExecNode *input, arrow::compute::ExecBatch batch) override
+    {
+        int64_t wall_begin = SteadyNowNs();
+        int64_t cpu_begin = ThreadCpuNowNs();
+        int64_t expected = -1;
+        profile_->first_batch_delay_ns.compare_exchange_strong(expected, wall_begin - profile_->start_ns);
+        profile_->output_batches += 1;
+        profile_->output_rows += batch.length;
+        profile_->output_bytes += batch.TotalBufferSize();
+        AtomicMax(profile_->peak_pool_bytes, pool_->bytes_allocated());
+
+        outputs_[0]->InputReceived(this, std::move(batch));
+
+        profile_->downstream_cpu_ns += ThreadCpuNowNs() - cpu_begin;
+        profile_->downstream_wall_ns += SteadyNowNs() - wall_begin;
+        if (++batches_forwarded_ == total_batches_.load())
+            MarkFinishedOnce();
+    }
+
+    void ErrorReceived(arrow::compute::ExecNode *input, arrow::Status error) override
+    {
+        outputs_[0]->ErrorReceived(this, std::move(error));
+    }
+
+    void InputFinished(arrow::compute::ExecNode *input, int total_batches) override
+    {
+        // aggregate等阻塞节点在输入结束时才计算并输出，这部分也算作下游耗时
+        int64_t wall_begin = SteadyNowNs();
+        int64_t cpu_begin = ThreadCpuNowNs();
+        outputs_[0]->InputFinished(this, total_batches);
+        profile_->downstream_cpu_ns += ThreadCpuNowNs() - cpu_begin;
+        profile_->downstream_wall_ns += SteadyNowNs() - wall_begin;
+        total_batches_ = total_batches;
+        if (batches_forwarded_.load() == total_batches)
+            MarkFinishedOnce();
+    }
+
+    arrow::Status StartProducing() override { return arrow::Status::OK(); }
+
+    void PauseProducing(arrow::compute::ExecNode *output, int32_t counter) override
+    {
+        inputs_[0]->PauseProducing(this, counter);
+    }
+
+    void ResumeProducing(arrow::compute::ExecNode *output, int32_t counter) override
+    {
+        inputs_[0]->ResumeProducing(this, counter);
+    }
+
+    void StopProducing(arrow::compute::ExecNode *output) override { StopProducing(); }
+
+    void StopProducing() override
+    {
+        inputs_[0]->StopProducing(this);
+        MarkFinishedOnce();
+    }
+
+private:
+    void MarkFinishedOnce()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!marked_finished_)
+        {
+            marked_finished_ = true;
+            finished_.MarkFinished();
+        }
+    }
+
+    std::shared_ptr<NodeProfile> profile_;
+    arrow::MemoryPool *pool_;
+    std::atomic<int> batches_forwarded_{0};
+    std::atomic<int> total_batches_{-1};
+    std::mutex mutex_;
+    bool marked_finished_ = false;
+};
+
+/**
+ * @brief 执行计划的性能统计
+ *
+ * 用Wrap在需要统计的节点之后插入ProfileNode，plan结束后以sink为根输出树形文本或JSON。
+ * 节点自身耗时 = 输入端ProfileNode记录的下游耗时 - 输出端ProfileNode记录的下游耗时；
+ * source节点没有输入端统计，只输出行数等信息。
+ */
+class PlanProfiler
+{
+public:
+    explicit PlanProfiler(arrow::MemoryPool *pool = arrow::default_memory_pool()) : pool_(pool) {}
+
+    /**
+     * @brief 注册profile节点工厂，重复调用不会报错
+     *
+     */
+    static arrow::Status Register()
+    {
+        static std::once_flag once;
+        static arrow::Status status;
+        std::call_once(once, []()
+                       { status = arrow::compute::default_exec_factory_registry()->AddFactory("profile", ProfileNode::Make); });
+        return status;
+    }
+
+    /**
+     * @brief 在node之后插入统计节点，返回值作为下游节点的输入
+     *
+     */
+    arrow::Result<arrow::compute::ExecNode *> Wrap(arrow::compute::ExecPlan *plan, arrow::compute::ExecNode *node)
+    {
+        ARROW_RETURN_NOT_OK(Register());
+        auto profile = std::make_shared<NodeProfile>();
+        profiles_[node] = profile;
+        return arrow::compute::MakeExecNode("profile", plan, {node}, ProfileNodeOptions{profile, pool_});
+    }
+
+    /**
+     * @brief 在plan->StartProducing()之前调用，作为等待时间的起点
+     *
+     */
+    void Start()
+    {
+        int64_t now = SteadyNowNs();
+        for (auto &item : profiles_)
+        {
+            item.second->start_ns = now;
+        }
+    }
+
+    std::string ToString(const arrow::compute::ExecNode *sink) const
+    {
+        std::stringstream ss;
+        ss << "ExecPlan profile (pool peak " << pool_->max_memory() << " bytes):" << std::endl;
+        PrintTree(ss, sink, 0);
+        return ss.str();
+    }
+
+    std::string ToJson(const arrow::compute::ExecNode *sink) const
+    {
+        std::stringstream ss;
+        PrintJson(ss, sink);
+        return ss.str();
+    }
+
+private:
+    struct NodeSummary
+    {
+        int64_t input_rows = 0;
+        int64_t input_batches = 0;
+        int64_t inclusive_wall_ns = -1; // 没有输入端统计时为-1
+        int64_t inclusive_cpu_ns = -1;
+        std::shared_ptr<NodeProfile> output;
+        std::vector<const arrow::compute::ExecNode *> children;
+    };
+
+    NodeSummary Summarize(const arrow::compute::ExecNode *node) const
+    {
+        NodeSummary summary;
+        auto it = profiles_.find(node);
+        if (it != profiles_.end())
+            summary.output = it->second;
+        for (auto *input : node->inputs())
+        {
+            const arrow::compute::ExecNode *child = input;
+            if (std::string(input->kind_name()) == "ProfileNode")
+            {
+                child = input->inputs()[0];
+                auto child_profile = profiles_.at(child);
+                summary.input_rows += child_profile->output_rows.load();
+                summary.input_batches += child_profile->output_batches.load();
+                summary.inclusive_wall_ns = std::max<int64_t>(summary.inclusive_wall_ns, 0) + child_profile->downstream_wall_ns.load();
+                summary.inclusive_cpu_ns = std::max<int64_t>(summary.inclusive_cpu_ns, 0) + child_profile->downstream_cpu_ns.load();
+            }
+            summary.children.push_back(child);
+        }
+        return summary;
+    }
+
+    static int64_t SelfTime(int64_t inclusive, const std::shared_ptr<NodeProfile> &output, bool cpu)
+    {
+        if (inclusive < 0)
+            return -1;
+        int64_t downstream = 0;
+        if (output)
+            downstream = cpu ? output->downstream_cpu_ns.load() : output->downstream_wall_ns.load();
+        return std::max<int64_t>(inclusive - downstream, 0);
+    }
+
+    static std::string FormatMs(int64_t ns)
+    {
+        if (ns < 0)
+            return "n/a";
+        return std::to_string(ns / 1e6) + " ms";
+    }
+
+    void PrintTree(std::stringstream &ss, const arrow::compute::ExecNode *node, int indent) const
+    {
+        auto summary = Summarize(node);
+        std::string pad(indent * 2, ' ');
+        ss << pad << node->kind_name() << ":" << node->label()
+           << " in_rows=" << summary.input_rows << " in_batches=" << summary.input_batches;
+        if (summary.output)
+        {
+            ss << " out_rows=" << summary.output->output_rows << " out_batches=" << summary.output->output_batches
+               << " out_bytes=" << summary.output->output_bytes
+               << " first_batch_delay=" << FormatMs(summary.output->first_batch_delay_ns)
+               << " peak_pool_bytes=" << summary.output->peak_pool_bytes;
+        }
+        ss << " wall=" << FormatMs(SelfTime(summary.inclusive_wall_ns, summary.output, false))
+           << " cpu=" << FormatMs(SelfTime(summary.inclusive_cpu_ns, summary.output, true)) << std::endl;
+        for (auto *child : summary.children)
+        {
+            PrintTree(ss, child, indent + 1);
+        }
+    }
+
+    void PrintJson(std::stringstream &ss, const arrow::compute::ExecNode *node) const
+    {
+        auto summary = Summarize(node);
+        ss << "{\"kind\":\"" << node->kind_name() << "\",\"label\":\"" << node->label() << "\""
+           << ",\"input_rows\":" << summary.input_rows << ",\"input_batches\":" << summary.input_batches;
+        if (summary.output)
+        {
+            ss << ",\"output_rows\":" << summary.output->output_rows
+               << ",\"output_batches\":" << summary.output->output_batches
+               << ",\"output_bytes\":" << summary.output->output_bytes
+               << ",\"first_batch_delay_ns\":" << summary.output->first_batch_delay_ns
+               << ",\"peak_pool_bytes\":" << summary.output->peak_pool_bytes;
+        }
+        ss << ",\"wall_ns\":" << SelfTime(summary.inclusive_wall_ns, summary.output, false)
+           << ",\"cpu_ns\":" << SelfTime(summary.inclusive_cpu_ns, summary.output, true)
+           << ",\"inputs\":[";
+        for (size_t i = 0; i < summary.children.size(); ++i)
+        {
+            if (i > 0)
+                ss << ",";
+            PrintJson(ss, summary.children[i]);
+        }
+        ss << "]}";
+    }
+
+    arrow::MemoryPool *pool_;
+    std::map<const arrow::compute::ExecNode *, std::shared_ptr<NodeProfile>> profiles_; // 被统计的节点 -> 统计数据
+};
+
+#endif
@@ -0,0 +1,261 @@
+
+#include <arrow/api.h>
+#include <arrow/io/api.h>
+#include <arrow/result.h>
+#include <arrow/status.h>
+#include <arrow/type.h>
+#include <arrow/compute/api.h>
+#include <arrow/compute/registry.h>
+#include <arrow/compute/exec/exec_plan.h>
+#include <arrow/compute/exec/expression.h>
+#include <arrow/compute/exec/options.h>
+
+#include <iostream>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <mutex>
+using namespace std;
+
+#include "common.h"
+
+/**
+ * @brief 第i个参数的占位符，在模板中以字段引用的形式出现
+ *
+ */
+arrow::compute::Expression Param(int i)
+{
+    return arrow::compute::field_ref("$" + std::to_string(i));
+}
+
+/**
+ * @brief 查询模板：对table做 过滤 + 分组聚合
+ *
+ */
+struct PlanTemplate
+{
+    std::string key;                                       // 模板的唯一标识，用于缓存
+    std::shared_ptr<arrow::Table> table;                   // 数据源
+    arrow::compute::Expression filter;                     // 可以包含Param(i)
+    std::vector<std::shared_ptr<arrow::DataType>> param_types; // 每个参数的类型
+    std::vector<arrow::compute::Aggregate> aggregates;
+    std::vector<arrow::FieldRef> keys;
+};
+
+/**
+ * @brief 已校验并绑定好的查询，可以反复用不同的参数执行
+ *
+ * 准备阶段完成：参数类型校验、表达式绑定（解析函数并选定kernel）、聚合函数的注册表查找。
+ * 执行阶段把占位符替换成字面量，已绑定的表达式在filter节点中不会再次绑定。
+ * Arrow 9的ExecPlan只能执行一次，每次执行仍要重新构造和校验ExecPlan，缓存省下的只是上面的准备工作。
+ */
+class PreparedStatement
+{
+public:
+    static arrow::Result<std::shared_ptr<PreparedStatement>> Prepare(const PlanTemplate &plan_template)
+    {
+        auto statement = std::make_shared<PreparedStatement>();
+        statement->template_ = plan_template;
+
+        // 参数作为额外的列加入schema，这样绑定时就能校验参数的类型
+        auto fields = plan_template.table->schema()->fields();
+        for (size_t i = 0; i < plan_template.param_types.size(); ++i)
+        {
+            fields.push_back(arrow::field("$" + std::to_string(i), plan_template.param_types[i]));
+        }
+        ARROW_ASSIGN_OR_RAISE(statement->bound_filter_, plan_template.filter.Bind(*arrow::schema(fields)));
+        if (!statement->bound_filter_.type()->Equals(arrow::boolean()))
+        {
+            return arrow::Status::TypeError("Filter must be boolean, got ", statement->bound_filter_.type()->ToString());
+        }
+
+        // 提前检查聚合函数是否存在
+        auto registry = arrow::compute::GetFunctionRegistry();
+        for (const auto &aggregate : plan_template.aggregates)
+        {
+            ARROW_RETURN_NOT_OK(registry->GetFunction(aggregate.function).status());
+        }
+        return statement;
+    }
+
+    /**
+     * @brief 用参数实例化并执行
+     *
+     */
+    arrow::Result<std::shared_ptr<arrow::Table>> Execute(const std::vector<arrow::Datum> &params) const
+    {
+        if (params.size() != template_.param_types.size())
+        {
+            return arrow::Status::Invalid("Expected ", template_.param_types.size(), " parameters, got ", params.size());
+        }
+        for (size_t i = 0; i < params.size(); ++i)
+        {
+            if (!params[i].is_scalar() || !params[i].type()->Equals(template_.param_types[i]))
+            {
+                return arrow::Status::TypeError("Parameter ", i, " must be a ", template_.param_types[i]->ToString(), " scalar");
+            }
+        }
+        auto begin = std::chrono::steady_clock::now();
+        ARROW_ASSIGN_OR_RAISE(auto filter, BindParameters(bound_filter_, params));
+
+        arrow::compute::ExecContext exec_context;
+        ARROW_ASSIGN_OR_RAISE(std::shared_ptr<arrow::compute::ExecPlan> plan, arrow::compute::ExecPlan::Make(&exec_context));
+        arrow::AsyncGenerator<arrow::util::optional<arrow::compute::ExecBatch>> sink_gen;
+        ARROW_ASSIGN_OR_RAISE(arrow::compute::ExecNode * source,
+                              arrow::compute::MakeExecNode("table_source", plan.get(), {},
+                                                           arrow::compute::TableSourceNodeOptions{template_.table, 4096}));
+        ARROW_ASSIGN_OR_RAISE(arrow::compute::ExecNode * filter_node,
+                              arrow::compute::MakeExecNode("filter", plan.get(), {source},
+                                                           arrow::compute::FilterNodeOptions{filter}));
+        ARROW_ASSIGN_OR_RAISE(arrow::compute::ExecNode * aggregate,
+                              arrow::compute::MakeExecNode("aggregate", plan.get(), {filter_node},
+                                                           arrow::compute::AggregateNodeOptions{template_.aggregates, template_.keys}));
+        ARROW_RETURN_NOT_OK(
+            arrow::compute::MakeExecNode("sink", plan.get(), {aggregate}, arrow::compute::SinkNodeOptions{&sink_gen}));
+        ARROW_ASSIGN_OR_RAISE(auto result, ExecutePlanToTable(exec_context, plan, aggregate->output_schema(), sink_gen));
+        ++executions_;
+        execute_ns_ += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - begin).count();
+        return result;
+    }
+
+    int64_t executions() const { return executions_; }
+    int64_t execute_ns() const { return execute_ns_; } // 实测的执行耗时，包括每次构造ExecPlan
+
+private:
+    /**
+     * @brief 把已绑定表达式中的占位符替换成字面量，其余的函数和kernel保持不变
+     *
+     */
+    static arrow::Result<arrow::compute::Expression> BindParameters(const arrow::compute::Expression &expr,
+                                                                   const std::vector<arrow::Datum> &params)
+    {
+        if (auto ref = expr.field_ref())
+        {
+            if (ref->IsName() && !ref->name()->empty() && (*ref->name())[0] == '$')
+            {
+                size_t index = std::stoul(ref->name()->substr(1));
+                if (index >= params.size())
+                {
+                    return arrow::Status::Invalid("Missing parameter ", *ref->name());
+                }
+                return arrow::compute::literal(params[index]);
+            }
+            return expr;
+        }
+        if (auto call = expr.call())
+        {
+            // 参数类型与绑定时一致，因此原来选定的kernel仍然适用
+            arrow::compute::Expression::Call bound_call = *call;
+            for (auto &argument : bound_call.arguments)
+            {
+                ARROW_ASSIGN_OR_RAISE(argument, BindParameters(argument, params));
+            }
+            return arrow::compute::Expression(std::move(bound_call));
+        }
+        return expr;
+    }
+
+    PlanTemplate template_;
+    arrow::compute::Expression bound_filter_;
+    mutable std::atomic<int64_t> executions_{0};
+    mutable std::atomic<int64_t> execute_ns_{0};
+};
+
+/**
+ * @brief 按模板key缓存PreparedStatement，并统计命中率、实测的准备耗时和执行耗时
+ *
+ */
+class PlanCache
+{
+public:
+    arrow::Result<std::shared_ptr<PreparedStatement>> GetOrPrepare(const PlanTemplate &plan_template)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto it = statements_.find(plan_template.key);
+            if (it != statements_.end())
+            {
+                ++hits_;
+                return it->second;
+            }
+        }
+        auto begin = std::chrono::steady_clock::now();
+        ARROW_ASSIGN_OR_RAISE(auto statement, PreparedStatement::Prepare(plan_template));
+        int64_t cost_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - begin).count();
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        ++misses_;
+        prepare_ns_ += cost_ns;
+        // 并发准备同一模板时保留先写入的那个
+        return statements_.emplace(plan_template.key, statement).first->second;
+    }
+
+    std::string Metrics() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        int64_t lookups = hits_ + misses_;
+        double hit_rate = lookups == 0 ? 0 : static_cast<double>(hits_) / lookups;
+        double avg_prepare_ms = misses_ == 0 ? 0 : prepare_ns_ / 1e6 / misses_;
+        int64_t executions = 0;
+        int64_t execute_ns = 0;
+        for (const auto &statement : statements_)
+        {
+            executions += statement.second->executions();
+            execute_ns += statement.second->execute_ns();
+        }
+        double avg_execute_ms = executions == 0 ? 0 : execute_ns / 1e6 / executions;
+        return "plan cache: entries=" + std::to_string(statements_.size()) +
+               " hits=" + std::to_string(hits_) + " misses=" + std::to_string(misses_) +
+               " hit_rate=" + std::to_string(hit_rate) +
+               " avg_prepare=" + std::to_string(avg_prepare_ms) + " ms" +
+               " executions=" + std::to_string(executions) +
+               " avg_execute=" + std::to_string(avg_execute_ms) + " ms";
+    }
+
+private:
+    mutable std::mutex mutex_;
+    std::map<std::string, std::shared_ptr<PreparedStatement>> statements_;
+    int64_t hits_ = 0;
+    int64_t misses_ = 0;
+    int64_t prepare_ns_ = 0;
+};
+
+arrow::Status opers()
+{
+    ARROW_ASSIGN_OR_RAISE(auto trades, CreateTradeTable(10000));
+
+    // 模板：select trderid, sum(qty), mean(pri) from trades where cuid = $0 and pri > $1 group by trderid
+    PlanTemplate plan_template;
+    plan_template.key = "trader_summary_by_cuid";
+    plan_template.table = trades;
+    plan_template.filter = arrow::compute::and_(
+        arrow::compute::equal(arrow::compute::field_ref("cuid"), Param(0)),
+        arrow::compute::greater(arrow::compute::field_ref("pri"), Param(1)));
+    plan_template.param_types = {arrow::utf8(), arrow::float64()};
+    auto options = std::make_shared<arrow::compute::ScalarAggregateOptions>(true);
+    plan_template.aggregates = {{"hash_sum", options, "qty", "sum(qty)"},
+                                {"hash_mean", options, "pri", "mean(pri)"}};
+    plan_template.keys = {"trderid"};
+
+    // 模拟看板的高频请求，每次只有参数不同
+    PlanCache cache;
+    for (int request = 0; request < 100; ++request)
+    {
+        ARROW_ASSIGN_OR_RAISE(auto statement, cache.GetOrPrepare(plan_template));
+        std::vector<arrow::Datum> params = {arrow::MakeScalar("C" + std::to_string(request % 13)),
+                                            arrow::MakeScalar(10.0 + request % 5)};
+        ARROW_ASSIGN_OR_RAISE(auto result, statement->Execute(params));
+        if (request == 0)
+        {
+            std::cout << "Results : " << result->ToString() << std::endl;
+        }
+    }
+    std::cout << cache.Metrics() << std::endl;
+    return arrow::Status::OK();
+}
+
+int main(int argc, char const *argv[])
+{
+    cout << opers() << endl;
+    return 0;
+}
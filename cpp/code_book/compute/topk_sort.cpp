@@ -0,0 +1,767 @@
+
+#include <arrow/api.h>
+#include <arrow/io/api.h>
+#include <arrow/ipc/api.h>
+#include <arrow/result.h>
+#include <arrow/status.h>
+#include <arrow/type.h>
+#include <arrow/filesystem/api.h>
+#include <arrow/compute/api.h>
+#include <arrow/compute/exec/exec_plan.h>
+#include <arrow/compute/exec/options.h>
+#include <arrow/util/byte_size.h>
+#include <arrow/util/checked_cast.h>
+#include <arrow/util/thread_pool.h>
+
+#include <iostream>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <unordered_map>
+using namespace std;
+
+#include "common.h"
+
+#define SPILL_DIR "./external_sort_spill/"
+
+/**
+ * @brief 生成带成交金额和成交日期的样例数据，部分tv为空
+ *
+ * @param num_rows 行数
+ * @return 数据表(trdno, trddate, tv)
+ */
+arrow::Result<std::shared_ptr<arrow::Table>> CreateTradeValueTable(int64_t num_rows)
+{
+    auto schema = arrow::schema({arrow::field("trdno", arrow::utf8()),
+                                 arrow::field("trddate", arrow::date32()),
+                                 arrow::field("tv", arrow::float64())});
+    arrow::StringBuilder trdno_builder;
+    arrow::Date32Builder trddate_builder;
+    arrow::DoubleBuilder tv_builder;
+    for (int64_t i = 0; i < num_rows; ++i)
+    {
+        ARROW_RETURN_NOT_OK(trdno_builder.Append("trade:" + std::to_string(i)));
+        ARROW_RETURN_NOT_OK(trddate_builder.Append(static_cast<int32_t>(19000 + i % 30)));
+        if (i % 97 == 0)
+        {
+            ARROW_RETURN_NOT_OK(tv_builder.AppendNull());
+        }
+        else
+        {
+            ARROW_RETURN_NOT_OK(tv_builder.Append(static_cast<double>((i * 7919) % 100003)));
+        }
+    }
+    std::vector<std::shared_ptr<arrow::Array>> arrays(3);
+    ARROW_RETURN_NOT_OK(trdno_builder.Finish(&arrays[0]));
+    ARROW_RETURN_NOT_OK(trddate_builder.Finish(&arrays[1]));
+    ARROW_RETURN_NOT_OK(tv_builder.Finish(&arrays[2]));
+    return arrow::Table::Make(schema, arrays);
+}
+
+/**
+ * @brief 检查排序列的类型是否支持跨batch比较，并返回列下标
+ *
+ */
+arrow::Result<std::vector<int>> ResolveSortKeys(const arrow::Schema &schema, const arrow::compute::SortOptions &sort_options)
+{
+    std::vector<int> indices;
+    for (const auto &sort_key : sort_options.sort_keys)
+    {
+        ARROW_ASSIGN_OR_RAISE(auto path, sort_key.target.FindOne(schema));
+        switch (schema.field(path[0])->type()->id())
+        {
+        case arrow::Type::INT32:
+        case arrow::Type::DATE32:
+        case arrow::Type::INT64:
+        case arrow::Type::DATE64:
+        case arrow::Type::TIMESTAMP:
+        case arrow::Type::DOUBLE:
+        case arrow::Type::STRING:
+            break;
+        default:
+            return arrow::Status::NotImplemented("Sorting on ", schema.field(path[0])->type()->ToString());
+        }
+        indices.push_back(path[0]);
+    }
+    return indices;
+}
+
+/**
+ * @brief 比较两个数组中的非空值，返回-1、0、1
+ *
+ */
+int CompareCell(const arrow::Array &a, int64_t i, const arrow::Array &b, int64_t j)
+{
+    switch (a.type_id())
+    {
+    case arrow::Type::INT32:
+    case arrow::Type::DATE32:
+    {
+        int32_t x = a.data()->GetValues<int32_t>(1)[i];
+        int32_t y = b.data()->GetValues<int32_t>(1)[j];
+        return x < y ? -1 : (x > y ? 1 : 0);
+    }
+    case arrow::Type::INT64:
+    case arrow::Type::DATE64:
+    case arrow::Type::TIMESTAMP:
+    {
+        int64_t x = a.data()->GetValues<int64_t>(1)[i];
+        int64_t y = b.data()->GetValues<int64_t>(1)[j];
+        return x < y ? -1 : (x > y ? 1 : 0);
+    }
+    case arrow::Type::DOUBLE:
+    {
+        double x = a.data()->GetValues<double>(1)[i];
+        double y = b.data()->GetValues<double>(1)[j];
+        return x < y ? -1 : (x > y ? 1 : 0);
+    }
+    default:
+    {
+        int result = arrow::internal::checked_cast<const arrow::StringArray &>(a).GetView(i).compare(
+            arrow::internal::checked_cast<const arrow::StringArray &>(b).GetView(j));
+        return result < 0 ? -1 : (result > 0 ? 1 : 0);
+    }
+    }
+}
+
+/**
+ * @brief 是否是浮点数NaN
+ *
+ */
+bool IsNaNCell(const arrow::Array &array, int64_t i)
+{
+    return array.type_id() == arrow::Type::DOUBLE && std::isnan(array.data()->GetValues<double>(1)[i]);
+}
+
+/**
+ * @brief 按多列排序键比较两行，空值和NaN的位置由null_placement决定，与升降序无关
+ *
+ * 与SortIndices一致：NaN紧挨着非空值，空值在最外侧（AtEnd时NaN在空值之前，AtStart时在空值之后）
+ */
+int CompareRows(const std::vector<std::shared_ptr<arrow::Array>> &a_keys, int64_t i,
+                const std::vector<std::shared_ptr<arrow::Array>> &b_keys, int64_t j,
+                const arrow::compute::SortOptions &sort_options)
+{
+    for (size_t k = 0; k < a_keys.size(); ++k)
+    {
+        bool a_null = a_keys[k]->IsNull(i);
+        bool b_null = b_keys[k]->IsNull(j);
+        if (a_null || b_null)
+        {
+            if (a_null && b_null)
+                continue;
+            bool nulls_first = sort_options.null_placement == arrow::compute::NullPlacement::AtStart;
+            return (a_null == nulls_first) ? -1 : 1;
+        }
+        bool a_nan = IsNaNCell(*a_keys[k], i);
+        bool b_nan = IsNaNCell(*b_keys[k], j);
+        if (a_nan || b_nan)
+        {
+            if (a_nan && b_nan)
+                continue;
+            bool nans_first = sort_options.null_placement == arrow::compute::NullPlacement::AtStart;
+            return (a_nan == nans_first) ? -1 : 1;
+        }
+        int result = CompareCell(*a_keys[k], i, *b_keys[k], j);
+        if (sort_options.sort_keys[k].order == arrow::compute::SortOrder::Descending)
+            result = -result;
+        if (result != 0)
+            return result;
+    }
+    return 0;
+}
+
+/**
+ * @brief 取一个batch中排序后的前k行
+ *
+ */
+arrow::Result<std::shared_ptr<arrow::RecordBatch>> TopKOfBatch(const std::shared_ptr<arrow::RecordBatch> &batch, int64_t k,
+                                                               const arrow::compute::SortOptions &sort_options)
+{
+    std::shared_ptr<arrow::Array> indices;
+    if (sort_options.null_placement == arrow::compute::NullPlacement::AtEnd && batch->num_rows() > k)
+    {
+        // select_k_unstable只需O(n)，它总是把空值放在最后
+        ARROW_ASSIGN_OR_RAISE(indices, arrow::compute::SelectKUnstable(batch, arrow::compute::SelectKOptions(k, sort_options.sort_keys)));
+    }
+    else
+    {
+        ARROW_ASSIGN_OR_RAISE(indices, arrow::compute::SortIndices(batch, sort_options));
+        indices = indices->Slice(0, std::min(k, indices->length()));
+    }
+    ARROW_ASSIGN_OR_RAISE(arrow::Datum taken, arrow::compute::Take(batch, indices));
+    return taken.record_batch();
+}
+
+/**
+ * @brief 合并一组batch后取前k行
+ *
+ */
+arrow::Result<std::shared_ptr<arrow::RecordBatch>> TopKOfBatches(const std::shared_ptr<arrow::Schema> &schema,
+                                                                 const std::vector<std::shared_ptr<arrow::RecordBatch>> &batches,
+                                                                 int64_t k, const arrow::compute::SortOptions &sort_options)
+{
+    ARROW_ASSIGN_OR_RAISE(auto table, arrow::Table::FromRecordBatches(schema, batches));
+    ARROW_ASSIGN_OR_RAISE(auto combined, table->CombineChunksToBatch(arrow::default_memory_pool()));
+    return TopKOfBatch(combined, k, sort_options);
+}
+
+/**
+ * @brief Top-K sink的参数，结果在plan结束后写入output
+ *
+ */
+class TopKSinkNodeOptions : public arrow::compute::ExecNodeOptions
+{
+public:
+    TopKSinkNodeOptions(int64_t k, arrow::compute::SortOptions sort_options, std::shared_ptr<arrow::Table> *output)
+        : k(k), sort_options(std::move(sort_options)), output(output) {}
+
+    int64_t k;
+    arrow::compute::SortOptions sort_options;
+    std::shared_ptr<arrow::Table> *output;
+};
+
+/**
+ * @brief Top-K sink：每个线程维护自己的前k行候选，结束时合并
+ *
+ */
+class TopKSinkNode : public arrow::compute::ExecNode
+{
+public:
+    TopKSinkNode(arrow::compute::ExecPlan *plan, std::vector<arrow::compute::ExecNode *> inputs,
+                 const TopKSinkNodeOptions &options)
+        : ExecNode(plan, std::move(inputs), {"collected"}, /*output_schema=*/nullptr, /*num_outputs=*/0),
+          k_(options.k), sort_options_(options.sort_options), output_(options.output) {}
+
+    static arrow::Result<arrow::compute::ExecNode *> Make(arrow::compute::ExecPlan *plan,
+                                                          std::vector<arrow::compute::ExecNode *> inputs,
+                                                          const arrow::compute::ExecNodeOptions &options)
+    {
+        if (inputs.size() != 1)
+        {
+            return arrow::Status::Invalid("topk_sink requires exactly one input");
+        }
+        const auto &topk_options = arrow::internal::checked_cast<const TopKSinkNodeOptions &>(options);
+        if (topk_options.k <= 0 || topk_options.output == nullptr)
+        {
+            return arrow::Status::Invalid("topk_sink requires k > 0 and an output table");
+        }
+        ARROW_RETURN_NOT_OK(ResolveSortKeys(*inputs[0]->output_schema(), topk_options.sort_options).status());
+        return plan->EmplaceNode<TopKSinkNode>(plan, std::move(inputs), topk_options);
+    }
+
+    const char *kind_name() const override { return "TopKSinkNode"; }
+
+    void InputReceived(arrow::compute::ExecNode *input, arrow::compute::ExecBatch batch) override
+    {
+        auto status = Consume(std::move(batch));
+        if (!status.ok())
+        {
+            ErrorReceived(input, status);
+            return;
+        }
+        if (++batches_received_ == total_batches_.load())
+            Finish();
+    }
+
+    void ErrorReceived(arrow::compute::ExecNode *input, arrow::Status error) override
+    {
+        inputs_[0]->StopProducing(this);
+        MarkFinishedOnce(std::move(error));
+    }
+
+    void InputFinished(arrow::compute::ExecNode *input, int total_batches) override
+    {
+        total_batches_ = total_batches;
+        if (batches_received_.load() == total_batches)
+            Finish();
+    }
+
+    arrow::Status StartProducing() override { return arrow::Status::OK(); }
+    void PauseProducing(arrow::compute::ExecNode *output, int32_t counter) override {}
+    void ResumeProducing(arrow::compute::ExecNode *output, int32_t counter) override {}
+    void StopProducing(arrow::compute::ExecNode *output) override { StopProducing(); }
+
+    void StopProducing() override
+    {
+        inputs_[0]->StopProducing(this);
+        MarkFinishedOnce(arrow::Status::OK());
+    }
+
+private:
+    struct Candidates
+    {
+        std::vector<std::shared_ptr<arrow::RecordBatch>> batches;
+        int64_t rows = 0;
+    };
+
+    arrow::Status Consume(arrow::compute::ExecBatch batch)
+    {
+        const auto &schema = inputs_[0]->output_schema();
+        ARROW_ASSIGN_OR_RAISE(auto record_batch, batch.ToRecordBatch(schema));
+        ARROW_ASSIGN_OR_RAISE(auto top, TopKOfBatch(record_batch, k_, sort_options_));
+
+        // 只在查找本线程的候选集时加锁，unordered_map扩容不会使已有元素的引用失效
+        Candidates *candidates;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            candidates = &per_thread_[std::this_thread::get_id()];
+        }
+        candidates->batches.push_back(top);
+        candidates->rows += top->num_rows();
+        // 候选超过2k行时压缩回k行，保证每个线程最多缓存2k行
+        if (candidates->rows > 2 * k_)
+        {
+            ARROW_ASSIGN_OR_RAISE(auto compacted, TopKOfBatches(schema, candidates->batches, k_, sort_options_));
+            candidates->batches = {compacted};
+            candidates->rows = compacted->num_rows();
+        }
+        return arrow::Status::OK();
+    }
+
+    void Finish()
+    {
+        auto status = Merge();
+        MarkFinishedOnce(status);
+    }
+
+    arrow::Status Merge()
+    {
+        const auto &schema = inputs_[0]->output_schema();
+        std::vector<std::shared_ptr<arrow::RecordBatch>> batches;
+        for (auto &item : per_thread_)
+        {
+            batches.insert(batches.end(), item.second.batches.begin(), item.second.batches.end());
+        }
+        if (batches.empty())
+        {
+            ARROW_ASSIGN_OR_RAISE(*output_, arrow::Table::MakeEmpty(schema));
+            return arrow::Status::OK();
+        }
+        // select_k的结果不保证有序，最后的k行再完整排序一次
+        ARROW_ASSIGN_OR_RAISE(auto top, TopKOfBatches(schema, batches, k_, sort_options_));
+        ARROW_ASSIGN_OR_RAISE(auto indices, arrow::compute::SortIndices(top, sort_options_));
+        ARROW_ASSIGN_OR_RAISE(arrow::Datum sorted, arrow::compute::Take(top, indices));
+        ARROW_ASSIGN_OR_RAISE(*output_, arrow::Table::FromRecordBatches(schema, {sorted.record_batch()}));
+        return arrow::Status::OK();
+    }
+
+    void MarkFinishedOnce(arrow::Status status)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!marked_finished_)
+        {
+            marked_finished_ = true;
+            finished_.MarkFinished(std::move(status));
+        }
+    }
+
+    int64_t k_;
+    arrow::compute::SortOptions sort_options_;
+    std::shared_ptr<arrow::Table> *output_;
+
+    std::mutex mutex_;
+    std::unordered_map<std::thread::id, Candidates> per_thread_;
+    std::atomic<int> batches_received_{0};
+    std::atomic<int> total_batches_{-1};
+    bool marked_finished_ = false;
+};
+
+/**
+ * @brief 外部排序sink的参数
+ *
+ * 输入先在内存中攒到run_bytes字节，排序后作为一个有序段落盘；输入结束后对所有段做k路归并，
+ * 每归并出output_batch_rows行就交给consumer处理。
+ */
+class ExternalSortSinkNodeOptions : public arrow::compute::ExecNodeOptions
+{
+public:
+    ExternalSortSinkNodeOptions(arrow::compute::SortOptions sort_options,
+                                std::function<arrow::Status(const std::shared_ptr<arrow::RecordBatch> &)> consumer,
+                                int64_t run_bytes = 64 << 20, int64_t output_batch_rows = 64 * 1024,
+                                std::string spill_dir = SPILL_DIR)
+        : sort_options(std::move(sort_options)), consumer(std::move(consumer)), run_bytes(run_bytes),
+          output_batch_rows(output_batch_rows), spill_dir(std::move(spill_dir)) {}
+
+    arrow::compute::SortOptions sort_options;
+    std::function<arrow::Status(const std::shared_ptr<arrow::RecordBatch> &)> consumer;
+    int64_t run_bytes;
+    int64_t output_batch_rows;
+    std::string spill_dir;
+};
+
+class ExternalSortSinkNode : public arrow::compute::ExecNode
+{
+public:
+    ExternalSortSinkNode(arrow::compute::ExecPlan *plan, std::vector<arrow::compute::ExecNode *> inputs,
+                         const ExternalSortSinkNodeOptions &options, std::vector<int> key_indices)
+        : ExecNode(plan, std::move(inputs), {"collected"}, /*output_schema=*/nullptr, /*num_outputs=*/0),
+          options_(options), key_indices_(std::move(key_indices)),
+          fs_(std::make_shared<arrow::fs::LocalFileSystem>()) {}
+
+    static arrow::Result<arrow::compute::ExecNode *> Make(arrow::compute::ExecPlan *plan,
+                                                          std::vector<arrow::compute::ExecNode *> inputs,
+                                                          const arrow::compute::ExecNodeOptions &options)
+    {
+        if (inputs.size() != 1)
+        {
+            return arrow::Status::Invalid("external_sort_sink requires exactly one input");
+        }
+        const auto &sort_options = arrow::internal::checked_cast<const ExternalSortSinkNodeOptions &>(options);
+        if (!sort_options.consumer)
+        {
+            return arrow::Status::Invalid("external_sort_sink requires a consumer");
+        }
+        ARROW_ASSIGN_OR_RAISE(auto key_indices, ResolveSortKeys(*inputs[0]->output_schema(), sort_options.sort_options));
+        return plan->EmplaceNode<ExternalSortSinkNode>(plan, std::move(inputs), sort_options, std::move(key_indices));
+    }
+
+    const char *kind_name() const override { return "ExternalSortSinkNode"; }
+
+    arrow::Status StartProducing() override
+    {
+        ARROW_RETURN_NOT_OK(fs_->CreateDir(options_.spill_dir));
+        return fs_->DeleteDirContents(options_.spill_dir);
+    }
+
+    void InputReceived(arrow::compute::ExecNode *input, arrow::compute::ExecBatch batch) override
+    {
+        auto status = Consume(std::move(batch));
+        if (!status.ok())
+        {
+            ErrorReceived(input, status);
+            return;
+        }
+        if (++batches_received_ == total_batches_.load())
+            Finish();
+    }
+
+    void ErrorReceived(arrow::compute::ExecNode *input, arrow::Status error) override
+    {
+        inputs_[0]->StopProducing(this);
+        MarkFinishedOnce(std::move(error));
+    }
+
+    void InputFinished(arrow::compute::ExecNode *input, int total_batches) override
+    {
+        total_batches_ = total_batches;
+        if (batches_received_.load() == total_batches)
+            Finish();
+    }
+
+    void PauseProducing(arrow::compute::ExecNode *output, int32_t counter) override {}
+    void ResumeProducing(arrow::compute::ExecNode *output, int32_t counter) override {}
+    void StopProducing(arrow::compute::ExecNode *output) override { StopProducing(); }
+
+    void StopProducing() override
+    {
+        inputs_[0]->StopProducing(this);
+        MarkFinishedOnce(arrow::Status::OK());
+    }
+
+private:
+    /**
+     * @brief 归并时每个有序段的读取位置
+     *
+     */
+    struct RunCursor
+    {
+        std::shared_ptr<arrow::ipc::RecordBatchFileReader> reader;
+        int next_batch = 0;
+        std::shared_ptr<arrow::RecordBatch> batch;
+        std::vector<std::shared_ptr<arrow::Array>> keys;
+        int64_t row = 0;
+    };
+
+    struct Segment
+    {
+        std::shared_ptr<arrow::RecordBatch> batch;
+        int run;
+        int64_t start;
+        int64_t length;
+    };
+
+    arrow::Status Consume(arrow::compute::ExecBatch batch)
+    {
+        ARROW_ASSIGN_OR_RAISE(auto record_batch, batch.ToRecordBatch(inputs_[0]->output_schema()));
+        std::vector<std::shared_ptr<arrow::RecordBatch>> run;
+        int run_id = -1;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            buffered_.push_back(record_batch);
+            buffered_bytes_ += arrow::util::TotalBufferSize(*record_batch);
+            if (buffered_bytes_ < options_.run_bytes)
+                return arrow::Status::OK();
+            // 攒够一个段，交换出来后在锁外排序落盘
+            run.swap(buffered_);
+            buffered_bytes_ = 0;
+            run_id = num_runs_++;
+        }
+        return SpillRun(run, run_id);
+    }
+
+    arrow::Result<std::shared_ptr<arrow::Table>> SortBatches(const std::vector<std::shared_ptr<arrow::RecordBatch>> &batches)
+    {
+        ARROW_ASSIGN_OR_RAISE(auto table, arrow::Table::FromRecordBatches(inputs_[0]->output_schema(), batches));
+        ARROW_ASSIGN_OR_RAISE(auto indices, arrow::compute::SortIndices(table, options_.sort_options));
+        ARROW_ASSIGN_OR_RAISE(arrow::Datum sorted, arrow::compute::Take(table, indices));
+        return sorted.table();
+    }
+
+    std::string RunPath(int run_id) const
+    {
+        return options_.spill_dir + "run_" + std::to_string(run_id) + ".arrow";
+    }
+
+    arrow::Status SpillRun(const std::vector<std::shared_ptr<arrow::RecordBatch>> &batches, int run_id)
+    {
+        ARROW_ASSIGN_OR_RAISE(auto sorted, SortBatches(batches));
+        ARROW_ASSIGN_OR_RAISE(auto output, fs_->OpenOutputStream(RunPath(run_id)));
+        ARROW_ASSIGN_OR_RAISE(auto writer, arrow::ipc::MakeFileWriter(output.get(), sorted->schema()));
+        ARROW_RETURN_NOT_OK(writer->WriteTable(*sorted, options_.output_batch_rows));
+        ARROW_RETURN_NOT_OK(writer->Close());
+        return output->Close();
+    }
+
+    void Finish()
+    {
+        auto status = MergeRuns();
+        auto cleanup = fs_->DeleteDirContents(options_.spill_dir);
+        MarkFinishedOnce(status.ok() ? cleanup : status);
+    }
+
+    arrow::Status EmitSorted(const std::shared_ptr<arrow::Table> &sorted)
+    {
+        arrow::TableBatchReader batch_reader(*sorted);
+        batch_reader.set_chunksize(options_.output_batch_rows);
+        std::shared_ptr<arrow::RecordBatch> batch;
+        while (true)
+        {
+            ARROW_RETURN_NOT_OK(batch_reader.ReadNext(&batch));
+            if (!batch)
+                break;
+            ARROW_RETURN_NOT_OK(options_.consumer(batch));
+        }
+        return arrow::Status::OK();
+    }
+
+    arrow::Status LoadNextBatch(RunCursor *cursor)
+    {
+        cursor->batch = nullptr;
+        while (cursor->next_batch < cursor->reader->num_record_batches())
+        {
+            ARROW_ASSIGN_OR_RAISE(auto batch, cursor->reader->ReadRecordBatch(cursor->next_batch++));
+            if (batch->num_rows() == 0)
+                continue;
+            cursor->batch = batch;
+            cursor->row = 0;
+            cursor->keys.clear();
+            for (int index : key_indices_)
+            {
+                cursor->keys.push_back(batch->column(index));
+            }
+            break;
+        }
+        return arrow::Status::OK();
+    }
+
+    /**
+     * @brief 把选出的行段拼成一个batch交给consumer
+     *
+     * 行段是对各段当前batch的零拷贝切片，但多路交错时行段可能只有几行，
+     * 所以这里拷贝一次拼成output_batch_rows行的batch，而不是把大量小切片直接交出去
+     */
+    arrow::Status FlushSegments(std::vector<Segment> *segments)
+    {
+        if (segments->empty())
+            return arrow::Status::OK();
+        std::vector<std::shared_ptr<arrow::RecordBatch>> slices;
+        for (const auto &segment : *segments)
+        {
+            slices.push_back(segment.batch->Slice(segment.start, segment.length));
+        }
+        segments->clear();
+        ARROW_ASSIGN_OR_RAISE(auto table, arrow::Table::FromRecordBatches(inputs_[0]->output_schema(), slices));
+        ARROW_ASSIGN_OR_RAISE(auto combined, table->CombineChunksToBatch(arrow::default_memory_pool()));
+        return options_.consumer(combined);
+    }
+
+    arrow::Status MergeRuns()
+    {
+        // 没有落过盘时直接在内存中排序
+        if (num_runs_ == 0)
+        {
+            if (buffered_.empty())
+                return arrow::Status::OK();
+            ARROW_ASSIGN_OR_RAISE(auto sorted, SortBatches(buffered_));
+            buffered_.clear();
+            return EmitSorted(sorted);
+        }
+        if (!buffered_.empty())
+        {
+            ARROW_RETURN_NOT_OK(SpillRun(buffered_, num_runs_++));
+            buffered_.clear();
+        }
+
+        std::vector<RunCursor> cursors(num_runs_);
+        for (int r = 0; r < num_runs_; ++r)
+        {
+            ARROW_ASSIGN_OR_RAISE(auto input, fs_->OpenInputFile(RunPath(r)));
+            ARROW_ASSIGN_OR_RAISE(cursors[r].reader, arrow::ipc::RecordBatchFileReader::Open(input));
+            ARROW_RETURN_NOT_OK(LoadNextBatch(&cursors[r]));
+        }
+
+        // 小顶堆，堆顶是当前最小的一行；相等时按段号保持稳定
+        const auto &sort_options = options_.sort_options;
+        auto comes_after = [&cursors, &sort_options](int a, int b)
+        {
+            int result = CompareRows(cursors[a].keys, cursors[a].row, cursors[b].keys, cursors[b].row, sort_options);
+            return result > 0 || (result == 0 && a > b);
+        };
+        std::priority_queue<int, std::vector<int>, decltype(comes_after)> heap(comes_after);
+        for (int r = 0; r < num_runs_; ++r)
+        {
+            if (cursors[r].batch)
+                heap.push(r);
+        }
+
+        std::vector<Segment> segments;
+        int64_t selected_rows = 0;
+        while (!heap.empty())
+        {
+            int r = heap.top();
+            heap.pop();
+            RunCursor &cursor = cursors[r];
+            if (!segments.empty() && segments.back().run == r && segments.back().batch == cursor.batch &&
+                segments.back().start + segments.back().length == cursor.row)
+            {
+                segments.back().length += 1;
+            }
+            else
+            {
+                segments.push_back(Segment{cursor.batch, r, cursor.row, 1});
+            }
+            ++selected_rows;
+
+            if (++cursor.row >= cursor.batch->num_rows())
+            {
+                ARROW_RETURN_NOT_OK(LoadNextBatch(&cursor));
+            }
+            if (cursor.batch)
+                heap.push(r);
+
+            if (selected_rows >= options_.output_batch_rows)
+            {
+                ARROW_RETURN_NOT_OK(FlushSegments(&segments));
+                selected_rows = 0;
+            }
+        }
+        return FlushSegments(&segments);
+    }
+
+    void MarkFinishedOnce(arrow::Status status)
+    {
+        std::lock_guard<std::mutex> lock(finish_mutex_);
+        if (!marked_finished_)
+        {
+            marked_finished_ = true;
+            finished_.MarkFinished(std::move(status));
+        }
+    }
+
+    ExternalSortSinkNodeOptions options_;
+    std::vector<int> key_indices_;
+    std::shared_ptr<arrow::fs::FileSystem> fs_;
+
+    std::mutex mutex_;
+    std::vector<std::shared_ptr<arrow::RecordBatch>> buffered_;
+    int64_t buffered_bytes_ = 0;
+    int num_runs_ = 0;
+    std::atomic<int> batches_received_{0};
+    std::atomic<int> total_batches_{-1};
+    std::mutex finish_mutex_;
+    bool marked_finished_ = false;
+};
+
+/**
+ * @brief 注册topk_sink和external_sort_sink
+ *
+ */
+arrow::Status RegisterSortSinkNodes()
+{
+    auto registry = arrow::compute::default_exec_factory_registry();
+    ARROW_RETURN_NOT_OK(registry->AddFactory("topk_sink", TopKSinkNode::Make));
+    return registry->AddFactory("external_sort_sink", ExternalSortSinkNode::Make);
+}
+
+/**
+ * @brief 执行只有自定义sink的plan，等待其结束
+ *
+ */
+arrow::Status RunPlan(std::shared_ptr<arrow::compute::ExecPlan> plan)
+{
+    ARROW_RETURN_NOT_OK(plan->Validate());
+    std::cout << "ExecPlan created : " << plan->ToString() << std::endl;
+    ARROW_RETURN_NOT_OK(plan->StartProducing());
+    return plan->finished().status();
+}
+
+arrow::Status opers()
+{
+    ARROW_RETURN_NOT_OK(RegisterSortSinkNodes());
+    ARROW_ASSIGN_OR_RAISE(auto trades, CreateTradeValueTable(200000));
+    arrow::compute::ExecContext exec_context(arrow::default_memory_pool(), arrow::internal::GetCpuThreadPool());
+
+    {
+        // 成交金额最大的100笔，不做全量排序
+        ARROW_ASSIGN_OR_RAISE(std::shared_ptr<arrow::compute::ExecPlan> plan, arrow::compute::ExecPlan::Make(&exec_context));
+        ARROW_ASSIGN_OR_RAISE(arrow::compute::ExecNode * source,
+                              arrow::compute::MakeExecNode("table_source", plan.get(), {},
+                                                           arrow::compute::TableSourceNodeOptions{trades, 8192}));
+        std::shared_ptr<arrow::Table> top_trades;
+        arrow::compute::SortOptions sort_options({arrow::compute::SortKey("tv", arrow::compute::SortOrder::Descending)},
+                                                 arrow::compute::NullPlacement::AtEnd);
+        ARROW_RETURN_NOT_OK(arrow::compute::MakeExecNode("topk_sink", plan.get(), {source},
+                                                         TopKSinkNodeOptions{100, sort_options, &top_trades}));
+        ARROW_RETURN_NOT_OK(RunPlan(plan));
+        arrow::PrettyPrintOptions print_options(/*indent=*/0, /*window=*/5);
+        ARROW_RETURN_NOT_OK(arrow::PrettyPrint(*top_trades, print_options, &std::cout));
+    }
+
+    {
+        // 按成交日期倒序、成交金额正序全量排序，段大小设得很小以演示落盘归并
+        ARROW_ASSIGN_OR_RAISE(std::shared_ptr<arrow::compute::ExecPlan> plan, arrow::compute::ExecPlan::Make(&exec_context));
+        ARROW_ASSIGN_OR_RAISE(arrow::compute::ExecNode * source,
+                              arrow::compute::MakeExecNode("table_source", plan.get(), {},
+                                                           arrow::compute::TableSourceNodeOptions{trades, 8192}));
+        arrow::compute::SortOptions sort_options({arrow::compute::SortKey("trddate", arrow::compute::SortOrder::Descending),
+                                                  arrow::compute::SortKey("tv", arrow::compute::SortOrder::Ascending)},
+                                                 arrow::compute::NullPlacement::AtStart);
+        int64_t sorted_rows = 0;
+        std::shared_ptr<arrow::RecordBatch> first_batch;
+        auto consumer = [&sorted_rows, &first_batch](const std::shared_ptr<arrow::RecordBatch> &batch)
+        {
+            if (!first_batch)
+                first_batch = batch->Slice(0, 5);
+            sorted_rows += batch->num_rows();
+            return arrow::Status::OK();
+        };
+        ARROW_RETURN_NOT_OK(arrow::compute::MakeExecNode("external_sort_sink", plan.get(), {source},
+                                                         ExternalSortSinkNodeOptions{sort_options, consumer,
+                                                                                     /*run_bytes=*/512 * 1024,
+                                                                                     /*output_batch_rows=*/16384}));
+        ARROW_RETURN_NOT_OK(RunPlan(plan));
+        std::cout << "sorted " << sorted_rows << " rows, head: " << first_batch->ToString() << std::endl;
+    }
+    return arrow::Status::OK();
+}
+
+int main(int argc, char const *argv[])
+{
+    cout << opers() << endl;
+    return 0;
+}
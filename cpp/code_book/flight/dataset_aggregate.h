@@ -0,0 +1,186 @@
+#ifndef DATASET_AGGREGATE_H
+#define DATASET_AGGREGATE_H
+
+#include <arrow/api.h>
+#include <arrow/compute/api.h>
+#include <arrow/compute/exec/exec_plan.h>
+#include <arrow/compute/exec/expression.h>
+#include <arrow/compute/exec/options.h>
+#include <arrow/dataset/dataset.h>
+#include <arrow/dataset/file_base.h>
+#include <arrow/dataset/plan.h>
+#include <arrow/dataset/scanner.h>
+#include <arrow/util/async_generator.h>
+#include <arrow/util/thread_pool.h>
+
+#include <set>
+#include <string>
+#include <vector>
+
+#include "exchange_pipeline.h"
+
+/**
+ * 服务端聚合：客户端只要几个汇总值时，不必把全部行拉回去自己算。
+ *
+ * 查询写在DoGet的ticket里，各部分用'|'分隔：
+ *   "aggregate:数据集|by:列,列|sum:列|mean:列|min:列|max:列|count|count_distinct:列|filter:列,gt,值"
+ * by省略时整体聚合，多个filter取AND。执行计划是scan -> filter -> aggregate -> sink，
+ * scan按过滤条件和清单里各文件的min/max跳过文件，扫描和聚合都在CPU线程池上并行，只返回聚合后的表。
+ */
+
+struct AggregateQuery
+{
+    std::string dataset;
+    std::vector<std::string> keys;
+    std::vector<std::pair<std::string, std::string>> aggregates; // (函数, 列)，count的列为空
+    std::vector<std::vector<std::string>> filters;               // (列, 比较符, 值)
+};
+
+/**
+ * @brief 解析"aggregate:"之后的部分
+ *
+ */
+arrow::Result<AggregateQuery> ParseAggregateQuery(const std::string &text)
+{
+    static const std::set<std::string> kFunctions{"sum", "mean", "min", "max", "count", "count_distinct"};
+    auto parts = SplitExchangeCommand(text, '|');
+    AggregateQuery query;
+    query.dataset = parts[0];
+    for (size_t i = 1; i < parts.size(); ++i)
+    {
+        size_t colon = parts[i].find(':');
+        std::string name = parts[i].substr(0, colon);
+        std::string args = colon == std::string::npos ? "" : parts[i].substr(colon + 1);
+        if (name == "by")
+        {
+            query.keys = SplitExchangeCommand(args, ',');
+        }
+        else if (name == "filter")
+        {
+            auto filter = SplitExchangeCommand(args, ',');
+            if (filter.size() != 3)
+                return arrow::Status::Invalid("filter takes <column>,eq|ne|lt|le|gt|ge,<value>");
+            query.filters.push_back(filter);
+        }
+        else if (kFunctions.count(name) > 0)
+        {
+            if (args.empty() && name != "count")
+                return arrow::Status::Invalid(name, " needs a column");
+            query.aggregates.emplace_back(name, args);
+        }
+        else
+        {
+            return arrow::Status::NotImplemented("Unknown aggregate query part: ", name);
+        }
+    }
+    if (query.dataset.empty() || query.aggregates.empty())
+    {
+        return arrow::Status::Invalid("Aggregate query needs a dataset and at least one aggregate function");
+    }
+    return query;
+}
+
+/**
+ * @brief 在数据集上执行聚合查询
+ *
+ * @return arrow::Result<std::shared_ptr<arrow::Table>> 每个分组一行，先是各聚合结果（列名如"sum(pri)"），再是分组列
+ */
+arrow::Result<std::shared_ptr<arrow::Table>> ExecuteAggregateQuery(const std::shared_ptr<arrow::dataset::Dataset> &dataset,
+                                                                   const AggregateQuery &query)
+{
+    // Arrow 9需要显式注册scan节点
+    arrow::dataset::internal::Initialize();
+    auto schema = dataset->schema();
+
+    // 只读分组列、聚合列和过滤列
+    std::set<std::string> columns(query.keys.begin(), query.keys.end());
+    arrow::compute::Expression filter = arrow::compute::literal(true);
+    for (const auto &condition : query.filters)
+    {
+        auto field = schema->GetFieldByName(condition[0]);
+        if (field == nullptr)
+            return arrow::Status::KeyError("Column ", condition[0], " not found in ", schema->ToString());
+        ARROW_ASSIGN_OR_RAISE(auto function, ComparisonFunction(condition[1]));
+        ARROW_ASSIGN_OR_RAISE(auto value, arrow::Scalar::Parse(field->type(), condition[2]));
+        filter = arrow::compute::and_(filter, arrow::compute::call(function, {arrow::compute::field_ref(condition[0]),
+                                                                               arrow::compute::literal(value)}));
+        columns.insert(condition[0]);
+    }
+
+    std::vector<arrow::compute::Aggregate> aggregates;
+    bool grouped = !query.keys.empty();
+    for (const auto &aggregate : query.aggregates)
+    {
+        std::string column = aggregate.second;
+        std::shared_ptr<arrow::compute::FunctionOptions> options;
+        std::string name = aggregate.first + "(" + (column.empty() ? "*" : column) + ")";
+        if (aggregate.first == "count")
+        {
+            // count(*)随便数一列，包括null
+            if (column.empty())
+            {
+                column = grouped ? query.keys.front() : schema->field(0)->name();
+                options = std::make_shared<arrow::compute::CountOptions>(arrow::compute::CountOptions::ALL);
+            }
+            else
+            {
+                options = std::make_shared<arrow::compute::CountOptions>(arrow::compute::CountOptions::ONLY_VALID);
+            }
+        }
+        else if (aggregate.first == "count_distinct")
+        {
+            options = std::make_shared<arrow::compute::CountOptions>(arrow::compute::CountOptions::ONLY_VALID);
+        }
+        else
+        {
+            options = std::make_shared<arrow::compute::ScalarAggregateOptions>(/*skip_nulls=*/true, /*min_count=*/0);
+        }
+        if (schema->GetFieldIndex(column) < 0)
+            return arrow::Status::KeyError("Column ", column, " not found in ", schema->ToString());
+        columns.insert(column);
+        aggregates.push_back({(grouped ? "hash_" : "") + aggregate.first, options, arrow::FieldRef(column), name});
+    }
+    std::vector<arrow::FieldRef> keys;
+    for (const auto &key : query.keys)
+    {
+        if (schema->GetFieldIndex(key) < 0)
+            return arrow::Status::KeyError("Column ", key, " not found in ", schema->ToString());
+        keys.emplace_back(key);
+    }
+
+    auto scan_options = std::make_shared<arrow::dataset::ScanOptions>();
+    scan_options->dataset_schema = schema;
+    scan_options->filter = filter;
+    scan_options->use_threads = true;
+    ARROW_ASSIGN_OR_RAISE(auto projection, arrow::dataset::ProjectionDescr::FromNames(
+                                               std::vector<std::string>(columns.begin(), columns.end()), *schema));
+    arrow::dataset::SetProjection(scan_options.get(), std::move(projection));
+
+    // 执行器为CPU线程池，各节点在线程池上并行处理batch
+    arrow::compute::ExecContext exec_context(arrow::default_memory_pool(), arrow::internal::GetCpuThreadPool());
+    ARROW_ASSIGN_OR_RAISE(std::shared_ptr<arrow::compute::ExecPlan> plan, arrow::compute::ExecPlan::Make(&exec_context));
+    arrow::AsyncGenerator<arrow::util::optional<arrow::compute::ExecBatch>> sink_gen;
+    ARROW_ASSIGN_OR_RAISE(arrow::compute::ExecNode * scan,
+                          arrow::compute::MakeExecNode("scan", plan.get(), {},
+                                                       arrow::dataset::ScanNodeOptions{dataset, scan_options}));
+    // scan只按统计信息跳过文件和row group，逐行过滤在filter节点
+    ARROW_ASSIGN_OR_RAISE(arrow::compute::ExecNode * filter_node,
+                          arrow::compute::MakeExecNode("filter", plan.get(), {scan},
+                                                       arrow::compute::FilterNodeOptions{filter}));
+    ARROW_ASSIGN_OR_RAISE(arrow::compute::ExecNode * aggregate,
+                          arrow::compute::MakeExecNode("aggregate", plan.get(), {filter_node},
+                                                       arrow::compute::AggregateNodeOptions{aggregates, keys}));
+    ARROW_RETURN_NOT_OK(
+        arrow::compute::MakeExecNode("sink", plan.get(), {aggregate}, arrow::compute::SinkNodeOptions{&sink_gen}));
+
+    std::shared_ptr<arrow::RecordBatchReader> sink_reader =
+        arrow::compute::MakeGeneratorReader(aggregate->output_schema(), std::move(sink_gen), exec_context.memory_pool());
+    ARROW_RETURN_NOT_OK(plan->Validate());
+    ARROW_RETURN_NOT_OK(plan->StartProducing());
+    auto result = arrow::Table::FromRecordBatchReader(sink_reader.get());
+    plan->StopProducing();
+    ARROW_RETURN_NOT_OK(plan->finished().status());
+    return result;
+}
+
+#endif
@@ -0,0 +1,444 @@
+#ifndef DATASET_MANIFEST_H
+#define DATASET_MANIFEST_H
+
+#include <arrow/api.h>
+#include <arrow/io/api.h>
+#include <arrow/result.h>
+#include <arrow/status.h>
+#include <arrow/compute/exec/expression.h>
+#include <arrow/filesystem/api.h>
+#include <arrow/ipc/api.h>
+#include <parquet/arrow/reader.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "../arrow_operators/dataset_catalog.h"
+
+/**
+ * 数据集清单：数据文件写入后不再修改，每次提交（上传、追加、删除）生成一个新版本的清单，
+ * 清单文件"_manifest/<版本号>.arrow"只追加不修改，记录该版本下每个数据集包含的数据文件及其统计信息。
+ *
+ * 读者拿到某个版本的快照（shared_ptr）后，按快照中的文件列表读取，不需要加锁；
+ * 被新版本替换或删除的文件要等所有更早版本的快照都释放后才会被回收。
+ */
+
+#define MANIFEST_DIR "_manifest"
+#define MANIFEST_DATA_DIR "_data"
+
+/**
+ * @brief 清单中的一个数据文件
+ *
+ */
+struct ManifestEntry
+{
+    std::string dataset;
+    std::string path; // 数据文件路径，文件写入后不再修改
+    int64_t num_rows = 0;
+    int64_t size = 0;
+    int64_t added_version = 0; // 在哪个版本加入
+    arrow::compute::Expression statistics = arrow::compute::literal(true); // 各列的min/max范围
+};
+
+/**
+ * @brief 一个版本的清单快照，创建后不再修改
+ *
+ */
+struct ManifestSnapshot
+{
+    int64_t version = 0;
+    int64_t next_file_id = 0;
+    std::vector<ManifestEntry> entries;
+
+    std::vector<std::string> Datasets() const
+    {
+        std::set<std::string> names;
+        for (const auto &entry : entries)
+        {
+            names.insert(entry.dataset);
+        }
+        return std::vector<std::string>(names.begin(), names.end());
+    }
+
+    /**
+     * @brief 数据集在该版本下的文件；since_version >= 0时只返回该版本之后加入的文件
+     *
+     */
+    std::vector<ManifestEntry> Files(const std::string &dataset, int64_t since_version = -1) const
+    {
+        std::vector<ManifestEntry> files;
+        for (const auto &entry : entries)
+        {
+            if (entry.dataset == dataset && entry.added_version > since_version)
+                files.push_back(entry);
+        }
+        return files;
+    }
+};
+
+/**
+ * @brief 读取数据文件的footer，生成清单条目
+ *
+ */
+arrow::Result<ManifestEntry> DescribeDataFile(const std::shared_ptr<arrow::fs::FileSystem> &filesystem,
+                                              const std::string &dataset, const std::string &path)
+{
+    ARROW_ASSIGN_OR_RAISE(auto info, filesystem->GetFileInfo(path));
+    ARROW_ASSIGN_OR_RAISE(auto input, filesystem->OpenInputFile(info));
+    std::unique_ptr<parquet::arrow::FileReader> reader;
+    ARROW_RETURN_NOT_OK(parquet::arrow::OpenFile(std::move(input), arrow::default_memory_pool(), &reader));
+    std::shared_ptr<arrow::Schema> schema;
+    ARROW_RETURN_NOT_OK(reader->GetSchema(&schema));
+    auto metadata = reader->parquet_reader()->metadata();
+
+    ManifestEntry entry;
+    entry.dataset = dataset;
+    entry.path = path;
+    entry.num_rows = metadata->num_rows();
+    entry.size = info.size();
+    ARROW_ASSIGN_OR_RAISE(entry.statistics, FileStatisticsGuarantee(*metadata, *schema));
+    return entry;
+}
+
+class DatasetManifest
+{
+public:
+    using DeleteFileFunc = std::function<arrow::Status(const std::string &path)>;
+
+    /**
+     * @brief 打开清单，加载最新版本，并删除不在最新版本中的数据文件（上次异常退出的遗留）
+     *
+     * @param filesystem
+     * @param delete_file 回收数据文件时调用，可以顺便删除布隆过滤器等附属文件
+     * @return arrow::Result<std::shared_ptr<DatasetManifest>>
+     */
+    static arrow::Result<std::shared_ptr<DatasetManifest>> Open(const std::shared_ptr<arrow::fs::FileSystem> &filesystem,
+                                                                DeleteFileFunc delete_file)
+    {
+        std::shared_ptr<DatasetManifest> manifest(new DatasetManifest());
+        manifest->filesystem_ = filesystem;
+        manifest->delete_file_ = std::move(delete_file);
+        ARROW_RETURN_NOT_OK(filesystem->CreateDir(MANIFEST_DIR));
+        ARROW_RETURN_NOT_OK(filesystem->CreateDir(MANIFEST_DATA_DIR));
+
+        arrow::fs::FileSelector selector;
+        selector.base_dir = MANIFEST_DIR;
+        ARROW_ASSIGN_OR_RAISE(auto infos, filesystem->GetFileInfo(selector));
+        int64_t latest = 0;
+        for (const auto &info : infos)
+        {
+            int64_t version;
+            if (ParseVersion(info.base_name(), &version))
+                latest = std::max(latest, version);
+        }
+        auto snapshot = std::make_shared<ManifestSnapshot>();
+        if (latest > 0)
+        {
+            ARROW_ASSIGN_OR_RAISE(snapshot, manifest->Load(latest));
+        }
+        manifest->oldest_readable_version_ = latest;
+        std::atomic_store(&manifest->current_, std::shared_ptr<const ManifestSnapshot>(snapshot));
+
+        std::set<std::string> referenced;
+        for (const auto &entry : snapshot->entries)
+        {
+            referenced.insert(entry.path);
+        }
+        selector.base_dir = MANIFEST_DATA_DIR;
+        ARROW_ASSIGN_OR_RAISE(infos, filesystem->GetFileInfo(selector));
+        for (const auto &info : infos)
+        {
+            if (info.IsFile() && info.extension() == "parquet" && !IgnoredByDiscovery(info.base_name()) &&
+                referenced.count(info.path()) == 0)
+            {
+                ARROW_RETURN_NOT_OK(manifest->delete_file_(info.path()));
+            }
+        }
+        return manifest;
+    }
+
+    /**
+     * @brief 当前版本的快照，无锁
+     *
+     */
+    std::shared_ptr<const ManifestSnapshot> Current() const
+    {
+        return std::atomic_load(&current_);
+    }
+
+    /**
+     * @brief 获取指定版本的快照，该版本的文件已被回收时返回错误
+     *
+     */
+    arrow::Result<std::shared_ptr<const ManifestSnapshot>> Pin(int64_t version)
+    {
+        auto current = Current();
+        if (version == current->version)
+            return current;
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (version > current->version || version < oldest_readable_version_)
+        {
+            return arrow::Status::KeyError("Manifest version ", version, " is not available, readable versions are ",
+                                           oldest_readable_version_, "-", current->version);
+        }
+        auto published = published_.find(version);
+        if (published != published_.end())
+        {
+            auto snapshot = published->second.lock();
+            if (snapshot != nullptr)
+                return snapshot;
+        }
+        ARROW_ASSIGN_OR_RAISE(auto loaded, Load(version));
+        std::shared_ptr<const ManifestSnapshot> snapshot = loaded;
+        published_[version] = snapshot;
+        return snapshot;
+    }
+
+    /**
+     * @brief 分配一个新的数据文件路径，路径不会重复使用
+     *
+     */
+    std::string NewDataFilePath()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return std::string(MANIFEST_DATA_DIR) + "/" + std::to_string(next_file_id_++) + ".parquet";
+    }
+
+    /**
+     * @brief 提交一个新版本
+     *
+     * @param dataset 数据集名
+     * @param added 新加入的文件
+     * @param replace true时替换数据集原有的全部文件（覆盖上传或删除数据集）
+     * @param removed 输出被替换的文件
+     * @return arrow::Result<int64_t> 新版本号
+     */
+    arrow::Result<int64_t> Commit(const std::string &dataset, std::vector<ManifestEntry> added, bool replace,
+                                  std::vector<ManifestEntry> *removed = nullptr)
+    {
+        int64_t version;
+        std::vector<ManifestEntry> replaced;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto current = Current();
+            auto next = std::make_shared<ManifestSnapshot>();
+            next->version = current->version + 1;
+            next->next_file_id = std::max(current->next_file_id, next_file_id_);
+            for (const auto &entry : current->entries)
+            {
+                if (replace && entry.dataset == dataset)
+                    replaced.push_back(entry);
+                else
+                    next->entries.push_back(entry);
+            }
+            for (auto &entry : added)
+            {
+                entry.dataset = dataset;
+                entry.added_version = next->version;
+                next->entries.push_back(entry);
+            }
+            ARROW_RETURN_NOT_OK(Save(*next));
+
+            // 旧版本可能还有读者，记下弱引用，回收时据此判断
+            published_[current->version] = current;
+            for (const auto &entry : replaced)
+            {
+                pending_deletes_.push_back(std::make_pair(next->version, entry.path));
+            }
+            std::atomic_store(&current_, std::shared_ptr<const ManifestSnapshot>(next));
+            version = next->version;
+        }
+        if (removed != nullptr)
+            *removed = replaced;
+        ARROW_RETURN_NOT_OK(CollectGarbage());
+        return version;
+    }
+
+    /**
+     * @brief 回收没有快照再引用的文件，以及不再可读的旧版本清单
+     *
+     * 在版本v被移除的文件，只有版本v之前的快照会引用它；这些快照都释放后才删除
+     */
+    arrow::Status CollectGarbage()
+    {
+        std::vector<std::string> to_delete;
+        std::vector<int64_t> expired_versions;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            int64_t oldest_pinned = Current()->version;
+            for (auto it = published_.begin(); it != published_.end();)
+            {
+                if (it->second.expired())
+                {
+                    it = published_.erase(it);
+                    continue;
+                }
+                oldest_pinned = std::min(oldest_pinned, it->first);
+                ++it;
+            }
+            auto it = pending_deletes_.begin();
+            while (it != pending_deletes_.end())
+            {
+                if (it->first <= oldest_pinned)
+                {
+                    to_delete.push_back(it->second);
+                    // 文件删除后，移除它之前的版本都不能再读
+                    oldest_readable_version_ = std::max(oldest_readable_version_, it->first);
+                    it = pending_deletes_.erase(it);
+                }
+                else
+                {
+                    ++it;
+                }
+            }
+            for (int64_t version = last_expired_version_ + 1; version < oldest_readable_version_; ++version)
+            {
+                expired_versions.push_back(version);
+            }
+            last_expired_version_ = std::max(last_expired_version_, oldest_readable_version_ - 1);
+        }
+        for (const auto &path : to_delete)
+        {
+            ARROW_RETURN_NOT_OK(delete_file_(path));
+        }
+        for (int64_t version : expired_versions)
+        {
+            ARROW_ASSIGN_OR_RAISE(auto info, filesystem_->GetFileInfo(VersionPath(version)));
+            if (info.IsFile())
+                ARROW_RETURN_NOT_OK(filesystem_->DeleteFile(info.path()));
+        }
+        return arrow::Status::OK();
+    }
+
+private:
+    DatasetManifest() = default;
+
+    static std::string VersionPath(int64_t version)
+    {
+        // 定长版本号，按文件名排序即按版本排序
+        char name[32];
+        std::snprintf(name, sizeof(name), "%020lld.arrow", static_cast<long long>(version));
+        return std::string(MANIFEST_DIR) + "/" + name;
+    }
+
+    static bool ParseVersion(const std::string &base_name, int64_t *version)
+    {
+        const std::string suffix = ".arrow";
+        if (base_name.size() != 20 + suffix.size() ||
+            base_name.compare(20, suffix.size(), suffix) != 0 ||
+            base_name.find_first_not_of("0123456789") != 20)
+        {
+            return false;
+        }
+        *version = std::stoll(base_name.substr(0, 20));
+        return true;
+    }
+
+    static std::shared_ptr<arrow::Schema> ManifestSchema()
+    {
+        return arrow::schema({arrow::field("dataset", arrow::utf8()),
+                              arrow::field("path", arrow::utf8()),
+                              arrow::field("num_rows", arrow::int64()),
+                              arrow::field("size", arrow::int64()),
+                              arrow::field("added_version", arrow::int64()),
+                              arrow::field("statistics", arrow::binary())});
+    }
+
+    arrow::Result<std::shared_ptr<ManifestSnapshot>> Load(int64_t version) const
+    {
+        ARROW_ASSIGN_OR_RAISE(auto input, filesystem_->OpenInputFile(VersionPath(version)));
+        ARROW_ASSIGN_OR_RAISE(auto reader, arrow::ipc::RecordBatchFileReader::Open(input));
+        auto snapshot = std::make_shared<ManifestSnapshot>();
+        snapshot->version = version;
+        auto metadata = reader->schema()->metadata();
+        if (metadata == nullptr || metadata->FindKey("next_file_id") < 0)
+        {
+            return arrow::Status::Invalid("Manifest ", VersionPath(version), " has no next_file_id");
+        }
+        snapshot->next_file_id = std::stoll(metadata->value(metadata->FindKey("next_file_id")));
+        for (int b = 0; b < reader->num_record_batches(); ++b)
+        {
+            ARROW_ASSIGN_OR_RAISE(auto batch, reader->ReadRecordBatch(b));
+            auto dataset = std::static_pointer_cast<arrow::StringArray>(batch->column(0));
+            auto path = std::static_pointer_cast<arrow::StringArray>(batch->column(1));
+            auto num_rows = std::static_pointer_cast<arrow::Int64Array>(batch->column(2));
+            auto size = std::static_pointer_cast<arrow::Int64Array>(batch->column(3));
+            auto added_version = std::static_pointer_cast<arrow::Int64Array>(batch->column(4));
+            auto statistics = std::static_pointer_cast<arrow::BinaryArray>(batch->column(5));
+            for (int64_t i = 0; i < batch->num_rows(); ++i)
+            {
+                ManifestEntry entry;
+                entry.dataset = dataset->GetString(i);
+                entry.path = path->GetString(i);
+                entry.num_rows = num_rows->Value(i);
+                entry.size = size->Value(i);
+                entry.added_version = added_version->Value(i);
+                ARROW_ASSIGN_OR_RAISE(entry.statistics, arrow::compute::Deserialize(
+                                                            arrow::Buffer::FromString(statistics->GetString(i))));
+                snapshot->entries.push_back(entry);
+            }
+        }
+        next_file_id_ = std::max(next_file_id_, snapshot->next_file_id);
+        return snapshot;
+    }
+
+    /**
+     * @brief 写入一个版本的清单：先写临时文件再改名，版本文件一旦出现就是完整的
+     *
+     */
+    arrow::Status Save(const ManifestSnapshot &snapshot) const
+    {
+        arrow::StringBuilder dataset, path;
+        arrow::Int64Builder num_rows, size, added_version;
+        arrow::BinaryBuilder statistics;
+        for (const auto &entry : snapshot.entries)
+        {
+            ARROW_ASSIGN_OR_RAISE(auto serialized, arrow::compute::Serialize(entry.statistics));
+            ARROW_RETURN_NOT_OK(dataset.Append(entry.dataset));
+            ARROW_RETURN_NOT_OK(path.Append(entry.path));
+            ARROW_RETURN_NOT_OK(num_rows.Append(entry.num_rows));
+            ARROW_RETURN_NOT_OK(size.Append(entry.size));
+            ARROW_RETURN_NOT_OK(added_version.Append(entry.added_version));
+            ARROW_RETURN_NOT_OK(statistics.Append(serialized->data(), serialized->size()));
+        }
+        std::vector<std::shared_ptr<arrow::Array>> arrays(6);
+        ARROW_RETURN_NOT_OK(dataset.Finish(&arrays[0]));
+        ARROW_RETURN_NOT_OK(path.Finish(&arrays[1]));
+        ARROW_RETURN_NOT_OK(num_rows.Finish(&arrays[2]));
+        ARROW_RETURN_NOT_OK(size.Finish(&arrays[3]));
+        ARROW_RETURN_NOT_OK(added_version.Finish(&arrays[4]));
+        ARROW_RETURN_NOT_OK(statistics.Finish(&arrays[5]));
+        auto schema = ManifestSchema()->WithMetadata(
+            arrow::key_value_metadata({"next_file_id"}, {std::to_string(snapshot.next_file_id)}));
+        auto batch = arrow::RecordBatch::Make(schema, arrays[0]->length(), arrays);
+
+        std::string version_path = VersionPath(snapshot.version);
+        std::string tmp_path = version_path + ".tmp";
+        ARROW_ASSIGN_OR_RAISE(auto output, filesystem_->OpenOutputStream(tmp_path));
+        ARROW_ASSIGN_OR_RAISE(auto writer, arrow::ipc::MakeFileWriter(output, schema));
+        ARROW_RETURN_NOT_OK(writer->WriteRecordBatch(*batch));
+        ARROW_RETURN_NOT_OK(writer->Close());
+        ARROW_RETURN_NOT_OK(output->Close());
+        return filesystem_->Move(tmp_path, version_path);
+    }
+
+    std::shared_ptr<arrow::fs::FileSystem> filesystem_;
+    DeleteFileFunc delete_file_;
+    std::shared_ptr<const ManifestSnapshot> current_; // 用std::atomic_load/atomic_store访问
+
+    std::mutex mutex_; // 保护以下成员，只有提交、回收和读取历史版本时加锁
+    std::map<int64_t, std::weak_ptr<const ManifestSnapshot>> published_;
+    std::vector<std::pair<int64_t, std::string>> pending_deletes_; // (移除时的版本, 文件)
+    int64_t oldest_readable_version_ = 0;
+    int64_t last_expired_version_ = 0;
+    mutable int64_t next_file_id_ = 0;
+};
+
+#endif
@@ -0,0 +1,440 @@
+#ifndef EXCHANGE_PIPELINE_H
+#define EXCHANGE_PIPELINE_H
+
+#include <arrow/api.h>
+#include <arrow/compute/api.h>
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+/**
+ * DoExchange的计算流水线：客户端发来的每个batch依次经过各个阶段，算完立即发回，
+ * 不用等输入全部到达，也不用先DoPut再DoGet。
+ *
+ * 流水线用描述符的cmd描述，阶段之间用'|'分隔，每个阶段是"名称:参数,参数,..."：
+ * - add/subtract/multiply/divide:左列,右列或数字[,输出列]  追加一列算术结果
+ * - filter:列,eq|ne|lt|le|gt|ge,值                        按条件过滤行
+ * - select:列,列,...                                       只保留这些列
+ * - join:数据集,键列[,列,...]                               按键列查找服务端数据集，追加指定的列或其余所有列（左连接）
+ *
+ * 例如"filter:qty,gt,100|multiply:pri,qty,amount|select:trdno,amount"
+ */
+
+/**
+ * @brief 流水线的一个阶段，对每个batch独立计算
+ *
+ */
+class ExchangeStage
+{
+public:
+    virtual ~ExchangeStage() = default;
+    virtual arrow::Result<std::shared_ptr<arrow::RecordBatch>> Process(const std::shared_ptr<arrow::RecordBatch> &batch) = 0;
+};
+
+arrow::Result<std::shared_ptr<arrow::Array>> GetExchangeColumn(const arrow::RecordBatch &batch, const std::string &name)
+{
+    auto column = batch.GetColumnByName(name);
+    if (column == nullptr)
+    {
+        return arrow::Status::KeyError("Column ", name, " not found in ", batch.schema()->ToString());
+    }
+    return column;
+}
+
+/**
+ * @brief 追加一列算术结果，右操作数不是列名时按数字处理
+ *
+ */
+class ArithmeticStage : public ExchangeStage
+{
+public:
+    ArithmeticStage(std::string function, std::string left, std::string right, std::string output)
+        : function_(std::move(function)), left_(std::move(left)), right_(std::move(right)), output_(std::move(output))
+    {
+    }
+
+    arrow::Result<std::shared_ptr<arrow::RecordBatch>> Process(const std::shared_ptr<arrow::RecordBatch> &batch) override
+    {
+        ARROW_ASSIGN_OR_RAISE(auto left, GetExchangeColumn(*batch, left_));
+        arrow::Datum right;
+        if (batch->schema()->GetFieldIndex(right_) >= 0)
+        {
+            right = batch->GetColumnByName(right_);
+        }
+        else
+        {
+            ARROW_ASSIGN_OR_RAISE(right, arrow::Scalar::Parse(arrow::float64(), right_));
+        }
+        ARROW_ASSIGN_OR_RAISE(auto result, arrow::compute::CallFunction(function_, {left, right}));
+        auto values = result.make_array();
+        return batch->AddColumn(batch->num_columns(), arrow::field(output_, values->type()), values);
+    }
+
+private:
+    std::string function_;
+    std::string left_;
+    std::string right_;
+    std::string output_;
+};
+
+/**
+ * @brief 按"列 比较 常量"过滤，常量按列的类型解析
+ *
+ */
+class FilterStage : public ExchangeStage
+{
+public:
+    FilterStage(std::string column, std::string function, std::string value)
+        : column_(std::move(column)), function_(std::move(function)), value_(std::move(value))
+    {
+    }
+
+    arrow::Result<std::shared_ptr<arrow::RecordBatch>> Process(const std::shared_ptr<arrow::RecordBatch> &batch) override
+    {
+        ARROW_ASSIGN_OR_RAISE(auto column, GetExchangeColumn(*batch, column_));
+        if (value_scalar_ == nullptr || !value_scalar_->type->Equals(*column->type()))
+        {
+            ARROW_ASSIGN_OR_RAISE(value_scalar_, arrow::Scalar::Parse(column->type(), value_));
+        }
+        ARROW_ASSIGN_OR_RAISE(auto mask, arrow::compute::CallFunction(function_, {column, value_scalar_}));
+        ARROW_ASSIGN_OR_RAISE(auto filtered, arrow::compute::Filter(batch, mask));
+        return filtered.record_batch();
+    }
+
+private:
+    std::string column_;
+    std::string function_;
+    std::string value_;
+    std::shared_ptr<arrow::Scalar> value_scalar_;
+};
+
+class SelectStage : public ExchangeStage
+{
+public:
+    explicit SelectStage(std::vector<std::string> columns)
+        : columns_(std::move(columns))
+    {
+    }
+
+    arrow::Result<std::shared_ptr<arrow::RecordBatch>> Process(const std::shared_ptr<arrow::RecordBatch> &batch) override
+    {
+        std::vector<int> indices;
+        for (const auto &column : columns_)
+        {
+            int index = batch->schema()->GetFieldIndex(column);
+            if (index < 0)
+            {
+                return arrow::Status::KeyError("Column ", column, " not found in ", batch->schema()->ToString());
+            }
+            indices.push_back(index);
+        }
+        return batch->SelectColumns(indices);
+    }
+
+private:
+    std::vector<std::string> columns_;
+};
+
+/**
+ * @brief 把分块的列合并成一个Array，Take需要按行号随机访问
+ *
+ */
+arrow::Result<std::shared_ptr<arrow::Array>> CombineColumn(const std::shared_ptr<arrow::ChunkedArray> &column)
+{
+    if (column->num_chunks() == 0)
+        return arrow::MakeEmptyArray(column->type());
+    if (column->num_chunks() == 1)
+        return column->chunk(0);
+    return arrow::Concatenate(column->chunks());
+}
+
+/**
+ * @brief 查找连接的build side：服务端数据集的键建一次哈希表，不可变，可以在多个DoExchange之间共享
+ *
+ * 键统一转成字符串比较。同一个键的行号连续存放在matches_里，哈希表只记(起点, 个数)。
+ */
+class LookupJoinTable
+{
+public:
+    /**
+     * @brief 建表
+     *
+     * @param right 服务端数据集，只需要键列和要追加的列
+     * @param key 键列
+     */
+    static arrow::Result<std::shared_ptr<const LookupJoinTable>> Make(const std::shared_ptr<arrow::Table> &right,
+                                                                      const std::string &key)
+    {
+        std::shared_ptr<LookupJoinTable> table(new LookupJoinTable());
+        int key_index = right->schema()->GetFieldIndex(key);
+        if (key_index < 0)
+        {
+            return arrow::Status::KeyError("Join key ", key, " not found in ", right->schema()->ToString());
+        }
+        ARROW_ASSIGN_OR_RAISE(auto right_keys, CombineColumn(right->column(key_index)));
+        ARROW_ASSIGN_OR_RAISE(auto key_strings, arrow::compute::Cast(*right_keys, arrow::utf8()));
+        const auto &strings = static_cast<const arrow::StringArray &>(*key_strings);
+
+        // 先数出每个键的行数，再按前缀和分配起点，最后按行号顺序填入
+        table->ranges_.reserve(strings.length());
+        for (int64_t i = 0; i < strings.length(); ++i)
+        {
+            if (strings.IsValid(i))
+                ++table->ranges_[strings.GetString(i)].second;
+        }
+        int64_t offset = 0;
+        for (auto &range : table->ranges_)
+        {
+            range.second.first = offset;
+            offset += range.second.second;
+            range.second.second = 0;
+        }
+        table->matches_.resize(offset);
+        for (int64_t i = 0; i < strings.length(); ++i)
+        {
+            if (!strings.IsValid(i))
+                continue;
+            auto &range = table->ranges_[strings.GetString(i)];
+            table->matches_[range.first + range.second++] = i;
+        }
+
+        for (int i = 0; i < right->num_columns(); ++i)
+        {
+            if (i == key_index)
+                continue;
+            ARROW_ASSIGN_OR_RAISE(auto column, CombineColumn(right->column(i)));
+            table->fields_.push_back(right->schema()->field(i)->WithNullable(true));
+            table->columns_.push_back(column);
+        }
+        return std::shared_ptr<const LookupJoinTable>(std::move(table));
+    }
+
+    const std::vector<std::shared_ptr<arrow::Field>> &fields() const { return fields_; }
+    const std::vector<std::shared_ptr<arrow::Array>> &columns() const { return columns_; }
+
+    /**
+     * @brief 键对应的行号，没有时返回false
+     *
+     */
+    bool Find(const std::string &key, const int64_t **rows, int64_t *count) const
+    {
+        auto it = ranges_.find(key);
+        if (it == ranges_.end())
+            return false;
+        *rows = matches_.data() + it->second.first;
+        *count = it->second.second;
+        return true;
+    }
+
+private:
+    LookupJoinTable() = default;
+
+    std::unordered_map<std::string, std::pair<int64_t, int64_t>> ranges_; // 键 -> (matches_中的起点, 行数)
+    std::vector<int64_t> matches_;
+    std::vector<std::shared_ptr<arrow::Field>> fields_;
+    std::vector<std::shared_ptr<arrow::Array>> columns_;
+};
+
+/**
+ * @brief 查找连接：每个batch只做查找和Take
+ *
+ * 左连接语义：数据集里一个键有多行时输出多行，找不到的键对应的列为null。
+ * 与输入重名的列加"_right"后缀。
+ */
+class LookupJoinStage : public ExchangeStage
+{
+public:
+    LookupJoinStage(std::shared_ptr<const LookupJoinTable> right, std::string key)
+        : right_(std::move(right)), key_(std::move(key))
+    {
+    }
+
+    arrow::Result<std::shared_ptr<arrow::RecordBatch>> Process(const std::shared_ptr<arrow::RecordBatch> &batch) override
+    {
+        ARROW_ASSIGN_OR_RAISE(auto keys, GetExchangeColumn(*batch, key_));
+        ARROW_ASSIGN_OR_RAISE(auto key_strings, arrow::compute::Cast(*keys, arrow::utf8()));
+        const auto &strings = static_cast<const arrow::StringArray &>(*key_strings);
+        arrow::Int64Builder left_builder;
+        arrow::Int64Builder right_builder;
+        ARROW_RETURN_NOT_OK(left_builder.Reserve(strings.length()));
+        ARROW_RETURN_NOT_OK(right_builder.Reserve(strings.length()));
+        bool expanded = false; // 有键匹配多行时，左边的行也要重复
+        for (int64_t i = 0; i < strings.length(); ++i)
+        {
+            const int64_t *rows = nullptr;
+            int64_t count = 0;
+            if (!strings.IsValid(i) || !right_->Find(strings.GetString(i), &rows, &count))
+            {
+                ARROW_RETURN_NOT_OK(left_builder.Append(i));
+                ARROW_RETURN_NOT_OK(right_builder.AppendNull());
+                continue;
+            }
+            expanded = expanded || count > 1;
+            for (int64_t j = 0; j < count; ++j)
+            {
+                ARROW_RETURN_NOT_OK(left_builder.Append(i));
+                ARROW_RETURN_NOT_OK(right_builder.Append(rows[j]));
+            }
+        }
+        std::shared_ptr<arrow::Array> left_indices;
+        std::shared_ptr<arrow::Array> right_indices;
+        ARROW_RETURN_NOT_OK(left_builder.Finish(&left_indices));
+        ARROW_RETURN_NOT_OK(right_builder.Finish(&right_indices));
+
+        auto left = batch;
+        if (expanded)
+        {
+            ARROW_ASSIGN_OR_RAISE(auto taken, arrow::compute::Take(batch, left_indices));
+            left = taken.record_batch();
+        }
+        auto fields = left->schema()->fields();
+        auto columns = left->columns();
+        for (size_t i = 0; i < right_->columns().size(); ++i)
+        {
+            ARROW_ASSIGN_OR_RAISE(auto taken, arrow::compute::Take(*right_->columns()[i], *right_indices));
+            auto field = right_->fields()[i];
+            if (left->schema()->GetFieldIndex(field->name()) >= 0)
+                field = field->WithName(field->name() + "_right");
+            fields.push_back(field);
+            columns.push_back(taken);
+        }
+        return arrow::RecordBatch::Make(arrow::schema(fields), left->num_rows(), columns);
+    }
+
+private:
+    std::shared_ptr<const LookupJoinTable> right_;
+    std::string key_;
+};
+
+/**
+ * @brief 按顺序执行的一组阶段
+ *
+ */
+class ExchangePipeline
+{
+public:
+    explicit ExchangePipeline(std::vector<std::unique_ptr<ExchangeStage>> stages)
+        : stages_(std::move(stages))
+    {
+    }
+
+    arrow::Result<std::shared_ptr<arrow::RecordBatch>> Process(std::shared_ptr<arrow::RecordBatch> batch)
+    {
+        for (auto &stage : stages_)
+        {
+            ARROW_ASSIGN_OR_RAISE(batch, stage->Process(batch));
+        }
+        return batch;
+    }
+
+    /**
+     * @brief 输出的schema：让一个空batch走一遍流水线
+     *
+     */
+    arrow::Result<std::shared_ptr<arrow::Schema>> OutputSchema(const std::shared_ptr<arrow::Schema> &input)
+    {
+        ARROW_ASSIGN_OR_RAISE(auto empty, arrow::RecordBatch::MakeEmpty(input));
+        ARROW_ASSIGN_OR_RAISE(auto output, Process(empty));
+        return output->schema();
+    }
+
+private:
+    std::vector<std::unique_ptr<ExchangeStage>> stages_;
+};
+
+/**
+ * @brief join阶段取build side：(数据集, 键列, 要追加的列)，列为空表示追加其余所有列
+ *
+ */
+using ExchangeJoinLoader = std::function<arrow::Result<std::shared_ptr<const LookupJoinTable>>(
+    const std::string &, const std::string &, const std::vector<std::string> &)>;
+
+std::vector<std::string> SplitExchangeCommand(const std::string &text, char separator)
+{
+    std::vector<std::string> parts;
+    size_t begin = 0;
+    while (true)
+    {
+        size_t end = text.find(separator, begin);
+        parts.push_back(text.substr(begin, end == std::string::npos ? std::string::npos : end - begin));
+        if (end == std::string::npos)
+            break;
+        begin = end + 1;
+    }
+    return parts;
+}
+
+/**
+ * @brief 比较符对应的计算函数名
+ *
+ */
+arrow::Result<std::string> ComparisonFunction(const std::string &op)
+{
+    static const std::unordered_map<std::string, std::string> kComparisons{
+        {"eq", "equal"}, {"ne", "not_equal"}, {"lt", "less"}, {"le", "less_equal"}, {"gt", "greater"}, {"ge", "greater_equal"}};
+    auto it = kComparisons.find(op);
+    if (it == kComparisons.end())
+    {
+        return arrow::Status::Invalid("Unknown comparison '", op, "', expected eq|ne|lt|le|gt|ge");
+    }
+    return it->second;
+}
+
+/**
+ * @brief 解析流水线描述
+ *
+ * @param load_join join阶段用来取服务端数据集的build side
+ */
+arrow::Result<std::unique_ptr<ExchangePipeline>> MakeExchangePipeline(const std::string &command,
+                                                                      const ExchangeJoinLoader &load_join)
+{
+    std::vector<std::unique_ptr<ExchangeStage>> stages;
+    for (const auto &stage_text : SplitExchangeCommand(command, '|'))
+    {
+        size_t colon = stage_text.find(':');
+        if (colon == std::string::npos)
+        {
+            return arrow::Status::Invalid("Exchange stage must be <name>:<args>, got '", stage_text, "'");
+        }
+        std::string name = stage_text.substr(0, colon);
+        auto args = SplitExchangeCommand(stage_text.substr(colon + 1), ',');
+
+        if (name == "add" || name == "subtract" || name == "multiply" || name == "divide")
+        {
+            if (args.size() != 2 && args.size() != 3)
+                return arrow::Status::Invalid(name, " takes <left>,<right>[,<output>]");
+            std::string output = args.size() == 3 ? args[2] : args[0] + "_" + name + "_" + args[1];
+            stages.emplace_back(new ArithmeticStage(name, args[0], args[1], output));
+        }
+        else if (name == "filter")
+        {
+            if (args.size() != 3)
+                return arrow::Status::Invalid("filter takes <column>,eq|ne|lt|le|gt|ge,<value>");
+            ARROW_ASSIGN_OR_RAISE(auto function, ComparisonFunction(args[1]));
+            stages.emplace_back(new FilterStage(args[0], function, args[2]));
+        }
+        else if (name == "select")
+        {
+            stages.emplace_back(new SelectStage(args));
+        }
+        else if (name == "join")
+        {
+            if (args.size() < 2)
+                return arrow::Status::Invalid("join takes <dataset>,<key>[,<column>,...]");
+            std::vector<std::string> columns(args.begin() + 2, args.end());
+            ARROW_ASSIGN_OR_RAISE(auto right, load_join(args[0], args[1], columns));
+            stages.emplace_back(new LookupJoinStage(right, args[1]));
+        }
+        else
+        {
+            return arrow::Status::NotImplemented("Unknown exchange stage: ", name);
+        }
+    }
+    return std::unique_ptr<ExchangePipeline>(new ExchangePipeline(std::move(stages)));
+}
+
+#endif
@@ -6,19 +6,224 @@
 #include <parquet/exception.h>
 #include <arrow/flight/api.h>
 #include <arrow/filesystem/api.h>
+#include <arrow/util/byte_size.h>
 
+#include <cerrno>
+#include <cstdlib>
 #include <iostream>
+#include <iterator>
+#include <map>
+#include <mutex>
+#include <numeric>
+#include <set>
 #include <string>
 using namespace std;
 
+#include "../flight_speed_test/parquet_lookup.h"
+#include "../flight_speed_test/secondary_index.h"
+#include "dataset_manifest.h"
+#include "exchange_pipeline.h"
+#include "dataset_aggregate.h"
+
 #define SERVER_PORT 33000
+#define JOIN_CACHE_ENTRIES 8 // DoExchange的join最多缓存这么多个build side
+
+/**
+ * @brief 按顺序读取快照中的数据文件，流结束前一直持有快照，文件不会被回收
+ *
+ */
+class SnapshotBatchReader : public arrow::RecordBatchReader
+{
+public:
+    /**
+     * @param column_indices 只读这些列，schema是投影后的schema；为空时读所有列
+     */
+    SnapshotBatchReader(std::shared_ptr<arrow::fs::FileSystem> filesystem,
+                        std::shared_ptr<const ManifestSnapshot> snapshot,
+                        std::vector<ManifestEntry> files, std::shared_ptr<arrow::Schema> schema,
+                        std::vector<int> column_indices = {})
+        : filesystem_(std::move(filesystem)), snapshot_(std::move(snapshot)),
+          files_(std::move(files)), schema_(std::move(schema)), column_indices_(std::move(column_indices))
+    {
+    }
+
+    std::shared_ptr<arrow::Schema> schema() const override { return schema_; }
+
+    arrow::Status ReadNext(std::shared_ptr<arrow::RecordBatch> *batch) override
+    {
+        while (true)
+        {
+            if (batches_ != nullptr)
+            {
+                ARROW_RETURN_NOT_OK(batches_->ReadNext(batch));
+                if (*batch != nullptr)
+                    return arrow::Status::OK();
+                batches_.reset();
+                file_reader_.reset();
+            }
+            if (next_file_ == files_.size())
+            {
+                *batch = nullptr;
+                return arrow::Status::OK();
+            }
+            ARROW_ASSIGN_OR_RAISE(auto input, filesystem_->OpenInputFile(files_[next_file_++].path));
+            ARROW_RETURN_NOT_OK(parquet::arrow::OpenFile(std::move(input), arrow::default_memory_pool(),
+                                                         &file_reader_));
+            std::vector<int> row_groups(file_reader_->num_row_groups());
+            std::iota(row_groups.begin(), row_groups.end(), 0);
+            if (column_indices_.empty())
+            {
+                ARROW_RETURN_NOT_OK(file_reader_->GetRecordBatchReader(row_groups, &batches_));
+            }
+            else
+            {
+                ARROW_RETURN_NOT_OK(file_reader_->GetRecordBatchReader(row_groups, column_indices_, &batches_));
+            }
+        }
+    }
+
+private:
+    std::shared_ptr<arrow::fs::FileSystem> filesystem_;
+    std::shared_ptr<const ManifestSnapshot> snapshot_;
+    std::vector<ManifestEntry> files_;
+    std::shared_ptr<arrow::Schema> schema_;
+    std::vector<int> column_indices_;
+    size_t next_file_ = 0;
+    std::unique_ptr<parquet::arrow::FileReader> file_reader_;
+    std::unique_ptr<arrow::RecordBatchReader> batches_;
+};
+
+/**
+ * @brief 解析客户端传来的非负整数，格式不对或越界时返回Invalid，不抛异常
+ *
+ */
+arrow::Result<int64_t> ParseNonNegative(const std::string &text, const std::string &what)
+{
+    errno = 0;
+    char *end = nullptr;
+    long long number = std::strtoll(text.c_str(), &end, 10);
+    if (text.empty() || *end != '\0' || errno == ERANGE || number < 0)
+    {
+        return arrow::Status::Invalid(what, " is not a non-negative integer: '", text, "'");
+    }
+    return static_cast<int64_t>(number);
+}
+
+/**
+ * @brief 流结束前一直持有快照的reader
+ *
+ */
+class PinnedBatchReader : public arrow::RecordBatchReader
+{
+public:
+    PinnedBatchReader(std::shared_ptr<arrow::RecordBatchReader> input, std::shared_ptr<const ManifestSnapshot> snapshot)
+        : input_(std::move(input)), snapshot_(std::move(snapshot))
+    {
+    }
+
+    std::shared_ptr<arrow::Schema> schema() const override { return input_->schema(); }
+
+    arrow::Status ReadNext(std::shared_ptr<arrow::RecordBatch> *batch) override { return input_->ReadNext(batch); }
+
+private:
+    std::shared_ptr<arrow::RecordBatchReader> input_;
+    std::shared_ptr<const ManifestSnapshot> snapshot_;
+};
+
+/**
+ * @brief 读取数据文件的schema
+ *
+ */
+arrow::Result<std::shared_ptr<arrow::Schema>> ReadFileSchema(const std::shared_ptr<arrow::fs::FileSystem> &filesystem,
+                                                             const std::string &path)
+{
+    ARROW_ASSIGN_OR_RAISE(auto input, filesystem->OpenInputFile(path));
+    std::unique_ptr<parquet::arrow::FileReader> reader;
+    ARROW_RETURN_NOT_OK(parquet::arrow::OpenFile(std::move(input), arrow::default_memory_pool(), &reader));
+    std::shared_ptr<arrow::Schema> schema;
+    ARROW_RETURN_NOT_OK(reader->GetSchema(&schema));
+    return schema;
+}
+
+/**
+ * @brief 回收数据文件：删除二级索引中的记录、布隆过滤器文件和数据文件
+ *
+ */
+arrow::Status DeleteDataFile(const std::shared_ptr<arrow::fs::FileSystem> &root,
+                             const std::vector<std::string> &key_columns, const std::string &path)
+{
+    for (const auto &column : key_columns)
+    {
+        ARROW_ASSIGN_OR_RAISE(auto indexed, HasSecondaryIndex(root, "", column));
+        if (indexed)
+        {
+            ARROW_RETURN_NOT_OK(UpdateSecondaryIndex(root, "", column, path, /*remove=*/true));
+        }
+    }
+    ARROW_ASSIGN_OR_RAISE(auto bloom_info, root->GetFileInfo(BloomSidecarPath(path)));
+    if (bloom_info.IsFile())
+    {
+        ARROW_RETURN_NOT_OK(root->DeleteFile(bloom_info.path()));
+    }
+    return root->DeleteFile(path);
+}
+
+/**
+ * @brief 分片上传中已写完、尚未提交的数据文件
+ *
+ */
+struct PendingUpload
+{
+    typedef std::pair<int64_t, int64_t> FileKey; // (分片序号, 文件在分片内的起始行)
+
+    std::string dataset;
+    bool append;
+    std::map<FileKey, ManifestEntry> files; // 按分片序号、起始行排列，提交后数据集中的顺序与源文件一致
+    std::map<FileKey, std::shared_ptr<arrow::Schema>> schemas;
+    std::map<int64_t, int64_t> generations; // 每个分片最近一次DoPut的序号，续传后旧的流不能再暂存文件
+
+    PendingUpload()
+        : append(false)
+    {
+    }
+};
+
+/**
+ * @brief 缓存的join build side，paths是建表时数据集的文件列表
+ *
+ */
+struct JoinCacheEntry
+{
+    std::vector<std::string> paths;
+    std::shared_ptr<const LookupJoinTable> table;
+    int64_t last_used;
+
+    JoinCacheEntry()
+        : last_used(0)
+    {
+    }
+};
 
 class ParquetStorageService : public arrow::flight::FlightServerBase
 {
 public:
     const arrow::flight::ActionType kActionDropDataset{"drop_dataset", "Delete a dataset."};
-    explicit ParquetStorageService(std::shared_ptr<arrow::fs::FileSystem> root)
-        : root_(std::move(root))
+    const arrow::flight::ActionType kActionCurrentVersion{"current_version", "Return the latest manifest version."};
+    const arrow::flight::ActionType kActionBeginUpload{"begin_upload",
+                                                       "Start a multi-part upload of <dataset> or <dataset>|append, return the upload id."};
+    const arrow::flight::ActionType kActionCommitUpload{"commit_upload",
+                                                        "Commit all parts of an upload in one manifest version."};
+    const arrow::flight::ActionType kActionAbortUpload{"abort_upload", "Discard all parts of an upload."};
+    const std::vector<std::string> kLookupKeyColumns{"trdno", "sno"};
+    const std::string kLookupTicketPrefix{"lookup:"};
+    const std::string kAppendCommand{"append"};
+    const std::string kPartCommand{"part"};
+    const int64_t kCheckpointBytes{64 << 20}; // 分片上传每收到这么多数据暂存一个文件
+    const std::string kSinceTicketPrefix{"since:"};
+    const std::string kAggregateTicketPrefix{"aggregate:"};
+    explicit ParquetStorageService(std::shared_ptr<arrow::fs::FileSystem> root,
+                                   std::shared_ptr<DatasetManifest> manifest)
+        : root_(std::move(root)), manifest_(std::move(manifest))
     {
     }
 
@@ -26,16 +231,12 @@ public:
         const arrow::flight::ServerCallContext &, const arrow::flight::Criteria *,
         std::unique_ptr<arrow::flight::FlightListing> *listings) override
     {
-        arrow::fs::FileSelector selector;
-        selector.base_dir = "/";
-        ARROW_ASSIGN_OR_RAISE(auto listing, root_->GetFileInfo(selector));
+        // 所有数据集都来自同一个版本的快照
+        auto snapshot = manifest_->Current();
         std::vector<arrow::flight::FlightInfo> flights;
-        for (const auto &file_info : listing)
+        for (const auto &dataset : snapshot->Datasets())
         {
-            if (!file_info.IsFile() || file_info.extension() != "parquet")
-                continue;
-
-            ARROW_ASSIGN_OR_RAISE(auto info, MakeFlightInfo(file_info));
+            ARROW_ASSIGN_OR_RAISE(auto info, MakeFlightInfo(*snapshot, dataset));
             flights.push_back(std::move(info));
         }
 
@@ -49,60 +250,145 @@ public:
                                 const arrow::flight::FlightDescriptor &descriptor,
                                 std::unique_ptr<arrow::flight::FlightInfo> *info) override
     {
-        ARROW_ASSIGN_OR_RAISE(auto file_info, FileInfoFromDescriptor(descriptor));
-        ARROW_ASSIGN_OR_RAISE(auto flight_info, MakeFlightInfo(file_info));
+        ARROW_ASSIGN_OR_RAISE(auto dataset, DatasetFromDescriptor(descriptor));
+        ARROW_ASSIGN_OR_RAISE(auto flight_info, MakeFlightInfo(*manifest_->Current(), dataset));
         *info = std::unique_ptr<arrow::flight::FlightInfo>(
             new arrow::flight::FlightInfo(std::move(flight_info)));
 
         return arrow::Status::OK();
     }
 
+    /**
+     * @brief 上传数据集
+     *
+     * 数据写入新的数据文件后再提交清单，读者只会看到提交前或提交后的完整版本。
+     * 描述符为{名称}时替换整个数据集，为{名称, "append"}时追加到数据集。
+     * 提交后的版本号通过metadata返回给客户端。
+     * 描述符为{上传id, "part", 序号[, 起始行]}时是分片上传的一个分片，只写文件，等commit_upload一起提交。
+     */
     arrow::Status DoPut(const arrow::flight::ServerCallContext &,
                         std::unique_ptr<arrow::flight::FlightMessageReader> reader,
-                        std::unique_ptr<arrow::flight::FlightMetadataWriter>) override
+                        std::unique_ptr<arrow::flight::FlightMetadataWriter> metadata_writer) override
     {
-        ARROW_ASSIGN_OR_RAISE(auto file_info, FileInfoFromDescriptor(reader->descriptor()));
-        ARROW_ASSIGN_OR_RAISE(auto sink, root_->OpenOutputStream(file_info.path()));
+        const auto &descriptor = reader->descriptor();
+        if (descriptor.type == arrow::flight::FlightDescriptor::PATH &&
+            (descriptor.path.size() == 3 || descriptor.path.size() == 4) && descriptor.path[1] == kPartCommand)
+        {
+            return DoPutPart(descriptor.path, std::move(reader), std::move(metadata_writer));
+        }
+        ARROW_ASSIGN_OR_RAISE(auto dataset, DatasetFromDescriptor(descriptor));
+        bool append = descriptor.path.size() == 2;
         ARROW_ASSIGN_OR_RAISE(std::shared_ptr<arrow::Table> table, reader->ToTable());
-        ARROW_RETURN_NOT_OK(parquet::arrow::WriteTable(*table, arrow::default_memory_pool(),
-                                                       sink, /*chunk_size=*/65536));
+        if (append)
+        {
+            ARROW_RETURN_NOT_OK(CheckAppendSchema(dataset, *table->schema()));
+        }
 
-        return arrow::Status::OK();
+        ARROW_ASSIGN_OR_RAISE(auto entry, WriteDataFile(dataset, *table));
+        ARROW_ASSIGN_OR_RAISE(auto version, manifest_->Commit(dataset, {entry}, /*replace=*/!append));
+        ARROW_RETURN_NOT_OK(IndexDataFile(*table->schema(), entry.path));
+
+        return metadata_writer->WriteMetadata(*arrow::Buffer::FromString(std::to_string(version)));
     }
 
+    /**
+     * @brief 下载数据集
+     *
+     * ticket为"名称"时读最新版本，"名称@版本"读指定版本，"名称@since:版本"只读该版本之后追加的数据
+     */
     arrow::Status DoGet(const arrow::flight::ServerCallContext &,
                         const arrow::flight::Ticket &request,
                         std::unique_ptr<arrow::flight::FlightDataStream> *stream) override
     {
-        ARROW_ASSIGN_OR_RAISE(auto input, root_->OpenInputFile(request.ticket));
-        std::unique_ptr<parquet::arrow::FileReader> reader;
-        ARROW_RETURN_NOT_OK(parquet::arrow::OpenFile(std::move(input),
-                                                     arrow::default_memory_pool(), &reader));
-        std::shared_ptr<arrow::Table> table;
-        ARROW_RETURN_NOT_OK(reader->ReadTable(&table));
-
-        // Note that we can't directly pass TableBatchReader to
-        // RecordBatchStream because TableBatchReader keeps a non-owning
-        // reference to the underlying Table, which would then get freed
-        // when we exit this function
+        // "lookup:数据集|列名=值"形式的ticket走二级索引，只读命中的row group
+        if (request.ticket.compare(0, kLookupTicketPrefix.size(), kLookupTicketPrefix) == 0)
+        {
+            return DoGetLookup(request.ticket.substr(kLookupTicketPrefix.size()), stream);
+        }
+        // "aggregate:..."形式的ticket在服务端聚合，只返回聚合结果（见dataset_aggregate.h）
+        if (request.ticket.compare(0, kAggregateTicketPrefix.size(), kAggregateTicketPrefix) == 0)
+        {
+            return DoGetAggregate(request.ticket.substr(kAggregateTicketPrefix.size()), stream);
+        }
 
-        std::vector<std::shared_ptr<arrow::RecordBatch>> batches;
-        arrow::TableBatchReader batch_reader(*table);
+        std::string dataset = request.ticket;
+        auto snapshot = manifest_->Current();
+        int64_t since_version = -1;
+        size_t pos = request.ticket.rfind('@');
+        if (pos != std::string::npos)
+        {
+            dataset = request.ticket.substr(0, pos);
+            std::string version = request.ticket.substr(pos + 1);
+            if (version.compare(0, kSinceTicketPrefix.size(), kSinceTicketPrefix) == 0)
+            {
+                ARROW_ASSIGN_OR_RAISE(since_version,
+                                      ParseNonNegative(version.substr(kSinceTicketPrefix.size()), "Ticket version"));
+            }
+            else
+            {
+                ARROW_ASSIGN_OR_RAISE(auto pinned_version, ParseNonNegative(version, "Ticket version"));
+                ARROW_ASSIGN_OR_RAISE(snapshot, manifest_->Pin(pinned_version));
+            }
+        }
 
-        ARROW_ASSIGN_OR_RAISE(batches, batch_reader.ToRecordBatches());
-        ARROW_ASSIGN_OR_RAISE(auto owning_reader, arrow::RecordBatchReader::Make(
-                                                      std::move(batches), table->schema()));
+        auto all_files = snapshot->Files(dataset);
+        if (all_files.empty())
+        {
+            return arrow::Status::KeyError("Dataset ", dataset, " does not exist in version ",
+                                           snapshot->version);
+        }
+        ARROW_ASSIGN_OR_RAISE(auto schema, ReadFileSchema(root_, all_files.front().path));
 
+        // 逐个文件读取，不把整个数据集读入内存
+        auto reader = std::make_shared<SnapshotBatchReader>(root_, snapshot,
+                                                            snapshot->Files(dataset, since_version), schema);
         *stream = std::unique_ptr<arrow::flight::FlightDataStream>(
-            new arrow::flight::RecordBatchStream(owning_reader));
+            new arrow::flight::RecordBatchStream(reader));
 
         return arrow::Status::OK();
     }
 
+    /**
+     * @brief 对客户端发来的batch执行cmd描述的计算流水线（见exchange_pipeline.h），边收边算边发
+     *
+     */
+    arrow::Status DoExchange(const arrow::flight::ServerCallContext &context,
+                             std::unique_ptr<arrow::flight::FlightMessageReader> reader,
+                             std::unique_ptr<arrow::flight::FlightMessageWriter> writer) override
+    {
+        const auto &descriptor = reader->descriptor();
+        if (descriptor.type != arrow::flight::FlightDescriptor::CMD)
+        {
+            return arrow::Status::Invalid("DoExchange needs a CMD-type FlightDescriptor describing the pipeline");
+        }
+        ARROW_ASSIGN_OR_RAISE(auto pipeline,
+                              MakeExchangePipeline(descriptor.cmd,
+                                                   [this](const std::string &dataset, const std::string &key,
+                                                          const std::vector<std::string> &columns)
+                                                   { return LoadJoinTable(dataset, key, columns); }));
+        ARROW_ASSIGN_OR_RAISE(auto input_schema, reader->GetSchema());
+        ARROW_ASSIGN_OR_RAISE(auto output_schema, pipeline->OutputSchema(input_schema));
+        ARROW_RETURN_NOT_OK(writer->Begin(output_schema));
+
+        while (true)
+        {
+            ARROW_ASSIGN_OR_RAISE(auto chunk, reader->Next());
+            if (chunk.data == nullptr)
+                break;
+            ARROW_ASSIGN_OR_RAISE(auto output, pipeline->Process(chunk.data));
+            if (output->num_rows() > 0)
+            {
+                ARROW_RETURN_NOT_OK(writer->WriteRecordBatch(*output));
+            }
+        }
+        return arrow::Status::OK();
+    }
+
     arrow::Status ListActions(const arrow::flight::ServerCallContext &,
                               std::vector<arrow::flight::ActionType> *actions) override
     {
-        *actions = {kActionDropDataset};
+        *actions = {kActionDropDataset, kActionCurrentVersion, kActionBeginUpload, kActionCommitUpload,
+                    kActionAbortUpload};
 
         return arrow::Status::OK();
     }
@@ -118,67 +404,612 @@ public:
 
             return DoActionDropDataset(action.body->ToString());
         }
+        if (action.type == kActionCurrentVersion.type)
+        {
+            arrow::flight::Result version{arrow::Buffer::FromString(std::to_string(manifest_->Current()->version))};
+            *result = std::unique_ptr<arrow::flight::ResultStream>(
+                new arrow::flight::SimpleResultStream({version}));
+
+            return arrow::Status::OK();
+        }
+        if (action.type == kActionBeginUpload.type)
+        {
+            ARROW_ASSIGN_OR_RAISE(auto upload_id, DoActionBeginUpload(action.body->ToString()));
+            *result = std::unique_ptr<arrow::flight::ResultStream>(
+                new arrow::flight::SimpleResultStream({arrow::flight::Result{arrow::Buffer::FromString(upload_id)}}));
+
+            return arrow::Status::OK();
+        }
+        if (action.type == kActionCommitUpload.type)
+        {
+            ARROW_ASSIGN_OR_RAISE(auto version, DoActionCommitUpload(action.body->ToString()));
+            arrow::flight::Result version_result{arrow::Buffer::FromString(std::to_string(version))};
+            *result = std::unique_ptr<arrow::flight::ResultStream>(
+                new arrow::flight::SimpleResultStream({version_result}));
+
+            return arrow::Status::OK();
+        }
+        if (action.type == kActionAbortUpload.type)
+        {
+            *result = std::unique_ptr<arrow::flight::ResultStream>(
+                new arrow::flight::SimpleResultStream({}));
+
+            return DoActionAbortUpload(action.body->ToString());
+        }
 
         return arrow::Status::NotImplemented("Unknown action type: ", action.type);
     }
 
 private:
-    arrow::Result<arrow::flight::FlightInfo> MakeFlightInfo(
-        const arrow::fs::FileInfo &file_info)
+    arrow::Result<arrow::flight::FlightInfo> MakeFlightInfo(const ManifestSnapshot &snapshot,
+                                                            const std::string &dataset)
     {
-        ARROW_ASSIGN_OR_RAISE(auto input, root_->OpenInputFile(file_info));
-        std::unique_ptr<parquet::arrow::FileReader> reader;
-        ARROW_RETURN_NOT_OK(parquet::arrow::OpenFile(std::move(input),
-                                                     arrow::default_memory_pool(), &reader));
-        std::shared_ptr<arrow::Schema> schema;
-        ARROW_RETURN_NOT_OK(reader->GetSchema(&schema));
-        auto descriptor = arrow::flight::FlightDescriptor::Path({file_info.base_name()});
+        auto files = snapshot.Files(dataset);
+        if (files.empty())
+        {
+            return arrow::Status::KeyError("Dataset ", dataset, " does not exist");
+        }
+        ARROW_ASSIGN_OR_RAISE(auto schema, ReadFileSchema(root_, files.front().path));
+        auto descriptor = arrow::flight::FlightDescriptor::Path({dataset});
+        // ticket固定在当前版本，之后的提交不影响这次查询
         arrow::flight::FlightEndpoint endpoint;
-        endpoint.ticket.ticket = file_info.base_name();
+        endpoint.ticket.ticket = dataset + "@" + std::to_string(snapshot.version);
         arrow::flight::Location location;
         ARROW_ASSIGN_OR_RAISE(location,
                               arrow::flight::Location::ForGrpcTcp("localhost", port()));
         endpoint.locations.push_back(location);
 
-        int64_t total_records = reader->parquet_reader()->metadata()->num_rows();
-        int64_t total_bytes = file_info.size();
+        int64_t total_records = 0;
+        int64_t total_bytes = 0;
+        for (const auto &file : files)
+        {
+            total_records += file.num_rows;
+            total_bytes += file.size;
+        }
 
         return arrow::flight::FlightInfo::Make(*schema, descriptor, {endpoint}, total_records,
                                                total_bytes);
     }
 
-    arrow::Result<arrow::fs::FileInfo> FileInfoFromDescriptor(
+    arrow::Result<std::string> DatasetFromDescriptor(
         const arrow::flight::FlightDescriptor &descriptor)
     {
         if (descriptor.type != arrow::flight::FlightDescriptor::PATH)
         {
             return arrow::Status::Invalid("Must provide PATH-type FlightDescriptor");
         }
+        else if (descriptor.path.size() == 2 && descriptor.path[1] == kAppendCommand)
+        {
+            return descriptor.path[0];
+        }
         else if (descriptor.path.size() != 1)
         {
             return arrow::Status::Invalid(
                 "Must provide PATH-type FlightDescriptor with one path component");
         }
 
-        return root_->GetFileInfo(descriptor.path[0]);
+        return descriptor.path[0];
+    }
+
+    /**
+     * @brief 追加的数据必须与数据集现有文件的schema一致
+     *
+     */
+    arrow::Status CheckAppendSchema(const std::string &dataset, const arrow::Schema &schema)
+    {
+        auto files = manifest_->Current()->Files(dataset);
+        if (files.empty())
+            return arrow::Status::OK();
+        ARROW_ASSIGN_OR_RAISE(auto existing, ReadFileSchema(root_, files.front().path));
+        if (!existing->Equals(schema, /*check_metadata=*/false))
+        {
+            return arrow::Status::Invalid("Cannot append to ", dataset, ": schema ", schema.ToString(),
+                                          " does not match ", existing->ToString());
+        }
+        return arrow::Status::OK();
+    }
+
+    /**
+     * @brief 数据里包含的主键列
+     *
+     */
+    std::vector<std::string> KeyColumns(const arrow::Schema &schema) const
+    {
+        std::vector<std::string> key_columns;
+        for (const auto &column : kLookupKeyColumns)
+        {
+            if (schema.GetFieldIndex(column) >= 0)
+                key_columns.push_back(column);
+        }
+        return key_columns;
+    }
+
+    /**
+     * @brief 把表写成一个新的数据文件，返回尚未提交的清单条目
+     *
+     * 上传的数据里有主键列时，生成布隆过滤器文件，方便点查
+     */
+    arrow::Result<ManifestEntry> WriteDataFile(const std::string &dataset, const arrow::Table &table)
+    {
+        std::string path = manifest_->NewDataFilePath();
+        ARROW_ASSIGN_OR_RAISE(auto sink, root_->OpenOutputStream(path));
+        ARROW_RETURN_NOT_OK(parquet::arrow::WriteTable(table, arrow::default_memory_pool(),
+                                                       sink, /*chunk_size=*/65536,
+                                                       LookupWriterProperties(kLookupKeyColumns)));
+        ARROW_RETURN_NOT_OK(sink->Close());
+
+        auto key_columns = KeyColumns(*table.schema());
+        if (!key_columns.empty())
+        {
+            ARROW_RETURN_NOT_OK(BuildBloomSidecar(root_, path, key_columns));
+        }
+        return DescribeDataFile(root_, dataset, path);
+    }
+
+    /**
+     * @brief 提交后更新二级索引，只扫描新文件的主键列，合并进已有索引
+     *
+     */
+    arrow::Status IndexDataFile(const arrow::Schema &schema, const std::string &path)
+    {
+        for (const auto &column : KeyColumns(schema))
+        {
+            ARROW_RETURN_NOT_OK(UpdateSecondaryIndex(root_, "", column, path));
+        }
+        return arrow::Status::OK();
+    }
+
+    /**
+     * @brief 写入分片上传的一个分片，边收边暂存，每暂存一个文件回一个检查点
+     *
+     * 各分片在不同的流上并行写入；收到的数据每满kCheckpointBytes写成一个数据文件，
+     * 文件不在清单里，读者看不到。文件写完后通过metadata返回检查点：分片内已暂存的行数。
+     * 流中断时，客户端用描述符{上传id, "part", 序号, 检查点}从检查点续传，
+     * 该分片在检查点及之后的文件会被丢弃，由续传的流重新写入。
+     * 服务在提交前重启时，这些文件按遗留文件删除。
+     */
+    arrow::Status DoPutPart(const std::vector<std::string> &path,
+                            std::unique_ptr<arrow::flight::FlightMessageReader> reader,
+                            std::unique_ptr<arrow::flight::FlightMetadataWriter> metadata_writer)
+    {
+        const std::string &upload_id = path[0];
+        int64_t numbers[2] = {0, 0}; // 分片序号，起始行
+        for (size_t i = 2; i < path.size(); ++i)
+        {
+            ARROW_ASSIGN_OR_RAISE(numbers[i - 2], ParseNonNegative(path[i], "Part number or start row"));
+        }
+        int64_t part = numbers[0];
+        int64_t checkpoint = numbers[1];
+
+        std::string dataset;
+        int64_t generation;
+        std::vector<std::string> superseded;
+        {
+            std::lock_guard<std::mutex> lock(uploads_mutex_);
+            auto upload = uploads_.find(upload_id);
+            if (upload == uploads_.end())
+                return arrow::Status::KeyError("Upload ", upload_id, " does not exist");
+            // 检查点必须是已暂存文件的边界，否则会重复或缺行
+            auto &files = upload->second.files;
+            auto first_superseded = files.lower_bound(PendingUpload::FileKey(part, checkpoint));
+            int64_t staged_rows = 0;
+            if (first_superseded != files.begin())
+            {
+                auto last_kept = std::prev(first_superseded);
+                if (last_kept->first.first == part)
+                    staged_rows = last_kept->first.second + last_kept->second.num_rows;
+            }
+            if (staged_rows != checkpoint)
+            {
+                return arrow::Status::Invalid("Part ", part, " of upload ", upload_id, " has ", staged_rows,
+                                              " rows staged before row ", checkpoint, ", cannot resume there");
+            }
+            dataset = upload->second.dataset;
+            generation = ++upload->second.generations[part];
+            // 检查点之后的文件客户端会重发
+            for (auto it = first_superseded;
+                 it != files.end() && it->first.first == part;)
+            {
+                superseded.push_back(it->second.path);
+                upload->second.schemas.erase(it->first);
+                it = files.erase(it);
+            }
+        }
+        for (const auto &file : superseded)
+        {
+            ARROW_RETURN_NOT_OK(DeleteDataFile(root_, {}, file));
+        }
+
+        ARROW_ASSIGN_OR_RAISE(auto schema, reader->GetSchema());
+        std::vector<std::shared_ptr<arrow::RecordBatch>> batches;
+        int64_t buffered_bytes = 0;
+        while (true)
+        {
+            ARROW_ASSIGN_OR_RAISE(auto chunk, reader->Next());
+            bool finished = chunk.data == nullptr;
+            if (!finished)
+            {
+                buffered_bytes += arrow::util::TotalBufferSize(*chunk.data);
+                batches.push_back(chunk.data);
+            }
+            // 客户端结束写入时把剩下的行也暂存；流出错时上面已经返回，没到检查点的行不暂存
+            if (!batches.empty() && (finished || buffered_bytes >= kCheckpointBytes))
+            {
+                ARROW_ASSIGN_OR_RAISE(auto table, arrow::Table::FromRecordBatches(schema, batches));
+                ARROW_RETURN_NOT_OK(StagePartFile(upload_id, part, generation, checkpoint, dataset, *table));
+                checkpoint += table->num_rows();
+                batches.clear();
+                buffered_bytes = 0;
+                ARROW_RETURN_NOT_OK(
+                    metadata_writer->WriteMetadata(*arrow::Buffer::FromString(std::to_string(checkpoint))));
+            }
+            if (finished)
+                break;
+        }
+        return arrow::Status::OK();
+    }
+
+    /**
+     * @brief 把分片中从start_row开始的一段写成数据文件并暂存
+     *
+     */
+    arrow::Status StagePartFile(const std::string &upload_id, int64_t part, int64_t generation, int64_t start_row,
+                                const std::string &dataset, const arrow::Table &table)
+    {
+        ARROW_ASSIGN_OR_RAISE(auto entry, WriteDataFile(dataset, table));
+        bool staged = false;
+        {
+            std::lock_guard<std::mutex> lock(uploads_mutex_);
+            auto upload = uploads_.find(upload_id);
+            if (upload != uploads_.end() && upload->second.generations[part] == generation)
+            {
+                PendingUpload::FileKey key(part, start_row);
+                upload->second.files[key] = entry;
+                upload->second.schemas[key] = table.schema();
+                staged = true;
+            }
+        }
+        if (!staged)
+        {
+            // 写文件期间上传已被提交或放弃，或者该分片已经从检查点续传
+            ARROW_RETURN_NOT_OK(DeleteDataFile(root_, {}, entry.path));
+            return arrow::Status::Invalid("Upload ", upload_id, " is no longer open or part ", part,
+                                          " was resumed by another stream");
+        }
+        return arrow::Status::OK();
     }
 
+    /**
+     * @brief 开始分片上传，body为"名称"时提交后替换数据集，为"名称|append"时追加
+     *
+     */
+    arrow::Result<std::string> DoActionBeginUpload(const std::string &body)
+    {
+        PendingUpload upload;
+        size_t pos = body.find('|');
+        upload.dataset = body.substr(0, pos);
+        if (pos != std::string::npos)
+        {
+            if (body.substr(pos + 1) != kAppendCommand)
+                return arrow::Status::Invalid("begin_upload takes <dataset> or <dataset>|append");
+            upload.append = true;
+        }
+        if (upload.dataset.empty())
+        {
+            return arrow::Status::Invalid("begin_upload needs a dataset name");
+        }
+
+        std::lock_guard<std::mutex> lock(uploads_mutex_);
+        std::string upload_id = "upload-" + std::to_string(next_upload_id_++);
+        uploads_[upload_id] = upload;
+        return upload_id;
+    }
+
+    /**
+     * @brief 把所有分片作为一个版本提交，读者要么看到全部分片，要么一个都看不到
+     *
+     */
+    arrow::Result<int64_t> DoActionCommitUpload(const std::string &upload_id)
+    {
+        PendingUpload upload;
+        {
+            std::lock_guard<std::mutex> lock(uploads_mutex_);
+            auto found = uploads_.find(upload_id);
+            if (found == uploads_.end())
+                return arrow::Status::KeyError("Upload ", upload_id, " does not exist");
+            upload = std::move(found->second);
+            uploads_.erase(found);
+        }
+
+        std::vector<ManifestEntry> entries;
+        int64_t total_rows = 0;
+        for (const auto &file : upload.files)
+        {
+            entries.push_back(file.second);
+            total_rows += file.second.num_rows;
+        }
+        std::shared_ptr<arrow::Schema> schema;
+        arrow::Status status;
+        if (entries.empty())
+        {
+            status = arrow::Status::Invalid("Upload ", upload_id, " has no parts");
+        }
+        for (const auto &file : upload.schemas)
+        {
+            if (schema == nullptr)
+            {
+                schema = file.second;
+            }
+            else if (status.ok() && !schema->Equals(*file.second, /*check_metadata=*/false))
+            {
+                status = arrow::Status::Invalid("Part ", file.first.first, " of upload ", upload_id, " has schema ",
+                                                file.second->ToString(), ", expected ", schema->ToString());
+            }
+        }
+        if (status.ok() && upload.append)
+        {
+            status = CheckAppendSchema(upload.dataset, *schema);
+        }
+        if (!status.ok())
+        {
+            ARROW_RETURN_NOT_OK(DiscardParts(upload));
+            return status;
+        }
+
+        ARROW_ASSIGN_OR_RAISE(auto version, manifest_->Commit(upload.dataset, entries, /*replace=*/!upload.append));
+        for (const auto &entry : entries)
+        {
+            ARROW_RETURN_NOT_OK(IndexDataFile(*schema, entry.path));
+        }
+        cout << "commit " << upload_id << ": " << entries.size() << " files, " << total_rows << " rows -> "
+             << upload.dataset << "@" << version << std::endl;
+        return version;
+    }
+
+    arrow::Status DoActionAbortUpload(const std::string &upload_id)
+    {
+        PendingUpload upload;
+        {
+            std::lock_guard<std::mutex> lock(uploads_mutex_);
+            auto found = uploads_.find(upload_id);
+            if (found == uploads_.end())
+                return arrow::Status::KeyError("Upload ", upload_id, " does not exist");
+            upload = std::move(found->second);
+            uploads_.erase(found);
+        }
+        return DiscardParts(upload);
+    }
+
+    /**
+     * @brief 删除未提交分片的数据文件和布隆过滤器文件，它们还没有进二级索引
+     *
+     */
+    arrow::Status DiscardParts(const PendingUpload &upload)
+    {
+        for (const auto &file : upload.files)
+        {
+            ARROW_RETURN_NOT_OK(DeleteDataFile(root_, {}, file.second.path));
+        }
+        return arrow::Status::OK();
+    }
+
+    /**
+     * @brief 取join的build side：按数据集的最新版本缓存，数据集的文件列表不变时直接复用哈希表
+     *
+     * 只读键列和要追加的列，columns为空时读所有列
+     */
+    arrow::Result<std::shared_ptr<const LookupJoinTable>> LoadJoinTable(const std::string &dataset,
+                                                                        const std::string &key,
+                                                                        const std::vector<std::string> &columns)
+    {
+        auto snapshot = manifest_->Current();
+        auto files = snapshot->Files(dataset);
+        if (files.empty())
+        {
+            return arrow::Status::KeyError("Dataset ", dataset, " does not exist");
+        }
+        std::vector<std::string> paths;
+        for (const auto &file : files)
+        {
+            paths.push_back(file.path);
+        }
+        std::string cache_key = dataset + "|" + key;
+        for (const auto &column : columns)
+        {
+            cache_key += "," + column;
+        }
+        {
+            std::lock_guard<std::mutex> lock(join_cache_mutex_);
+            auto it = join_cache_.find(cache_key);
+            if (it != join_cache_.end() && it->second.paths == paths)
+            {
+                it->second.last_used = ++join_cache_tick_;
+                return it->second.table;
+            }
+        }
+
+        // 缓存没有命中时在锁外建表，并发的请求可能各建一次，结果相同
+        ARROW_ASSIGN_OR_RAISE(auto schema, ReadFileSchema(root_, files.front().path));
+        std::vector<int> column_indices;
+        if (!columns.empty())
+        {
+            std::vector<std::string> names{key};
+            for (const auto &column : columns)
+            {
+                if (column != key)
+                    names.push_back(column);
+            }
+            std::vector<std::shared_ptr<arrow::Field>> fields;
+            for (const auto &name : names)
+            {
+                int index = schema->GetFieldIndex(name);
+                if (index < 0)
+                {
+                    return arrow::Status::KeyError("Column ", name, " not found in ", schema->ToString());
+                }
+                column_indices.push_back(index);
+                fields.push_back(schema->field(index));
+            }
+            schema = arrow::schema(fields);
+        }
+        SnapshotBatchReader reader(root_, snapshot, files, schema, column_indices);
+        ARROW_ASSIGN_OR_RAISE(auto right, arrow::Table::FromRecordBatchReader(&reader));
+        ARROW_ASSIGN_OR_RAISE(auto table, LookupJoinTable::Make(right, key));
+
+        std::lock_guard<std::mutex> lock(join_cache_mutex_);
+        JoinCacheEntry &entry = join_cache_[cache_key];
+        entry.paths = paths;
+        entry.table = table;
+        entry.last_used = ++join_cache_tick_;
+        while (join_cache_.size() > JOIN_CACHE_ENTRIES)
+        {
+            auto oldest = join_cache_.begin();
+            for (auto it = join_cache_.begin(); it != join_cache_.end(); ++it)
+            {
+                if (it->second.last_used < oldest->second.last_used)
+                    oldest = it;
+            }
+            join_cache_.erase(oldest);
+        }
+        return table;
+    }
+
+    /**
+     * @brief 按二级索引点查数据集的最新版本
+     *
+     * 索引覆盖所有数据集，也可能还留着已被替换、等待回收的文件的记录；
+     * 只保留当前快照里属于该数据集的文件，读完之前持有快照，文件不会被回收
+     */
+    arrow::Status DoGetLookup(const std::string &text,
+                              std::unique_ptr<arrow::flight::FlightDataStream> *stream)
+    {
+        size_t bar = text.find('|');
+        size_t pos = text.find('=', bar == std::string::npos ? 0 : bar);
+        if (bar == std::string::npos || pos == std::string::npos)
+        {
+            return arrow::Status::Invalid("Lookup ticket must be lookup:<dataset>|<column>=<value>");
+        }
+        std::string dataset = text.substr(0, bar);
+        std::string column = text.substr(bar + 1, pos - bar - 1);
+        auto snapshot = manifest_->Current();
+        auto files = snapshot->Files(dataset);
+        if (files.empty())
+        {
+            return arrow::Status::KeyError("Dataset ", dataset, " does not exist");
+        }
+        std::set<std::string> paths;
+        for (const auto &file : files)
+        {
+            paths.insert(file.path);
+        }
+
+        ARROW_ASSIGN_OR_RAISE(auto index, SecondaryIndex::Open(root_, "", column));
+        ARROW_ASSIGN_OR_RAISE(auto all_entries, index->Lookup(text.substr(pos + 1)));
+        std::vector<IndexEntry> entries;
+        for (const auto &entry : all_entries)
+        {
+            if (paths.count(entry.fragment) > 0)
+                entries.push_back(entry);
+        }
+        // 没有命中时返回空表，schema与数据集一致
+        ARROW_ASSIGN_OR_RAISE(auto schema, ReadFileSchema(root_, files.front().path));
+        ARROW_ASSIGN_OR_RAISE(auto table, ReadIndexedRows(root_, "", entries, schema));
+
+        std::vector<std::shared_ptr<arrow::RecordBatch>> batches;
+        arrow::TableBatchReader batch_reader(*table);
+        ARROW_ASSIGN_OR_RAISE(batches, batch_reader.ToRecordBatches());
+        ARROW_ASSIGN_OR_RAISE(auto owning_reader, arrow::RecordBatchReader::Make(
+                                                      std::move(batches), table->schema()));
+        *stream = std::unique_ptr<arrow::flight::FlightDataStream>(
+            new arrow::flight::RecordBatchStream(std::make_shared<PinnedBatchReader>(owning_reader, snapshot)));
+        return arrow::Status::OK();
+    }
+
+    /**
+     * @brief 在数据集的最新版本上执行聚合查询
+     *
+     * 每个数据文件带着清单里的min/max作为guarantee，过滤条件排除的文件不会打开
+     */
+    arrow::Status DoGetAggregate(const std::string &text,
+                                 std::unique_ptr<arrow::flight::FlightDataStream> *stream)
+    {
+        ARROW_ASSIGN_OR_RAISE(auto query, ParseAggregateQuery(text));
+        auto snapshot = manifest_->Current();
+        auto files = snapshot->Files(query.dataset);
+        if (files.empty())
+        {
+            return arrow::Status::KeyError("Dataset ", query.dataset, " does not exist");
+        }
+        ARROW_ASSIGN_OR_RAISE(auto schema, ReadFileSchema(root_, files.front().path));
+        auto format = std::make_shared<arrow::dataset::ParquetFileFormat>();
+        std::vector<std::shared_ptr<arrow::dataset::FileFragment>> fragments;
+        int64_t total_rows = 0;
+        for (const auto &file : files)
+        {
+            ARROW_ASSIGN_OR_RAISE(auto fragment, format->MakeFragment(arrow::dataset::FileSource(file.path, root_),
+                                                                      file.statistics));
+            fragments.push_back(fragment);
+            total_rows += file.num_rows;
+        }
+        ARROW_ASSIGN_OR_RAISE(auto dataset, arrow::dataset::FileSystemDataset::Make(
+                                                schema, arrow::compute::literal(true), format, root_,
+                                                std::move(fragments)));
+
+        // 查询执行期间持有快照，文件不会被回收
+        ARROW_ASSIGN_OR_RAISE(auto table, ExecuteAggregateQuery(dataset, query));
+        cout << "aggregate " << query.dataset << ": " << total_rows << " rows -> " << table->num_rows()
+             << " rows" << std::endl;
+
+        std::vector<std::shared_ptr<arrow::RecordBatch>> batches;
+        arrow::TableBatchReader batch_reader(*table);
+        ARROW_ASSIGN_OR_RAISE(batches, batch_reader.ToRecordBatches());
+        ARROW_ASSIGN_OR_RAISE(auto owning_reader, arrow::RecordBatchReader::Make(
+                                                      std::move(batches), table->schema()));
+        *stream = std::unique_ptr<arrow::flight::FlightDataStream>(
+            new arrow::flight::RecordBatchStream(owning_reader));
+        return arrow::Status::OK();
+    }
+
+    /**
+     * @brief 提交一个不含该数据集的新版本，文件等正在读的快照释放后再回收
+     *
+     */
     arrow::Status DoActionDropDataset(const std::string &key)
     {
-        return root_->DeleteFile(key);
+        if (manifest_->Current()->Files(key).empty())
+        {
+            return arrow::Status::KeyError("Dataset ", key, " does not exist");
+        }
+        return manifest_->Commit(key, {}, /*replace=*/true).status();
     }
 
     std::shared_ptr<arrow::fs::FileSystem> root_;
+    std::shared_ptr<DatasetManifest> manifest_;
+
+    std::mutex uploads_mutex_;
+    std::map<std::string, PendingUpload> uploads_; // 进行中的分片上传
+    int64_t next_upload_id_ = 0;
+
+    std::mutex join_cache_mutex_;
+    std::map<std::string, JoinCacheEntry> join_cache_; // "数据集|键列,列..." -> build side
+    int64_t join_cache_tick_ = 0;
 
 }; // end ParquetStorageService
 
 arrow::Status startServer()
 {
-    // 创建并清空存储的数据文件目录
-    auto fs = std::make_shared<arrow::fs::LocalFileSystem>();
+    // 创建存储的数据文件目录，已提交的版本记录在清单里，重启后继续使用
+    // 使用内存映射读文件，二级索引打开时不需要整体读入内存
+    arrow::fs::LocalFileSystemOptions fs_options;
+    fs_options.use_mmap = true;
+    auto fs = std::make_shared<arrow::fs::LocalFileSystem>(fs_options);
     ARROW_RETURN_NOT_OK(fs->CreateDir("./flight_datasets/"));
-    ARROW_RETURN_NOT_OK(fs->DeleteDirContents("./flight_datasets/"));
-    auto root = std::make_shared<arrow::fs::SubTreeFileSystem>("./flight_datasets/", fs);
+    std::shared_ptr<arrow::fs::FileSystem> root = std::make_shared<arrow::fs::SubTreeFileSystem>("./flight_datasets/", fs);
+
+    std::vector<std::string> key_columns{"trdno", "sno"};
+    ARROW_ASSIGN_OR_RAISE(auto manifest, DatasetManifest::Open(root, [root, key_columns](const std::string &path)
+                                                               { return DeleteDataFile(root, key_columns, path); }));
+    cout << "Manifest version " << manifest->Current()->version << std::endl;
 
     // 设置flight监听IP端口
     arrow::flight::Location server_location;
@@ -188,7 +1019,7 @@ arrow::Status startServer()
     // 初始化
     arrow::flight::FlightServerOptions options(server_location);
     auto server = std::unique_ptr<arrow::flight::FlightServerBase>(
-        new ParquetStorageService(std::move(root)));
+        new ParquetStorageService(std::move(root), std::move(manifest)));
     ARROW_RETURN_NOT_OK(server->Init(options));
     cout << "Listening on port " << server->port() << std::endl;
 
@@ -5,17 +5,52 @@
 #include <parquet/exception.h>
 #include <arrow/flight/api.h>
 #include <arrow/filesystem/api.h>
+#include <arrow/util/byte_size.h>
+#include <arrow/util/thread_pool.h>
 
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
 #include <iostream>
+#include <numeric>
 #include <string>
+#include <thread>
+#include <vector>
 using namespace std;
 
+#include "../flight_speed_test/resumable_read.h"
+
 #define SERVER_PORT 33000
 // 该文件是通过read_write_parquet生成的
 #define DATA_FILE_1 "test2.parquet"
 #define DATA_FILE_2 "test.parquet"
+// 分片上传中断后最多尝试几次
+#define UPLOAD_ATTEMPTS 3
+
+/**
+ * @brief 解析服务端回的版本号或检查点，格式不对或越界时返回IOError，不抛异常
+ *
+ */
+arrow::Result<int64_t> ParseServerNumber(const std::string &text, const std::string &what)
+{
+    errno = 0;
+    char *end = nullptr;
+    long long number = std::strtoll(text.c_str(), &end, 10);
+    if (text.empty() || *end != '\0' || errno == ERANGE || number < 0)
+    {
+        return arrow::Status::IOError("Server returned an invalid ", what, ": '", text, "'");
+    }
+    return static_cast<int64_t>(number);
+}
 
-arrow::Status uploadData(std::unique_ptr<arrow::flight::FlightClient> &client)
+/**
+ * @brief 上传数据文件，path为{名称}时替换数据集，为{名称, "append"}时追加
+ *
+ * @return arrow::Result<int64_t> 服务端提交后的清单版本
+ */
+arrow::Result<int64_t> uploadData(std::unique_ptr<arrow::flight::FlightClient> &client,
+                                  const std::vector<std::string> &path)
 {
     // 打开数据文件
     auto fs = std::make_shared<arrow::fs::LocalFileSystem>();
@@ -26,7 +61,7 @@ arrow::Status uploadData(std::unique_ptr<arrow::flight::FlightClient> &client)
     ARROW_RETURN_NOT_OK(parquet::arrow::OpenFile(std::move(input), arrow::default_memory_pool(), &reader));
 
     // 设置请求头（设置文件路径和元数据）
-    auto descriptor = arrow::flight::FlightDescriptor::Path({DATA_FILE_1});
+    auto descriptor = arrow::flight::FlightDescriptor::Path(path);
     std::shared_ptr<arrow::Schema> schema;
     ARROW_RETURN_NOT_OK(reader->GetSchema(&schema));
 
@@ -54,10 +89,224 @@ arrow::Status uploadData(std::unique_ptr<arrow::flight::FlightClient> &client)
         batches++;
     }
 
+    // 写完后等服务端提交，读回提交的版本号
+    ARROW_RETURN_NOT_OK(writer->DoneWriting());
+    std::shared_ptr<arrow::Buffer> version;
+    ARROW_RETURN_NOT_OK(metadata_reader->ReadMetadata(&version));
     ARROW_RETURN_NOT_OK(writer->Close());
-    cout << "写了 " << batches << " batches" << std::endl;
+    if (version == nullptr)
+    {
+        return arrow::Status::IOError("Server did not return a manifest version");
+    }
+    cout << "写了 " << batches << " batches，版本 " << version->ToString() << std::endl;
 
-    return arrow::Status::OK();
+    return ParseServerNumber(version->ToString(), "manifest version");
+}
+
+/**
+ * @brief 从checkpoint行开始上传分片的剩余部分，服务端每暂存一个文件，checkpoint就前进到该文件末尾
+ *
+ */
+arrow::Status uploadPartFrom(arrow::flight::FlightClient *client,
+                             const std::shared_ptr<parquet::arrow::FileReader> &reader,
+                             const std::string &upload_id, int part, const std::vector<int> &row_groups,
+                             arrow::internal::Executor *decode_pool, int64_t *checkpoint, int64_t *bytes)
+{
+    // 检查点之前的row group不再读取，检查点所在的row group解码后切掉已上传的行
+    ARROW_ASSIGN_OR_RAISE(auto range, LocateRow(*reader->parquet_reader()->metadata(), row_groups, *checkpoint));
+    if (range.row_groups.empty())
+        return arrow::Status::OK();
+    std::shared_ptr<arrow::Schema> schema;
+    ARROW_RETURN_NOT_OK(reader->GetSchema(&schema));
+    std::vector<int> columns(reader->parquet_reader()->metadata()->num_columns());
+    std::iota(columns.begin(), columns.end(), 0);
+    ARROW_ASSIGN_OR_RAISE(auto generator, reader->GetRecordBatchGenerator(reader, range.row_groups, columns,
+                                                                          decode_pool, /*row_group_readahead=*/2));
+
+    auto descriptor = arrow::flight::FlightDescriptor::Path(
+        {upload_id, "part", std::to_string(part), std::to_string(*checkpoint)});
+    ARROW_ASSIGN_OR_RAISE(auto put_stream, client->DoPut(descriptor, schema));
+
+    // 检查点在单独的线程里读，流中断时记着最后一个；线程里不能抛异常，解析失败时记下状态后退出
+    arrow::flight::FlightMetadataReader *metadata_reader = put_stream.reader.get();
+    arrow::Status metadata_status;
+    std::thread metadata_thread([metadata_reader, checkpoint, &metadata_status]()
+                                {
+                                    while (true)
+                                    {
+                                        std::shared_ptr<arrow::Buffer> metadata;
+                                        if (!metadata_reader->ReadMetadata(&metadata).ok() || metadata == nullptr)
+                                            break;
+                                        auto staged = ParseServerNumber(metadata->ToString(), "checkpoint");
+                                        if (!staged.ok())
+                                        {
+                                            metadata_status = staged.status();
+                                            break;
+                                        }
+                                        *checkpoint = *staged;
+                                    } });
+
+    auto write_status = [&]() -> arrow::Status
+    {
+        int64_t skip_rows = range.skip_rows;
+        while (true)
+        {
+            ARROW_ASSIGN_OR_RAISE(auto batch, generator().result());
+            if (batch == nullptr)
+                break;
+            if (skip_rows >= batch->num_rows())
+            {
+                skip_rows -= batch->num_rows();
+                continue;
+            }
+            if (skip_rows > 0)
+            {
+                batch = batch->Slice(skip_rows);
+                skip_rows = 0;
+            }
+            ARROW_RETURN_NOT_OK(put_stream.writer->WriteRecordBatch(*batch));
+            *bytes += arrow::util::TotalBufferSize(*batch);
+        }
+        return arrow::Status::OK();
+    }();
+    // 出错时也结束写入，服务端暂存已收到的行、回最后一个检查点后结束调用
+    auto done_status = put_stream.writer->DoneWriting();
+    metadata_thread.join();
+    auto close_status = put_stream.writer->Close();
+    ARROW_RETURN_NOT_OK(metadata_status);
+    ARROW_RETURN_NOT_OK(write_status);
+    ARROW_RETURN_NOT_OK(done_status);
+    return close_status;
+}
+
+/**
+ * @brief 上传一个分片：一段连续的row group，走自己的连接和DoPut流
+ *
+ * row group在decode_pool上预读解码，本线程只负责把解码好的batch写出去；
+ * 流中断时从服务端最后确认的检查点续传，只重发检查点之后的行
+ */
+arrow::Status uploadPart(const arrow::flight::Location &location, const std::string &upload_id, int part,
+                         const std::vector<int> &row_groups, arrow::internal::Executor *decode_pool,
+                         int64_t *bytes)
+{
+    // gRPC默认在进程内的channel之间共享连接，用独立的subchannel池时每个流才是单独的TCP连接
+    auto options = arrow::flight::FlightClientOptions::Defaults();
+    options.generic_options.emplace_back("grpc.use_local_subchannel_pool", 1);
+    std::unique_ptr<arrow::flight::FlightClient> client;
+    ARROW_ASSIGN_OR_RAISE(client, arrow::flight::FlightClient::Connect(location, options));
+
+    // 每个流一个FileReader，pre_buffer合并同一row group各列的IO请求
+    auto fs = std::make_shared<arrow::fs::LocalFileSystem>();
+    ARROW_ASSIGN_OR_RAISE(std::shared_ptr<arrow::io::RandomAccessFile> input, fs->OpenInputFile(DATA_FILE_1));
+    parquet::ArrowReaderProperties properties;
+    properties.set_pre_buffer(true);
+    parquet::arrow::FileReaderBuilder builder;
+    ARROW_RETURN_NOT_OK(builder.Open(std::move(input)));
+    std::unique_ptr<parquet::arrow::FileReader> file_reader;
+    ARROW_RETURN_NOT_OK(builder.properties(properties)->Build(&file_reader));
+    std::shared_ptr<parquet::arrow::FileReader> reader = std::move(file_reader);
+
+    int64_t part_rows = 0;
+    for (int row_group : row_groups)
+    {
+        part_rows += reader->parquet_reader()->metadata()->RowGroup(row_group)->num_rows();
+    }
+    int64_t checkpoint = 0;
+    for (int attempt = 1;; ++attempt)
+    {
+        auto status = uploadPartFrom(client.get(), reader, upload_id, part, row_groups, decode_pool, &checkpoint,
+                                     bytes);
+        if (status.ok() && checkpoint != part_rows)
+        {
+            status = arrow::Status::IOError("Part ", part, " has ", part_rows, " rows, server staged ", checkpoint);
+        }
+        if (status.ok())
+            break;
+        if (attempt == UPLOAD_ATTEMPTS)
+            return status;
+        cout << "part " << part << ": " << status.ToString() << "，从第 " << checkpoint << " 行续传" << endl;
+    }
+    return client->Close();
+}
+
+/**
+ * @brief 把数据文件的row group分给num_streams个DoPut流并行上传，服务端把所有分片作为一个版本提交
+ *
+ * 每个流分到一段连续的row group，服务端边收边暂存成数据文件；任一流续传后仍失败时放弃整个上传。
+ *
+ * @return arrow::Result<int64_t> 服务端提交后的清单版本
+ */
+arrow::Result<int64_t> parallelUploadData(std::unique_ptr<arrow::flight::FlightClient> &client,
+                                          const arrow::flight::Location &location, const std::string &dataset,
+                                          bool append, int num_streams)
+{
+    auto fs = std::make_shared<arrow::fs::LocalFileSystem>();
+    ARROW_ASSIGN_OR_RAISE(std::shared_ptr<arrow::io::RandomAccessFile> input, fs->OpenInputFile(DATA_FILE_1));
+    std::unique_ptr<parquet::arrow::FileReader> reader;
+    ARROW_RETURN_NOT_OK(parquet::arrow::OpenFile(std::move(input), arrow::default_memory_pool(), &reader));
+    int num_row_groups = reader->num_row_groups();
+    num_streams = std::max(1, std::min(num_streams, num_row_groups));
+
+    arrow::flight::Action begin{"begin_upload", arrow::Buffer::FromString(dataset + (append ? "|append" : ""))};
+    std::unique_ptr<arrow::flight::ResultStream> results;
+    ARROW_ASSIGN_OR_RAISE(results, client->DoAction(begin));
+    ARROW_ASSIGN_OR_RAISE(auto upload_id_result, results->Next());
+    if (upload_id_result == nullptr)
+    {
+        return arrow::Status::IOError("Server did not return an upload id");
+    }
+    std::string upload_id = upload_id_result->body->ToString();
+
+    // 解码线程池由所有流共用
+    ARROW_ASSIGN_OR_RAISE(auto decode_pool, arrow::internal::ThreadPool::Make(num_streams));
+    std::vector<arrow::Status> statuses(num_streams);
+    std::vector<int64_t> bytes(num_streams, 0);
+    std::vector<std::thread> threads;
+    auto start = std::chrono::steady_clock::now();
+    for (int part = 0; part < num_streams; ++part)
+    {
+        std::vector<int> row_groups;
+        for (int i = num_row_groups * part / num_streams; i < num_row_groups * (part + 1) / num_streams; ++i)
+        {
+            row_groups.push_back(i);
+        }
+        threads.emplace_back([&, part, row_groups]()
+                             { statuses[part] = uploadPart(location, upload_id, part, row_groups,
+                                                           decode_pool.get(), &bytes[part]); });
+    }
+    for (auto &thread : threads)
+    {
+        thread.join();
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    for (const auto &status : statuses)
+    {
+        if (!status.ok())
+        {
+            // 已写完的分片由服务端删除，数据集不受影响
+            arrow::flight::Action abort{"abort_upload", arrow::Buffer::FromString(upload_id)};
+            auto abort_status = client->DoAction(abort).status();
+            if (!abort_status.ok())
+                cout << "abort " << upload_id << ": " << abort_status << std::endl;
+            return status;
+        }
+    }
+
+    arrow::flight::Action commit{"commit_upload", arrow::Buffer::FromString(upload_id)};
+    ARROW_ASSIGN_OR_RAISE(results, client->DoAction(commit));
+    ARROW_ASSIGN_OR_RAISE(auto version, results->Next());
+    if (version == nullptr)
+    {
+        return arrow::Status::IOError("Server did not return a manifest version");
+    }
+
+    int64_t total_bytes = std::accumulate(bytes.begin(), bytes.end(), int64_t(0));
+    cout << num_streams << " 个流上传了 " << num_row_groups << " 个row group，" << total_bytes << " bytes，"
+         << seconds << " s，" << total_bytes / seconds / (1 << 20) << " MB/s，版本 " << version->body->ToString()
+         << std::endl;
+
+    return ParseServerNumber(version->body->ToString(), "manifest version");
 }
 
 arrow::Status getData(std::unique_ptr<arrow::flight::FlightClient> &client)
@@ -99,6 +348,86 @@ arrow::Status getData(std::unique_ptr<arrow::flight::FlightClient> &client)
     return arrow::Status::OK();
 }
 
+arrow::Status getDataSince(std::unique_ptr<arrow::flight::FlightClient> &client, int64_t version)
+{
+    // 只取指定版本之后追加的数据
+    arrow::flight::Ticket ticket{std::string(DATA_FILE_1) + "@since:" + std::to_string(version)};
+    std::unique_ptr<arrow::flight::FlightStreamReader> stream;
+    ARROW_ASSIGN_OR_RAISE(stream, client->DoGet(ticket));
+    std::shared_ptr<arrow::Table> table;
+    ARROW_ASSIGN_OR_RAISE(table, stream->ToTable());
+    cout << "版本 " << version << " 之后追加了 " << table->num_rows() << " 行" << std::endl;
+
+    return arrow::Status::OK();
+}
+
+/**
+ * @brief 把一组键发给服务端，与DATA_FILE_1连接后再计算、过滤，结果边算边返回
+ *
+ * 写和读必须并行：结果积压在客户端的接收窗口里时，服务端会停下来不再读输入
+ */
+arrow::Status exchangeData(std::unique_ptr<arrow::flight::FlightClient> &client)
+{
+    std::string pipeline = std::string("join:") + DATA_FILE_1 + ",int|multiply:int,10,int_x10|filter:int,ge,2";
+    auto descriptor = arrow::flight::FlightDescriptor::Command(pipeline);
+    ARROW_ASSIGN_OR_RAISE(auto exchange, client->DoExchange(descriptor));
+    auto schema = arrow::schema({arrow::field("int", arrow::int64())});
+    ARROW_RETURN_NOT_OK(exchange.writer->Begin(schema));
+
+    arrow::flight::FlightStreamWriter *writer = exchange.writer.get();
+    arrow::Status write_status;
+    std::thread write_thread([writer, schema, &write_status]()
+                             {
+                                 // 每个batch两个键，模拟陆续产生的请求
+                                 for (int64_t begin = 0; begin < 10 && write_status.ok(); begin += 2)
+                                 {
+                                     arrow::Int64Builder builder;
+                                     std::shared_ptr<arrow::Array> keys;
+                                     write_status = builder.AppendValues(std::vector<int64_t>{begin, begin + 1});
+                                     if (write_status.ok())
+                                         write_status = builder.Finish(&keys);
+                                     if (write_status.ok())
+                                         write_status = writer->WriteRecordBatch(*arrow::RecordBatch::Make(schema, keys->length(), {keys}));
+                                 }
+                                 if (write_status.ok())
+                                     write_status = writer->DoneWriting(); });
+
+    auto read_status = [&]() -> arrow::Status
+    {
+        while (true)
+        {
+            ARROW_ASSIGN_OR_RAISE(auto chunk, exchange.reader->Next());
+            if (!chunk.data)
+                break;
+            cout << "=== " << pipeline << " ===" << std::endl;
+            ARROW_RETURN_NOT_OK(arrow::PrettyPrint(*chunk.data, 0, &cout));
+        }
+        return arrow::Status::OK();
+    }();
+    write_thread.join();
+    ARROW_RETURN_NOT_OK(read_status);
+    ARROW_RETURN_NOT_OK(write_status);
+    return exchange.writer->Close();
+}
+
+/**
+ * @brief 在服务端分组聚合，只取回聚合结果
+ *
+ */
+arrow::Status aggregateData(std::unique_ptr<arrow::flight::FlightClient> &client)
+{
+    arrow::flight::Ticket ticket{std::string("aggregate:") + DATA_FILE_1 +
+                                 "|by:str|sum:int|mean:int|max:int|count|count_distinct:int|filter:int,ge,1"};
+    std::unique_ptr<arrow::flight::FlightStreamReader> stream;
+    ARROW_ASSIGN_OR_RAISE(stream, client->DoGet(ticket));
+    std::shared_ptr<arrow::Table> table;
+    ARROW_ASSIGN_OR_RAISE(table, stream->ToTable());
+    cout << "=== " << ticket.ticket << " ===" << std::endl;
+    ARROW_RETURN_NOT_OK(arrow::PrettyPrint(*table, arrow::PrettyPrintOptions(0), &cout));
+
+    return arrow::Status::OK();
+}
+
 arrow::Status delData(std::unique_ptr<arrow::flight::FlightClient> &client)
 {
     // flight可以调用自定义的actions，可以先获取支持的Actions
@@ -137,7 +466,7 @@ arrow::Status delData(std::unique_ptr<arrow::flight::FlightClient> &client)
     return arrow::Status::OK();
 }
 
-arrow::Status connect()
+arrow::Status connect(int num_streams)
 {
     arrow::flight::Location location;
     ARROW_ASSIGN_OR_RAISE(location,
@@ -147,8 +476,13 @@ arrow::Status connect()
     ARROW_ASSIGN_OR_RAISE(client, arrow::flight::FlightClient::Connect(location));
     cout << "已连接上 " << location.ToString() << std::endl;
 
-    ARROW_RETURN_NOT_OK(uploadData(client));
+    ARROW_ASSIGN_OR_RAISE(auto version, uploadData(client, {DATA_FILE_1}));
     ARROW_RETURN_NOT_OK(getData(client));
+    ARROW_RETURN_NOT_OK(uploadData(client, {DATA_FILE_1, "append"}).status());
+    ARROW_RETURN_NOT_OK(getDataSince(client, version));
+    ARROW_RETURN_NOT_OK(exchangeData(client));
+    ARROW_RETURN_NOT_OK(aggregateData(client));
+    ARROW_RETURN_NOT_OK(parallelUploadData(client, location, DATA_FILE_1, /*append=*/true, num_streams).status());
     ARROW_RETURN_NOT_OK(delData(client));
 
     client->Close();
@@ -157,6 +491,8 @@ arrow::Status connect()
 
 int main(int argc, char const *argv[])
 {
-    cout << connect() << endl;
+    // 参数为并行上传的流数
+    int num_streams = argc > 1 ? std::atoi(argv[1]) : 4;
+    cout << connect(num_streams) << endl;
     return 0;
 }
@@ -6,14 +6,24 @@
 #include <arrow/flight/api.h>
 #include <arrow/filesystem/api.h>
 
+#include <chrono>
+#include <cstdlib>
 #include <iostream>
 #include <string>
 
 #include "common.h"
+#include "message_chunking.h"
 using namespace std;
 
+// DoGet中断后最多请求几次
+#define GET_ATTEMPTS 3
 
-arrow::Status getData(std::unique_ptr<arrow::flight::FlightClient> &client)
+/**
+ * @brief 取PARQUET_FILE_NAME的数据
+ *
+ * @param max_message_bytes 希望服务端每条消息的大小
+ */
+arrow::Status getData(std::unique_ptr<arrow::flight::FlightClient> &client, int64_t max_message_bytes)
 {
     // 在完成写入之后，通过GetFlightInfo来获取指定descriptor文件的表结构
 
@@ -33,16 +43,38 @@ arrow::Status getData(std::unique_ptr<arrow::flight::FlightClient> &client)
     std::unique_ptr<arrow::flight::FlightStreamReader> stream;
     // 有意思的是，他把flight的从目的地获取数据的过程看作坐飞机，手里需要拿个ticket，保存了目的地
 
-    ARROW_ASSIGN_OR_RAISE(stream, client->DoGet(flight_info->endpoints()[0].ticket)); // 要第一个符合descriptor的文件
+    // 与arrow_grpc的client对比同一个文件的传输耗时
+    auto start = std::chrono::steady_clock::now();
     std::shared_ptr<arrow::Table> table;
-    
-    while(true)
+
+    int64_t batches = 0;
+    int64_t rows = 0;
+    for (int attempt = 1;; ++attempt)
     {
-        ARROW_ASSIGN_OR_RAISE(auto stream_chunk, stream->Next());
-        if (!stream_chunk.data)
+        // 要第一个符合descriptor的文件，ticket后面附带消息大小；重试时从已收到的行数继续
+        arrow::flight::Ticket ticket;
+        ticket.ticket = MakeTicket(flight_info->endpoints()[0].ticket.ticket, max_message_bytes, rows);
+        auto status = [&]() -> arrow::Status
+        {
+            ARROW_ASSIGN_OR_RAISE(stream, client->DoGet(ticket));
+            while (true)
+            {
+                ARROW_ASSIGN_OR_RAISE(auto stream_chunk, stream->Next());
+                if (!stream_chunk.data)
+                    break;
+                ++batches;
+                rows += stream_chunk.data->num_rows();
+            }
+            return arrow::Status::OK();
+        }();
+        if (status.ok())
             break;
-        cout<<"!!!"<<endl;
+        if (attempt == GET_ATTEMPTS)
+            return status;
+        cout << status.ToString() << "，从第 " << rows << " 行续传" << endl;
     }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    cout << batches << " batches, " << rows << " rows in " << seconds << " s, " << rows / seconds << " rows/s" << endl;
     // ARROW_ASSIGN_OR_RAISE(table, stream->ToTable());
     // arrow::PrettyPrintOptions print_options(/*indent=*/0, /*window=*/2);
     // ARROW_RETURN_NOT_OK(arrow::PrettyPrint(*table, print_options, &cout));
@@ -50,11 +82,11 @@ arrow::Status getData(std::unique_ptr<arrow::flight::FlightClient> &client)
     return arrow::Status::OK();
 }
 
-arrow::Status connect()
+arrow::Status connect(int64_t max_message_bytes)
 {
     auto client_options = arrow::flight::FlightClientOptions::Defaults();
-    // Set a very low limit at the gRPC layer to fail all calls
-    client_options.generic_options.emplace_back("grpc.max_send_message_length", -1);
+    // 服务端按max_message_bytes切分batch，接收上限不用放开到无限
+    client_options.generic_options.emplace_back("grpc.max_receive_message_length", GRPC_MESSAGE_LIMIT);
 
     arrow::flight::Location location;
     ARROW_ASSIGN_OR_RAISE(location,
@@ -64,7 +96,7 @@ arrow::Status connect()
     ARROW_ASSIGN_OR_RAISE(client, arrow::flight::FlightClient::Connect(location, client_options));
     cout << "已连接上 " << location.ToString() << std::endl;
 
-    ARROW_RETURN_NOT_OK(getData(client));
+    ARROW_RETURN_NOT_OK(getData(client, max_message_bytes));
 
     client->Close();
     return arrow::Status::OK();
@@ -72,6 +104,7 @@ arrow::Status connect()
 
 int main(int argc, char const *argv[])
 {
-    cout << connect() << endl;
+    int64_t max_message_bytes = argc > 1 ? std::atoll(argv[1]) : DEFAULT_MESSAGE_BYTES;
+    cout << connect(max_message_bytes) << endl;
     return 0;
 }
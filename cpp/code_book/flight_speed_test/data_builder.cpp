@@ -17,6 +17,8 @@
 #include <chrono>
 
 #include "common.h"
+#include "parquet_lookup.h"
+#include "secondary_index.h"
 using namespace std;
 
 class RandomBatchGenerator
@@ -119,8 +121,19 @@ void write_parquet_file(const arrow::Table &table)
 
     PARQUET_ASSIGN_OR_THROW(
         outfile, arrow::io::FileOutputStream ::Open(PARQUET_FILE_DIR PARQUET_FILE_NAME, false));
+    // 成交编号和序号是点查的主键，生成统计信息和布隆过滤器
+    std::vector<std::string> key_columns{"trdno", "sno"};
     PARQUET_THROW_NOT_OK(
-        parquet::arrow::WriteTable(table, arrow::default_memory_pool(), outfile, PARQUET_ROWGROUP_RECORDS));
+        parquet::arrow::WriteTable(table, arrow::default_memory_pool(), outfile, PARQUET_ROWGROUP_RECORDS,
+                                   LookupWriterProperties(key_columns)));
+    PARQUET_THROW_NOT_OK(outfile->Close());
+    auto fs = std::make_shared<arrow::fs::LocalFileSystem>();
+    PARQUET_THROW_NOT_OK(BuildBloomSidecar(fs, PARQUET_FILE_DIR PARQUET_FILE_NAME, key_columns));
+    // 二级索引：key -> (文件, row group, 行号)
+    for (const auto &column : key_columns)
+    {
+        PARQUET_THROW_NOT_OK(UpdateSecondaryIndex(fs, PARQUET_FILE_DIR, column, PARQUET_FILE_DIR PARQUET_FILE_NAME));
+    }
 }
 
 std::string formatTime(std::chrono::steady_clock::time_point &clock)
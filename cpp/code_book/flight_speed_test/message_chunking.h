@@ -0,0 +1,155 @@
+#ifndef MESSAGE_CHUNKING_H
+#define MESSAGE_CHUNKING_H
+
+#include <arrow/api.h>
+#include <arrow/util/byte_size.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <string>
+
+/**
+ * 按字节数切分发送的batch：一个10000行、30列的row group编码后有好几MB，
+ * 整条作为一个gRPC消息发送时，两端都要为它准备整块内存，客户端也要等整条收完才能处理。
+ *
+ * 这里按buffer大小估算平均行宽，用零拷贝的RecordBatch::Slice把batch切成不超过目标字节数的片，
+ * IPC编码切片时只写切片范围内的数据。每个片是一条消息，gRPC的流控窗口按消息逐条推进，
+ * 消息大小上限也不用再设成INT_MAX。
+ *
+ * 客户端在ticket后面带上参数指定想要的消息大小，如"trade.parquet?max_message_bytes=1048576"。
+ * 传输中断后，客户端带上已收到的行数"&start_row=N"重新请求，只取缺少的部分（见resumable_read.h）。
+ */
+
+#define DEFAULT_MESSAGE_BYTES (1 << 20)
+#define MIN_MESSAGE_BYTES (64 << 10)
+#define MAX_MESSAGE_BYTES (16 << 20)
+// gRPC的消息大小上限：最大的片加上IPC元数据和对齐的余量
+#define GRPC_MESSAGE_LIMIT (MAX_MESSAGE_BYTES + (1 << 20))
+
+/**
+ * @brief DoGet的ticket：数据集名和传输参数
+ *
+ */
+struct TicketRequest
+{
+    std::string name;
+    int64_t max_message_bytes;
+    int64_t start_row; // 从第几行开始发送，续传时为客户端已收到的行数
+
+    TicketRequest()
+        : max_message_bytes(DEFAULT_MESSAGE_BYTES), start_row(0)
+    {
+    }
+};
+
+/**
+ * @brief 解析"name?key=value&key=value"形式的ticket，没有参数时就是数据集名
+ *
+ * @return arrow::Result<TicketRequest> 参数未知或不是数字时返回Invalid，消息大小会被限制在[MIN_MESSAGE_BYTES, MAX_MESSAGE_BYTES]
+ */
+arrow::Result<TicketRequest> ParseTicket(const std::string &ticket)
+{
+    TicketRequest request;
+    size_t query = ticket.find('?');
+    request.name = ticket.substr(0, query);
+    while (query != std::string::npos)
+    {
+        size_t begin = query + 1;
+        query = ticket.find('&', begin);
+        std::string param = ticket.substr(begin, query == std::string::npos ? std::string::npos : query - begin);
+        size_t eq = param.find('=');
+        std::string key = param.substr(0, eq);
+        std::string value = eq == std::string::npos ? "" : param.substr(eq + 1);
+
+        char *end = nullptr;
+        long long number = std::strtoll(value.c_str(), &end, 10);
+        if (value.empty() || *end != '\0')
+        {
+            return arrow::Status::Invalid("Ticket parameter ", key, " is not an integer: '", value, "'");
+        }
+        if (key == "max_message_bytes")
+        {
+            request.max_message_bytes = std::min<int64_t>(std::max<int64_t>(number, MIN_MESSAGE_BYTES), MAX_MESSAGE_BYTES);
+        }
+        else if (key == "start_row")
+        {
+            if (number < 0)
+                return arrow::Status::Invalid("Ticket parameter start_row is negative: ", number);
+            request.start_row = number;
+        }
+        else
+        {
+            return arrow::Status::Invalid("Unknown ticket parameter: ", key);
+        }
+    }
+    return request;
+}
+
+/**
+ * @brief 生成带消息大小参数的ticket，start_row大于0时从该行开始
+ *
+ */
+std::string MakeTicket(const std::string &name, int64_t max_message_bytes, int64_t start_row = 0)
+{
+    std::string ticket = name + "?max_message_bytes=" + std::to_string(max_message_bytes);
+    if (start_row > 0)
+        ticket += "&start_row=" + std::to_string(start_row);
+    return ticket;
+}
+
+/**
+ * @brief 把上游的batch切成不超过max_chunk_bytes的片，不拷贝数据
+ *
+ * 按整个batch的平均行宽估算每片的行数，字符串长度差别很大时单片可能略超目标；
+ * 单行就超过目标时每片一行。比目标小的batch原样输出，合并小batch需要拷贝，这里不做。
+ */
+class RechunkingBatchReader : public arrow::RecordBatchReader
+{
+public:
+    RechunkingBatchReader(std::shared_ptr<arrow::RecordBatchReader> input, int64_t max_chunk_bytes)
+        : input_(std::move(input)), max_chunk_bytes_(max_chunk_bytes)
+    {
+    }
+
+    std::shared_ptr<arrow::Schema> schema() const override { return input_->schema(); }
+
+    arrow::Status ReadNext(std::shared_ptr<arrow::RecordBatch> *batch) override
+    {
+        // 跳过空batch，取到有剩余行的batch为止
+        while (current_ == nullptr || offset_ >= current_->num_rows())
+        {
+            ARROW_RETURN_NOT_OK(input_->ReadNext(&current_));
+            if (current_ == nullptr)
+            {
+                *batch = nullptr;
+                return arrow::Status::OK();
+            }
+            offset_ = 0;
+            chunk_rows_ = RowsPerChunk(*current_);
+        }
+
+        int64_t length = std::min(chunk_rows_, current_->num_rows() - offset_);
+        *batch = length == current_->num_rows() ? current_ : current_->Slice(offset_, length);
+        offset_ += length;
+        return arrow::Status::OK();
+    }
+
+private:
+    int64_t RowsPerChunk(const arrow::RecordBatch &batch) const
+    {
+        int64_t bytes = arrow::util::TotalBufferSize(batch);
+        if (bytes <= max_chunk_bytes_ || batch.num_rows() == 0)
+        {
+            return std::max<int64_t>(batch.num_rows(), 1);
+        }
+        return std::max<int64_t>(1, static_cast<int64_t>(static_cast<double>(batch.num_rows()) * max_chunk_bytes_ / bytes));
+    }
+
+    std::shared_ptr<arrow::RecordBatchReader> input_;
+    int64_t max_chunk_bytes_;
+    std::shared_ptr<arrow::RecordBatch> current_;
+    int64_t offset_ = 0;
+    int64_t chunk_rows_ = 0;
+};
+
+#endif
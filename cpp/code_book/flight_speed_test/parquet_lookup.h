@@ -0,0 +1,404 @@
+#ifndef PARQUET_LOOKUP_H
+#define PARQUET_LOOKUP_H
+
+#include <arrow/api.h>
+#include <arrow/io/api.h>
+#include <arrow/result.h>
+#include <arrow/status.h>
+#include <arrow/compute/api.h>
+#include <arrow/filesystem/api.h>
+#include <arrow/ipc/api.h>
+#include <parquet/arrow/reader.h>
+#include <parquet/arrow/writer.h>
+#include <parquet/properties.h>
+#include <parquet/statistics.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+
+/**
+ * Parquet点查辅助：写入时为主键列生成统计信息和布隆过滤器，读取时用它们跳过row group
+ *
+ * Arrow 9的parquet writer还不能写page index和布隆过滤器，因此布隆过滤器保存在旁边的
+ * "_<文件名>.bloom"文件里（Arrow IPC格式），下划线开头的文件会被dataset扫描忽略。
+ */
+
+/**
+ * @brief 适合点查的写入参数：打开统计信息，主键列不用字典编码，页面小一些
+ *
+ * @param key_columns 主键列
+ * @return std::shared_ptr<parquet::WriterProperties>
+ */
+std::shared_ptr<parquet::WriterProperties> LookupWriterProperties(const std::vector<std::string> &key_columns)
+{
+    parquet::WriterProperties::Builder builder;
+    builder.enable_statistics()->data_pagesize(64 * 1024);
+    for (const auto &column : key_columns)
+    {
+        // 主键几乎不重复，字典编码只会浪费空间
+        builder.disable_dictionary(column);
+    }
+    return builder.build();
+}
+
+/**
+ * @brief 分块布隆过滤器（与parquet规范中的split block bloom filter算法相同）
+ *
+ * 每个块256位，每个key在一个块内置8位，一次缓存行访问即可完成判断
+ */
+class KeyBloomFilter
+{
+public:
+    KeyBloomFilter(int64_t num_values, double fpp)
+    {
+        double num_bits = -std::max<int64_t>(num_values, 1) * std::log(fpp) / (std::log(2) * std::log(2));
+        int64_t num_blocks = std::max<int64_t>(1, static_cast<int64_t>(std::ceil(num_bits / 256)));
+        words_.assign(num_blocks * 8, 0);
+    }
+
+    explicit KeyBloomFilter(std::vector<uint32_t> words) : words_(std::move(words)) {}
+
+    void Insert(uint64_t hash)
+    {
+        uint32_t *block = &words_[BlockIndex(hash) * 8];
+        for (int i = 0; i < 8; ++i)
+        {
+            block[i] |= Mask(hash, i);
+        }
+    }
+
+    bool MightContain(uint64_t hash) const
+    {
+        const uint32_t *block = &words_[BlockIndex(hash) * 8];
+        for (int i = 0; i < 8; ++i)
+        {
+            if ((block[i] & Mask(hash, i)) == 0)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    const std::vector<uint32_t> &words() const { return words_; }
+
+    /**
+     * @brief 64位FNV-1a再做一次splitmix64混合，结果要写入文件，所以不能用std::hash
+     *
+     */
+    static uint64_t Hash(const uint8_t *data, int64_t length)
+    {
+        uint64_t hash = 14695981039346656037ULL;
+        for (int64_t i = 0; i < length; ++i)
+        {
+            hash ^= data[i];
+            hash *= 1099511628211ULL;
+        }
+        return Mix(hash);
+    }
+
+    static uint64_t Hash(int64_t value) { return Mix(static_cast<uint64_t>(value)); }
+
+private:
+    static uint64_t Mix(uint64_t x)
+    {
+        x += 0x9e3779b97f4a7c15ULL;
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+        return x ^ (x >> 31);
+    }
+
+    size_t BlockIndex(uint64_t hash) const
+    {
+        return static_cast<size_t>(((hash >> 32) * (words_.size() / 8)) >> 32);
+    }
+
+    static uint32_t Mask(uint64_t hash, int i)
+    {
+        static const uint32_t kSalt[8] = {0x47b6137bU, 0x44974d91U, 0x8824ad5bU, 0xa2b7289dU,
+                                          0x705495c7U, 0x2df1424bU, 0x9efc4947U, 0x5c6bfb31U};
+        return 1U << ((static_cast<uint32_t>(hash) * kSalt[i]) >> 27);
+    }
+
+    std::vector<uint32_t> words_;
+};
+
+/**
+ * @brief 对数组中的第i个值求哈希，目前支持字符串和整型主键
+ *
+ */
+arrow::Result<uint64_t> HashKey(const arrow::Array &array, int64_t i)
+{
+    switch (array.type_id())
+    {
+    case arrow::Type::STRING:
+    {
+        auto view = static_cast<const arrow::StringArray &>(array).GetView(i);
+        return KeyBloomFilter::Hash(reinterpret_cast<const uint8_t *>(view.data()), view.size());
+    }
+    case arrow::Type::INT64:
+        return KeyBloomFilter::Hash(static_cast<const arrow::Int64Array &>(array).Value(i));
+    case arrow::Type::INT32:
+        return KeyBloomFilter::Hash(static_cast<int64_t>(static_cast<const arrow::Int32Array &>(array).Value(i)));
+    default:
+        return arrow::Status::NotImplemented("Bloom filter on ", array.type()->ToString(), " columns");
+    }
+}
+
+/**
+ * @brief 数据文件对应的布隆过滤器文件路径
+ *
+ */
+std::string BloomSidecarPath(const std::string &path)
+{
+    size_t pos = path.rfind('/');
+    size_t name_pos = pos == std::string::npos ? 0 : pos + 1;
+    return path.substr(0, name_pos) + "_" + path.substr(name_pos) + ".bloom";
+}
+
+std::shared_ptr<arrow::Schema> BloomSidecarSchema()
+{
+    return arrow::schema({arrow::field("column", arrow::utf8()),
+                          arrow::field("row_group", arrow::int32()),
+                          arrow::field("bitset", arrow::binary())});
+}
+
+/**
+ * @brief 为已经写好的parquet文件生成布隆过滤器文件，每个row group、每个主键列一个过滤器
+ *
+ * 只依赖写好的文件，所以WriteTable、DoPut和FileSystemDataset::Write都可以在写完后调用
+ *
+ * @param filesystem
+ * @param path parquet文件
+ * @param key_columns 主键列
+ * @param fpp 误判率
+ * @return arrow::Status
+ */
+arrow::Status BuildBloomSidecar(const std::shared_ptr<arrow::fs::FileSystem> &filesystem, const std::string &path,
+                                const std::vector<std::string> &key_columns, double fpp = 0.01)
+{
+    ARROW_ASSIGN_OR_RAISE(auto input, filesystem->OpenInputFile(path));
+    std::unique_ptr<parquet::arrow::FileReader> reader;
+    ARROW_RETURN_NOT_OK(parquet::arrow::OpenFile(std::move(input), arrow::default_memory_pool(), &reader));
+    std::shared_ptr<arrow::Schema> schema;
+    ARROW_RETURN_NOT_OK(reader->GetSchema(&schema));
+
+    arrow::StringBuilder column_builder;
+    arrow::Int32Builder row_group_builder;
+    arrow::BinaryBuilder bitset_builder;
+    for (const auto &column : key_columns)
+    {
+        int column_index = schema->GetFieldIndex(column);
+        if (column_index < 0)
+        {
+            return arrow::Status::Invalid("No column named ", column, " in ", path);
+        }
+        for (int row_group = 0; row_group < reader->num_row_groups(); ++row_group)
+        {
+            std::shared_ptr<arrow::Table> table;
+            ARROW_RETURN_NOT_OK(reader->ReadRowGroup(row_group, {column_index}, &table));
+            KeyBloomFilter filter(table->num_rows(), fpp);
+            for (const auto &chunk : table->column(0)->chunks())
+            {
+                for (int64_t i = 0; i < chunk->length(); ++i)
+                {
+                    if (chunk->IsNull(i))
+                    {
+                        continue;
+                    }
+                    ARROW_ASSIGN_OR_RAISE(auto hash, HashKey(*chunk, i));
+                    filter.Insert(hash);
+                }
+            }
+            ARROW_RETURN_NOT_OK(column_builder.Append(column));
+            ARROW_RETURN_NOT_OK(row_group_builder.Append(row_group));
+            ARROW_RETURN_NOT_OK(bitset_builder.Append(reinterpret_cast<const uint8_t *>(filter.words().data()),
+                                                      filter.words().size() * sizeof(uint32_t)));
+        }
+    }
+    std::vector<std::shared_ptr<arrow::Array>> arrays(3);
+    ARROW_RETURN_NOT_OK(column_builder.Finish(&arrays[0]));
+    ARROW_RETURN_NOT_OK(row_group_builder.Finish(&arrays[1]));
+    ARROW_RETURN_NOT_OK(bitset_builder.Finish(&arrays[2]));
+    auto batch = arrow::RecordBatch::Make(BloomSidecarSchema(), arrays[0]->length(), arrays);
+
+    ARROW_ASSIGN_OR_RAISE(auto output, filesystem->OpenOutputStream(BloomSidecarPath(path)));
+    ARROW_ASSIGN_OR_RAISE(auto writer, arrow::ipc::MakeFileWriter(output, batch->schema()));
+    ARROW_RETURN_NOT_OK(writer->WriteRecordBatch(*batch));
+    ARROW_RETURN_NOT_OK(writer->Close());
+    return output->Close();
+}
+
+/**
+ * @brief 读取某一列的布隆过滤器，key为row group序号；没有布隆过滤器文件时返回空
+ *
+ */
+arrow::Result<std::map<int, KeyBloomFilter>> LoadBloomFilters(const std::shared_ptr<arrow::fs::FileSystem> &filesystem,
+                                                              const std::string &path, const std::string &column)
+{
+    std::map<int, KeyBloomFilter> filters;
+    ARROW_ASSIGN_OR_RAISE(auto info, filesystem->GetFileInfo(BloomSidecarPath(path)));
+    if (!info.IsFile())
+    {
+        return filters;
+    }
+    ARROW_ASSIGN_OR_RAISE(auto input, filesystem->OpenInputFile(info));
+    ARROW_ASSIGN_OR_RAISE(auto reader, arrow::ipc::RecordBatchFileReader::Open(input));
+    for (int b = 0; b < reader->num_record_batches(); ++b)
+    {
+        ARROW_ASSIGN_OR_RAISE(auto batch, reader->ReadRecordBatch(b));
+        auto columns = std::static_pointer_cast<arrow::StringArray>(batch->column(0));
+        auto row_groups = std::static_pointer_cast<arrow::Int32Array>(batch->column(1));
+        auto bitsets = std::static_pointer_cast<arrow::BinaryArray>(batch->column(2));
+        for (int64_t i = 0; i < batch->num_rows(); ++i)
+        {
+            if (columns->GetString(i) != column)
+            {
+                continue;
+            }
+            auto bitset = bitsets->GetView(i);
+            std::vector<uint32_t> words(bitset.size() / sizeof(uint32_t));
+            std::memcpy(words.data(), bitset.data(), words.size() * sizeof(uint32_t));
+            filters.emplace(row_groups->Value(i), KeyBloomFilter(std::move(words)));
+        }
+    }
+    return filters;
+}
+
+/**
+ * @brief 判断第i个值是否落在row group统计信息的[min, max]内，没有统计信息时返回true
+ *
+ */
+bool InStatisticsRange(const std::shared_ptr<parquet::Statistics> &statistics, const arrow::Array &values, int64_t i)
+{
+    if (statistics == nullptr || !statistics->HasMinMax())
+    {
+        return true;
+    }
+    if (values.type_id() == arrow::Type::STRING)
+    {
+        // 字符串的min/max是原始字节，按无符号字节序比较
+        std::string value = static_cast<const arrow::StringArray &>(values).GetString(i);
+        return statistics->EncodeMin() <= value && value <= statistics->EncodeMax();
+    }
+    if (values.type_id() == arrow::Type::INT64 && statistics->physical_type() == parquet::Type::INT64)
+    {
+        auto typed = std::static_pointer_cast<parquet::Int64Statistics>(statistics);
+        int64_t value = static_cast<const arrow::Int64Array &>(values).Value(i);
+        return typed->min() <= value && value <= typed->max();
+    }
+    return true;
+}
+
+/**
+ * @brief 点查统计
+ *
+ */
+struct LookupStats
+{
+    int64_t row_groups = 0;              // 文件中的row group总数
+    int64_t row_groups_after_stats = 0;  // min/max裁剪后剩下的
+    int64_t row_groups_after_bloom = 0;  // 布隆过滤器裁剪后剩下的，也就是实际读取的
+};
+
+/**
+ * @brief 找出可能包含values中任一个值的row group（等值和IN查询）
+ *
+ * @param filesystem
+ * @param path
+ * @param reader 已打开的parquet文件
+ * @param column 查询列
+ * @param values 查询值
+ * @param stats
+ * @return arrow::Result<std::vector<int>>
+ */
+arrow::Result<std::vector<int>> PruneRowGroups(const std::shared_ptr<arrow::fs::FileSystem> &filesystem,
+                                               const std::string &path, parquet::arrow::FileReader &reader,
+                                               const std::string &column, const arrow::Array &values,
+                                               LookupStats *stats)
+{
+    std::shared_ptr<arrow::Schema> schema;
+    ARROW_RETURN_NOT_OK(reader.GetSchema(&schema));
+    int column_index = schema->GetFieldIndex(column);
+    if (column_index < 0)
+    {
+        return arrow::Status::Invalid("No column named ", column, " in ", path);
+    }
+    ARROW_ASSIGN_OR_RAISE(auto filters, LoadBloomFilters(filesystem, path, column));
+
+    std::vector<uint64_t> hashes;
+    for (int64_t i = 0; i < values.length(); ++i)
+    {
+        ARROW_ASSIGN_OR_RAISE(auto hash, HashKey(values, i));
+        hashes.push_back(hash);
+    }
+
+    std::vector<int> row_groups;
+    auto metadata = reader.parquet_reader()->metadata();
+    for (int row_group = 0; row_group < metadata->num_row_groups(); ++row_group)
+    {
+        ++stats->row_groups;
+        auto statistics = metadata->RowGroup(row_group)->ColumnChunk(column_index)->statistics();
+        auto filter = filters.find(row_group);
+        bool in_range = false;
+        bool maybe_present = false;
+        for (int64_t i = 0; i < values.length() && !maybe_present; ++i)
+        {
+            if (values.IsNull(i) || !InStatisticsRange(statistics, values, i))
+            {
+                continue;
+            }
+            in_range = true;
+            maybe_present = filter == filters.end() || filter->second.MightContain(hashes[i]);
+        }
+        stats->row_groups_after_stats += in_range ? 1 : 0;
+        if (maybe_present)
+        {
+            ++stats->row_groups_after_bloom;
+            row_groups.push_back(row_group);
+        }
+    }
+    return row_groups;
+}
+
+/**
+ * @brief 点查：只读取可能命中的row group，再用is_in精确过滤
+ *
+ * @param filesystem
+ * @param path parquet文件
+ * @param column 查询列
+ * @param values 查询值，一个值即等值查询，多个值即IN查询
+ * @param stats
+ * @return arrow::Result<std::shared_ptr<arrow::Table>>
+ */
+arrow::Result<std::shared_ptr<arrow::Table>> LookupRows(const std::shared_ptr<arrow::fs::FileSystem> &filesystem,
+                                                        const std::string &path, const std::string &column,
+                                                        const std::shared_ptr<arrow::Array> &values,
+                                                        LookupStats *stats)
+{
+    ARROW_ASSIGN_OR_RAISE(auto input, filesystem->OpenInputFile(path));
+    std::unique_ptr<parquet::arrow::FileReader> reader;
+    ARROW_RETURN_NOT_OK(parquet::arrow::OpenFile(std::move(input), arrow::default_memory_pool(), &reader));
+    ARROW_ASSIGN_OR_RAISE(auto row_groups, PruneRowGroups(filesystem, path, *reader, column, *values, stats));
+
+    std::shared_ptr<arrow::Schema> schema;
+    ARROW_RETURN_NOT_OK(reader->GetSchema(&schema));
+    if (row_groups.empty())
+    {
+        return arrow::Table::MakeEmpty(schema);
+    }
+    std::shared_ptr<arrow::Table> table;
+    ARROW_RETURN_NOT_OK(reader->ReadRowGroups(row_groups, &table));
+
+    // 布隆过滤器有误判，row group内也有其他行，最后精确过滤一次
+    ARROW_ASSIGN_OR_RAISE(auto mask, arrow::compute::IsIn(table->GetColumnByName(column),
+                                                          arrow::compute::SetLookupOptions(values)));
+    ARROW_ASSIGN_OR_RAISE(auto filtered, arrow::compute::Filter(table, mask));
+    return filtered.table();
+}
+
+#endif
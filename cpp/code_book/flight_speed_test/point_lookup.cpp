@@ -0,0 +1,117 @@
+#include <arrow/api.h>
+#include <arrow/io/api.h>
+#include <arrow/compute/api.h>
+#include <arrow/filesystem/api.h>
+#include <parquet/arrow/reader.h>
+#include <parquet/exception.h>
+
+#include <iostream>
+#include <random>
+#include <chrono>
+
+#include "common.h"
+#include "parquet_lookup.h"
+#include "secondary_index.h"
+using namespace std;
+
+#define LOOKUP_TIMES 20
+#define LOOKUP_IN_SIZE 10
+
+/**
+ * @brief 对照组：读取所有row group再过滤，相当于没有索引时的点查
+ *
+ */
+arrow::Result<std::shared_ptr<arrow::Table>> FullScanLookup(const std::shared_ptr<arrow::fs::FileSystem> &filesystem,
+                                                            const std::string &path, const std::string &column,
+                                                            const std::shared_ptr<arrow::Array> &values)
+{
+    ARROW_ASSIGN_OR_RAISE(auto input, filesystem->OpenInputFile(path));
+    std::unique_ptr<parquet::arrow::FileReader> reader;
+    ARROW_RETURN_NOT_OK(parquet::arrow::OpenFile(std::move(input), arrow::default_memory_pool(), &reader));
+    std::shared_ptr<arrow::Table> table;
+    ARROW_RETURN_NOT_OK(reader->ReadTable(&table));
+    ARROW_ASSIGN_OR_RAISE(auto mask, arrow::compute::IsIn(table->GetColumnByName(column),
+                                                          arrow::compute::SetLookupOptions(values)));
+    ARROW_ASSIGN_OR_RAISE(auto filtered, arrow::compute::Filter(table, mask));
+    return filtered.table();
+}
+
+/**
+ * @brief 随机生成num个成交编号（data_builder生成的trdno为"string:行号"）
+ *
+ */
+arrow::Result<std::shared_ptr<arrow::Array>> RandomTradeNumbers(std::mt19937 &gen, int num)
+{
+    std::uniform_int_distribution<int64_t> row{0, RECORD_ROW_NUM - 1};
+    arrow::StringBuilder builder;
+    for (int i = 0; i < num; ++i)
+    {
+        ARROW_RETURN_NOT_OK(builder.Append(std::string("string:") + to_string(row(gen))));
+    }
+    return builder.Finish();
+}
+
+double elapsedMs(std::chrono::steady_clock::time_point &clock)
+{
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - clock).count();
+}
+
+/**
+ * @brief 分别用全表扫描、row group裁剪和二级索引做等值/IN点查，对比平均耗时
+ *
+ */
+arrow::Status func()
+{
+    // 内存映射方式打开，索引不用整体读入内存
+    arrow::fs::LocalFileSystemOptions fs_options;
+    fs_options.use_mmap = true;
+    auto fs = std::make_shared<arrow::fs::LocalFileSystem>(fs_options);
+    std::string path{PARQUET_FILE_DIR PARQUET_FILE_NAME};
+    std::mt19937 gen{42};
+    ARROW_ASSIGN_OR_RAISE(auto index, SecondaryIndex::Open(fs, PARQUET_FILE_DIR, "trdno"));
+
+    for (int in_size : {1, LOOKUP_IN_SIZE})
+    {
+        double full_scan_ms = 0;
+        double lookup_ms = 0;
+        double index_ms = 0;
+        int64_t full_scan_rows = 0;
+        int64_t lookup_rows = 0;
+        int64_t index_rows = 0;
+        LookupStats stats;
+        for (int i = 0; i < LOOKUP_TIMES; ++i)
+        {
+            ARROW_ASSIGN_OR_RAISE(auto values, RandomTradeNumbers(gen, in_size));
+
+            auto clock = std::chrono::steady_clock::now();
+            ARROW_ASSIGN_OR_RAISE(auto expected, FullScanLookup(fs, path, "trdno", values));
+            full_scan_ms += elapsedMs(clock);
+            full_scan_rows += expected->num_rows();
+
+            clock = std::chrono::steady_clock::now();
+            ARROW_ASSIGN_OR_RAISE(auto result, LookupRows(fs, path, "trdno", values, &stats));
+            lookup_ms += elapsedMs(clock);
+            lookup_rows += result->num_rows();
+
+            clock = std::chrono::steady_clock::now();
+            ARROW_ASSIGN_OR_RAISE(auto entries, index->Lookup(*values));
+            ARROW_ASSIGN_OR_RAISE(auto rows, ReadIndexedRows(fs, PARQUET_FILE_DIR, entries, expected->schema()));
+            index_rows += rows->num_rows();
+            index_ms += elapsedMs(clock);
+        }
+
+        cout << (in_size == 1 ? "trdno = ?" : "trdno in (?...)") << " x" << LOOKUP_TIMES << endl;
+        cout << "  full scan: avg " << full_scan_ms / LOOKUP_TIMES << " ms, rows " << full_scan_rows << endl;
+        cout << "  pruned   : avg " << lookup_ms / LOOKUP_TIMES << " ms, rows " << lookup_rows << endl;
+        cout << "  index    : avg " << index_ms / LOOKUP_TIMES << " ms, rows " << index_rows << endl;
+        cout << "  row groups: total " << stats.row_groups << ", after min/max " << stats.row_groups_after_stats
+             << ", after bloom " << stats.row_groups_after_bloom << endl;
+    }
+    return arrow::Status::OK();
+}
+
+int main(int argc, char const *argv[])
+{
+    cout << func() << endl;
+    return 0;
+}
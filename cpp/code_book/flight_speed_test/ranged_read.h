@@ -0,0 +1,186 @@
+#ifndef RANGED_READ_H
+#define RANGED_READ_H
+
+#include <arrow/api.h>
+#include <arrow/result.h>
+#include <arrow/status.h>
+#include <parquet/column_reader.h>
+#include <parquet/exception.h>
+#include <parquet/file_reader.h>
+#include <parquet/schema.h>
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+/**
+ * 按行区间读取parquet列：用底层ColumnReader跳过区间之间的行，只解码区间内的行。
+ * 延迟物化的投影列和二级索引的点查都只需要row group中的少数几行。
+ */
+
+#define RANGED_READ_CHUNK 4096 // 按行区间读取时每次ReadBatch的行数
+
+typedef std::vector<std::pair<int64_t, int64_t>> RowRanges; // (row group内的起始行, 行数)
+
+/**
+ * @brief 把升序、不重复的行号合并成连续的行区间
+ *
+ */
+RowRanges RowsToRanges(const std::vector<int64_t> &rows)
+{
+    RowRanges ranges;
+    for (int64_t row : rows)
+    {
+        if (!ranges.empty() && ranges.back().first + ranges.back().second == row)
+            ++ranges.back().second;
+        else
+            ranges.emplace_back(row, 1);
+    }
+    return ranges;
+}
+
+/**
+ * @brief 列能否用底层ColumnReader按行区间读取：平铺列，物理类型与Arrow类型直接对应
+ *
+ */
+bool SupportsRangedRead(const arrow::DataType &type, const parquet::ColumnDescriptor &descr)
+{
+    if (descr.max_repetition_level() > 0)
+        return false;
+    switch (type.id())
+    {
+    case arrow::Type::INT32:
+        return descr.physical_type() == parquet::Type::INT32;
+    case arrow::Type::INT64:
+        return descr.physical_type() == parquet::Type::INT64;
+    case arrow::Type::FLOAT:
+        return descr.physical_type() == parquet::Type::FLOAT;
+    case arrow::Type::DOUBLE:
+        return descr.physical_type() == parquet::Type::DOUBLE;
+    case arrow::Type::STRING:
+        return descr.physical_type() == parquet::Type::BYTE_ARRAY;
+    default:
+        return false;
+    }
+}
+
+/**
+ * @brief 跳过区间之间的行，只把区间内的行解码进builder
+ *
+ * Skip整页跳过时不解码页内的值，区间只覆盖页的一部分时才解码后丢弃
+ */
+template <typename DType, typename Builder>
+arrow::Status ReadRowRanges(parquet::ColumnReader *column_reader, int16_t max_definition_level,
+                            const RowRanges &ranges, Builder *builder,
+                            arrow::Status (*append)(Builder *, const typename DType::c_type &))
+{
+    auto *reader = static_cast<parquet::TypedColumnReader<DType> *>(column_reader);
+    std::vector<typename DType::c_type> values(RANGED_READ_CHUNK);
+    std::vector<int16_t> definition_levels(RANGED_READ_CHUNK);
+    int64_t position = 0;
+    for (const auto &range : ranges)
+    {
+        if (range.first > position)
+        {
+            int64_t skipped = reader->Skip(range.first - position);
+            if (skipped != range.first - position)
+            {
+                return arrow::Status::Invalid("Column chunk ended at row ", position + skipped);
+            }
+            position = range.first;
+        }
+        int64_t remaining = range.second;
+        while (remaining > 0)
+        {
+            int64_t values_read = 0;
+            int64_t levels_read =
+                reader->ReadBatch(std::min<int64_t>(remaining, RANGED_READ_CHUNK),
+                                  definition_levels.data(), nullptr, values.data(), &values_read);
+            if (levels_read == 0)
+            {
+                return arrow::Status::Invalid("Column chunk ended at row ", position);
+            }
+            int64_t value = 0;
+            for (int64_t i = 0; i < levels_read; ++i)
+            {
+                if (max_definition_level > 0 && definition_levels[i] < max_definition_level)
+                {
+                    ARROW_RETURN_NOT_OK(builder->AppendNull());
+                }
+                else
+                {
+                    ARROW_RETURN_NOT_OK(append(builder, values[value++]));
+                }
+            }
+            remaining -= levels_read;
+            position += levels_read;
+        }
+    }
+    return arrow::Status::OK();
+}
+
+template <typename Builder, typename T>
+arrow::Status AppendValue(Builder *builder, const T &value)
+{
+    return builder->Append(value);
+}
+
+arrow::Status AppendByteArray(arrow::StringBuilder *builder, const parquet::ByteArray &value)
+{
+    return builder->Append(value.ptr, static_cast<int32_t>(value.len));
+}
+
+/**
+ * @brief 只解码row group中ranges覆盖的行，列需满足SupportsRangedRead
+ *
+ */
+arrow::Result<std::shared_ptr<arrow::Array>> ReadRangedColumn(parquet::RowGroupReader *row_group, int column,
+                                                              const arrow::DataType &type, const RowRanges &ranges)
+{
+    BEGIN_PARQUET_CATCH_EXCEPTIONS
+    auto column_reader = row_group->Column(column);
+    int16_t max_definition_level = column_reader->descr()->max_definition_level();
+    switch (type.id())
+    {
+    case arrow::Type::INT32:
+    {
+        arrow::Int32Builder builder;
+        ARROW_RETURN_NOT_OK((ReadRowRanges<parquet::Int32Type, arrow::Int32Builder>(
+            column_reader.get(), max_definition_level, ranges, &builder, &AppendValue<arrow::Int32Builder, int32_t>)));
+        return builder.Finish();
+    }
+    case arrow::Type::INT64:
+    {
+        arrow::Int64Builder builder;
+        ARROW_RETURN_NOT_OK((ReadRowRanges<parquet::Int64Type, arrow::Int64Builder>(
+            column_reader.get(), max_definition_level, ranges, &builder, &AppendValue<arrow::Int64Builder, int64_t>)));
+        return builder.Finish();
+    }
+    case arrow::Type::FLOAT:
+    {
+        arrow::FloatBuilder builder;
+        ARROW_RETURN_NOT_OK((ReadRowRanges<parquet::FloatType, arrow::FloatBuilder>(
+            column_reader.get(), max_definition_level, ranges, &builder, &AppendValue<arrow::FloatBuilder, float>)));
+        return builder.Finish();
+    }
+    case arrow::Type::DOUBLE:
+    {
+        arrow::DoubleBuilder builder;
+        ARROW_RETURN_NOT_OK((ReadRowRanges<parquet::DoubleType, arrow::DoubleBuilder>(
+            column_reader.get(), max_definition_level, ranges, &builder, &AppendValue<arrow::DoubleBuilder, double>)));
+        return builder.Finish();
+    }
+    case arrow::Type::STRING:
+    {
+        arrow::StringBuilder builder;
+        ARROW_RETURN_NOT_OK((ReadRowRanges<parquet::ByteArrayType, arrow::StringBuilder>(
+            column_reader.get(), max_definition_level, ranges, &builder, &AppendByteArray)));
+        return builder.Finish();
+    }
+    default:
+        return arrow::Status::NotImplemented("Ranged read of ", type.ToString());
+    }
+    END_PARQUET_CATCH_EXCEPTIONS
+}
+
+#endif
@@ -0,0 +1,131 @@
+#ifndef RESUMABLE_READ_H
+#define RESUMABLE_READ_H
+
+#include <arrow/api.h>
+#include <arrow/io/api.h>
+#include <parquet/arrow/reader.h>
+#include <parquet/file_reader.h>
+
+#include <memory>
+#include <numeric>
+#include <vector>
+
+/**
+ * 断点续传：1000万行的DoGet在快结束时断开，原来只能从头再来。
+ *
+ * 续传的位置用行号而不是batch序号：服务端按消息大小切片，同一个文件切出的batch数随max_message_bytes变化，
+ * 行号不变。行号按parquet元数据里各row group的行数换算成(row group, 组内偏移)，
+ * 之前的row group不读不解码；起始行所在的row group要整组解码，再用零拷贝的Slice跳过组内的行。
+ */
+
+/**
+ * @brief 起始行对应的读取范围
+ *
+ */
+struct RowGroupRange
+{
+    std::vector<int> row_groups; // 从起始行所在的row group开始
+    int64_t skip_rows;           // 第一个row group里要跳过的行数
+
+    RowGroupRange()
+        : skip_rows(0)
+    {
+    }
+};
+
+/**
+ * @brief 在row_groups依次拼成的行序列中定位start_row
+ *
+ * @return arrow::Result<RowGroupRange> start_row等于总行数时row_groups为空，超过总行数时返回IndexError
+ */
+arrow::Result<RowGroupRange> LocateRow(const parquet::FileMetaData &metadata, const std::vector<int> &row_groups,
+                                       int64_t start_row)
+{
+    if (start_row < 0)
+    {
+        return arrow::Status::Invalid("Start row is negative: ", start_row);
+    }
+    RowGroupRange range;
+    range.skip_rows = start_row;
+    for (int row_group : row_groups)
+    {
+        int64_t rows = metadata.RowGroup(row_group)->num_rows();
+        if (range.row_groups.empty() && range.skip_rows >= rows)
+        {
+            range.skip_rows -= rows;
+            continue;
+        }
+        range.row_groups.push_back(row_group);
+    }
+    if (range.row_groups.empty() && range.skip_rows > 0)
+    {
+        return arrow::Status::IndexError("Start row ", start_row, " is past the end of the data");
+    }
+    return range;
+}
+
+/**
+ * @brief 从指定行开始按row group流式读取parquet文件，持有FileReader，可以直接交给RecordBatchStream
+ *
+ */
+class ParquetTailReader : public arrow::RecordBatchReader
+{
+public:
+    static arrow::Result<std::shared_ptr<ParquetTailReader>> Open(std::shared_ptr<arrow::io::RandomAccessFile> input,
+                                                                  int64_t start_row)
+    {
+        std::shared_ptr<ParquetTailReader> tail(new ParquetTailReader());
+        ARROW_RETURN_NOT_OK(parquet::arrow::OpenFile(std::move(input), arrow::default_memory_pool(),
+                                                     &tail->file_reader_));
+        ARROW_RETURN_NOT_OK(tail->file_reader_->GetSchema(&tail->schema_));
+
+        std::vector<int> row_groups(tail->file_reader_->num_row_groups());
+        std::iota(row_groups.begin(), row_groups.end(), 0);
+        ARROW_ASSIGN_OR_RAISE(auto range, LocateRow(*tail->file_reader_->parquet_reader()->metadata(), row_groups,
+                                                    start_row));
+        tail->skip_rows_ = range.skip_rows;
+        if (!range.row_groups.empty())
+        {
+            ARROW_RETURN_NOT_OK(tail->file_reader_->GetRecordBatchReader(range.row_groups, &tail->batches_));
+        }
+        return tail;
+    }
+
+    std::shared_ptr<arrow::Schema> schema() const override { return schema_; }
+
+    arrow::Status ReadNext(std::shared_ptr<arrow::RecordBatch> *batch) override
+    {
+        if (batches_ == nullptr)
+        {
+            *batch = nullptr;
+            return arrow::Status::OK();
+        }
+        while (true)
+        {
+            ARROW_RETURN_NOT_OK(batches_->ReadNext(batch));
+            if (*batch == nullptr || skip_rows_ == 0)
+                return arrow::Status::OK();
+            if ((*batch)->num_rows() <= skip_rows_)
+            {
+                skip_rows_ -= (*batch)->num_rows();
+                continue;
+            }
+            *batch = (*batch)->Slice(skip_rows_);
+            skip_rows_ = 0;
+            return arrow::Status::OK();
+        }
+    }
+
+private:
+    ParquetTailReader()
+        : skip_rows_(0)
+    {
+    }
+
+    std::unique_ptr<parquet::arrow::FileReader> file_reader_;
+    std::unique_ptr<arrow::RecordBatchReader> batches_; // 引用file_reader_
+    std::shared_ptr<arrow::Schema> schema_;
+    int64_t skip_rows_;
+};
+
+#endif
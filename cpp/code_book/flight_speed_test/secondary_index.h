@@ -0,0 +1,685 @@
+#ifndef SECONDARY_INDEX_H
+#define SECONDARY_INDEX_H
+
+#include <arrow/api.h>
+#include <arrow/io/api.h>
+#include <arrow/result.h>
+#include <arrow/status.h>
+#include <arrow/compute/api.h>
+#include <arrow/filesystem/api.h>
+#include <arrow/ipc/api.h>
+#include <parquet/arrow/reader.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "ranged_read.h"
+
+#define SECONDARY_INDEX_MAX_SEGMENTS 16 // 段数超过后合并成一个段
+#define SECONDARY_INDEX_OPEN_ATTEMPTS 3  // 打开时段被并发合并删除，重新列目录的次数
+
+/**
+ * 二级索引：数据集目录下的"_index_<列名>/"，每行记录key -> (fragment, row_group, row)，
+ * fragment是相对于数据集目录的文件路径。
+ *
+ * 目录里是若干按key排序的段"<序号>.arrow"，每个段是单个batch的Arrow IPC文件，schema元数据"fragments"
+ * 列出该段覆盖的数据文件。追加文件时只扫描新文件的key列写一个新段，已有的段不重写；
+ * 同一个文件出现在多个段里时以序号最大的段为准，删除文件就写一个只列出该文件、没有记录的段。
+ * 段数超过SECONDARY_INDEX_MAX_SEGMENTS时合并成一个段。用use_mmap的LocalFileSystem打开时各段零拷贝映射。
+ */
+
+/**
+ * @brief 一条索引记录指向的行
+ *
+ */
+struct IndexEntry
+{
+    std::string fragment;
+    int32_t row_group;
+    int64_t row; // row group内的行号
+};
+
+/**
+ * @brief 拼接数据集目录和其中的相对路径，base_dir为空表示文件系统根目录（如SubTreeFileSystem）
+ *
+ */
+std::string JoinDatasetPath(const std::string &base_dir, const std::string &name)
+{
+    if (base_dir.empty())
+    {
+        return name;
+    }
+    return base_dir.back() == '/' ? base_dir + name : base_dir + "/" + name;
+}
+
+/**
+ * @brief 索引目录，以"_"开头，发现数据集文件时会被忽略
+ *
+ */
+std::string SecondaryIndexPath(const std::string &base_dir, const std::string &column)
+{
+    return JoinDatasetPath(base_dir, "_index_" + column);
+}
+
+/**
+ * @brief path相对于base_dir的路径
+ *
+ */
+std::string RelativeFragmentPath(const std::string &base_dir, const std::string &path)
+{
+    if (!base_dir.empty() && path.compare(0, base_dir.size(), base_dir) == 0)
+    {
+        size_t pos = base_dir.size();
+        while (pos < path.size() && path[pos] == '/')
+        {
+            ++pos;
+        }
+        return path.substr(pos);
+    }
+    return path;
+}
+
+/**
+ * @brief 扫描一个parquet文件的key列，生成它的索引记录
+ *
+ * @param filesystem
+ * @param base_dir 数据集目录
+ * @param path 数据文件
+ * @param column key列
+ * @return arrow::Result<std::shared_ptr<arrow::Table>> key, fragment, row_group, row
+ */
+arrow::Result<std::shared_ptr<arrow::Table>> BuildIndexEntries(const std::shared_ptr<arrow::fs::FileSystem> &filesystem,
+                                                              const std::string &base_dir, const std::string &path,
+                                                              const std::string &column)
+{
+    ARROW_ASSIGN_OR_RAISE(auto input, filesystem->OpenInputFile(path));
+    std::unique_ptr<parquet::arrow::FileReader> reader;
+    ARROW_RETURN_NOT_OK(parquet::arrow::OpenFile(std::move(input), arrow::default_memory_pool(), &reader));
+    std::shared_ptr<arrow::Schema> schema;
+    ARROW_RETURN_NOT_OK(reader->GetSchema(&schema));
+    int column_index = schema->GetFieldIndex(column);
+    if (column_index < 0)
+    {
+        return arrow::Status::Invalid("No column named ", column, " in ", path);
+    }
+
+    std::string fragment = RelativeFragmentPath(base_dir, path);
+    std::vector<std::shared_ptr<arrow::Array>> keys;
+    arrow::StringBuilder fragment_builder;
+    arrow::Int32Builder row_group_builder;
+    arrow::Int64Builder row_builder;
+    for (int row_group = 0; row_group < reader->num_row_groups(); ++row_group)
+    {
+        std::shared_ptr<arrow::Table> table;
+        ARROW_RETURN_NOT_OK(reader->ReadRowGroup(row_group, {column_index}, &table));
+        int64_t row = 0;
+        for (const auto &chunk : table->column(0)->chunks())
+        {
+            keys.push_back(chunk);
+            for (int64_t i = 0; i < chunk->length(); ++i, ++row)
+            {
+                ARROW_RETURN_NOT_OK(fragment_builder.Append(fragment));
+                ARROW_RETURN_NOT_OK(row_group_builder.Append(row_group));
+                ARROW_RETURN_NOT_OK(row_builder.Append(row));
+            }
+        }
+    }
+    std::vector<std::shared_ptr<arrow::Array>> arrays(3);
+    ARROW_RETURN_NOT_OK(fragment_builder.Finish(&arrays[0]));
+    ARROW_RETURN_NOT_OK(row_group_builder.Finish(&arrays[1]));
+    ARROW_RETURN_NOT_OK(row_builder.Finish(&arrays[2]));
+    auto index_schema = arrow::schema({arrow::field("key", schema->field(column_index)->type()),
+                                       arrow::field("fragment", arrow::utf8()),
+                                       arrow::field("row_group", arrow::int32()),
+                                       arrow::field("row", arrow::int64())});
+    std::vector<std::shared_ptr<arrow::ChunkedArray>> columns{
+        std::make_shared<arrow::ChunkedArray>(keys, schema->field(column_index)->type()),
+        std::make_shared<arrow::ChunkedArray>(arrays[0]),
+        std::make_shared<arrow::ChunkedArray>(arrays[1]),
+        std::make_shared<arrow::ChunkedArray>(arrays[2])};
+    return arrow::Table::Make(index_schema, columns);
+}
+
+/**
+ * @brief 索引目录中的一个段文件
+ *
+ */
+struct IndexSegmentFile
+{
+    int64_t seq;
+    std::string path;
+
+    IndexSegmentFile()
+        : seq(0)
+    {
+    }
+};
+
+std::string IndexSegmentName(int64_t seq)
+{
+    char name[32];
+    snprintf(name, sizeof(name), "%020lld.arrow", static_cast<long long>(seq));
+    return name;
+}
+
+/**
+ * @brief 按序号从小到大列出索引的段，索引不存在时返回空列表，写了一半的临时文件不算
+ *
+ */
+arrow::Result<std::vector<IndexSegmentFile>> ListIndexSegments(const std::shared_ptr<arrow::fs::FileSystem> &filesystem,
+                                                               const std::string &index_dir)
+{
+    arrow::fs::FileSelector selector;
+    selector.base_dir = index_dir;
+    selector.allow_not_found = true;
+    ARROW_ASSIGN_OR_RAISE(auto infos, filesystem->GetFileInfo(selector));
+
+    const std::string suffix = ".arrow";
+    std::vector<IndexSegmentFile> segments;
+    for (const auto &info : infos)
+    {
+        std::string name = info.base_name();
+        if (!info.IsFile() || name.size() <= suffix.size() ||
+            name.compare(name.size() - suffix.size(), suffix.size(), suffix) != 0)
+            continue;
+        std::string digits = name.substr(0, name.size() - suffix.size());
+        char *end = nullptr;
+        errno = 0;
+        long long seq = std::strtoll(digits.c_str(), &end, 10);
+        if (errno != 0 || end != digits.c_str() + digits.size() || seq < 0)
+            continue;
+        IndexSegmentFile segment;
+        segment.seq = seq;
+        segment.path = info.path();
+        segments.push_back(segment);
+    }
+    std::sort(segments.begin(), segments.end(),
+              [](const IndexSegmentFile &a, const IndexSegmentFile &b) { return a.seq < b.seq; });
+    return segments;
+}
+
+/**
+ * @brief 数据集目录下是否已经有column的索引
+ *
+ */
+arrow::Result<bool> HasSecondaryIndex(const std::shared_ptr<arrow::fs::FileSystem> &filesystem,
+                                      const std::string &base_dir, const std::string &column)
+{
+    ARROW_ASSIGN_OR_RAISE(auto segments, ListIndexSegments(filesystem, SecondaryIndexPath(base_dir, column)));
+    return !segments.empty();
+}
+
+/**
+ * @brief 打开后的一个段。shadowed是本段列出、但更新的段也列出的文件，本段里这些文件的记录已经失效
+ *
+ */
+struct IndexSegment
+{
+    int64_t seq;
+    std::shared_ptr<arrow::io::RandomAccessFile> input; // 内存映射时batch引用的是这里的内存
+    std::shared_ptr<arrow::RecordBatch> batch;
+    std::shared_ptr<arrow::Array> keys;
+    std::shared_ptr<arrow::StringArray> fragments;
+    std::shared_ptr<arrow::Int32Array> row_groups;
+    std::shared_ptr<arrow::Int64Array> rows;
+    std::vector<std::string> listed; // schema元数据"fragments"列出的文件
+    std::set<std::string> shadowed;
+
+    IndexSegment()
+        : seq(0)
+    {
+    }
+};
+
+arrow::Status CheckIndexSegmentSchema(const IndexSegmentFile &file, const arrow::Schema &schema)
+{
+    if (schema.num_fields() != 4 || schema.field(1)->type()->id() != arrow::Type::STRING ||
+        schema.field(2)->type()->id() != arrow::Type::INT32 || schema.field(3)->type()->id() != arrow::Type::INT64)
+    {
+        return arrow::Status::Invalid("Unexpected index segment schema in ", file.path, ": ", schema.ToString());
+    }
+    return arrow::Status::OK();
+}
+
+arrow::Result<std::shared_ptr<arrow::Schema>> ReadIndexSegmentSchema(
+    const std::shared_ptr<arrow::fs::FileSystem> &filesystem, const IndexSegmentFile &file)
+{
+    ARROW_ASSIGN_OR_RAISE(auto input, filesystem->OpenInputFile(file.path));
+    ARROW_ASSIGN_OR_RAISE(auto reader, arrow::ipc::RecordBatchFileReader::Open(input));
+    auto schema = reader->schema();
+    ARROW_RETURN_NOT_OK(CheckIndexSegmentSchema(file, *schema));
+    return schema;
+}
+
+arrow::Result<std::shared_ptr<IndexSegment>> OpenIndexSegment(const std::shared_ptr<arrow::fs::FileSystem> &filesystem,
+                                                              const IndexSegmentFile &file)
+{
+    auto segment = std::make_shared<IndexSegment>();
+    segment->seq = file.seq;
+    ARROW_ASSIGN_OR_RAISE(segment->input, filesystem->OpenInputFile(file.path));
+    ARROW_ASSIGN_OR_RAISE(auto reader, arrow::ipc::RecordBatchFileReader::Open(segment->input));
+    auto schema = reader->schema();
+    ARROW_RETURN_NOT_OK(CheckIndexSegmentSchema(file, *schema));
+    if (reader->num_record_batches() > 1)
+    {
+        return arrow::Status::Invalid("Index segment ", file.path, " must contain at most one batch");
+    }
+    if (reader->num_record_batches() == 1)
+    {
+        ARROW_ASSIGN_OR_RAISE(segment->batch, reader->ReadRecordBatch(0));
+    }
+    else
+    {
+        // 没有记录的段（删除文件时写的段）里没有batch
+        std::vector<std::shared_ptr<arrow::Array>> columns;
+        for (const auto &field : schema->fields())
+        {
+            ARROW_ASSIGN_OR_RAISE(auto column, arrow::MakeEmptyArray(field->type()));
+            columns.push_back(column);
+        }
+        segment->batch = arrow::RecordBatch::Make(schema, 0, columns);
+    }
+    segment->keys = segment->batch->column(0);
+    segment->fragments = std::static_pointer_cast<arrow::StringArray>(segment->batch->column(1));
+    segment->row_groups = std::static_pointer_cast<arrow::Int32Array>(segment->batch->column(2));
+    segment->rows = std::static_pointer_cast<arrow::Int64Array>(segment->batch->column(3));
+
+    int pos = schema->metadata() == nullptr ? -1 : schema->metadata()->FindKey("fragments");
+    if (pos >= 0)
+    {
+        std::stringstream lines(schema->metadata()->value(pos));
+        std::string fragment;
+        while (std::getline(lines, fragment))
+        {
+            if (!fragment.empty())
+                segment->listed.push_back(fragment);
+        }
+    }
+    return segment;
+}
+
+/**
+ * @brief 打开files中的各段，标出每个段里被更新的段覆盖的文件
+ *
+ */
+arrow::Result<std::vector<std::shared_ptr<IndexSegment>>> OpenIndexSegments(
+    const std::shared_ptr<arrow::fs::FileSystem> &filesystem, const std::vector<IndexSegmentFile> &files)
+{
+    std::vector<std::shared_ptr<IndexSegment>> segments;
+    for (const auto &file : files)
+    {
+        ARROW_ASSIGN_OR_RAISE(auto segment, OpenIndexSegment(filesystem, file));
+        segments.push_back(segment);
+    }
+    // 从新到旧：更新的段已经列出的文件，在旧段里的记录作废
+    std::set<std::string> claimed;
+    for (auto it = segments.rbegin(); it != segments.rend(); ++it)
+    {
+        for (const auto &fragment : (*it)->listed)
+        {
+            if (claimed.count(fragment) > 0)
+                (*it)->shadowed.insert(fragment);
+        }
+        claimed.insert((*it)->listed.begin(), (*it)->listed.end());
+    }
+    return segments;
+}
+
+arrow::Result<std::shared_ptr<arrow::Table>> SortIndexEntries(const std::shared_ptr<arrow::Table> &entries)
+{
+    ARROW_ASSIGN_OR_RAISE(auto order, arrow::compute::SortIndices(
+                                          entries, arrow::compute::SortOptions({arrow::compute::SortKey("key")})));
+    ARROW_ASSIGN_OR_RAISE(auto sorted, arrow::compute::Take(entries, order));
+    return sorted.table();
+}
+
+/**
+ * @brief 把已排序的记录写成序号为seq的段，先写临时文件再改名，读者不会看到写了一半的段
+ *
+ * @param fragments 本段覆盖的文件，它们在更旧的段里的记录以本段为准
+ */
+arrow::Status WriteIndexSegment(const std::shared_ptr<arrow::fs::FileSystem> &filesystem, const std::string &index_dir,
+                                int64_t seq, const std::shared_ptr<arrow::Table> &entries,
+                                const std::vector<std::string> &fragments)
+{
+    std::string listed;
+    for (const auto &fragment : fragments)
+    {
+        if (!listed.empty())
+            listed += "\n";
+        listed += fragment;
+    }
+    // 合并成一个batch，方便打开后直接二分查找
+    ARROW_ASSIGN_OR_RAISE(auto table, entries->CombineChunks());
+    table = table->ReplaceSchemaMetadata(arrow::key_value_metadata({"fragments"}, {listed}));
+
+    std::string path = JoinDatasetPath(index_dir, IndexSegmentName(seq));
+    std::string tmp_path = path + ".tmp";
+    ARROW_RETURN_NOT_OK(filesystem->CreateDir(index_dir));
+    ARROW_ASSIGN_OR_RAISE(auto output, filesystem->OpenOutputStream(tmp_path));
+    ARROW_ASSIGN_OR_RAISE(auto writer, arrow::ipc::MakeFileWriter(output, table->schema()));
+    ARROW_RETURN_NOT_OK(writer->WriteTable(*table, std::max<int64_t>(table->num_rows(), 1)));
+    ARROW_RETURN_NOT_OK(writer->Close());
+    ARROW_RETURN_NOT_OK(output->Close());
+    return filesystem->Move(tmp_path, path);
+}
+
+/**
+ * @brief 把各段中仍然有效的记录合并成一个新段，再从旧到新删除旧段
+ *
+ * 新段序号最大，列出所有还有记录的文件。删除过程中剩下的旧段总是最新的几个，每个文件以哪个段为准不变，
+ * 并发的读者看到的结果一致
+ */
+arrow::Status CompactSecondaryIndex(const std::shared_ptr<arrow::fs::FileSystem> &filesystem,
+                                    const std::string &index_dir, const std::vector<IndexSegmentFile> &files)
+{
+    if (files.empty())
+    {
+        return arrow::Status::OK();
+    }
+    std::vector<std::shared_ptr<arrow::Table>> parts;
+    std::set<std::string> live;
+    {
+        ARROW_ASSIGN_OR_RAISE(auto segments, OpenIndexSegments(filesystem, files));
+        for (const auto &segment : segments)
+        {
+            arrow::Int64Builder keep;
+            for (int64_t i = 0; i < segment->fragments->length(); ++i)
+            {
+                std::string fragment = segment->fragments->GetString(i);
+                if (segment->shadowed.count(fragment) > 0)
+                    continue;
+                live.insert(fragment);
+                ARROW_RETURN_NOT_OK(keep.Append(i));
+            }
+            ARROW_ASSIGN_OR_RAISE(auto indices, keep.Finish());
+            ARROW_ASSIGN_OR_RAISE(auto kept, arrow::compute::Take(segment->batch, indices));
+            ARROW_ASSIGN_OR_RAISE(auto table, arrow::Table::FromRecordBatches({kept.record_batch()}));
+            parts.push_back(table->ReplaceSchemaMetadata(nullptr));
+        }
+    }
+    ARROW_ASSIGN_OR_RAISE(auto merged, arrow::ConcatenateTables(parts));
+    ARROW_ASSIGN_OR_RAISE(auto sorted, SortIndexEntries(merged));
+    ARROW_RETURN_NOT_OK(WriteIndexSegment(filesystem, index_dir, files.back().seq + 1, sorted,
+                                          std::vector<std::string>(live.begin(), live.end())));
+    for (const auto &file : files)
+    {
+        ARROW_RETURN_NOT_OK(filesystem->DeleteFile(file.path));
+    }
+    return arrow::Status::OK();
+}
+
+/**
+ * @brief 为新增的数据文件写一个段，删除的文件写一个只列出该文件、没有记录的段，已有的段不动
+ *
+ * @param filesystem
+ * @param base_dir 数据集目录
+ * @param column key列
+ * @param fragment_path 新增/删除的数据文件
+ * @param remove true时只删除该文件的记录
+ * @return arrow::Status
+ */
+arrow::Status UpdateSecondaryIndex(const std::shared_ptr<arrow::fs::FileSystem> &filesystem, const std::string &base_dir,
+                                   const std::string &column, const std::string &fragment_path, bool remove = false)
+{
+    // FileSystemDataset::Write会在多个线程里回调，段的序号分配和合并需要串行
+    static std::mutex mutex;
+    std::lock_guard<std::mutex> lock(mutex);
+
+    std::string index_dir = SecondaryIndexPath(base_dir, column);
+    std::string fragment = RelativeFragmentPath(base_dir, fragment_path);
+    ARROW_ASSIGN_OR_RAISE(auto files, ListIndexSegments(filesystem, index_dir));
+    std::shared_ptr<arrow::Schema> index_schema;
+    if (!files.empty())
+    {
+        ARROW_ASSIGN_OR_RAISE(index_schema, ReadIndexSegmentSchema(filesystem, files.back()));
+        index_schema = index_schema->RemoveMetadata();
+    }
+
+    std::shared_ptr<arrow::Table> entries;
+    if (remove)
+    {
+        if (index_schema == nullptr)
+        {
+            return arrow::Status::OK(); // 还没有索引，没有要删除的记录
+        }
+        ARROW_ASSIGN_OR_RAISE(entries, arrow::Table::MakeEmpty(index_schema));
+    }
+    else
+    {
+        ARROW_ASSIGN_OR_RAISE(auto built, BuildIndexEntries(filesystem, base_dir, fragment_path, column));
+        if (index_schema != nullptr && !built->schema()->Equals(*index_schema))
+        {
+            return arrow::Status::TypeError("Index key type of ", fragment, " differs from ", index_dir);
+        }
+        ARROW_ASSIGN_OR_RAISE(entries, SortIndexEntries(built));
+    }
+
+    IndexSegmentFile written;
+    written.seq = files.empty() ? 0 : files.back().seq + 1;
+    written.path = JoinDatasetPath(index_dir, IndexSegmentName(written.seq));
+    ARROW_RETURN_NOT_OK(WriteIndexSegment(filesystem, index_dir, written.seq, entries, {fragment}));
+    files.push_back(written);
+    if (static_cast<int>(files.size()) > SECONDARY_INDEX_MAX_SEGMENTS)
+    {
+        return CompactSecondaryIndex(filesystem, index_dir, files);
+    }
+    return arrow::Status::OK();
+}
+
+/**
+ * @brief 打开后的二级索引，在每个段里按key二分查找，跳过被更新的段覆盖的记录
+ *
+ */
+class SecondaryIndex
+{
+public:
+    /**
+     * @brief 打开索引。filesystem为use_mmap的LocalFileSystem时，各段是内存映射的，不会整体读入内存
+     *
+     */
+    static arrow::Result<std::shared_ptr<SecondaryIndex>> Open(const std::shared_ptr<arrow::fs::FileSystem> &filesystem,
+                                                               const std::string &base_dir, const std::string &column)
+    {
+        std::string index_dir = SecondaryIndexPath(base_dir, column);
+        arrow::Status status;
+        for (int attempt = 0; attempt < SECONDARY_INDEX_OPEN_ATTEMPTS; ++attempt)
+        {
+            ARROW_ASSIGN_OR_RAISE(auto files, ListIndexSegments(filesystem, index_dir));
+            if (files.empty())
+            {
+                return arrow::Status::IOError("Secondary index ", index_dir, " does not exist");
+            }
+            auto segments = OpenIndexSegments(filesystem, files);
+            if (!segments.ok())
+            {
+                // 列出之后段可能刚被合并删除，重新列一次
+                status = segments.status();
+                continue;
+            }
+
+            auto index = std::make_shared<SecondaryIndex>();
+            index->segments_ = segments.MoveValueUnsafe();
+            index->key_type_ = index->segments_.front()->keys->type();
+            for (const auto &segment : index->segments_)
+            {
+                if (!segment->keys->type()->Equals(index->key_type_))
+                {
+                    return arrow::Status::TypeError("Index segments of ", index_dir, " have different key types");
+                }
+            }
+            if (index->key_type_->id() != arrow::Type::STRING && index->key_type_->id() != arrow::Type::INT64)
+            {
+                return arrow::Status::NotImplemented("Index on ", index->key_type_->ToString(), " keys");
+            }
+            return index;
+        }
+        return status;
+    }
+
+    /**
+     * @brief 查找values中每个值对应的所有行
+     *
+     */
+    arrow::Result<std::vector<IndexEntry>> Lookup(const arrow::Array &values) const
+    {
+        if (!values.type()->Equals(key_type_))
+        {
+            return arrow::Status::TypeError("Lookup values are ", values.type()->ToString(), ", index keys are ",
+                                            key_type_->ToString());
+        }
+        std::vector<IndexEntry> entries;
+        for (int64_t i = 0; i < values.length(); ++i)
+        {
+            if (values.IsNull(i))
+            {
+                continue;
+            }
+            for (const auto &segment : segments_)
+            {
+                const arrow::Array &keys = *segment->keys;
+                for (int64_t pos = LowerBound(keys, values, i); pos < keys.length() && Compare(keys, pos, values, i) == 0;
+                     ++pos)
+                {
+                    IndexEntry entry;
+                    entry.fragment = segment->fragments->GetString(pos);
+                    if (!segment->shadowed.empty() && segment->shadowed.count(entry.fragment) > 0)
+                    {
+                        continue;
+                    }
+                    entry.row_group = segment->row_groups->Value(pos);
+                    entry.row = segment->rows->Value(pos);
+                    entries.push_back(entry);
+                }
+            }
+        }
+        return entries;
+    }
+
+    /**
+     * @brief 按文本形式的值查找，值按索引key的类型解析（例如Flight ticket里带的值）
+     *
+     */
+    arrow::Result<std::vector<IndexEntry>> Lookup(const std::string &value) const
+    {
+        ARROW_ASSIGN_OR_RAISE(auto scalar, arrow::Scalar::Parse(key_type_, value));
+        ARROW_ASSIGN_OR_RAISE(auto values, arrow::MakeArrayFromScalar(*scalar, 1));
+        return Lookup(*values);
+    }
+
+private:
+    static int Compare(const arrow::Array &keys, int64_t pos, const arrow::Array &values, int64_t i)
+    {
+        if (keys.type_id() == arrow::Type::STRING)
+        {
+            auto key = static_cast<const arrow::StringArray &>(keys).GetView(pos);
+            return key.compare(static_cast<const arrow::StringArray &>(values).GetView(i));
+        }
+        int64_t key = static_cast<const arrow::Int64Array &>(keys).Value(pos);
+        int64_t value = static_cast<const arrow::Int64Array &>(values).Value(i);
+        return key < value ? -1 : (key > value ? 1 : 0);
+    }
+
+    static int64_t LowerBound(const arrow::Array &keys, const arrow::Array &values, int64_t i)
+    {
+        // 排序时null排在最后，只在非null部分查找
+        int64_t low = 0;
+        int64_t high = keys.length() - keys.null_count();
+        while (low < high)
+        {
+            int64_t mid = low + (high - low) / 2;
+            if (Compare(keys, mid, values, i) < 0)
+                low = mid + 1;
+            else
+                high = mid;
+        }
+        return low;
+    }
+
+    std::shared_ptr<arrow::DataType> key_type_;
+    std::vector<std::shared_ptr<IndexSegment>> segments_; // 按序号从小到大
+};
+
+/**
+ * @brief 按索引记录只读取命中的row group，平铺列用ReadRangedColumn只解码命中的行
+ *
+ * 同一个row group内按行号顺序输出，重复的行只输出一次
+ * @param filesystem
+ * @param base_dir 数据集目录
+ * @param entries SecondaryIndex::Lookup的结果
+ * @param schema 数据文件的schema，没有命中时返回该schema的空表
+ * @return arrow::Result<std::shared_ptr<arrow::Table>>
+ */
+arrow::Result<std::shared_ptr<arrow::Table>> ReadIndexedRows(const std::shared_ptr<arrow::fs::FileSystem> &filesystem,
+                                                            const std::string &base_dir,
+                                                            const std::vector<IndexEntry> &entries,
+                                                            const std::shared_ptr<arrow::Schema> &schema)
+{
+    // fragment -> row group -> 行号
+    std::map<std::string, std::map<int32_t, std::vector<int64_t>>> rows;
+    for (const auto &entry : entries)
+    {
+        rows[entry.fragment][entry.row_group].push_back(entry.row);
+    }
+
+    std::vector<std::shared_ptr<arrow::Table>> tables;
+    for (const auto &fragment : rows)
+    {
+        ARROW_ASSIGN_OR_RAISE(auto input, filesystem->OpenInputFile(JoinDatasetPath(base_dir, fragment.first)));
+        std::unique_ptr<parquet::arrow::FileReader> reader;
+        ARROW_RETURN_NOT_OK(parquet::arrow::OpenFile(std::move(input), arrow::default_memory_pool(), &reader));
+        std::shared_ptr<arrow::Schema> file_schema;
+        ARROW_RETURN_NOT_OK(reader->GetSchema(&file_schema));
+        const auto &parquet_schema = *reader->parquet_reader()->metadata()->schema();
+        for (const auto &row_group : fragment.second)
+        {
+            std::vector<int64_t> row_numbers = row_group.second;
+            std::sort(row_numbers.begin(), row_numbers.end());
+            row_numbers.erase(std::unique(row_numbers.begin(), row_numbers.end()), row_numbers.end());
+            auto ranges = RowsToRanges(row_numbers);
+            auto row_group_reader = reader->parquet_reader()->RowGroup(row_group.first);
+            std::shared_ptr<arrow::Array> indices;
+
+            // 平铺的列只解码命中的行，其余列（嵌套、字典等）解码整列再取行
+            std::vector<std::shared_ptr<arrow::ChunkedArray>> columns;
+            for (int i = 0; i < file_schema->num_fields(); ++i)
+            {
+                const auto &type = *file_schema->field(i)->type();
+                if (file_schema->num_fields() == parquet_schema.num_columns() &&
+                    SupportsRangedRead(type, *parquet_schema.Column(i)))
+                {
+                    ARROW_ASSIGN_OR_RAISE(auto array, ReadRangedColumn(row_group_reader.get(), i, type, ranges));
+                    columns.push_back(std::make_shared<arrow::ChunkedArray>(array));
+                    continue;
+                }
+                if (indices == nullptr)
+                {
+                    arrow::Int64Builder builder;
+                    ARROW_RETURN_NOT_OK(builder.AppendValues(row_numbers));
+                    ARROW_RETURN_NOT_OK(builder.Finish(&indices));
+                }
+                std::shared_ptr<arrow::ChunkedArray> column;
+                ARROW_RETURN_NOT_OK(reader->RowGroup(row_group.first)->Column(i)->Read(&column));
+                ARROW_ASSIGN_OR_RAISE(auto taken, arrow::compute::Take(column, indices));
+                columns.push_back(taken.chunked_array());
+            }
+            tables.push_back(arrow::Table::Make(file_schema, columns, static_cast<int64_t>(row_numbers.size())));
+        }
+    }
+    if (tables.empty())
+    {
+        return arrow::Table::MakeEmpty(schema);
+    }
+    return arrow::ConcatenateTables(tables);
+}
+
+#endif
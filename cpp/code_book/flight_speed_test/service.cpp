@@ -12,6 +12,8 @@
 #include <iostream>
 #include <string>
 #include "common.h"
+#include "message_chunking.h"
+#include "resumable_read.h"
 
 using namespace std;
 
@@ -62,30 +64,20 @@ public:
                         const arrow::flight::Ticket &request,
                         std::unique_ptr<arrow::flight::FlightDataStream> *stream) override
     {
-        ARROW_ASSIGN_OR_RAISE(auto input, root_->OpenInputFile(request.ticket));
-        std::unique_ptr<parquet::arrow::FileReader> reader;
-        ARROW_RETURN_NOT_OK(parquet::arrow::OpenFile(std::move(input),
-                                                     arrow::default_memory_pool(), &reader));
-        std::shared_ptr<arrow::Table> table;
-        ARROW_RETURN_NOT_OK(reader->ReadTable(&table));
-
-        // Note that we can't directly pass TableBatchReader to
-        // RecordBatchStream because TableBatchReader keeps a non-owning
-        // reference to the underlying Table, which would then get freed
-        // when we exit this function
-
-        std::vector<std::shared_ptr<arrow::RecordBatch>> batches;
-        arrow::TableBatchReader batch_reader(*table);
-
-        ARROW_ASSIGN_OR_RAISE(batches, batch_reader.ToRecordBatches());
-        ARROW_ASSIGN_OR_RAISE(auto owning_reader, arrow::RecordBatchReader::Make(
-                                                      std::move(batches), table->schema()));
+        ARROW_ASSIGN_OR_RAISE(auto ticket, ParseTicket(request.ticket));
+        ARROW_ASSIGN_OR_RAISE(auto input, root_->OpenInputFile(ticket.name));
+        // 逐个row group读，从start_row所在的row group开始，之前的row group不解码
+        ARROW_ASSIGN_OR_RAISE(std::shared_ptr<arrow::RecordBatchReader> tail_reader,
+                              ParquetTailReader::Open(std::move(input), ticket.start_row));
+        // 每个row group切成客户端要求大小的片，一片一条消息，切片不拷贝数据
+        auto chunked_reader = std::make_shared<RechunkingBatchReader>(std::move(tail_reader),
+                                                                      ticket.max_message_bytes);
 
         arrow::ipc::IpcWriteOptions options;
         options.allow_64bit = true;
 
         *stream = std::unique_ptr<arrow::flight::FlightDataStream>(
-            new arrow::flight::RecordBatchStream(owning_reader, options));
+            new arrow::flight::RecordBatchStream(chunked_reader, options));
 
         return arrow::Status::OK();
     }